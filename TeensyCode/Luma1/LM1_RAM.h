@@ -1,4 +1,4 @@
-uint8_t factory_ram[8*1024] = {
+const uint8_t factory_ram[8*1024] PROGMEM = {        // stays in flash, load_z80_ram() copies it over the bus
 0x01,0x00,0x00,0x01,0x00,0x16,0x0a,0x0b, 0x80,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
 0x00,0x00,0x00,0x00,0x00,0x00,0xb0,0x00, 0x00,0x00,0xf5,0xcd,0x86,0x16,0x21,0x00,
 0xed,0xa4,0x0a,0xed,0xa4,0x17,0x00,0xeb, 0xa4,0x01,0x0c,0x00,0x16,0x00,0x08,0xa5,
@@ -0,0 +1,84 @@
+/* ---------------------------------------------------------------------------------------
+    SHARED BUFFERS
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LM_Buffers_H_
+#define LM_Buffers_H_
+
+#include "LM_SysExZ.h"                                  // SXZ_MAX_LEN
+
+/*
+    One big working buffer, shared by the subsystems that need a lot of RAM but never at the same time:
+
+      - SysEx transmit, holds the raw message and the packed copy while it goes out
+      - EPROM dump, holds the EPROM image from dump_eprom_data() until dump_eprom_epilogue()
+      - FRAM test, holds the Z-80 RAM contents while the test pattern is in there
+
+    Whoever wants it calls buf_claim() with their owner ID and must buf_release() when done. If someone else owns it,
+    buf_claim() returns NULL and the caller reports the error and backs off. A claim by the current owner just returns
+    the buffer again.
+
+    Behind it is a smaller stage slot, for data that has to be there while an upload is using the big one:
+
+      - SysEx receive, a sample or RAM image is collected here and only loaded once the whole message is in
+      - Bulk backup, the next item is read off the SD card here while the last one goes out
+
+    Those two don't overlap, a sample sent during a bulk backup is refused. The slot an owner gets is fixed
+    (buf_owner_slot[]), the claim / release rules are the same for both.
+
+    It lives in DMAMEM (OCRAM), with the other big buffers that aren't on a time-critical path. Things that are touched
+    byte-at-a-time while we're driving the voice boards (filebuf, rambuf) stay in DTCM. Luma-1 doesn't fit the Teensy 4.1
+    PSRAM, so nothing goes in EXTMEM.
+*/
+
+#define BUF_OWNER_NONE              0
+#define BUF_OWNER_SYSEX_TX          1
+#define BUF_OWNER_EPROM             2
+#define BUF_OWNER_FRAM_TEST         3
+#define BUF_OWNER_BULK              4                                     // stage slot
+#define BUF_OWNER_SYSEX_RX          5                                     // stage slot
+
+#define BUF_SLOT_MAIN               0
+#define BUF_SLOT_STAGE              1
+
+#define SYSEX_TX_HDR_MAX            64                                    // biggest upload header, sx_bulk_item_hdr_t (checked in LM_MIDI)
+#define SYSEX_TX_RAW_MAX            (SXZ_MAX_LEN(32768) + SYSEX_TX_HDR_MAX)   // 32KB sample (compressed, worst case) + header
+#define BUF_SYSEX_TX_SIZE           (((SYSEX_TX_RAW_MAX + 6) / 7) * 8 + 1 + SYSEX_TX_RAW_MAX)   // packed 7->8 + mfr ID, then the raw message
+#define BUF_EPROM_SIZE              (32*1024)                             // 27256
+#define BUF_FRAM_TEST_SIZE          (8*1024)
+
+#define BUF_MAIN_SIZE               BUF_SYSEX_TX_SIZE                     // biggest of the above
+#define BUF_STAGE_SIZE              (32*1024)                             // full size sample
+
+#define BUF_SHARED_SIZE             (BUF_MAIN_SIZE + BUF_STAGE_SIZE)
+
+uint8_t *buf_claim( uint8_t owner, uint32_t len );      // NULL if someone else has the owner's slot, or len is more than the slot
+void buf_release( uint8_t owner );                      // no-op if owner doesn't have it
+
+uint8_t buf_owner( uint8_t slot );
+
+void print_mem_footprint();                             // static RAM use per module, and shared buffer stats
+
+
+#endif
@@ -0,0 +1,166 @@
+/* ---------------------------------------------------------------------------------------
+    SHARED BUFFERS
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LM_Buffers.h"
+#include "LM_SDCard.h"
+#include "LM_SDCatalog.h"
+#include "LM_PackedBank.h"
+#include "LM_MIDI.h"
+#include "LM_SMF.h"
+
+DMAMEM uint8_t buf_shared[BUF_SHARED_SIZE] __attribute__((aligned(32)));
+
+uint8_t   buf_cur_owner[2] = { BUF_OWNER_NONE, BUF_OWNER_NONE };      // per slot
+uint32_t  buf_high_water[2] = { 0, 0 };                 // biggest claim so far
+uint32_t  buf_busy_count = 0;                           // claims refused because someone else had it
+
+const char *buf_owner_names[] = { "none", "SysEx TX", "EPROM dump", "FRAM test", "bulk backup", "SysEx RX" };
+
+const uint8_t buf_owner_slot[] = { BUF_SLOT_MAIN, BUF_SLOT_MAIN, BUF_SLOT_MAIN, BUF_SLOT_MAIN, BUF_SLOT_STAGE, BUF_SLOT_STAGE };
+
+const uint32_t buf_slot_size[] = { BUF_MAIN_SIZE, BUF_STAGE_SIZE };
+uint8_t * const buf_slot_base[] = { buf_shared, buf_shared + BUF_MAIN_SIZE };
+
+
+uint8_t *buf_claim( uint8_t owner, uint32_t len ) {
+  uint8_t slot = buf_owner_slot[owner];
+
+  if( len > buf_slot_size[slot] ) {
+    Serial.printf("### buf_claim: %s wants %d bytes, max is %d\n", buf_owner_names[owner], len, buf_slot_size[slot]);
+    return NULL;
+  }
+
+  if( (buf_cur_owner[slot] != BUF_OWNER_NONE) && (buf_cur_owner[slot] != owner) ) {
+    Serial.printf("### buf_claim: %s wants the shared buffer, %s has it\n", buf_owner_names[owner], buf_owner_names[buf_cur_owner[slot]]);
+    buf_busy_count++;
+    return NULL;
+  }
+
+  buf_cur_owner[slot] = owner;
+
+  if( len > buf_high_water[slot] )
+    buf_high_water[slot] = len;
+
+  return buf_slot_base[slot];
+}
+
+
+void buf_release( uint8_t owner ) {
+  uint8_t slot = buf_owner_slot[owner];
+
+  if( buf_cur_owner[slot] == owner )
+    buf_cur_owner[slot] = BUF_OWNER_NONE;
+}
+
+
+uint8_t buf_owner( uint8_t slot ) {
+  return buf_cur_owner[slot];
+}
+
+
+/* ================================================================================================================
+    Static RAM footprint
+
+    The big statics, by module and where they live. Sizes come from the declarations, so this can't drift from the
+    code. The static_asserts fail the build if a module grows past what we've budgeted for that memory region.
+*/
+
+extern uint8_t            filebuf[32768];
+extern uint8_t            rambuf[8192];
+extern char               fn_buf[256];
+extern char               sd_scratch[256];
+extern uint8_t            copy_buf[SD_COPY_BUF_SIZE];
+extern uint8_t            sx_rx_buf[SX_RX_BUF_SIZE];
+extern uint8_t            sx_rx_block[SX_RX_BLOCK_SIZE];
+extern cat_voice_bank_t   cat_voice_banks[CAT_NUM_BANKS];
+extern cat_ram_bank_t     cat_ram_banks[CAT_NUM_BANKS];
+extern cat_voice_bank_t   cat_staging;
+extern pbank_hdr_t        pbank_hdr;
+extern uint8_t            pbank_zeros[PBANK_SECTOR_SIZE];
+extern char               dbg_buf[1024];
+extern char               stage_fn[256];
+extern rec_event_t        rec_ev_ring[REC_EV_RING_SIZE];
+extern uint8_t            rec_buf[2][REC_BUF_SIZE];
+extern play_event_t       play_ev_ring[PLAY_EV_RING_SIZE];
+extern uint8_t            play_trk_buf[PLAY_MAX_TRACKS][PLAY_TRK_BUF_SIZE];
+
+#define MEM_DTCM                    0
+#define MEM_OCRAM                   1
+
+typedef struct {
+  const char  *module;
+  const char  *name;
+  uint8_t     region;
+  uint32_t    len;
+} mem_footprint_t;
+
+const mem_footprint_t mem_footprint[] = {
+  { "LM_SDCard",      "filebuf",            MEM_DTCM,   sizeof(filebuf)           },
+  { "LM_SDCard",      "rambuf",             MEM_DTCM,   sizeof(rambuf)            },
+  { "LM_SDCard",      "fn_buf/sd_scratch",  MEM_DTCM,   sizeof(fn_buf) + sizeof(sd_scratch) },
+  { "LM_SDCard",      "copy_buf",           MEM_OCRAM,  sizeof(copy_buf)          },
+  { "LM_MIDI",        "sx_rx_buf/block",    MEM_DTCM,   sizeof(sx_rx_buf) + sizeof(sx_rx_block) },
+  { "LM_SDCatalog",   "voice/ram banks",    MEM_OCRAM,  sizeof(cat_voice_banks) + sizeof(cat_ram_banks) + sizeof(cat_staging) },
+  { "LM_PackedBank",  "hdr/zeros",          MEM_DTCM,   sizeof(pbank_hdr) + sizeof(pbank_zeros) },
+  { "LM_DebugCmds",   "dbg_buf",            MEM_DTCM,   sizeof(dbg_buf)           },
+  { "LM_Voices",      "stage_fn",           MEM_DTCM,   sizeof(stage_fn)          },
+  { "LM_SMFRecord",   "rec_ev_ring",        MEM_DTCM,   sizeof(rec_ev_ring)       },
+  { "LM_SMFRecord",   "rec_buf",            MEM_OCRAM,  sizeof(rec_buf)           },
+  { "LM_SMFPlay",     "play_ev_ring",       MEM_OCRAM,  sizeof(play_ev_ring)      },
+  { "LM_SMFPlay",     "play_trk_buf",       MEM_OCRAM,  sizeof(play_trk_buf)      },
+  { "LM_Buffers",     "buf_shared",         MEM_OCRAM,  sizeof(buf_shared)        },
+};
+
+#define MEM_DTCM_BUDGET             (48*1024)           // RAM1 is shared with code (ITCM) and the stack, keep it lean
+#define MEM_OCRAM_BUDGET            (256*1024)          // RAM2 is 512KB, leave room for USB host and SD library buffers
+
+static_assert( (sizeof(filebuf) + sizeof(rambuf) + sizeof(fn_buf) + sizeof(sd_scratch) + sizeof(pbank_hdr) + sizeof(pbank_zeros) + 
+                sizeof(dbg_buf) + sizeof(stage_fn) + sizeof(sx_rx_buf) + sizeof(sx_rx_block) + sizeof(rec_ev_ring)) <= MEM_DTCM_BUDGET, "big DTCM buffers are over budget" );
+
+static_assert( (sizeof(copy_buf) + sizeof(cat_voice_banks) + sizeof(cat_ram_banks) + sizeof(cat_staging) + 
+                sizeof(buf_shared) + sizeof(rec_buf) + sizeof(play_ev_ring) + sizeof(play_trk_buf)) <= MEM_OCRAM_BUDGET, "big OCRAM (DMAMEM) buffers are over budget" );
+
+static_assert( (BUF_EPROM_SIZE <= BUF_MAIN_SIZE) && (BUF_FRAM_TEST_SIZE <= BUF_MAIN_SIZE), "shared buffer too small for one of its owners" );
+
+
+void print_mem_footprint() {
+  uint32_t total[2] = { 0, 0 };
+  const mem_footprint_t *m;
+
+  Serial.printf("\n--- Static buffers\n\n");
+
+  for( unsigned int xxx = 0; xxx != (sizeof(mem_footprint) / sizeof(mem_footprint_t)); xxx++ ) {
+    m = &mem_footprint[xxx];
+    Serial.printf("  %-16s %-20s %-6s %6d\n", m->module, m->name, (m->region == MEM_DTCM) ? "DTCM" : "OCRAM", m->len);
+    total[m->region] += m->len;
+  }
+
+  Serial.printf("\n  DTCM  total %6d of %6d budgeted\n", total[MEM_DTCM], MEM_DTCM_BUDGET);
+  Serial.printf("  OCRAM total %6d of %6d budgeted\n", total[MEM_OCRAM], MEM_OCRAM_BUDGET);
+
+  Serial.printf("\n--- Shared buffer: %d bytes, refused claims = %d\n", BUF_SHARED_SIZE, buf_busy_count);
+  Serial.printf("  main  %6d bytes, owner = %-12s high water = %d\n", BUF_MAIN_SIZE, buf_owner_names[buf_cur_owner[BUF_SLOT_MAIN]], buf_high_water[BUF_SLOT_MAIN]);
+  Serial.printf("  stage %6d bytes, owner = %-12s high water = %d\n\n", BUF_STAGE_SIZE, buf_owner_names[buf_cur_owner[BUF_SLOT_STAGE]], buf_high_water[BUF_SLOT_STAGE]);
+}
@@ -22,13 +22,13 @@
 */
 
 #include "LM_DebugCmds.h"
+#include "LM_Buffers.h"
+#include "LM_SMF.h"
 
 // commands over the USB serial port
 // this can block, and has no bounds checking, it's only intended for debug commands
 
 
-byte ram_backup[8192];
-
 extern uint8_t filebuf[32768];
 extern bool prev_drum_trig_int_enable;
 
@@ -195,7 +195,16 @@ uint16_t addr = 0xa000;
 
   
 void run_fram_test() {
+  uint8_t *ram_backup;
+
   Serial.printf("FRAM Test (SEND x TO CANCEL)...\n");
+
+  ram_backup = buf_claim( BUF_OWNER_FRAM_TEST, BUF_FRAM_TEST_SIZE );
+
+  if( !ram_backup ) {
+    Serial.printf("### no buffer to save FRAM in, can't run test\n");
+    return;
+  }
   
   teensy_drives_z80_bus( true );
   
@@ -255,6 +264,8 @@ void run_fram_test() {
   Serial.printf("resuming where we left off.\n");
   
   teensy_drives_z80_bus( false );
+
+  buf_release( BUF_OWNER_FRAM_TEST );
 }
 
 
@@ -316,6 +327,66 @@ void run_rom_sram_test() {
 
 
 
+/* ===========================================================================================================
+    SD CARD COPY SPEED
+
+    Streams each STAGING voice into /SDTEST/<voice>, the same way a bank store does, and reports MB/s.
+    Handy for comparing SD cards.
+*/
+
+#define SDTEST_DIR          "/SDTEST"
+
+void run_sd_copy_test() {
+  sd_copy_stats_t st;
+  char src[64];
+  char dst[64];
+  char fn[MAX_LEN_FILE_NAME];
+  uint32_t len;
+  uint32_t hash;
+
+  make_dir( (char*)SDTEST_DIR );
+  sd_copy_stats_clear( &st );
+
+  for( int vvv = 0; vvv != 10; vvv++ ) {
+    build_voice_filename( bank_voice_2_stb( vvv ), BANK_STAGING, src );       // "/STAGING/CONGA"
+    snprintf( dst, sizeof(dst), "%s%s", SDTEST_DIR, strrchr( src, '/' ) );    // "/SDTEST/CONGA"
+
+    make_dir( dst );
+
+    if( sd_copy_first_file_in_dir( src, dst, fn, &len, &hash, &st ) )
+      Serial.printf("  %-24s %6d bytes, hash %08X%s\n", fn, len, hash, stage_copy_check( vvv, fn, len, hash ) ? "" : " ### doesn't match STAGING");
+  }
+
+  sd_copy_stats_print( "SD copy test", &st );
+}
+
+
+// "y <file> [bpm | ext]": play a MIDI file. No directory means REC_DIR. "y" alone stops.
+
+void play_debug_cmd( char *args ) {
+  char name[MAX_LEN_PATH_NAME];
+  char opt[16];
+  char path[MAX_LEN_PATH_NAME];
+
+  name[0] = opt[0] = 0;
+
+  if( (args[-1] != ' ') || (sscanf( args, "%40s %15s", name, opt ) < 1) ) {
+    play_stop();
+    return;
+  }
+
+  if( name[0] == '/' )
+    snprintf( path, sizeof(path), "%s", name );
+  else
+    snprintf( path, sizeof(path), "%s/%s", REC_DIR, name );
+
+  if( !strcasecmp( opt, "ext" ) )
+    play_start( path, true, 0 );
+  else
+    play_start( path, false, atoi( opt ) );
+}
+
+
 /* ===========================================================================================================
     TEST COMMANDS
 */
@@ -333,6 +404,7 @@ bool end_test_time() {
 
 void handle_debug_commands() {
   uint8_t kc;
+  int bpm;
 
 
   if( Serial.available() ) {
@@ -633,6 +705,50 @@ void handle_debug_commands() {
 
                   
       
+      case 'P':
+      case 'p':   pack_voice_bank( atoi( &dbg_buf[2] ) );                                break;
+
+      case 'U':
+      case 'u':   unpack_voice_bank( atoi( &dbg_buf[2] ) );                              break;
+
+      case 'C':
+      case 'c':   run_sd_copy_test();                                                     break;
+
+      case 'X':
+      case 'x':   print_mem_footprint();                                                  break;
+
+      case 'T':
+      case 't':   print_midi_in_timing();
+                  print_midi_thru_stats();
+                  print_din_tx_stats();
+                  print_usb_tx_stats();
+                  print_timer_stats();
+                  print_midi_clock_out_timing();
+                  break;
+
+      case 'J':
+      case 'j':   bpm = atoi( &dbg_buf[2] );
+                  if( bpm == 0 )
+                    bpm = 120;
+                  run_pll_sim( bpm, 0,    0 );                                      // clean clock
+                  run_pll_sim( bpm, 2000, 0 );                                      // sloppy USB / busy loop
+                  run_pll_sim( bpm, 2000, 8000 );                                   // plus the occasional stall
+                  break;
+
+      case 'E':
+      case 'e':   run_sysex_pack_test();                                                  break;
+
+      case 'W':
+      case 'w':   if( rec_running() )
+                    rec_stop();
+                  else
+                    rec_start();
+                  break;
+
+      case 'Y':
+      case 'y':   play_debug_cmd( &dbg_buf[2] );                                         break;
+
+      
       case '?':
       default:    Serial.printf("=== Debug / Diag Commands ===\n\n");
 
@@ -642,6 +758,10 @@ void handle_debug_commands() {
                   Serial.printf("l                        LED Test\n");
                   Serial.printf("k                        Keyboard Test\n");
                   Serial.printf("m                        MIDI Loopback Test\n");
+                  Serial.printf("x                        Show static RAM footprint and shared buffer use\n");
+                  Serial.printf("t                        Show worst-case MIDI input interval, thru latency, DIN out bytes saved, USB out packets, chord spread, timers, clock out jitter since last t\n");
+                  Serial.printf("j <bpm>                  Run the MIDI clock tracking loop against a fake jittery clock\n");
+                  Serial.printf("e                        SysEx pack/unpack and compression round trip test, timing\n");
 
                   Serial.printf("\n -- Z-80 memory tests --\n");
                   Serial.printf("f                        FRAM Test\n");
@@ -669,6 +789,17 @@ void handle_debug_commands() {
                   Serial.printf("*                        Set voice to 32 KB (16 KB for CONGA and TOM)\n");
                   Serial.printf("\n");
                   Serial.printf("b                        Burn-in test: all voices, then FRAM, then ROM SRAM, then repeat\n");
+
+                  Serial.printf("\n -- voice banks --\n");
+                  Serial.printf("p <bank #>               Pack voice bank directories into BANK.LMB\n");
+                  Serial.printf("u <bank #>               Unpack BANK.LMB into voice bank directories\n");
+                  Serial.printf("c                        SD card copy speed test, STAGING -> /SDTEST\n");
+
+                  Serial.printf("\n -- MIDI files --\n");
+                  Serial.printf("w                        Start / stop recording everything played and received to /RECORD/LUMAnnnn.MID\n");
+                  Serial.printf("y <file> [bpm]           Play a MIDI file (in /RECORD unless there's a path) at its own tempo, or bpm\n");
+                  Serial.printf("y <file> ext             Play a MIDI file following MIDI clock in, from the top on every Start\n");
+                  Serial.printf("y                        Stop playing\n");
                   break;
       
     }
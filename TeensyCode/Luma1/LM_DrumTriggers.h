@@ -45,9 +45,26 @@ typedef struct {
   uint8_t   trigs_b;  
   uint8_t   trig_mods;
   uint8_t   pad;
-} __attribute__((__packed__)) drum_trig_event;
+  uint32_t  cycles;                         // ARM_DWT_CYCCNT when the interrupt fired
+} drum_trig_event;                           // 8 bytes, no padding
 
-void push_trig_event( uint8_t a, uint8_t b, uint8_t mods );
-drum_trig_event *pop_trig_event();
+// Single producer (the expander interrupt) / single consumer (handle_midi_out()) queue, no locking needed.
+// Size must be a power of 2. If it fills up, new events are dropped and counted.
+
+#define TRIG_EVENT_BUF_SIZE         32
+
+void push_trig_event( uint8_t a, uint8_t b, uint8_t mods, uint32_t cycles );   // interrupt side
+bool peek_trig_event( drum_trig_event *e );                                   // copy of oldest event, false if none
+bool pop_trig_event( drum_trig_event *e );                                    // same, and removes it
+
+uint32_t trig_event_overflows();            // # of events dropped because the queue was full
+
+// Strobes the Teensy writes from interrupt context (the SMF player) can't turn the trigger interrupt off around
+// the write, that takes i2c. Instead the writer says when, and the expander interrupt that follows is dropped.
+
+#define SELF_TRIG_WINDOW_US         100             // expander interrupt this soon after our write was us
+
+void self_trig_mark();                              // call just before writing strobes from an interrupt
+uint32_t self_trigs_ignored();
 
 #endif
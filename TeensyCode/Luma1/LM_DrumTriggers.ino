@@ -360,39 +360,109 @@ void restore_drum_trig_interrupt() {
 
 
 
-volatile drum_trig_event trig_events[16];           // circular buffer, tail is processed in main loop handle_midi_out()
-                                                    // head is updated when interrupt handler pushes a new event into the buffer
+/*
+    Drum trigger event queue
 
-#define TRIG_EVENT_BUF_MASK   0x0f                  // 16 events, increment and mask to make circular
+    The interrupt handlers push, handle_midi_out() pops. head is only written by the producer, tail only by the consumer.
+    Both count up forever and get masked on use, so full vs. empty is just (head - tail).
 
-volatile int trig_events_head = 0;
-volatile int trig_events_tail = 0;
+    The M7 can reorder stores, so the slot is written before head is published with a release store, and the consumer
+    reads head with an acquire load before touching the slot. Same the other way around for tail. Events are copied out,
+    a slot is never handed out while the interrupt could be writing it.
+*/
 
-void push_trig_event( uint8_t a, uint8_t b, uint8_t mods ) {
-  trig_events_head++;                               // insert new event
-  trig_events_head &= TRIG_EVENT_BUF_MASK;          // do we need to wrap?
+static_assert( (TRIG_EVENT_BUF_SIZE & (TRIG_EVENT_BUF_SIZE - 1)) == 0, "TRIG_EVENT_BUF_SIZE must be a power of 2" );
 
-  trig_events[trig_events_head].trigs_a   = a;
-  trig_events[trig_events_head].trigs_b   = b;
-  trig_events[trig_events_head].trig_mods = mods;
-}
+#define TRIG_EVENT_BUF_MASK   (TRIG_EVENT_BUF_SIZE - 1)
 
+drum_trig_event trig_events[TRIG_EVENT_BUF_SIZE];
 
-drum_trig_event *pop_trig_event() {
+uint32_t trig_events_head = 0;                      // next slot to write
+uint32_t trig_events_tail = 0;                      // next slot to read
+volatile uint32_t trig_events_dropped = 0;
 
-  if( trig_events_tail != trig_events_head ) {
-    trig_events_tail++;                             // we will eat the next one
-    trig_events_tail &= TRIG_EVENT_BUF_MASK;        // do we need to wrap?
 
-    return &trig_events[trig_events_tail];          // process it directly from the buffer
+void push_trig_event( uint8_t a, uint8_t b, uint8_t mods, uint32_t cycles ) {
+  uint32_t head = trig_events_head;                                           // we're the only writer, no need for ordering
+  uint32_t tail = __atomic_load_n( &trig_events_tail, __ATOMIC_ACQUIRE );
+  drum_trig_event *e;
+
+  if( (head - tail) >= TRIG_EVENT_BUF_SIZE ) {      // full, drop this one rather than stomp on one not read yet
+    trig_events_dropped++;
+    return;
   }
-  else
-    return NULL;                                    // nothing to pop
+
+  e = &trig_events[head & TRIG_EVENT_BUF_MASK];
+
+  e->trigs_a   = a;
+  e->trigs_b   = b;
+  e->trig_mods = mods;
+  e->cycles    = cycles;
+
+  __atomic_store_n( &trig_events_head, head + 1, __ATOMIC_RELEASE );         // publish
+}
+
+
+bool peek_trig_event( drum_trig_event *e ) {
+  uint32_t tail = trig_events_tail;
+  uint32_t head = __atomic_load_n( &trig_events_head, __ATOMIC_ACQUIRE );
+
+  if( tail == head )
+    return false;                                   // nothing there
+
+  *e = trig_events[tail & TRIG_EVENT_BUF_MASK];
+  
+  return true;
+}
+
+
+bool pop_trig_event( drum_trig_event *e ) {
+  if( !peek_trig_event( e ) )
+    return false;
+
+  __atomic_store_n( &trig_events_tail, trig_events_tail + 1, __ATOMIC_RELEASE );     // slot is free for the producer again
+
+  return true;
+}
+
+
+uint32_t trig_event_overflows() {
+  return trig_events_dropped;
+}
+
+
+volatile uint32_t self_trig_cycles;                 // when the last self_trig_mark() happened
+volatile bool self_trig_valid = false;
+uint32_t self_trig_ignored = 0;
+
+
+void self_trig_mark() {
+  self_trig_cycles = ARM_DWT_CYCCNT;
+  self_trig_valid = true;
+}
+
+
+// The writer runs at a higher priority than the expander interrupt, so ours shows up right after it. One that
+// started before the write (real trigger) has an earlier timestamp and is kept.
+
+bool self_trig( uint32_t cycles ) {
+  if( !self_trig_valid || ((cycles - self_trig_cycles) > (SELF_TRIG_WINDOW_US * (F_CPU_ACTUAL / 1000000))) )
+    return false;
+
+  self_trig_ignored++;
+  return true;
+}
+
+
+uint32_t self_trigs_ignored() {
+  return self_trig_ignored;
 }
 
 
 
 void exp_irq_a( void ) {  
+  uint32_t cycles = ARM_DWT_CYCCNT;                 // timestamp first, the i2c reads below take a while
+
   Wire.requestFrom( TRIGGER_EXP_ADDR, 1 );         // we left the address pointer -> GPIOB so we can grab it fast
   drum_modifiers = Wire.read();
 
@@ -408,11 +478,16 @@ void exp_irq_a( void ) {
 
   drum_triggers_b = 0;
   
-  push_trig_event( drum_triggers_a, drum_triggers_b, drum_modifiers );
+  if( self_trig( cycles ) )                        // the SMF player's strobes, not the Z-80's
+    return;
+
+  push_trig_event( drum_triggers_a, drum_triggers_b, drum_modifiers, cycles );
 }
 
 
 void exp_irq_b( void ) {  
+  uint32_t cycles = ARM_DWT_CYCCNT;
+
   Wire.requestFrom( TRIGGER_EXP_ADDR, 1 );         // we left the address pointer -> GPIOB so we can grab it fast
   drum_modifiers = Wire.read();
 
@@ -428,5 +503,8 @@ void exp_irq_b( void ) {
 
   drum_triggers_a = 0;
 
-  push_trig_event( drum_triggers_a, drum_triggers_b, drum_modifiers );
+  if( self_trig( cycles ) )                        // the SMF player's strobes, not the Z-80's
+    return;
+
+  push_trig_event( drum_triggers_a, drum_triggers_b, drum_modifiers, cycles );
 }
@@ -52,6 +52,8 @@
 
 #define LM_EEPROM_MIDI_SYSEX_DLY    13        // delay between sysex chunks
 
+#define LM_EEPROM_MIDI_NOTE_MAP     14        // note map profile, see LM_NoteMap.h
+
 
 // ... available ...
 
@@ -72,6 +74,7 @@
   MIDI Soft Thru            ENABLED
   MIDI Start Honor          disabled
   MIDI Send Velocity        ENABLED
+  MIDI Note Map             0 (original Luma-1 layout)
 */
 
 void eeprom_reset_to_factory_defaults();
@@ -119,6 +122,9 @@ bool eeprom_load_midi_send_velocity();
 void eeprom_save_midi_sysex_delay( uint8_t dly );
 uint8_t eeprom_load_midi_sysex_delay();
 
+void eeprom_save_midi_note_map( uint8_t profile );
+uint8_t eeprom_load_midi_note_map();
+
 uint16_t eeprom_next_rambank_num();
 
 
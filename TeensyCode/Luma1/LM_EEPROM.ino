@@ -25,6 +25,7 @@
 #include "LM_EEPROM.h"
 
 #include "LM_Fan.h"
+#include "LM_NoteMap.h"
 
 /* ---------------------------------------------------------------------------------------
     Settings persistent storage, in EEPROM of Teensy
@@ -68,6 +69,8 @@ void eeprom_reset_to_factory_defaults() {
   eeprom_save_midi_send_velocity(   true            );
 
   eeprom_save_midi_sysex_delay(     50              );      // default 50ms delay
+
+  eeprom_save_midi_note_map(        0               );      // NOTE_MAP_KENTON
 }
 
 
@@ -327,6 +330,27 @@ uint8_t eeprom_load_midi_sysex_delay() {
 
 
 
+// --- MIDI NOTE MAP PROFILE
+
+void eeprom_save_midi_note_map( uint8_t profile ) {
+  Serial.printf("Saving MIDI Note Map: %d\n", profile);
+  EEPROM.write( LM_EEPROM_MIDI_NOTE_MAP, profile );
+}
+
+uint8_t eeprom_load_midi_note_map() {
+  uint8_t m;
+  m = EEPROM.read( LM_EEPROM_MIDI_NOTE_MAP );
+  Serial.printf("Loaded MIDI Note Map: %d\n", m );
+  if( m > NOTE_MAP_LAST_USER ) {
+    Serial.printf("Looks uninitialized, setting to default value\n");
+    m = NOTE_MAP_KENTON;
+    eeprom_save_midi_note_map( m );
+  }
+  return m;
+}
+
+
+
 // --- MONOTONICALLY INCREMENTING NUMBER FOR RAM BANK NAMES
 
 uint16_t eeprom_next_rambank_num() {
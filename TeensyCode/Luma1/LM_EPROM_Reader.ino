@@ -23,8 +23,9 @@
 
 #include "LM_EPROM_Reader.h"
 #include "LM_Z80Bus.h"
+#include "LM_Buffers.h"
 
-uint8_t eprom_dump_buf[32*1024];
+uint8_t *eprom_dump_buf = NULL;     // borrowed from the shared buffer, from dump_eprom_data() until dump_eprom_epilogue()
 
 uint16_t eprom_dump_voice;          // voice card we should copy the EPROM data into
 uint16_t eprom_size;                // EPROM size in bytes
@@ -95,6 +96,9 @@ void set_eprom_ce( int ce ) {
 void dump_eprom_prologue() {  
   Serial.println("dump eprom prologue");
 
+  buf_release( BUF_OWNER_EPROM );                                   // in case a previous dump was abandoned before the epilogue
+  eprom_dump_buf = NULL;
+
   save_LED_SET_2();                                                 // remember current state of D802
 
   set_eprom_oe( 1 );                                                // make sure /OE = 1
@@ -141,12 +145,17 @@ uint8_t *dump_eprom_data() {
 
   Serial.printf("Dumping %d bytes\n", eprom_size);
 
-  eprom_checksum = 0;
+  eprom_dump_buf = buf_claim( BUF_OWNER_EPROM, BUF_EPROM_SIZE );
 
-  orig_eprom_size = eprom_size;                             // for hack for 32K EPROMs
+  if( !eprom_dump_buf ) {
+    Serial.printf("### dump_eprom_data: no buffer, can't dump\n");
+    return NULL;
+  }
 
-  memset( eprom_dump_buf, 0, 32768 );                       // zero buffer
+  eprom_checksum = 0;
 
+  orig_eprom_size = eprom_size;                             // for hack for 32K EPROMs
+                                                            // no need to zero buffer, only eprom_size bytes are used
 
   // --- Need to drive Vpp high
   //     Also drive the address we are reading
@@ -215,6 +224,7 @@ uint8_t *dump_eprom_data() {
 
 void dump_eprom_epilogue() {
   char vname[16];
+  voice_sample_t vs;
   
   Serial.println("dump eprom epilogue");
 
@@ -233,9 +243,18 @@ void dump_eprom_epilogue() {
 
   // send to the voice board  
 
-  snprintf( vname, 15, "E_%04X.bin", eprom_checksum );
+  if( eprom_dump_buf ) {
+    snprintf( vname, 15, "E_%04X.bin", eprom_checksum );
+
+    vs = voice_sample( eprom_dump_buf, eprom_size );        // straight from the dump buffer, load_sample() pads with 0s
+
+    set_voice_sample( eprom_dump_voice, &vs, vname );
+  }
+  else
+    Serial.printf("### dump_eprom_epilogue: nothing was dumped\n");
 
-  set_voice( eprom_dump_voice, eprom_dump_buf, eprom_size, vname);
+  buf_release( BUF_OWNER_EPROM );                           // done with it, voice board and STAGING have the data now
+  eprom_dump_buf = NULL;
 
   /*
   set_voice( eprom_dump_voice, 
@@ -24,8 +24,7 @@
 #include <InternalTemperature.h>
 
 #include "LM_Fan.h"
-
-elapsedMillis temp_check_timer;
+#include "LM_Timers.h"
 
 
 /*  
@@ -37,6 +36,11 @@ elapsedMillis temp_check_timer;
 
 #define TEMP_CHECK_TIME         (120*1000)        // every 2 minutes
 
+void temp_check_due( int arg );
+
+lm_timer_t temp_check_timer = TIMER_INIT( temp_check_due, 0 );     // periodic, every TEMP_CHECK_TIME
+bool temp_check_pending = false;                  // set by the timer, handled in handle_fan() where it's safe to touch the bus
+
 bool fan_is_on = false;
 
 int fan_mode = FAN_OFF;
@@ -61,7 +65,7 @@ bool fan_running(){
 
 void init_fan() {
   last_temp_reading = InternalTemperature.readTemperatureC();
-  temp_check_timer = 0;
+  timer_start_periodic( &temp_check_timer, TEMP_CHECK_TIME );
 
   fan_enable( false );                            // make sure it's off, flip-flop can come up in either state
 }
@@ -119,12 +123,17 @@ void fan_enable( bool en ) {
 
 
 
+void temp_check_due( int arg ) {
+  temp_check_pending = true;
+}
+
+
 // call periodically from main loop
 
 void handle_fan() {
   if( last_fan_mode != get_fan_mode() ) {                     // handles boot case and where user changes mode
     switch( get_fan_mode() ) {
-      case FAN_AUTO:  temp_check_timer = (TEMP_CHECK_TIME+1000);  // force temp check
+      case FAN_AUTO:  temp_check_pending = true;                  // force temp check
                       break;
                       
       case FAN_ON:    fan_enable( true );
@@ -147,8 +156,8 @@ void handle_fan() {
     fan_enable( true );
   }
 
-  if( temp_check_timer > TEMP_CHECK_TIME ) {                  // poll temperature every TEMP_CHECK_TIME
-    temp_check_timer = 0;
+  if( temp_check_pending ) {                                  // poll temperature every TEMP_CHECK_TIME
+    temp_check_pending = false;
 
     if( last_temp_reading != InternalTemperature.readTemperatureC() ) {
       last_temp_reading = InternalTemperature.readTemperatureC();
@@ -52,9 +52,70 @@
 
 void init_midi();
 
-void handle_midi_in();
+void handle_midi_in();                              // drain whatever has arrived, doesn't wait for more
 void handle_midi_out();
 
+bool midi_in_pending();                             // cheap check, true if DIN bytes are sitting in the UART buffer
+
+void print_midi_in_timing();                        // worst-case time between input checks since last call, then reset
+void print_midi_thru_stats();                       // thru merge queue counters and latency per port since last call, then reset
+
+
+// --- MIDI Clock -> LM-1 tempo clock tracking loop, see LM_MIDI.ino
+
+typedef struct {
+  bool      have_ref;                       // seen at least one clock
+  bool      have_period;                    // seen at least two
+  uint32_t  last_ts;                        // raw timestamp of the previous clock, cycles
+  uint32_t  ref;                            // filtered time of the current clock, cycles
+  float     period;                         // filtered MIDI clock period, cycles
+  int       outliers;                       // in a row
+  uint32_t  clock_edge;                     // 4 * clock #, edge due at ref
+  uint32_t  first_shift;                    // 1 if the first clock after Start also takes edge 1
+  uint32_t  edges_out;                      // edges emitted so far
+  uint32_t  last_edge;                      // when, cycles
+} pll_state_t;
+
+bool pll_clock( pll_state_t *p, uint32_t ts );              // feed in a MIDI clock timestamp, true if it was an outlier
+uint32_t pll_target_edge( pll_state_t *p, uint32_t now );   // highest edge # due by now
+bool pll_edge_due( pll_state_t *p, uint32_t now );          // true (and counted) if an edge should go out now
+
+void midi_clock_in( uint32_t ts );                  // MIDI Clock received at ts (ARM_DWT_CYCCNT)
+void run_pll_sim( int bpm, int jitter_us, int late_us );    // run the tracking loop against a fake jittery clock, print results
+void run_sysex_pack_test();                          // check SysEx pack/unpack against the byte-at-a-time versions, time them
+
+// --- Realtime (Clock / Start / Stop) out, sent from the FSK clock interrupt, see LM_MIDI.ino
+
+#define MIDI_RT_CLOCK               0xf8
+#define MIDI_RT_START               0xfa
+#define MIDI_RT_STOP                0xfc
+
+#define RT_SLOT_SIZE                4               // realtime bytes that can wait for the port to be free
+
+typedef struct {
+  uint8_t   b[RT_SLOT_SIZE];
+  uint32_t  edge[RT_SLOT_SIZE];                     // FSK edge time each byte is for, cycles
+  uint8_t   n;
+} rt_slot_t;
+
+typedef struct {
+  uint32_t  clocks;                                 // Clock bytes sent
+  uint32_t  min_cycles;                             // FSK edge -> byte on its way, best and worst case
+  uint32_t  max_cycles;
+  uint64_t  sum_cycles;
+  uint32_t  deferred;                               // had to wait in the slot
+  uint32_t  dropped;                                // slot was full
+} rt_stats_t;
+
+void send_midi_rt( uint8_t b, uint32_t edge );      // OK to call from an interrupt
+void midi_rt_drain();                               // called from loop, pushes out anything left waiting
+void send_midi_stop();                              // from loop, when the FSK clock has gone quiet
+
+bool usb_tx_begin();                                // bracket usbMIDI sends from loop code, so the interrupt
+void usb_tx_end();                                  //  doesn't re-enter the USB MIDI library
+
+void print_midi_clock_out_timing();                 // edge -> byte latency and jitter since last call, then reset
+
 bool enable_midi_start_stop_clock( bool en );       // enable/disable interrupt used to detect FSK TTL clock
                                                     // --> this signal comes from a register shared with other control signals, we need to disable/enable to prevent false triggers
 
@@ -120,7 +181,7 @@ bool get_midi_send_vel();                     // if FALSE, send vel = 127 and us
 
 #define MIDI_SYSEX_DELAY_DEFAULT      50      // 50 ms default
 
-void set_midi_sysex_delay( uint8_t del );     // time between sysex chunks
+void set_midi_sysex_delay( uint8_t del );     // most time between sysex chunks, ms (pacing is adaptive below this)
 uint8_t get_midi_sysex_delay();
 
 
@@ -153,9 +214,7 @@ bool get_tape_sync_clk_gpo();                       // return current state
 // clock work
 
 elapsedMillis sinceLastFSKClk;                      // zeroed in interrupt handler -- keep pulling it back to 0
-bool song_is_started = false;                       // set when we first see the FSK clock go, stopped when we see time pass without an FSK clock
-
-bool send_midi_clk = false;                         // set to true by the clock edge interrupt handler when it's time to send one
+volatile bool song_is_started = false;              // set when we first see the FSK clock go, stopped when we see time pass without an FSK clock
 
 void reset_FSK_clock_check();                       // call if we haven't been able to check the FSK clock for a while to prevent spurious MIDI start/stop
 
@@ -167,6 +226,18 @@ extern elapsedMillis no_tempo_clk_detect;
 
 // externally visible sysex routines
 
+#define SYSEX_HEADER_SIZE       32
+
+#define SX_RX_BUF_SIZE          512                                     // header, plus all of a small message (param, name, note map)
+#define SX_RX_BLOCK_SIZE        512                                     // big payloads go to their destination this many bytes at a time
+
+bool sysex_rx_busy();                                                   // true while a big SysEx is being received
+void sysex_rx_check_timeout();                                          // from handle_midi_in(), gives up on a sender that went quiet
+
+void sysex_tx_service();                                                // called from handle_midi_out(), sends the next bit of an upload
+bool sysex_tx_busy();                                                   // true until the whole upload is out
+uint8_t sysex_tx_routes();                                              // ROUTE_USB / ROUTE_DIN5 an upload is still going out on
+
 #define DRUM_SEL_BASS           0
 #define DRUM_SEL_SNARE          1
 #define DRUM_SEL_HIHAT          2
@@ -185,4 +256,8 @@ uint16_t drum_sel_2_voice( uint8_t drum_sel );                  // map sysex dru
 
 void send_pattern_RAM_sysex( uint8_t banknum );                 // banknum 00-99, or 0xff -> send currently active RAM
 
+void handle_sysex_requests();                                   // called from loop(), answers requests that came in during an upload
+void handle_sysex_bulk();                                       // called from loop(), reads the SD card for a bulk backup in progress
+bool sysex_bulk_busy();
+
 #endif
@@ -26,6 +26,9 @@
 #include "LM_MIDI.h"
 #include "LM_Utilities.h"
 #include "LM_DrumTriggers.h"
+#include "LM_Buffers.h"
+#include "LM_Timers.h"
+#include "LM_SMF.h"
 
 #include <MIDI.h>
 
@@ -45,8 +48,45 @@ MIDIDevice midiHOST01(usbHOST);
 MIDIDevice midiHOST02(usbHOST);
 MIDIDevice midiHOST03(usbHOST);
 
+#define THRU_HOST_PORTS         3
 
-MIDI_CREATE_INSTANCE(HardwareSerial, HW_MIDI, midiDIN);
+MIDIDevice *thru_host_dev[THRU_HOST_PORTS] = { &midiHOST01, &midiHOST02, &midiHOST03 };
+
+// Thru merge queue ports, see thru_service()
+
+#define THRU_SRC_DIN5           0
+#define THRU_SRC_USB            1
+#define THRU_SRC_HOST1          2                   // then HOST2, HOST3
+#define THRU_SRCS               (THRU_SRC_HOST1 + THRU_HOST_PORTS)
+
+#define THRU_DEST_DIN5          0
+#define THRU_DEST_USB           1
+#define THRU_DEST_HOST          2                   // every hosted device except the one it came from
+#define THRU_DESTS              3
+
+
+/*
+    The MIDI library doesn't read Serial1 directly. It reads through DinMidiPort, which hands it bytes that
+    din_rx_pump() has already looked at. SysEx never gets to the library: din_rx_frame() pulls it out of the
+    byte stream and feeds the SysEx decoder itself, so chunk boundaries and end-of-message are exact.
+    Everything else (including realtime bytes that show up in the middle of a SysEx message) goes to the library.
+*/
+
+int  din_rx_available();
+int  din_rx_read();
+int  din_tx_raw( const uint8_t *b, int n );
+
+class DinMidiPort {
+public:
+  void begin( unsigned long baud )    {     HW_MIDI.begin( baud );              }
+  int available()                     {     return din_rx_available();          }
+  int read()                          {     return din_rx_read();               }
+  size_t write( uint8_t b )           {     return din_tx_raw( &b, 1 );         }
+};
+
+DinMidiPort din_midi_port;
+
+MIDI_CREATE_INSTANCE(DinMidiPort, din_midi_port, midiDIN);
 
 // HW_MIDI is on Serial1, which is i.MX RT1062 LPUART UART6. This is for a hack to invert the TX line (which Luma's hardware needs)
 
@@ -54,6 +94,11 @@ MIDI_CREATE_INSTANCE(HardwareSerial, HW_MIDI, midiDIN);
 #define IMXRT_LPUART_CTRL         0x18
 #define TXINV_FORCE               0x10000000        // TXINV bit to set
 
+#define IMXRT_LPUART_DATA         0x1c              // write here to push a byte into the TX FIFO
+#define IMXRT_LPUART_WATER        0x2c
+#define LPUART_WATER_TXCOUNT(w)   (((w) >> 8) & 0x07)     // # of bytes in the TX FIFO
+#define LPUART_TX_FIFO_DEPTH      4
+
 
 int midi_chan = 1;
 
@@ -104,35 +149,20 @@ bool map_midi_2_strobe( byte note, byte vel, uint16_t *strobe, uint8_t *flags );
 #define NOF_TIME_MS         40
 
 typedef struct {
-  byte midi_note;
-  bool drum_playing;
+  byte midi_note;         // last note sent for this drum, so the NOF matches
   bool drum_soft;         // this was a soft one, need this if midi_send_velocity == false
   byte flags;
   uint16_t strobe;
-  elapsedMillis drum_time_elapsed; 
+  lm_timer_t nof_timer;   // armed while the note is on, sends the NOF when it expires
 } drum_midi_map_t;
 
-drum_midi_map_t drums[13];
-
-#define drum_BASS           0
-#define drum_SNARE          1
-#define drum_HIHAT          2
-#define drum_HIHAT_OPEN     3
-#define drum_CLAPS          4
-#define drum_CABASA         5
-#define drum_TAMB           6
-#define drum_TOM_UP         7
-#define drum_TOM_DN         8
-#define drum_CONGA_UP       9
-#define drum_CONGA_DN       10
-#define drum_COWBELL        11
-#define drum_CLAVE          12
+drum_midi_map_t drums[NUM_DRUMS];                // indexed by drum_xx, see LM_NoteMap.h
 
 
 void set_drum_table_entry( int entry, byte note, uint16_t stb, byte flgs ) {
   
   drums[entry].midi_note = note;
-  drums[entry].drum_playing = false;
+  timer_setup( &drums[entry].nof_timer, send_drum_NOF, entry );
   drums[entry].drum_soft = false;
   drums[entry].strobe = stb;
   drums[entry].flags = flgs;
@@ -141,27 +171,30 @@ void set_drum_table_entry( int entry, byte note, uint16_t stb, byte flgs ) {
 }
 
 
+// note -> drum is a table lookup in the active note map profile (LM_NoteMap)
+
 bool map_midi_2_strobe( byte note, byte vel, uint16_t *strobe, uint8_t *flags ) {
+  const note_map_entry_t *e = note_map_lookup( note );
+  drum_midi_map_t *d;
 
   //Serial.printf("note: %02d\n", note);
   
-  for( int xxx = 0; xxx != 13; xxx++ ) {                    // check all 13 drums
-    
-    if( drums[xxx].midi_note == note ) {                    // one of our notes?
+  if( e->drum == NOTE_MAP_NONE )                            // not one of our notes
+    return false;
 
-      *strobe = drums[xxx].strobe;                          // get the hardware strobe address
+  if( e->vel )                                              // profile says this note always plays at a fixed velocity
+    vel = e->vel;
 
-      if( drums[xxx].flags == 0 )                           // if flags == 0, it's a loud/soft voice
-        *flags = ( (vel>MIDI_VEL_SOFT) ? 0x03 : 0x01 );
-      else
-        *flags = drums[xxx].flags;                          // otherwise it's special
+  d = &drums[e->drum];
 
-      return true;
-    }
-    
-  }
+  *strobe = d->strobe;                                      // get the hardware strobe address
 
-  return false;
+  if( d->flags == 0 )                                       // if flags == 0, it's a loud/soft voice
+    *flags = ( (vel>MIDI_VEL_SOFT) ? 0x03 : 0x01 );
+  else
+    *flags = d->flags;                                      // otherwise it's special
+
+  return true;
 }
 
 
@@ -172,6 +205,8 @@ bool map_midi_2_strobe( byte note, byte vel, uint16_t *strobe, uint8_t *flags )
 void din_midi_begin( int chan );
 
 void din_midi_begin( int chan ) {
+  din_rx_reset();
+
   if( midi_chan != 0 ) {                            // only seem to need to do this for the DIN interface
     Serial.printf("MIDI Channel = %d, starting DIN-5 interface for non-omni mode\n", midi_chan);
     midiDIN.begin();
@@ -180,6 +215,8 @@ void din_midi_begin( int chan ) {
     Serial.printf("MIDI Channel = %d, starting DIN-5 interface for OMNI mode\n", midi_chan);
     midiDIN.begin( MIDI_CHANNEL_OMNI );
   }
+
+  midiDIN.turnThruOff();                            // begin() turns the library's thru on, ours is in thru_service()
 }
 
 
@@ -227,6 +264,10 @@ void init_midi() {
 
   set_drum_table_entry( drum_COWBELL,     MIDI_NOTE_COWBELL,      STB_COWBELL,      0x01    );
   set_drum_table_entry( drum_CLAVE,       MIDI_NOTE_CLAVE,        STB_CLAVE,        0x01    );
+
+  // -- which notes play which drums
+
+  init_note_map();
   
 
   // -- DIN-5 old-skool MIDI
@@ -241,8 +282,6 @@ void init_midi() {
   midiDIN.setHandleContinue(        din_myContinue        );
   midiDIN.setHandleStop(            din_myStop            );
 
-  midiDIN.setHandleSystemExclusive( din_mySystemExclusiveChunk  );
-
   din_midi_begin( midi_chan );
 
   // -- Total hack: manually whack the TXINV bit in the LPUART6 block. 
@@ -326,14 +365,7 @@ void set_midi_soft_thru( bool on ) {
 
   Serial.printf("Turning MIDI Soft Thru %s\n", midi_soft_thru?"ON":"off");
   
-  if( midi_soft_thru ) {
-    midiDIN.turnThruOn();
-    //usbMIDI.turnThruOn();                 // doesn't exist for USB
-  } else {
-    midiDIN.turnThruOff();
-    //usbMIDI.turnThruOff();                // doesn't exist for USB
-  }
-
+  midiDIN.turnThruOff();                    // we do thru ourselves (DIN-5 and USB), see thru_service()
 }
 
 bool get_midi_soft_thru()                   {     return midi_soft_thru;        }
@@ -383,21 +415,17 @@ void din_myNoteOff(byte channel, byte note, byte velocity) {
 // ======================================================================
 // usbHOST note ON/OFF handlers
 
+// Passing these on to USB and DIN-5 is done by the thru merge queue, see thru_capture_lib()
+
 void midiHOST01_myNoteOn(byte channel, byte note, byte velocity) {
     myNoteOn( channel, note, velocity );
   //Serial.printf("USB Host data NOTE ON");  
-    usbMIDI.sendNoteOn( note, velocity, (midi_chan == 0)?1:midi_chan );
-    midiDIN.sendNoteOn( note, velocity, (midi_chan == 0)?1:midi_chan );
-    midi_din_out_event();
     midi_usb_in_event();
 }
 
 void midiHOST01_myNoteOff(byte channel, byte note, byte velocity) {
     myNoteOff( channel, note, velocity );
   //Serial.printf("USB Host data NOTE OFF");  
-    usbMIDI.sendNoteOff( note, MIDI_VEL_LOUD, (midi_chan == 0)?1:midi_chan );
-    midiDIN.sendNoteOff( note, MIDI_VEL_LOUD, (midi_chan == 0)?1:midi_chan );
-    midi_din_out_event();
     midi_usb_in_event();
 }
 
@@ -439,116 +467,202 @@ void din_myStop() {
 
 
 /*
-    VERY hacky fixes to some broken behavior in the DIN-5 (UART) MIDI Sysex receive handling.
-    
-      - The blocks we get passed are smaller (not a problem)
-      - The blocks have unexpected 0xf0 and 0xf7 characters (a problem)
-      - The "last" flag doesn't go true on the last block (another problem)
-
-    Here are some blocks as received, and how I massage them to get rid of the bad stuff:
-
-    --> original
-    Dumping 128 bytes: 
-    0000: f0 69 00 00 41 66 72 69 63 61 00 42 6c 00 00 00  |   i     A f r i c a   B l       
-    0010: 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00  |                                 
-    0020: 00 00 01 00 00 00 00 00 00 31 67 50 30 57 57 2f  |                   1 g P 0 W W / 
-    0030: 54 44 06 47 55 4f 27 50 60 2f 1c 77 76 73 7f 7c  | T D   G U O ' P ` /   w v s   | 
-    0040: 6f 79 30 5d 54 5b 38 73 7d 77 31 4f 7a 79 6e 7f  | o y 0 ] T [ 8 s } w 1 O z y n   
-    0050: 6d 63 7c 74 6e 64 74 6b 74 7a 78 60 7e 7a 6c 57  | m c | t n d t k t z x ` ~ z l W 
-    0060: 71 4d 70 6f 74 6f 3c 7c 7f 77 61 5e 6f 55 7c 7c  | q M p o t o < |   w a ^ o U | | 
-    0070: 53 71 63 74 5d 6c 7c 69 7a 7f 47 7f 4b 79 62 f0  | S q c t ] l | i z   G   K y b   
-    --> fixed
-    Dumping 127 bytes: 
-    0000: f0 69 00 00 41 66 72 69 63 61 00 42 6c 00 00 00  |   i     A f r i c a   B l       
-    0010: 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00  |                                 
-    0020: 00 00 01 00 00 00 00 00 00 31 67 50 30 57 57 2f  |                   1 g P 0 W W / 
-    0030: 54 44 06 47 55 4f 27 50 60 2f 1c 77 76 73 7f 7c  | T D   G U O ' P ` /   w v s   | 
-    0040: 6f 79 30 5d 54 5b 38 73 7d 77 31 4f 7a 79 6e 7f  | o y 0 ] T [ 8 s } w 1 O z y n   
-    0050: 6d 63 7c 74 6e 64 74 6b 74 7a 78 60 7e 7a 6c 57  | m c | t n d t k t z x ` ~ z l W 
-    0060: 71 4d 70 6f 74 6f 3c 7c 7f 77 61 5e 6f 55 7c 7c  | q M p o t o < |   w a ^ o U | | 
-    0070: 53 71 63 74 5d 6c 7c 69 7a 7f 47 7f 4b 79 62 f0  | S q c t ] l | i z   G   K y b   
-    sysex: 127, last: 0, err: 0
-    
-    --> original
-    Dumping 128 bytes: 
-    0000: f7 7d 7f 7a 06 56 7c 7b 37 72 59 72 04 7f 7f 7f  |   }   z   V | { 7 r Y r         
-    0010: 64 4d 48 64 33 3f 62 5f 54 50 7b 7f 5f 78 4f 58  | d M H d 3 ? b _ T P {   _ x O X 
-    0020: 7f 7f 79 52 0e 6f 7f 7c 12 77 5e 7f 18 7f 7c 54  |     y R   o   |   w ^       | T 
-    0030: 67 6f 7f 7f 39 4f 75 7f 78 3e 71 43 7f 7f 7f 77  | g o     9 O u   x > q C       w 
-    0040: 5f 39 6f 7d 40 71 4a 6b 67 5f 70 7e 00 7b 67 59  | _ 9 o } @ q J k g _ p ~   { g Y 
-    0050: 71 7e 7f 72 39 54 37 48 3e 5f 61 73 7f 7f 7f 75  | q ~   r 9 T 7 H > _ a s       u 
-    0060: 5e 52 6b 7f 61 7f 6f 62 7b 7b 4c 67 02 57 7f 7f  | ^ R k   a   o b { { L g   W     
-    0070: 7f 74 48 3d 0f 77 7b 57 6d 75 74 75 7f 77 78 f0  |   t H =   w { W m u t u   w x   
-    --> fixed
-    Dumping 126 bytes: 
-    0000: 7d 7f 7a 06 56 7c 7b 37 72 59 72 04 7f 7f 7f 64  | }   z   V | { 7 r Y r         d 
-    0010: 4d 48 64 33 3f 62 5f 54 50 7b 7f 5f 78 4f 58 7f  | M H d 3 ? b _ T P {   _ x O X   
-    0020: 7f 79 52 0e 6f 7f 7c 12 77 5e 7f 18 7f 7c 54 67  |   y R   o   |   w ^       | T g 
-    0030: 6f 7f 7f 39 4f 75 7f 78 3e 71 43 7f 7f 7f 77 5f  | o     9 O u   x > q C       w _ 
-    0040: 39 6f 7d 40 71 4a 6b 67 5f 70 7e 00 7b 67 59 71  | 9 o } @ q J k g _ p ~   { g Y q 
-    0050: 7e 7f 72 39 54 37 48 3e 5f 61 73 7f 7f 7f 75 5e  | ~   r 9 T 7 H > _ a s       u ^ 
-    0060: 52 6b 7f 61 7f 6f 62 7b 7b 4c 67 02 57 7f 7f 7f  | R k   a   o b { { L g   W       
-    0070: 74 48 3d 0f 77 7b 57 6d 75 74 75 7f 77 78 f0 f0  | t H =   w { W m u t u   w x     
-    sysex: 126, last: 0, err: 0
-
-    This seems to work, at least with my setup (Mac, using SysEx Librarian and Greg Simon's
-      LumaTool to send files).
+    DIN-5 SysEx framing
+
+    Bytes come in from Serial1 one at a time, so we can see exactly where a message starts and ends:
+
+      F0                    start of message, chunk starts with the F0 (same as USB chunks)
+      00-7F                 data, into the chunk
+      F7                    end of message, chunk goes to the decoder with last = true
+      F8-FF                 realtime, allowed anywhere -- goes to the library, doesn't touch the message
+      any other status      message got cut off, decoder is told (last = true, no F7), byte starts a new message
+
+    Full chunks go to the decoder with last = false. With soft thru on, SysEx bytes are echoed here,
+    since the library never sees them.
 */
 
-bool getting_1st_din5_block = true;
+#define DIN_RX_Q_SIZE           64                  // bytes waiting for the MIDI library, power of 2
+#define DIN_RX_Q_MASK           (DIN_RX_Q_SIZE - 1)
 
-void din_mySystemExclusiveChunk(unsigned char *d, unsigned int len) {
-  bool last = false;
+#define DIN_SX_CHUNK_BYTES      128
 
-  if( get_midi_sysex_route() & ROUTE_DIN5 ) {
-      
-    //Serial.printf("--> original\n");
-    //dumpit( d, len );
-    
-    // --> In the blocks AFTER the first block, there is a bogus 0xf7 in the first byte.
+uint8_t  din_rx_q[DIN_RX_Q_SIZE];
+uint32_t din_rx_q_head = 0;                         // free-running, masked on use
+uint32_t din_rx_q_tail = 0;
 
-    if( getting_1st_din5_block == false ) {
-      if( d[0] == 0xf7 ) {
-        len--;
-        memcpy( d, &d[1], len );
-      }
-    }
-    else
-      getting_1st_din5_block = false;
+uint8_t  din_sx_chunk[DIN_SX_CHUNK_BYTES];
+int      din_sx_len = 0;
+bool     din_sx_active = false;                     // between F0 and its end
+bool     din_sx_ours = false;                       // SysEx route includes DIN-5, decode it
 
-    // --> In each block, there is a bogus 0xf0 in the last byte.
+uint8_t  din_th_msg[3];                              // message being put together for thru
+uint8_t  din_th_len = 0;                            // bytes so far, 0 = no running status
+uint8_t  din_th_need = 0;
 
-    if( d[len-1] == 0xf0 )
-      len--;
+uint32_t din_sx_msgs = 0;
+uint32_t din_sx_truncated = 0;                      // ended by a status byte instead of F7
+uint32_t din_sx_realtime = 0;                       // realtime bytes seen inside SysEx
 
-    //Serial.printf("--> fixed\n");
-    //dumpit( d, len );
-      
-    if( (int)len < 126 ) {                  // XXX "last" seems to be broken on non-USB MIDI, hacky workaround --> 126 is len when 2 bytes pulled from 128 byte block
-      last = true;
-      getting_1st_din5_block = true;        // reset this other hack
+
+void din_rx_q_push( uint8_t b ) {
+  din_rx_q[din_rx_q_head & DIN_RX_Q_MASK] = b;
+  din_rx_q_head++;
+}
+
+
+int din_rx_available() {
+  return din_rx_q_head - din_rx_q_tail;
+}
+
+
+int din_rx_read() {
+  uint8_t b;
+
+  if( din_rx_q_head == din_rx_q_tail )
+    return -1;
+
+  b = din_rx_q[din_rx_q_tail & DIN_RX_Q_MASK];
+  din_rx_q_tail++;
+
+  return b;
+}
+
+
+// Puts whole messages back together (running status and all) for the thru merge queue
+
+void din_thru_byte( uint8_t b ) {
+
+  if( b >= 0xf8 ) {                                         // realtime, on its own
+    thru_capture( THRU_SRC_DIN5, b, 0, 0 );
+    return;
+  }
+
+  if( b & 0x80 ) {
+    din_th_msg[0] = b;
+    din_th_len = 1;
+    din_th_need = thru_msg_len( b );
+
+    if( din_th_need == 1 ) {                                // tune request (F4/F5 are undefined, dropped)
+      if( b == 0xf6 )
+        thru_capture( THRU_SRC_DIN5, b, 0, 0 );
+      din_th_len = 0;
     }
-    else
-      last = false;
-      
-    mySystemExclusiveChunk( d, len, last );                                                                      // XXX total hack, it sends 128 when false, and not 128 when true
+    return;
+  }
+
+  if( din_th_len == 0 )                                     // data with no status to go with it
+    return;
+
+  din_th_msg[din_th_len++] = b;
+
+  if( din_th_len == din_th_need ) {
+    thru_capture( THRU_SRC_DIN5, din_th_msg[0], din_th_msg[1], din_th_msg[2] );
+    din_th_len = (din_th_msg[0] < 0xf0) ? 1 : 0;           // channel messages keep running status
+  }
+}
+
+
+void din_sx_flush( bool last ) {
+  if( din_sx_ours && (din_sx_len || last) ) {
+    mySystemExclusiveChunk( din_sx_chunk, din_sx_len, last );
     midi_din_in_event();
   }
+
+  din_sx_len = 0;
+}
+
+
+void din_sx_thru( uint8_t b ) {
+  if( midi_soft_thru && !(sysex_tx_routes() & ROUTE_DIN5) )
+    din_tx_raw( &b, 1 );
+}
+
+
+void din_rx_frame( uint8_t b ) {
+
+  if( din_sx_active ) {
+    if( b >= 0xf8 ) {                                       // realtime, doesn't end the message
+      din_sx_realtime++;
+      din_rx_q_push( b );
+      din_thru_byte( b );
+      return;
+    }
+
+    if( (b < 0x80) || (b == 0xf7) ) {
+      din_sx_chunk[din_sx_len++] = b;
+      din_sx_thru( b );
+
+      if( b == 0xf7 ) {
+        din_sx_flush( true );
+        din_sx_active = false;
+        din_sx_msgs++;
+      }
+      else if( din_sx_len == DIN_SX_CHUNK_BYTES )
+        din_sx_flush( false );
+
+      return;
+    }
+
+    Serial.printf("### DIN SysEx cut off by status byte 0x%02x\n", b);    // fall thru, b starts the next message
+
+    din_sx_flush( true );
+    din_sx_active = false;
+    din_sx_truncated++;
+  }
+
+  if( b == 0xf0 ) {
+    din_th_len = 0;                                         // SysEx cancels running status
+    din_sx_active = true;
+    din_sx_ours = (get_midi_sysex_route() & ROUTE_DIN5) ? true : false;
+    din_sx_len = 0;
+    din_sx_chunk[din_sx_len++] = b;
+    din_sx_thru( b );
+  }
+  else if( b != 0xf7 ) {                                    // stray F7 is dropped
+    din_rx_q_push( b );
+    din_thru_byte( b );
+  }
+}
+
+
+// Runs everything waiting in Serial1 thru the framer, as long as the library queue has room (a realtime byte
+//  can go in there for every byte read)
+
+void din_rx_pump() {
+  int n = HW_MIDI.available();
+
+  while( (n-- > 0) && (din_rx_available() < DIN_RX_Q_SIZE) )
+    din_rx_frame( HW_MIDI.read() );
+}
+
+
+void din_rx_reset() {
+  din_rx_q_head = din_rx_q_tail = 0;
+  din_th_len = 0;
+  din_sx_active = false;
+  din_sx_len = 0;
 }
 
 
 // ======================================================================
 // USB MIDI Trampolines
 
+// USB is read OMNI so thru and recording see every channel (see handle_midi_in()), the channel filter is applied here
+
+bool usb_chan_match( byte channel ) {
+  return (midi_chan == 0) || (channel == midi_chan);                              // 0 = OMNI
+}
+
+
 void usb_myNoteOn(byte channel, byte note, byte velocity) {
-  if( get_midi_note_in_route() & ROUTE_USB ) {
+  if( (get_midi_note_in_route() & ROUTE_USB) && usb_chan_match( channel ) ) {
     myNoteOn( channel, note, velocity );
     midi_usb_in_event();
   }
 }
 
 void usb_myNoteOff(byte channel, byte note, byte velocity) {
-  if( get_midi_note_in_route() & ROUTE_USB ) {
+  if( (get_midi_note_in_route() & ROUTE_USB) && usb_chan_match( channel ) ) {
     myNoteOff( channel, note, velocity );
     midi_usb_in_event();
   }
@@ -556,7 +670,7 @@ void usb_myNoteOff(byte channel, byte note, byte velocity) {
 
 
 void usb_myProgramChange(byte channel, byte pgm) {
-  if( get_midi_note_in_route() & ROUTE_USB ) {
+  if( (get_midi_note_in_route() & ROUTE_USB) && usb_chan_match( channel ) ) {
     myProgramChange( channel, pgm );
     midi_usb_in_event();
   }
@@ -604,76 +718,44 @@ void usb_mySystemExclusiveChunk(const byte *d, uint16_t len, bool last) {
     MIDI traffic indicators
 */
 
-elapsedMillis since_din_out;
-elapsedMillis since_din_in;
-
-elapsedMillis since_usb_out;
-elapsedMillis since_usb_in;
-
 #define SINCE_DWELL_MAX     100             // show for up to this many milliseconds
 
-bool did_din_out;
-bool did_din_in;
+#define IND_DIN_OUT         0
+#define IND_DIN_IN          1
+#define IND_USB_OUT         2
+#define IND_USB_IN          3
+#define IND_COUNT           4
 
-bool did_usb_out;
-bool did_usb_in;
+void midi_indicator_off( int ind );
 
-void midi_din_out_event() {                 // these are called by MIDI transmit and reeceive routines
-  did_din_out = true;
-  since_din_out = 0;
-}
+volatile bool midi_ind_on[IND_COUNT];
 
-void midi_din_in_event() {
-  did_din_in = true;
-  since_din_in = 0;
-}
+lm_timer_t midi_ind_timer[IND_COUNT] = {
+  TIMER_INIT( midi_indicator_off, IND_DIN_OUT ),
+  TIMER_INIT( midi_indicator_off, IND_DIN_IN ),
+  TIMER_INIT( midi_indicator_off, IND_USB_OUT ),
+  TIMER_INIT( midi_indicator_off, IND_USB_IN )
+};
 
-void midi_usb_out_event() {
-  did_usb_out = true;
-  since_usb_out = 0;
+void midi_indicator_off( int ind ) {        // SINCE_DWELL_MAX went by with no more traffic
+  midi_ind_on[ind] = false;
 }
 
-void midi_usb_in_event() {
-  did_usb_in = true;
-  since_usb_in = 0;
+void midi_indicator_hit( int ind ) {
+  midi_ind_on[ind] = true;
+  timer_start( &midi_ind_timer[ind], SINCE_DWELL_MAX );
 }
 
+void midi_din_out_event()   {     midi_indicator_hit( IND_DIN_OUT );      }     // these are called by MIDI transmit and reeceive routines
+void midi_din_in_event()    {     midi_indicator_hit( IND_DIN_IN );       }     //  (send_midi_rt() calls them from an interrupt, timer_start() is OK with that)
+void midi_usb_out_event()   {     midi_indicator_hit( IND_USB_OUT );      }
+void midi_usb_in_event()    {     midi_indicator_hit( IND_USB_IN );       }
 
                                             // these are called by the code that draws the activity arrows on the OLED
-bool midi_din_out_active() {
-  if( did_din_out && (since_din_out < SINCE_DWELL_MAX) )
-    return true;
-  else
-    did_din_out = false;
-
-  return false;
-}
-
-bool midi_din_in_active() {
-  if( did_din_in && (since_din_in < SINCE_DWELL_MAX) )
-    return true;
-  else
-    did_din_in = false;
-
-  return false;
-}
-
-bool midi_usb_out_active() {
-  if( did_usb_out && (since_usb_out < SINCE_DWELL_MAX) )
-    return true;
-  else
-    did_usb_out = false;
-
-  return false;}
-
-bool midi_usb_in_active() {
-  if( did_usb_in && (since_usb_in < SINCE_DWELL_MAX) )
-    return true;
-  else
-    did_usb_in = false;
-
-  return false;
-}
+bool midi_din_out_active()  {     return midi_ind_on[IND_DIN_OUT];        }
+bool midi_din_in_active()   {     return midi_ind_on[IND_DIN_IN];         }
+bool midi_usb_out_active()  {     return midi_ind_on[IND_USB_OUT];        }
+bool midi_usb_in_active()   {     return midi_ind_on[IND_USB_IN];         }
 
 
 /* ---------------------------------------------------------------------------------------
@@ -690,70 +772,145 @@ bool midi_usb_in_active() {
     handle_midi_in() must be called frequently -- it is what triggers processing of received messages
 */
 
-elapsedMicros midi_in_yield_time;
+/*
+    There is no "message arrived" interrupt to hook -- the UART and USB interrupts just fill the library buffers.
+    So instead of spinning here waiting for bytes, handle_midi_in() drains every source until none of them has a complete
+    message (or we hit a limit, so a flood can't starve everything else), and returns. midiDIN.read() only takes one
+    byte per call and says false until a message is complete, so DIN is drained until its bytes are all used up, not
+    until the first false -- otherwise a Note On could take 3 passes and a DIN chord would be split.
+
+    Latency is then bounded by how long it can be between calls. loop_time_critical() calls us, and code that runs
+    for a long time calls time_critical_yield() at points where that's safe. We keep track of the longest gap so
+    it can be checked ("t" debug command) rather than guessed.
+
+    MIDI_IN_DEADLINE_US is the target. One DIN byte takes 320us and the Serial1 buffer holds 64, so this leaves
+    lots of margin before anything is lost.
+*/
+
+#define MIDI_IN_MAX_MSGS_PER_CALL   32          // bail out after this many, come back on the next call
+#define MIDI_IN_DEADLINE_US         1000        // longest we want to go between input checks
+
+elapsedMicros midi_in_since_check;
+
+uint32_t midi_in_max_gap_us   = 0;              // worst case time between handle_midi_in() calls
+uint32_t midi_in_late_count   = 0;              // # of times MIDI_IN_DEADLINE_US was missed
+uint32_t midi_in_max_msgs     = 0;              // most messages handled in one call
+uint32_t midi_in_calls        = 0;
+
+
+/*
+    Chords
+
+    A DAW will often send kick + hat + clap on the same tick. Grabbing the bus and doing stop/start for each one makes the
+    later voices noticeably late, so while handle_midi_in() is draining input, note ons are just collected here.
+    At the end of the pass play_chord() fires them all in one bus window.
+
+    Outside of handle_midi_in() (chord_collecting == false), play_midi_drm() still plays right away.
+*/
+
+uint16_t chord_strobes[TRIG_VOICES_MAX];
+uint8_t  chord_flags[TRIG_VOICES_MAX];
+int      chord_count = 0;
+bool     chord_collecting = false;
+
+uint32_t chord_max_spread_cycles = 0;                       // worst first-to-last start time within a chord
+uint32_t chord_max_voices = 0;
+uint32_t chords_played = 0;
+
 
-#define MIDI_IN_YIELD_MICROS    10
+bool midi_in_pending() {
+  return (HW_MIDI.available() > 0) || (din_rx_available() > 0);
+}
 
-#define MIDI_IN_LOOPS_PLAYING   10        // when z-80 sequencer is running
-#define MIDI_IN_LOOPS_IDLE      1         // when z-80 sequencer is stopped
 
 void handle_midi_in() {
-  int run_loops = MIDI_IN_LOOPS_IDLE;
-  int yield_loops;
+  uint32_t gap = midi_in_since_check;
+  uint32_t msgs = 0;
+  bool got;
+
+  if( gap > midi_in_max_gap_us )
+    midi_in_max_gap_us = gap;
+
+  if( gap > MIDI_IN_DEADLINE_US )
+    midi_in_late_count++;
+
+  midi_in_calls++;
 
-  if( luma_is_playing() )
-    run_loops = MIDI_IN_LOOPS_PLAYING;    // do this for LUI responsiveness when not running z80 sequencer
+  chord_collecting = true;              // note ons from this pass go out together, see play_chord()
+
+  do {
+    got = false;
 
-  for( int loops = 0; loops < run_loops; loops++ ) 
-  {    
     // -- DIN-5 old-skool MIDI
 
+    din_rx_pump();                      // SysEx is handled in here, the rest is queued for midiDIN
+
     if( midi_chan == 0 )                // 0 = OMNI
-      midiDIN.read();
+      got |= midiDIN.read();
     else
-      midiDIN.read( midi_chan );
+      got |= midiDIN.read( midi_chan );
 
-    
     // -- modern USB hotness MIDI
+    //  always OMNI, like DIN-5 thru. usb_chan_match() keeps other channels away from the voices
   
-    if( midi_chan == 0 )                // 0 = OMNI
-      usbMIDI.read();
-    else
-      usbMIDI.read( midi_chan );
+    if( usbMIDI.read() ) {
+      thru_capture_lib( THRU_SRC_USB, usbMIDI.getType(), usbMIDI.getChannel(), usbMIDI.getData1(), usbMIDI.getData2() );
+      got = true;
+    }
 
     //Check USB HOST activity
-    midiHOST01.read();
-    midiHOST02.read();
-    midiHOST03.read();
+    for( int i = 0; i < THRU_HOST_PORTS; i++ ) {
+      if( thru_host_dev[i]->read() ) {
+        thru_capture_lib( THRU_SRC_HOST1 + i, thru_host_dev[i]->getType(), thru_host_dev[i]->getChannel(),
+                          thru_host_dev[i]->getData1(), thru_host_dev[i]->getData2() );
+        got = true;
+      }
+    }
 
-    // -- give some breathing time for messages to come in, while yield()'ing
+    if( got )
+      msgs++;
 
-    midi_in_yield_time = 0;
-    yield_loops = 0;
+    thru_service();                     // forward what just came in before handling more
 
-    while( midi_in_yield_time < MIDI_IN_YIELD_MICROS ) {
-      yield();
+  } while( (got || midi_in_pending()) && (msgs < MIDI_IN_MAX_MSGS_PER_CALL) );       // midiDIN.read() parses one byte per call
 
-      yield_loops++;
-      if( yield_loops > 3 ) {
-        
-        if( midi_chan == 0 )                // 0 = OMNI
-          midiDIN.read();
-        else
-          midiDIN.read( midi_chan );
+  chord_collecting = false;
+  play_chord();
 
-        if( midi_chan == 0 )                // 0 = OMNI
-          usbMIDI.read();
-        else
-          usbMIDI.read( midi_chan );
-        
-        //Check USB HOST activity
-        midiHOST01.read();
-        midiHOST02.read();
-        midiHOST03.read();
-      }
-    }
-  }
+  din_tx_flush();                       // thru from this pass, one write
+  usb_tx_flush();                       // ... and one USB packet
+
+  sysex_rx_check_timeout();
+
+  if( msgs > midi_in_max_msgs )
+    midi_in_max_msgs = msgs;
+
+  midi_in_since_check = 0;              // measured from the end, handlers we called above count against the next gap
+}
+
+
+void print_midi_in_timing() {
+  Serial.printf("MIDI in: %d checks, longest gap %d us, %d over %d us deadline, most msgs in one check %d\n",
+                midi_in_calls, midi_in_max_gap_us, midi_in_late_count, MIDI_IN_DEADLINE_US, midi_in_max_msgs);
+
+  Serial.printf("Chords:  %d played, up to %d voices, worst spread first to last voice %d ns\n",
+                chords_played, chord_max_voices, (int)((uint64_t)chord_max_spread_cycles * 1000000000ULL / F_CPU_ACTUAL));
+
+  Serial.printf("DIN SysEx: %d msgs, %d cut off, %d realtime bytes inside\n",
+                din_sx_msgs, din_sx_truncated, din_sx_realtime);
+
+  midi_in_calls = 0;
+  midi_in_max_gap_us = 0;
+  midi_in_late_count = 0;
+  midi_in_max_msgs = 0;
+
+  chords_played = 0;
+  chord_max_voices = 0;
+  chord_max_spread_cycles = 0;
+
+  din_sx_msgs = 0;
+  din_sx_truncated = 0;
+  din_sx_realtime = 0;
 }
 
 
@@ -761,14 +918,7 @@ void myNoteOn(byte channel, byte note, byte velocity) {
   
   //Serial.printf(" %d %d %d\n", channel, note, velocity);
 
-  if( note >= MIDI_NOTE_BASS )
-    play_midi_drm( note, velocity );                                    // if it's in our range, play with the provided velocity
-  else {
-    //Serial.printf(" low note, will play %d\n", note+MIDI_NOTE_SOFT_TRIG_OFFSET);
-
-    play_midi_drm( note+MIDI_NOTE_SOFT_TRIG_OFFSET, MIDI_VEL_SOFT );    // if it's in the soft trig range, play with soft velocity
-  }
-  
+  play_midi_drm( note, velocity );                                      // note map takes care of the soft trig range
 }
 
 void myNoteOff(byte channel, byte note, byte velocity) {
@@ -776,23 +926,59 @@ void myNoteOff(byte channel, byte note, byte velocity) {
 
 
 
+void play_chord() {
+  uint32_t spread;
+
+  if( chord_count == 0 )
+    return;
+
+  teensy_drives_z80_bus( true );                            // grab the bus
+
+  disable_drum_trig_interrupt();                            // don't detect drum writes as triggers
+
+  spread = trig_voices( chord_strobes, chord_flags, chord_count );
+
+  restore_drum_trig_interrupt();                            // the way we were
+
+  teensy_drives_z80_bus( false );                           // back to our regularly scheduled program
+
+  if( spread > chord_max_spread_cycles )
+    chord_max_spread_cycles = spread;
+
+  if( (uint32_t)chord_count > chord_max_voices )
+    chord_max_voices = chord_count;
+
+  chords_played++;
+  chord_count = 0;
+}
+
+
 void play_midi_drm( byte note, byte vel ) {
   uint16_t strobe;
   uint8_t flags;
+  int idx;
 
   if( map_midi_2_strobe( note, vel, &strobe, &flags ) ) {   // is it valid? map to strobe, set loudness flag
     
     if( vel != 0 ) {                                        // velocity 0 = NOF
-      teensy_drives_z80_bus( true );                        // grab the bus
-    
-      disable_drum_trig_interrupt();                        // don't detect drum writes as triggers
-    
-      trig_voice( strobe, 0x00 );                           // stop
-      trig_voice( strobe, flags );                          // start
-      
-      restore_drum_trig_interrupt();                        // the way we were
-    
-      teensy_drives_z80_bus( false );                       // back to our regularly scheduled program
+
+      for( idx = 0; idx != chord_count; idx++ )             // same voice twice in one pass, last one wins
+        if( chord_strobes[idx] == strobe )
+          break;
+
+      if( idx == TRIG_VOICES_MAX ) {                        // shouldn't happen, there aren't that many voices
+        play_chord();
+        idx = 0;
+      }
+
+      chord_strobes[idx] = strobe;
+      chord_flags[idx] = flags;
+
+      if( idx == chord_count )
+        chord_count++;
+
+      if( !chord_collecting )
+        play_chord();
     }
 
     last_drum = strobe;                                     // NON & NOF used to select target voice for sysex sample download
@@ -804,6 +990,9 @@ void play_midi_drm( byte note, byte vel ) {
 
 void myProgramChange(byte channel, byte pgm) {
 
+  if( sysex_rx_defer_pgm( pgm ) )                                 // voice board / Z-80 RAM is being loaded, done after the F7
+    return;
+
   if( (uint8_t)pgm <= 99 ) {
     Serial.printf("Program Change val = %d\n", pgm);
     teensy_drives_z80_bus( true );
@@ -817,579 +1006,1724 @@ void myProgramChange(byte channel, byte pgm) {
 
 
 /* ---------------------------------------------------------------------------------------
-    __  __ _____ _____ _____    ____  _    _ _______ 
-   |  \/  |_   _|  __ \_   _|  / __ \| |  | |__   __|
-   | \  / | | | | |  | || |   | |  | | |  | |  | |   
-   | |\/| | | | | |  | || |   | |  | | |  | |  | |   
-   | |  | |_| |_| |__| || |_  | |__| | |__| |  | |   
-   |_|  |_|_____|_____/_____|  \____/ \____/   |_|
- 
-    MIDI Out Handling
+    DIN-5 output: voice queue, running status
+
+    Three kinds of traffic share the DIN-5 wire, most urgent first:
+
+      realtime        Clock / Start / Stop. din_rt_write() puts them straight into the LPUART FIFO, ahead of anything
+                      in the Serial1 buffer -- MIDI allows them anywhere, even inside a SysEx. See "Realtime output".
+      channel voice   Our Note Ons / Offs, Program Change, and thru. Queued here by din_tx_msg().
+      bulk            SysEx uploads (sysex_tx_din_fill()) and SysEx thru (din_sx_thru()), written with din_tx_raw().
+
+    A channel message can't go inside a SysEx (its status byte would end it), so the voice queue is only sent while
+    the wire is between messages: din_tx_in_sysex follows every F0 written and is cleared by the F7 (or any other
+    status byte). An upload doesn't start its F0 until the voice queue is empty, so notes get in between the messages
+    of a bulk backup instead of waiting for all of it. One message can't be split, though -- a hit that comes in
+    while a 37 KB voice is going out waits for its F7, and a Note On that has waited more than DIN_TX_NOTE_STALE_MS
+    is dropped instead of flamming in late (its Note Off still goes, that's harmless).
+
+    At 31250 baud every byte is 320us, so a 4 voice hit as full Note Ons is 12 bytes, almost 4ms before the last one
+    is out. When the queue goes out the status byte is left off if it's the same as the last one the receiver saw,
+    and our Note Offs are Note On velocity 0 so they don't break the run. A drum hit is then 3 bytes for the first
+    voice and 2 for each one after, and its Note Offs are 2 bytes each. din_tx_flush() sends whatever fits in Serial1
+    as one write, at the end of handle_midi_in() / handle_midi_out(), so everything from one pass goes out back to back.
+
+    Bytes written with din_tx_raw() forget the running status if they're SysEx or System Common, so the next message
+    sends its status again. Realtime bytes don't touch running status, that's how MIDI defines it. A receiver that
+    was plugged in mid-run needs a status byte to lock on to, so one is sent at least every DIN_TX_STATUS_REFRESH_MS.
 */
 
-elapsedMillis no_tempo_clk_detect = 0;                        // detect "no clk" -- often switch on rear set incorrectly
-
-bool luma_is_playing() {
-  return !( no_tempo_clk_detect > MS_TO_NO_CLK );             // used to display "Awaiting Tempo Clock" and control when fan can run
-}
+#define DIN_TX_BURST_SIZE           64
+#define DIN_TX_STATUS_REFRESH_MS    1000
+#define DIN_TX_Q_SIZE               32
+#define DIN_TX_NOTE_STALE_MS        30
 
-  
+int  din_tx_raw( const uint8_t *b, int n );
 
+typedef struct {
+  uint32_t t;                                       // ARM_DWT_CYCCNT when it was queued
+  uint8_t  b[3];                                    // status first
+} din_tx_msg_t;
+
+din_tx_msg_t din_tx_q[DIN_TX_Q_SIZE];
+int      din_tx_q_n = 0;
+
+uint8_t  din_tx_burst[DIN_TX_BURST_SIZE];
+uint8_t  din_tx_running = 0;                        // status the receiver has now, 0 = none
+bool     din_tx_in_sysex = false;                   // an F0 went out and its end hasn't yet
+
+elapsedMillis din_tx_since_status;
+
+uint32_t din_tx_msgs = 0;
+uint32_t din_tx_bytes = 0;                          // actually sent, including raw
+uint32_t din_tx_saved = 0;                          // status bytes left off
+uint32_t din_tx_bursts = 0;
+uint32_t din_tx_max_burst = 0;
+uint32_t din_tx_behind = 0;                         // queued while a SysEx was on the wire
+uint32_t din_tx_max_wait = 0;                       // cycles, queued to sent
+uint32_t din_tx_stale = 0;                          // Note Ons dropped, waited too long
+uint32_t din_tx_merged = 0;                         // Note Offs already waiting
+uint32_t din_tx_overflow = 0;
+uint32_t din_tx_closed = 0;                         // SysEx we had to end ourselves
+
+
+void din_tx_track( uint8_t b ) {
+  if( b >= 0xf8 )                                   // realtime, no effect
+    return;
+
+  if( b & 0x80 )
+    din_tx_in_sysex = (b == 0xf0);                  // F7, or any other status, ends it
+
+  if( b >= 0xf0 )                                   // SysEx / System Common cancel running status
+    din_tx_running = 0;
+  else if( b & 0x80 ) {
+    din_tx_running = b;
+    din_tx_since_status = 0;
+  }
+}
 
-// These are used to send Note Off (NOF) messages at some time after a NON. We can't tell when a sample is finished playing, so we use a fixed time.
 
-void check_NOF_times() {
-  byte note;
+bool din_tx_note_off( const uint8_t *b ) {
+  return ((b[0] & 0xf0) == 0x80) || (((b[0] & 0xf0) == 0x90) && (b[2] == 0));
+}
 
-  for( int xxx = 0; xxx != 13; xxx++ ) {                                  // check all 13 drums
-    
-    if( drums[xxx].drum_playing == true ) {                               // is this one playing?
 
-      if ( drums[xxx].drum_time_elapsed > NOF_TIME_MS ) {                 // is it time to send the NOF?
-        note = drums[xxx].midi_note;
+bool din_tx_is_stale( int i, uint32_t now ) {
+  din_tx_msg_t *m = &din_tx_q[i];
 
-        if( midi_send_velocity == false ) {                               // IF we are not sending velocity
-          if( drums[xxx].drum_soft == true ) {                            // AND this was a soft one
-            note -= MIDI_NOTE_SOFT_TRIG_OFFSET;                           // THEN adjust note value
-          }
-        }
+  return ((m->b[0] & 0xf0) == 0x90) && m->b[2] && ((now - m->t) > (DIN_TX_NOTE_STALE_MS * (F_CPU_ACTUAL / 1000)));
+}
 
-        if( get_midi_note_out_route() & ROUTE_DIN5 ) {
-          midiDIN.sendNoteOff( note, MIDI_VEL_LOUD, (midi_chan == 0)?1:midi_chan );
-          midi_din_out_event();
-        }
 
-        if( get_midi_note_out_route() & ROUTE_USB ) {
-          usbMIDI.sendNoteOff( note, MIDI_VEL_LOUD, (midi_chan == 0)?1:midi_chan );
-          midi_usb_out_event();
-        }
+// Squeeze out Note Ons that are too late to send anyway
 
-        drums[xxx].drum_playing = false;
-      }
+void din_tx_compact() {
+  uint32_t now = ARM_DWT_CYCCNT;
+  int k = 0;
 
-    }
+  for( int i = 0; i < din_tx_q_n; i++ ) {
+    if( din_tx_is_stale( i, now ) )
+      din_tx_stale++;
+    else
+      din_tx_q[k++] = din_tx_q[i];
   }
+
+  din_tx_q_n = k;
 }
 
 
-char *drum_name( int idx, byte vel ) {
-  switch( idx ) {
-                  case drum_BASS:       if(vel>MIDI_VEL_SOFT) return (char*)"BASS";    else return (char*)"bass";     break;
-                  case drum_SNARE:      if(vel>MIDI_VEL_SOFT) return (char*)"SNARE";   else return (char*)"snare";    break;
-                  case drum_HIHAT:      if(vel>MIDI_VEL_SOFT) return (char*)"HIHAT";   else return (char*)"hihat";    break;
-                  case drum_HIHAT_OPEN: return (char*)"HIHAT OPEN";                                                   break;
-                  case drum_CLAPS:      return (char*)"CLAPS";                                                        break;
-                  case drum_CABASA:     if(vel>MIDI_VEL_SOFT) return (char*)"CABASA";  else return (char*)"cabasa";   break;
-                  case drum_TAMB:       if(vel>MIDI_VEL_SOFT) return (char*)"TAMB";    else return (char*)"tamb";     break;
-                  case drum_TOM_UP:     return (char*)"TOM ^";                                                        break;    
-                  case drum_TOM_DN:     return (char*)"TOM v";                                                        break;
-                  case drum_CONGA_UP:   return (char*)"CONGA ^";                                                      break;
-                  case drum_CONGA_DN:   return (char*)"CONGA v";                                                      break;
-                  case drum_COWBELL:    return (char*)"COWBELL";                                                      break;
-                  case drum_CLAVE:      return (char*)"RIMSHOT";                                                      break;
-  
-                  default:              return (char*)"UNKNOWN";                                                      break;
-  }
+// Is there a SysEx on the wire that nobody is going to finish? (we started echoing one and it was cut off, or
+//  an upload took over the port). Voice would wait behind it forever.
+
+bool din_tx_sysex_orphaned() {
+  if( !din_tx_in_sysex || sysex_tx_din_sending() )
+    return false;
+
+  return !(din_sx_active && midi_soft_thru && !(sysex_tx_routes() & ROUTE_DIN5));
 }
 
 
-void send_midi_drm( int drum_idx, byte vel ) {                            // if we are in OMNI mode, send on channel 1
-  byte note;
+// Sends as much of the voice queue as fits in Serial1, as one write. Never waits.
 
-  note = drums[drum_idx].midi_note;
+void din_tx_flush() {
+  uint32_t now = ARM_DWT_CYCCNT;
+  uint32_t wait;
+  int room;
+  int len;
+  int n = 0;
+  int i;
 
-  drums[drum_idx].drum_soft = (vel < MIDI_VEL_LOUD);          // remember this so we can NOF the right way when midi_send_velocity == false
+  if( din_tx_sysex_orphaned() ) {
+    uint8_t eox = 0xf7;
 
-  Serial.printf("%s: %d %d\n", drum_name(drum_idx,vel), note, vel );
-
-  if( midi_send_velocity == false ) {                         // if FALSE, send soft notes on secondary note mapping. can keep low velocity.
-    switch( note ) {
-      case MIDI_NOTE_BASS:
-      case MIDI_NOTE_SNARE:
-      case MIDI_NOTE_HIHAT:
-      case MIDI_NOTE_CABASA:
-      case MIDI_NOTE_TAMB:
-                            if( vel < MIDI_VEL_LOUD ) {
-                              Serial.printf("no vel, mapped MIDI note %d to %d\n", note, note-MIDI_NOTE_SOFT_TRIG_OFFSET);
-                              note -= MIDI_NOTE_SOFT_TRIG_OFFSET;
-                            }
-                            break;
-    }
+    din_tx_closed++;
+    din_tx_raw( &eox, 1 );
   }
 
-  if( get_midi_note_out_route() & ROUTE_DIN5 ) {
-    midiDIN.sendNoteOn( note, vel, (midi_chan == 0)?1:midi_chan );
-    midi_din_out_event();
-  }
-
-  if( get_midi_note_out_route() & ROUTE_USB ) {
-    usbMIDI.sendNoteOn( note, vel, (midi_chan == 0)?1:midi_chan );
-    midi_usb_out_event();
-  }
-  
-  drums[drum_idx].drum_time_elapsed = 0;                                  // prepare to send NOF in the near future
-  drums[drum_idx].drum_playing = true;
-
-  // this is used to target a drum voice when loading a sample via sysex
-  last_drum = drums[drum_idx].strobe;
-  
-  // if any drum keys hit, make sure the bootscreen goes away
-  bootscreen_showing = false;
-}
-
-
-
-void handle_midi_out() {
-  drum_trig_event *dte;
-
-  // ===============================
-  // Go see if it's time to send any Note Offs for drums that were triggered
-  
-  check_NOF_times();
+  if( !din_tx_q_n || din_tx_in_sysex )              // nothing to send, or wait for the F7
+    return;
 
+  room = min( HW_MIDI.availableForWrite(), DIN_TX_BURST_SIZE );
 
-  // ===============================
-  // Cry, the Clock Said
-
-  if( song_is_started && (sinceLastFSKClk > 100) ) {          // think song is running but 100ms passed with no FSK clock interrupt?
+  for( i = 0; i < din_tx_q_n; i++ ) {
+    din_tx_msg_t *m = &din_tx_q[i];
 
-    if( get_midi_clock_out_route() & ROUTE_DIN5 ) {           // STOP -> DIN-5
-      midiDIN.sendRealTime(MIDI_NAMESPACE::Stop);
-      midi_din_out_event();
+    if( din_tx_is_stale( i, now ) ) {
+      din_tx_stale++;
+      continue;
     }
 
-    if( get_midi_clock_out_route() & ROUTE_USB ) {            // STOP -> USB
-      usbMIDI.sendRealTime(usbMIDI.Stop);
-      midi_usb_out_event();
-    }
-    
-    song_is_started = false;
-    send_midi_clk = false;
-    Serial.println("sent MIDI Stop");
-  }
-  
-  if( send_midi_clk ) {
-    if( !song_is_started ) {
-
-      if( get_midi_clock_out_route() & ROUTE_DIN5 ) {         // START -> DIN-5
-        midiDIN.sendRealTime(MIDI_NAMESPACE::Start);
-        midi_din_out_event();
-      }
+    len = thru_msg_len( m->b[0] );
 
-      if( get_midi_clock_out_route() & ROUTE_USB ) {          // START -> USB
-        usbMIDI.sendRealTime(usbMIDI.Start);
-        midi_usb_out_event();
-      }
+    if( (n + len) > room )
+      break;
 
-      song_is_started = true;
-      Serial.println("sent MIDI Start");
+    if( (m->b[0] == din_tx_running) && (din_tx_since_status < DIN_TX_STATUS_REFRESH_MS) ) {
+      din_tx_saved++;                               // receiver already has it
     }
-
-    if( get_midi_clock_out_route() & ROUTE_DIN5 ) {           // CLOCK -> DIN-5
-      midiDIN.sendRealTime(MIDI_NAMESPACE::Clock);
-      midi_din_out_event();
+    else {
+      din_tx_burst[n++] = m->b[0];
+      din_tx_track( m->b[0] );
     }
 
-    if( get_midi_clock_out_route() & ROUTE_USB ) {            // CLOCK -> USB    
-      usbMIDI.sendRealTime(usbMIDI.Clock);
-      midi_usb_out_event();
-    }
-    
-    send_midi_clk = false;
+    if( len > 1 )
+      din_tx_burst[n++] = m->b[1];
+    if( len > 2 )
+      din_tx_burst[n++] = m->b[2];
 
-    no_tempo_clk_detect = 0;                                        // reset "no clk" detector
+    wait = now - m->t;
+    if( wait > din_tx_max_wait )
+      din_tx_max_wait = wait;
+
+    din_tx_msgs++;
   }
 
-  
-  // ===============================
-  // see if any drums were hit, look at trigger bits captured from the i2c port expander
-  
-  while( (dte = pop_trig_event()) != NULL ) {                    // process all that have arrived
-    
-    if( dte->trigs_a ) {
-      if( dte->trigs_a & 0x01 )  send_midi_drm( drum_CABASA,     (dte->trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
-        
-      if( dte->trigs_a & 0x02 )  send_midi_drm( drum_TAMB,       (dte->trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
+  din_tx_q_n -= i;
+  if( din_tx_q_n )
+    memmove( din_tx_q, &din_tx_q[i], din_tx_q_n * sizeof(din_tx_msg_t) );
 
-      if( dte->trigs_a & 0x04 ) {
-        if( dte->trig_mods & 0x04 ) 
-          send_midi_drm( ( dte->trig_mods & 0x02 ) ? drum_CONGA_UP : drum_CONGA_DN,           MIDI_VEL_LOUD );
-        else
-          send_midi_drm( ( dte->trig_mods & 0x02 ) ? drum_TOM_UP : drum_TOM_DN,               MIDI_VEL_LOUD );
-        }
-      
-      if( dte->trigs_a & 0x10 )  send_midi_drm( drum_COWBELL,                                 MIDI_VEL_LOUD );
-      
-      if( dte->trigs_a & 0x20 )  send_midi_drm( drum_CLAVE,                                   MIDI_VEL_LOUD );
-    }
-  
-    
-    if( dte->trigs_b ) {
-      if( dte->trigs_b & 0x80 )     send_midi_drm( drum_CLAPS,                                MIDI_VEL_LOUD );
+  if( !n )
+    return;
 
-      // HIHAT / hihat / HIHAT SPLASH (OPEN)
-      if( dte->trigs_b & 0x10 ) {      
-        if( dte->trig_mods & 0x04 ) send_midi_drm( drum_HIHAT_OPEN,                           MIDI_VEL_LOUD );
-        else                        send_midi_drm( drum_HIHAT,      (dte->trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
-      }
-        
-      if( dte->trigs_b & 0x40 )     send_midi_drm( drum_BASS,       (dte->trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
-        
-      if( dte->trigs_b & 0x20 )     send_midi_drm( drum_SNARE,      (dte->trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
-    }  
-  }  
+  HW_MIDI.write( din_tx_burst, n );
+  midi_din_out_event();
+
+  din_tx_bytes += n;
+  din_tx_bursts++;
+  if( (uint32_t)n > din_tx_max_burst )
+    din_tx_max_burst = n;
 }
 
 
-void didProgramChange( byte pgm ) {
-  Serial.printf("Sending MIDI Program Change: %02d\n", pgm);
+// Room in the queue for one more message
+
+bool din_tx_room() {
+  if( din_tx_q_n == DIN_TX_Q_SIZE )
+    din_tx_compact();
 
-  midiDIN.sendProgramChange( pgm, (midi_chan == 0)?1:midi_chan );
-  usbMIDI.sendProgramChange( pgm, (midi_chan == 0)?1:midi_chan );
+  return din_tx_q_n < DIN_TX_Q_SIZE;
 }
 
 
-/* ---------------------------------------------------------------------------------------
-    __  __ _____ _____ _____    _____ _      ____   _____ _  __
-   |  \/  |_   _|  __ \_   _|  / ____| |    / __ \ / ____| |/ /
-   | \  / | | | | |  | || |   | |    | |   | |  | | |    | ' / 
-   | |\/| | | | | |  | || |   | |    | |   | |  | | |    |  <  
-   | |  | |_| |_| |__| || |_  | |____| |___| |__| | |____| . \ 
-   |_|  |_|_____|_____/_____|  \_____|______\____/ \_____|_|\_\
-     
-    MIDI CLOCK IN & OUT
+// Queue a channel message for DIN-5. Goes out with din_tx_flush(), false if there was no room.
 
-    MIDI Clock In drives the DECODED_TAPE_SYNC_CLK at the correct frequency to make the LM-1 firmware think
-     that it is receiving a Tape Sync signal (like from an FSK Tape Sync stripe laid down on tape from an original LM-1).
+bool din_tx_msg( uint8_t status, uint8_t d1, uint8_t d2 ) {
+  din_tx_msg_t *m;
+  uint8_t b[3] = { status, d1, d2 };
 
-    MIDI Clock out is generated when the LM-1 firmware sequencer is running. This is detected by the presence of a clock
-     on the TAPE_FSK_TTL signal (which was originally the FSK Tape Sync output).
+  if( din_tx_note_off( b ) ) {
+    for( int i = din_tx_q_n - 1; i >= 0; i-- ) {   // latest Note On / Off for this note decides
+      m = &din_tx_q[i];
 
-    The LM-1 internal clock runs at 48 PPQN.
-    MIDI clock runs at 24 PPQN.
-    Teensy software adjusts both as needed.
-     
-*/
+      if( ((m->b[0] & 0xe0) != 0x80) || ((m->b[0] & 0x0f) != (status & 0x0f)) || (m->b[1] != d1) )
+        continue;
 
-/* ---------------------------------------------------------------------------------------
-    Manage the TAPE_SYNC_MODE_CLK signal
+      if( din_tx_note_off( m->b ) ) {
+        din_tx_merged++;                            // same note is already being turned off
+        return true;
+      }
 
-    This gets used by the MIDI clock code AND the EPROM dumping code.
-    
-    These routines manage the mode of the TAPE_SYNC_MODE_CLK pin.
+      break;                                        // a Note On is waiting, it needs this Off after it
+    }
+  }
 
-    We do this becuase the DECODED_TAPE_SYNC_CLK signal is used for 2 things:
+  if( !din_tx_room() ) {
+    din_tx_overflow++;
+    return false;
+  }
 
-      - General Purpose Output to drive /CE on EPROM socket for EPROM dumping
-      - Clock to LM-1 firmware to simulate Tape Sync Clock
-*/
+  if( din_tx_in_sysex )
+    din_tx_behind++;
 
-void set_tape_sync_clk_gpo( bool state ) {
-  digitalWriteFast( DECODED_TAPE_SYNC_CLK, state );
-}
+  m = &din_tx_q[din_tx_q_n++];
+  m->t = ARM_DWT_CYCCNT;
+  memcpy( m->b, b, 3 );
 
-bool get_tape_sync_clk_gpo() {
-  return digitalReadFast( DECODED_TAPE_SYNC_CLK );
+  return true;
 }
 
 
-/* ---------------------------------------------------------------------------------------
-    MIDI Clock time calculation
-*/
+// Bytes that aren't channel messages we built (SysEx). The voice queue goes first if the wire is free,
+//  returns how many were written.
 
-elapsedMicros sinceLastMIDIClk;         // use this to keep track of time since previous MIDI clk
+int din_tx_raw( const uint8_t *b, int n ) {
+  if( !din_tx_in_sysex )
+    din_tx_flush();
 
-elapsedMicros sinceMIDIStart;           // used to detect if quick or slower MIDI Clock after MIDI Start
+  for( int i = 0; i < n; i++ )
+    din_tx_track( b[i] );
 
-IntervalTimer tempoTimer;               // interrupt-driven timer to generate tempo clock pulses
+  din_tx_bytes += n;
 
-bool tempo_clock_state;
+  return HW_MIDI.write( b, n );
+}
 
-int tempo_clock_count;
 
-bool started = false;
+void print_din_tx_stats() {
+  uint32_t full = din_tx_bytes + din_tx_saved;
 
-bool first_tempo_clock = false;
+  Serial.printf("DIN out: %d msgs, %d bytes in %d bursts (biggest %d), running status saved %d bytes = %d ms of wire time",
+                din_tx_msgs, din_tx_bytes, din_tx_bursts, din_tx_max_burst, din_tx_saved, din_tx_saved * 320 / 1000);
+  if( full )
+    Serial.printf(" (%d%%)", din_tx_saved * 100 / full);
+  Serial.printf("\n");
 
-uint32_t last_time;
+  Serial.printf("DIN out queue: %d waiting, %d behind SysEx, longest wait %d us, %d stale Note Ons dropped, %d Note Offs merged\n",
+                din_tx_q_n, din_tx_behind, din_tx_max_wait / (F_CPU_ACTUAL / 1000000), din_tx_stale, din_tx_merged);
+  if( din_tx_overflow || din_tx_closed )
+    Serial.printf("### DIN out queue: %d overflows, %d cut off SysEx closed\n", din_tx_overflow, din_tx_closed);
 
+  din_tx_msgs = din_tx_bytes = din_tx_saved = din_tx_bursts = din_tx_max_burst = 0;
+  din_tx_behind = din_tx_max_wait = din_tx_stale = din_tx_merged = din_tx_overflow = din_tx_closed = 0;
+}
 
-void tempo_clock_output() {                               // INTERRUPT CONTEXT, be careful, don't do too much
-  if( tempo_clock_count < 3 ) {                           // EDGES 2, 3, 4
 
-    tempo_clock_state = !tempo_clock_state;               // just flip it
 
-    if( started )                                         // normally hold tempo clock high until we get our first MIDI clock
-      set_tape_sync_clk_gpo( tempo_clock_state );         // we are running, let it wiggle
-    else
-      set_tape_sync_clk_gpo( false );                     // inverted, this holds it high
+/* ---------------------------------------------------------------------------------------
+    USB MIDI output, one packet per pass
 
-    tempo_clock_count++;
-                                                          // total hacks, Ableton sometimes shortens the MIDI clock period -- a lot!
-                                                          // these hacks squeeze things to add more room for error in the 24ppqn clocks
+    Every usbMIDI.sendXXX() call puts a 4 byte event in the USB library's buffer, which goes to the host when it fills
+    or when the USB interrupt decides it's been sitting long enough. So a 4 voice hit sent one call at a time (with
+    a Serial.printf in between) could be split over 2 or 3 transfers, and the DAW sees the voices land at different
+    times -- it depends on where the frame timer happens to fall.
 
-    if( tempo_clock_count == 2 )
-      tempoTimer.begin( tempo_clock_output, last_time*0.7 );    // shorten the second pulse 30%
-  }
-  else
-    tempoTimer.end();
-}
+    Channel messages for USB go through usb_tx_msg(), which only collects them. usb_tx_flush() hands them all to
+    usbMIDI back to back and sends them with one send_now(), at the end of handle_midi_in() / handle_midi_out(), so
+    all the events from one pass travel in one transfer. USB_TX_Q_SIZE events fill one 64 byte full speed packet, if
+    a pass makes more than that the full packet goes right away. Realtime (Clock / Start / Stop) doesn't wait for the
+    pass, see "Realtime output", and SysEx chunks are already one call each.
+
+    While a SysEx upload is going out on USB the queue is held, a channel message would end the SysEx early. Note Ons
+    aren't sent at all then, but Note Offs wait here and go as soon as the upload is done, so nothing is left hanging.
+*/
 
+#define USB_TX_Q_SIZE               16              // 4 byte events in a 64 byte packet
 
-void init_tempo_clock_timer( uint32_t t, bool first_clock ) {
-  tempoTimer.end();
+typedef struct {
+  uint32_t t;                                       // ARM_DWT_CYCCNT when it was queued
+  uint8_t  b[3];                                    // status first
+} usb_tx_msg_t;
 
-  /*
-      SOME NOTES
+usb_tx_msg_t usb_tx_q[USB_TX_Q_SIZE];
+int      usb_tx_q_n = 0;
 
-      LM-1 internal tempo clock runs from 35bpm to 165bpm.
+uint32_t usb_tx_msgs = 0;
+uint32_t usb_tx_packets = 0;                        // send_now()s
+uint32_t usb_tx_full = 0;                           // of those, because the queue filled up mid-pass
+uint32_t usb_tx_max_wait = 0;                       // cycles, queued to handed off
+uint32_t usb_tx_sum_wait = 0;
+uint32_t usb_tx_dropped = 0;                        // queue full while held for an upload
 
-      We have tested this with tempos (driven from Ableton) of 30bpm to 150bpm, above 150bpm you lose enough time for the z80 to process.
 
-  */
+void usb_tx_flush() {
+  uint32_t now = ARM_DWT_CYCCNT;
+  uint32_t wait;
 
-  if( t > 50000 ) {                                       // if it's so big it looks like we haven't been getting clocks...
-    t = 3500;                                             // ...fake it with something fast enough to fit, but not too fast
-  }
+  if( !usb_tx_q_n || sysex_tx_usb_sending() )       // waits for the end of the upload
+    return;
 
-  //Serial.printf("init: --> %d\n", t);
+  usb_tx_begin();
 
-  sinceLastMIDIClk = 0;                                   // time to start a new measurement
+  for( int i = 0; i < usb_tx_q_n; i++ ) {
+    usb_tx_msg_t *m = &usb_tx_q[i];
 
-  if( first_clock && (sinceMIDIStart > (t+1000)) ) {      // first one, AND more than 1/4 period between MIDI Clocks passed (with 1ms fudge)?
-   tempo_clock_state = false;                             // inverted, drive tempo clock HIGH for first MIDI clock
-   tempo_clock_count = 1;                                 // only 3 edges for the first clock
-  }
-  else {
-    tempo_clock_state = true;                             // inverted, drive tempo clock LOW for subsequent MIDI clocks
-    tempo_clock_count = 0;
-  }
+    usbMIDI.send( (m->b[0] < 0xf0) ? (m->b[0] & 0xf0) : m->b[0], m->b[1], m->b[2], (m->b[0] & 0x0f) + 1, 0 );
 
-  if( first_clock ) {
-   first_tempo_clock = false;                             // first one is special
+    wait = now - m->t;
+    usb_tx_sum_wait += wait / (F_CPU_ACTUAL / 1000000);
+    if( wait > usb_tx_max_wait )
+      usb_tx_max_wait = wait;
   }
 
-  if( started )
-    set_tape_sync_clk_gpo( tempo_clock_state );           // start in known state at each new MIDI clock, EDGE 1 of 4 (or 3, for first one)
+  usbMIDI.send_now();
+  usb_tx_end();                                     // a clock that came in meanwhile goes right after
 
-  last_time = t;
+  midi_usb_out_event();
 
-  tempoTimer.begin( tempo_clock_output, t );              // we will do 4 (3 for first one) tempo clock flips between each MIDI clock message
-  tempoTimer.priority( 0 );                               // highest priority
+  usb_tx_msgs += usb_tx_q_n;
+  usb_tx_packets++;
+  usb_tx_q_n = 0;
 }
 
 
-// -- Called when we get a MIDI Clock
+// Queue a channel message for USB, goes out with usb_tx_flush()
 
-/*
-  NOTE! MIDI Start means start the sequencer at the NEXT MIDI CLOCK.
-        Since we double the MIDI Clock to 48ppqn, we need to make sure we only start it (push the footpedal)
-         on a MIDI Clock boundary (not an interpolated 48ppqn clock pulse).
+void usb_tx_msg( uint8_t status, uint8_t d1, uint8_t d2 ) {
+  usb_tx_msg_t *m;
 
+  if( usb_tx_q_n == USB_TX_Q_SIZE ) {
+    if( sysex_tx_usb_sending() ) {
+      usb_tx_dropped++;
+      return;
+    }
 
-  Hold tempo clock HIGH
-  Get MIDI Start
-    Drop tempo clock
-  Get MIDI Clock
-    Raise tempo clock
-    Drive tempo clock with interpolated MIDI clock timing
-*/
+    usb_tx_full++;
+    usb_tx_flush();
+  }
 
-void myClock() {  
-  init_tempo_clock_timer( sinceLastMIDIClk/4, first_tempo_clock );
+  m = &usb_tx_q[usb_tx_q_n++];
+  m->t = ARM_DWT_CYCCNT;
+  m->b[0] = status;
+  m->b[1] = d1;
+  m->b[2] = d2;
 }
 
 
+void print_usb_tx_stats() {
+  Serial.printf("USB out: %d msgs in %d packets (%d full), wait avg %d us max %d us\n",
+                usb_tx_msgs, usb_tx_packets, usb_tx_full,
+                usb_tx_msgs ? (usb_tx_sum_wait / usb_tx_msgs) : 0, usb_tx_max_wait / (F_CPU_ACTUAL / 1000000));
+  if( usb_tx_dropped )
+    Serial.printf("### USB out: %d dropped, queue full during a SysEx upload\n", usb_tx_dropped);
 
-bool honorMIDIStartStopState() {
-  return honor_start_stop;
+  usb_tx_msgs = usb_tx_packets = usb_tx_full = usb_tx_max_wait = usb_tx_sum_wait = usb_tx_dropped = 0;
 }
 
-bool honorMIDIStartStop( bool honor ) {
-  bool prev = honor_start_stop;
 
-  honor_start_stop = honor;
 
-  Serial.printf("%s honor MIDI Start/Stop messages\n", honor?"Will":"Will NOT");
+/* ---------------------------------------------------------------------------------------
+    MIDI Thru / Merge
 
-  return prev;
-}
+    Every input port drops the messages it receives into one queue, in the order they arrived, each stamped with
+    the cycle counter. The output ports (DIN-5, USB device, USB host devices) each keep their own position in that
+    same queue and send straight out of it, so a message is never copied or parsed again after it comes in.
 
+    A message is done when every output has gone past it. If an output can't keep up (DIN-5 is 31250 baud, or its
+    voice queue is waiting out a long SysEx), the queue fills up and that output skips its oldest message, counted as a drop for
+    that output -- the others aren't held back by it. No one input can take more than THRU_SRC_SHARE entries,
+    so a flood on one port doesn't lock the others out.
 
+    What gets forwarded:
+      DIN-5 and USB device inputs           when Soft Thru is on (DIN-5 -> DIN-5 is the classic soft thru)
+      USB host inputs                       always, channel messages moved to our channel (like before)
+      never back out the port it came in on (except DIN-5, which has separate in and out jacks)
 
-// -- Called when we get a MIDI Start
+    DIN-5 SysEx doesn't come thru here, din_rx_frame() echoes it a byte at a time as it arrives.
+*/
 
-/*
-    When we get a MIDI Start, the NEXT MIDI CLOCK marks the initial downbeat.
+#define THRU_Q_SIZE             64                  // power of 2
+#define THRU_Q_MASK             (THRU_Q_SIZE - 1)
+#define THRU_SRC_SHARE          (THRU_Q_SIZE / 2)   // most entries one input can have waiting
 
-    BUT! We are generating 2 LM-1 clocks for each MIDI Clock.
+#define THRU_SENT               0
+#define THRU_SKIP               1                   // this output doesn't want it
+#define THRU_HOLD               2                   // output is busy, try again later
 
-    We need to wait for the next MIDI Clock to actually start the LM-1 sequencer.
+typedef struct {
+  uint32_t t;                                       // ARM_DWT_CYCCNT when it came in
+  uint8_t  src;                                     // THRU_SRC_xx
+  uint8_t  len;
+  uint8_t  b[3];                                    // raw message, status first
+} thru_msg_t;
 
-    MIDI Clock  1000 1000 1000
-    LM-1 Clock  1010 1010 1010
-*/
+thru_msg_t thru_q[THRU_Q_SIZE];
 
-void myStart() {
-  Serial.println("received MIDI Start");
+uint32_t thru_q_head = 0;                           // next free entry, free-running, masked on use
+uint32_t thru_q_tail = 0;                           // oldest entry some output still needs
+uint32_t thru_dest_pos[THRU_DESTS];                 // next entry for each output
 
-  if( !started ) {                                          // if we hadn't started yet
-    if( honorMIDIStartStopState() ) {
-      Serial.printf("Honoring MIDI Start, pressing foot pedal\n");
-      z80_seq_ctl( Z80_SEQ_START );                           // simulate foot pedal press
-    }
+uint8_t  thru_src_queued[THRU_SRCS];                // entries each input has in the queue
 
-    tempoTimer.end();                                       // make sure this isn't running
+uint32_t thru_src_msgs[THRU_SRCS];
+uint32_t thru_src_drops[THRU_SRCS];                 // over THRU_SRC_SHARE
 
-    tempo_clock_state = true;                               // inverted, drive tempo clock LOW when we get MIDI Start
-    set_tape_sync_clk_gpo( tempo_clock_state );
+uint32_t thru_dest_msgs[THRU_DESTS];
+uint32_t thru_dest_drops[THRU_DESTS];               // skipped because this output fell behind
+uint32_t thru_dest_max_cycles[THRU_DESTS];          // worst arrival -> sent
+uint64_t thru_dest_sum_cycles[THRU_DESTS];
 
-    started = true;                                         // now we've started
-    sinceMIDIStart = 0;                                     // used to figure out how much time has passed by first MIDI Clock
+const char *thru_src_name[THRU_SRCS]    = { "DIN-5", "USB", "Host 1", "Host 2", "Host 3" };
+const char *thru_dest_name[THRU_DESTS]  = { "DIN-5", "USB", "Host" };
 
-    first_tempo_clock = true;                               // first tempo clock is funny, just 3 edges
-  }
-  else {
-    Serial.println("DUPLICATE MIDI Start, ignoring");
+
+// total length of the message that starts with this status byte
+
+uint8_t thru_msg_len( uint8_t status ) {
+  switch( status & 0xf0 ) {
+    case 0xc0:
+    case 0xd0:    return 2;
+    case 0xf0:    if( (status == 0xf1) || (status == 0xf3) )
+                    return 2;
+                  if( status == 0xf2 )
+                    return 3;
+                  return 1;
   }
+
+  return 3;
 }
 
 
-// -- Called when we get a MIDI Continue
+bool thru_src_enabled( uint8_t src ) {
+  if( src >= THRU_SRC_HOST1 )
+    return true;
 
-void myContinue() {
-/*
-  Serial.println("received MIDI Continue");
+  return midi_soft_thru;
+}
 
-  if( honor_start_stop ) {
 
-    got_midi_start = true;                              // we don't really honor Continue, we treat it like Start
+// the slowest output skips its oldest entry to make room
 
-    z80_seq_ctl( Z80_SEQ_START );                       // simulate foot pedal press
-  }
-  else {
-    Serial.printf("MIDI Start (Continue) honor disabled\n");
+void thru_q_make_room() {
+  uint32_t oldest = thru_q_head - THRU_Q_SIZE;
+
+  for( int d = 0; d < THRU_DESTS; d++ ) {
+    if( thru_dest_pos[d] == oldest ) {
+      thru_dest_pos[d]++;
+      thru_dest_drops[d]++;
+    }
   }
-*/
+
+  thru_q_retire();
 }
 
 
-// -- Called when we get a MIDI Stop
+void thru_capture( uint8_t src, uint8_t status, uint8_t d1, uint8_t d2 ) {
+  thru_msg_t *m;
+  uint32_t now = ARM_DWT_CYCCNT;
 
-void myStop() {
-  Serial.println("received MIDI Stop");
+  rec_msg( status, d1, d2, now );                   // every port's input passes here, so the recorder hooks in too
 
-  if( started ) {
-    first_tempo_clock = false;                          // shouldn't need to do this, but it doesn't hurt (in case we got no MIDI clocks)
+  if( !thru_src_enabled( src ) )
+    return;
 
-    if( honorMIDIStartStopState() ) {
-      Serial.printf("Honoring MIDI Stop, pressing foot pedal\n");
-      z80_seq_ctl( Z80_SEQ_STOP );                      // simulate foot pedal press
+  thru_src_msgs[src]++;
 
-      init_tempo_clock_timer( 18000/4, false );
-      delay( 100 );
-      tempoTimer.end();                                       // make sure this isn't running
-    }
-    
-    started = false;                                    // now we've stopped
-  }
-  else {
-    Serial.println("DUPLICATE MIDI Stop, ignoring");
+  if( thru_src_queued[src] >= THRU_SRC_SHARE ) {
+    thru_src_drops[src]++;
+    return;
   }
-}
 
+  if( (thru_q_head - thru_q_tail) == THRU_Q_SIZE )
+    thru_q_make_room();
 
+  m = &thru_q[thru_q_head & THRU_Q_MASK];
+  m->t = now;
+  m->src = src;
+  m->len = thru_msg_len( status );
+  m->b[0] = status;
+  m->b[1] = d1;
+  m->b[2] = d2;
 
+  thru_src_queued[src]++;
+  thru_q_head++;
+}
 
 
-/* ---------------------------------------------------------------------------------------
-    MIDI Clock Interrupt Handling
-*/
+// For ports where the library has already parsed the message, put the raw bytes back together
 
-bool midi_start_stop_clk_enable = false;
+void thru_capture_lib( uint8_t src, uint8_t type, uint8_t chan, uint8_t d1, uint8_t d2 ) {
 
-bool enable_midi_start_stop_clock( bool en ) {        // enable/disable interrupt used to detect FSK TTL clock
-  bool prev_en = midi_start_stop_clk_enable;          // remember what it was
+  if( (type < 0x80) || (type == 0xf0) || (type == 0xf7) )           // SysEx isn't forwarded from here
+    return;
 
-  midi_start_stop_clk_enable = en;
-  
-  if( en ) {
-    Serial.println("enable clk detect");
-    attachInterrupt( digitalPinToInterrupt(TAPE_FSK_TTL),  internal_tempo_clock, FALLING );
-  }
-  else {
-    Serial.println("DISABLE clk detect");
-    detachInterrupt( digitalPinToInterrupt(TAPE_FSK_TTL) );
+  if( type < 0xf0 ) {
+    if( src >= THRU_SRC_HOST1 )                                       // host controllers play on our channel
+      chan = (midi_chan == 0) ? 1 : midi_chan;
+
+    type = (type & 0xf0) | ((chan - 1) & 0x0f);
   }
 
-  return prev_en;                                     // so we can put it back like it was
+  thru_capture( src, type, d1, d2 );
 }
 
 
-int int_tempo_clk_counts = 0;
+// retire entries every output has gone past
 
-void internal_tempo_clock( void ) {
-  if( !digitalRead( LM1_LED_A ) ) {
-    int_tempo_clk_counts++;
-    if( int_tempo_clk_counts >= 2 ) {                 // MIDI clock is 24 PPQN, FSK clock is 48 PPQN, so send a MIDI clock every other FSK clock
-      int_tempo_clk_counts = 0;
-      send_midi_clk = true;
-    }
-  
-    sinceLastFSKClk = 0;                              // keep pulling this back to 0, it's how we detect that the FSK clock has stopped
+void thru_q_retire() {
+  uint32_t t = thru_q_head;
+
+  for( int d = 0; d < THRU_DESTS; d++ ) {
+    if( (int32_t)(thru_dest_pos[d] - t) < 0 )
+      t = thru_dest_pos[d];
+  }
+
+  while( thru_q_tail != t ) {
+    thru_src_queued[thru_q[thru_q_tail & THRU_Q_MASK].src]--;
+    thru_q_tail++;
   }
 }
 
 
-// This gets used for cases where we have not been able to keep an eye on the FSK clock
+int thru_send( int d, uint32_t pos ) {
+  thru_msg_t *m = &thru_q[pos & THRU_Q_MASK];
+  bool sent = false;
 
-void reset_FSK_clock_check() {
-  sinceLastFSKClk = 0;
-  int_tempo_clk_counts = 0;
-  send_midi_clk = false;
-}
+  switch( d ) {
+    case THRU_DEST_DIN5:
+      if( m->b[0] >= 0xf8 ) {                       // realtime goes ahead of everything, even inside a SysEx
+        din_rt_send( m->b[0], m->t );
+        return THRU_SENT;
+      }
 
+      if( !din_tx_room() )
+        return THRU_HOLD;
 
+      din_tx_msg( m->b[0], m->b[1], m->b[2] );      // waits for the end of any SysEx going out, see din_tx_flush()
+      return THRU_SENT;
 
+    case THRU_DEST_USB:
+      if( m->src == THRU_SRC_USB )
+        return THRU_SKIP;
 
+      if( sysex_tx_routes() & ROUTE_USB )
+        return THRU_HOLD;
 
-/* ---------------------------------------------------------------------------------------
-     _______     _______ ________   __
-    / ____\ \   / / ____|  ____\ \ / /
-   | (___  \ \_/ / (___ | |__   \ V / 
-    \___ \  \   / \___ \|  __|   > <  
-    ____) |  | |  ____) | |____ / . \ 
-   |_____/   |_| |_____/|______/_/ \_\
-                                                          
-    Sysex for:
-      - Sample Download / Upload
-      - Pattern Data Download / Upload
-      - Utility Commands (setting serial number, bank name, etc.)
+      usb_tx_msg( m->b[0], m->b[1], m->b[2] );      // goes out with the rest of this pass, see usb_tx_flush()
+      return THRU_SENT;
 
-    FORMAT:
-            0xF0 0x69 ...bytes of packed data... 0xF7
-*/
+    case THRU_DEST_HOST:
+      for( int i = 0; i < THRU_HOST_PORTS; i++ ) {
+        if( (m->src != (THRU_SRC_HOST1 + i)) && *thru_host_dev[i] ) {
+          thru_host_dev[i]->send( (m->b[0] < 0xf0) ? (m->b[0] & 0xf0) : m->b[0], m->b[1], m->b[2], (m->b[0] & 0x0f) + 1, 0 );
+          sent = true;
+        }
+      }
+      return sent ? THRU_SENT : THRU_SKIP;
+  }
 
-#define OUR_MIDI_MFR_ID         0x69                                    // 0x60 - 0x7f [Reserved for Other Uses]
+  return THRU_SKIP;
+}
 
-#define SYSEX_HEADER_SIZE       32
 
-// ENCODING
+void thru_service() {
+  uint32_t c;
 
-#define ENCODE_BUF_SIZE         (65536 + SYSEX_HEADER_SIZE)             // large buffers to handle up to 32K samples, room to optimize but we have plenty of RAM
+  if( thru_q_head == thru_q_tail )
+    return;
 
-uint8_t sysex_encode_buf[ENCODE_BUF_SIZE];                              // working buf for sysex out operations
-int sysex_encode_idx = 0;
+  for( int d = 0; d < THRU_DESTS; d++ ) {
+    while( thru_dest_pos[d] != thru_q_head ) {
+      int r = thru_send( d, thru_dest_pos[d] );
 
-int pack_sysex_data( int len, unsigned char *in, unsigned char *out );  // encode input buffer for sysex transmission (no high bits set)
+      if( r == THRU_HOLD )
+        break;
 
+      if( r == THRU_SENT ) {
+        c = ARM_DWT_CYCCNT - thru_q[thru_dest_pos[d] & THRU_Q_MASK].t;
 
-// DECODING
+        thru_dest_msgs[d]++;
+        thru_dest_sum_cycles[d] += c;
+        if( c > thru_dest_max_cycles[d] )
+          thru_dest_max_cycles[d] = c;
+      }
 
-#define DECODE_BUF_SIZE         (65536 + SYSEX_HEADER_SIZE)             // large buffers to handle up to 32K samples, room to optimize but we have plenty of RAM
+      thru_dest_pos[d]++;
+    }
+  }
+
+  thru_q_retire();
+}
+
+
+void print_midi_thru_stats() {
+  Serial.printf("Thru in:  ");
+  for( int s = 0; s < THRU_SRCS; s++ )
+    Serial.printf("%s %d (%d dropped)%s", thru_src_name[s], thru_src_msgs[s], thru_src_drops[s], (s == THRU_SRCS - 1) ? "\n" : ", ");
+
+  for( int d = 0; d < THRU_DESTS; d++ ) {
+    Serial.printf("Thru out: %-6s %d msgs, %d dropped, latency avg %d us, worst %d us\n", thru_dest_name[d],
+                  thru_dest_msgs[d], thru_dest_drops[d],
+                  thru_dest_msgs[d] ? (int)(thru_dest_sum_cycles[d] / thru_dest_msgs[d] * 1000000ULL / F_CPU_ACTUAL) : 0,
+                  (int)((uint64_t)thru_dest_max_cycles[d] * 1000000ULL / F_CPU_ACTUAL));
+  }
+
+  for( int s = 0; s < THRU_SRCS; s++ ) {
+    thru_src_msgs[s] = 0;
+    thru_src_drops[s] = 0;
+  }
+
+  for( int d = 0; d < THRU_DESTS; d++ ) {
+    thru_dest_msgs[d] = 0;
+    thru_dest_drops[d] = 0;
+    thru_dest_max_cycles[d] = 0;
+    thru_dest_sum_cycles[d] = 0;
+  }
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    __  __ _____ _____ _____    ____  _    _ _______ 
+   |  \/  |_   _|  __ \_   _|  / __ \| |  | |__   __|
+   | \  / | | | | |  | || |   | |  | | |  | |  | |   
+   | |\/| | | | | |  | || |   | |  | | |  | |  | |   
+   | |  | |_| |_| |__| || |_  | |__| | |__| |  | |   
+   |_|  |_|_____|_____/_____|  \____/ \____/   |_|
+ 
+    MIDI Out Handling
+*/
+
+elapsedMillis no_tempo_clk_detect = 0;                        // detect "no clk" -- often switch on rear set incorrectly
+
+bool luma_is_playing() {
+  return !( no_tempo_clk_detect > MS_TO_NO_CLK );             // used to display "Awaiting Tempo Clock" and control when fan can run
+}
+
+  
+
+
+// These are used to send Note Off (NOF) messages at some time after a NON. We can't tell when a sample is finished playing, so we use a fixed time.
+
+//  Each drum has a timer that's (re)started when its NON goes out, this is called when it expires.
+
+void send_drum_NOF( int drum_idx ) {
+  byte note = drums[drum_idx].midi_note;                                  // same note we sent the NON for
+  uint8_t route = get_midi_note_out_route();                              // always, both queues hold it back from an upload
+
+  rec_msg( 0x80 | (((midi_chan == 0)?1:midi_chan) - 1), note, MIDI_VEL_LOUD, ARM_DWT_CYCCNT );
+
+  if( route & ROUTE_DIN5 )
+    din_tx_msg( 0x90 | (((midi_chan == 0)?1:midi_chan) - 1), note, 0 );  // Note On vel 0, keeps the running status
+
+  if( route & ROUTE_USB )
+    usb_tx_msg( 0x80 | (((midi_chan == 0)?1:midi_chan) - 1), note, MIDI_VEL_LOUD );
+}
+
+
+char *drum_name( int idx, byte vel ) {
+  switch( idx ) {
+                  case drum_BASS:       if(vel>MIDI_VEL_SOFT) return (char*)"BASS";    else return (char*)"bass";     break;
+                  case drum_SNARE:      if(vel>MIDI_VEL_SOFT) return (char*)"SNARE";   else return (char*)"snare";    break;
+                  case drum_HIHAT:      if(vel>MIDI_VEL_SOFT) return (char*)"HIHAT";   else return (char*)"hihat";    break;
+                  case drum_HIHAT_OPEN: return (char*)"HIHAT OPEN";                                                   break;
+                  case drum_CLAPS:      return (char*)"CLAPS";                                                        break;
+                  case drum_CABASA:     if(vel>MIDI_VEL_SOFT) return (char*)"CABASA";  else return (char*)"cabasa";   break;
+                  case drum_TAMB:       if(vel>MIDI_VEL_SOFT) return (char*)"TAMB";    else return (char*)"tamb";     break;
+                  case drum_TOM_UP:     return (char*)"TOM ^";                                                        break;    
+                  case drum_TOM_DN:     return (char*)"TOM v";                                                        break;
+                  case drum_CONGA_UP:   return (char*)"CONGA ^";                                                      break;
+                  case drum_CONGA_DN:   return (char*)"CONGA v";                                                      break;
+                  case drum_COWBELL:    return (char*)"COWBELL";                                                      break;
+                  case drum_CLAVE:      return (char*)"RIMSHOT";                                                      break;
+  
+                  default:              return (char*)"UNKNOWN";                                                      break;
+  }
+}
+
+
+uint32_t drm_trig_cycles;                                                 // trigger time of the event being sent, for the recorder
+
+void send_midi_drm( int drum_idx, byte vel ) {                            // if we are in OMNI mode, send on channel 1
+  byte note;
+  uint8_t route = get_midi_note_out_route() & ~(sysex_tx_routes() & ROUTE_USB);   // not into a USB upload, DIN-5 queues
+
+  note = note_map_out_note( drum_idx, false );                // note comes from the active note map profile
+
+  drums[drum_idx].drum_soft = (vel < MIDI_VEL_LOUD);          // remember this so we can NOF the right way when midi_send_velocity == false
+
+  if( (midi_send_velocity == false)                           // if FALSE, send soft notes on secondary note mapping. can keep low velocity.
+      && (vel < MIDI_VEL_LOUD)
+      && (note_map_out_note( drum_idx, true ) != NOTE_MAP_NONE) ) {
+    Serial.printf("no vel, mapped MIDI note %d to %d\n", note, note_map_out_note( drum_idx, true ));
+    note = note_map_out_note( drum_idx, true );
+  }
+
+  if( note != NOTE_MAP_NONE ) {                               // profile might not have a note for this drum
+    drums[drum_idx].midi_note = note;
+
+    Serial.printf("%s: %d %d\n", drum_name(drum_idx,vel), note, vel );
+
+    rec_msg( 0x90 | (((midi_chan == 0)?1:midi_chan) - 1), note, vel, drm_trig_cycles );     // when the trigger actually fired
+
+    if( route & ROUTE_DIN5 )
+      din_tx_msg( 0x90 | (((midi_chan == 0)?1:midi_chan) - 1), note, vel );
+
+    if( route & ROUTE_USB )
+      usb_tx_msg( 0x90 | (((midi_chan == 0)?1:midi_chan) - 1), note, vel );
+  
+    timer_start( &drums[drum_idx].nof_timer, NOF_TIME_MS );              // NOF goes out NOF_TIME_MS from now
+  }
+
+  // this is used to target a drum voice when loading a sample via sysex
+  last_drum = drums[drum_idx].strobe;
+  
+  // if any drum keys hit, make sure the bootscreen goes away
+  bootscreen_showing = false;
+}
+
+
+
+/*
+    Drum trigger output timing
+
+    Each trigger event carries the cycle counter value from when the interrupt fired. If we're slow getting to the queue
+    (OLED update, SD card access, etc.) several hits can be waiting, and sending them all at once flattens a flam or a fast
+    hihat into a chord.
+
+    So: the first event of a burst goes out right away, and we remember how late it was. Everything else in that burst
+    goes out at its own timestamp plus that same lateness, so the spacing between hits is what the LM-1 played. Once the
+    queue drains, the next hit starts a new burst.
+*/
+
+#define TRIG_OUT_MAX_LAG_US           50000             // if we're further behind than this, give up on spacing and catch up
+
+uint32_t trig_out_lag_cycles;                           // how late the first event of the current burst went out
+bool     trig_out_in_burst = false;
+
+uint32_t trig_overflows_reported = 0;
+
+
+bool next_trig_event_due( drum_trig_event *dte ) {
+  uint32_t now;
+  uint32_t late;
+
+  if( !peek_trig_event( dte ) ) {
+    trig_out_in_burst = false;                          // drained
+    return false;
+  }
+
+  now  = ARM_DWT_CYCCNT;
+  late = now - dte->cycles;
+
+  if( !trig_out_in_burst || (late > (uint32_t)(TRIG_OUT_MAX_LAG_US * (F_CPU_ACTUAL / 1000000))) ) {
+    trig_out_lag_cycles = late;                         // start of a burst (or hopelessly behind), send it now
+    trig_out_in_burst = true;
+  }
+
+  if( (int32_t)(late - trig_out_lag_cycles) < 0 )
+    return false;                                       // not time for this one yet, next pass
+
+  pop_trig_event( dte );
+  return true;
+}
+
+
+void handle_midi_out() {
+  drum_trig_event dte;
+
+  // ===============================
+  // Cry, the Clock Said
+  //  Clock and Start go out from the FSK edge interrupt, see internal_tempo_clock(). Here we push out anything that
+  //  couldn't go right away, and send Stop when the FSK clock goes quiet.
+
+  midi_rt_drain();
+
+  // ===============================
+  // Keep any SysEx upload moving
+
+  sysex_tx_service();
+
+  // ===============================
+  // Thru outputs that were busy last time
+
+  thru_service();
+
+  if( song_is_started && (sinceLastFSKClk > 100) ) {          // think song is running but 100ms passed with no FSK clock interrupt?
+    song_is_started = false;                                  // edges have stopped, the interrupt won't touch it
+
+    send_midi_stop();
+    Serial.println("sent MIDI Stop");
+  }
+
+  
+  // ===============================
+  // see if any drums were hit, look at trigger bits captured from the i2c port expander
+  
+  if( trig_event_overflows() != trig_overflows_reported ) {
+    trig_overflows_reported = trig_event_overflows();
+    Serial.printf("### drum trigger queue overflowed, %d events dropped so far\n", trig_overflows_reported);
+  }
+
+  while( next_trig_event_due( &dte ) ) {                          // process all that are due, in order
+    drm_trig_cycles = dte.cycles;
+    
+    if( dte.trigs_a ) {
+      if( dte.trigs_a & 0x01 )  send_midi_drm( drum_CABASA,     (dte.trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
+        
+      if( dte.trigs_a & 0x02 )  send_midi_drm( drum_TAMB,       (dte.trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
+
+      if( dte.trigs_a & 0x04 ) {
+        if( dte.trig_mods & 0x04 ) 
+          send_midi_drm( ( dte.trig_mods & 0x02 ) ? drum_CONGA_UP : drum_CONGA_DN,           MIDI_VEL_LOUD );
+        else
+          send_midi_drm( ( dte.trig_mods & 0x02 ) ? drum_TOM_UP : drum_TOM_DN,               MIDI_VEL_LOUD );
+        }
+      
+      if( dte.trigs_a & 0x10 )  send_midi_drm( drum_COWBELL,                                 MIDI_VEL_LOUD );
+      
+      if( dte.trigs_a & 0x20 )  send_midi_drm( drum_CLAVE,                                   MIDI_VEL_LOUD );
+    }
+  
+    
+    if( dte.trigs_b ) {
+      if( dte.trigs_b & 0x80 )     send_midi_drm( drum_CLAPS,                                MIDI_VEL_LOUD );
+
+      // HIHAT / hihat / HIHAT SPLASH (OPEN)
+      if( dte.trigs_b & 0x10 ) {      
+        if( dte.trig_mods & 0x04 ) send_midi_drm( drum_HIHAT_OPEN,                           MIDI_VEL_LOUD );
+        else                        send_midi_drm( drum_HIHAT,      (dte.trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
+      }
+        
+      if( dte.trigs_b & 0x40 )     send_midi_drm( drum_BASS,       (dte.trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
+        
+      if( dte.trigs_b & 0x20 )     send_midi_drm( drum_SNARE,      (dte.trig_mods & 0x02) ? MIDI_VEL_LOUD : MIDI_VEL_SOFT );
+    }  
+  }  
+
+  // ===============================
+  // Note Offs that came due (handle_timers()), thru, and the hits above go out to DIN-5 as one write, and to USB as
+  //  one packet
+
+  din_tx_flush();
+  usb_tx_flush();
+}
+
+
+void didProgramChange( byte pgm ) {
+  Serial.printf("Sending MIDI Program Change: %02d\n", pgm);
+
+  din_tx_msg( 0xc0 | (((midi_chan == 0)?1:midi_chan) - 1), pgm, 0 );
+  din_tx_flush();
+
+  if( !(sysex_tx_routes() & ROUTE_USB) ) {
+    usb_tx_msg( 0xc0 | (((midi_chan == 0)?1:midi_chan) - 1), pgm, 0 );
+    usb_tx_flush();
+  }
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    __  __ _____ _____ _____    _____ _      ____   _____ _  __
+   |  \/  |_   _|  __ \_   _|  / ____| |    / __ \ / ____| |/ /
+   | \  / | | | | |  | || |   | |    | |   | |  | | |    | ' / 
+   | |\/| | | | | |  | || |   | |    | |   | |  | | |    |  <  
+   | |  | |_| |_| |__| || |_  | |____| |___| |__| | |____| . \ 
+   |_|  |_|_____|_____/_____|  \_____|______\____/ \_____|_|\_\
+     
+    MIDI CLOCK IN & OUT
+
+    MIDI Clock In drives the DECODED_TAPE_SYNC_CLK at the correct frequency to make the LM-1 firmware think
+     that it is receiving a Tape Sync signal (like from an FSK Tape Sync stripe laid down on tape from an original LM-1).
+
+    MIDI Clock out is generated when the LM-1 firmware sequencer is running. This is detected by the presence of a clock
+     on the TAPE_FSK_TTL signal (which was originally the FSK Tape Sync output).
+
+    The LM-1 internal clock runs at 48 PPQN.
+    MIDI clock runs at 24 PPQN.
+    Teensy software adjusts both as needed.
+     
+*/
+
+/* ---------------------------------------------------------------------------------------
+    Manage the TAPE_SYNC_MODE_CLK signal
+
+    This gets used by the MIDI clock code AND the EPROM dumping code.
+    
+    These routines manage the mode of the TAPE_SYNC_MODE_CLK pin.
+
+    We do this becuase the DECODED_TAPE_SYNC_CLK signal is used for 2 things:
+
+      - General Purpose Output to drive /CE on EPROM socket for EPROM dumping
+      - Clock to LM-1 firmware to simulate Tape Sync Clock
+*/
+
+void set_tape_sync_clk_gpo( bool state ) {
+  digitalWriteFast( DECODED_TAPE_SYNC_CLK, state );
+}
+
+bool get_tape_sync_clk_gpo() {
+  return digitalReadFast( DECODED_TAPE_SYNC_CLK );
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    MIDI Clock -> LM-1 tempo clock
+
+    Each MIDI Clock (24 ppqn) becomes 2 tempo clock pulses (48 ppqn) = 4 edges. Edge 4k is on MIDI clock k, then
+    one every 1/4 of a MIDI clock period.
+
+    MIDI clock timestamps are noisy (DAW jitter, plus however long it took us to get to the byte), so the edges are
+    not timed off the raw clocks. A small tracking loop keeps a filtered estimate of when clock k "really" happened
+    (ref) and of the period:
+
+      predicted = last ref + period
+      r         = timestamp - predicted           (residual)
+      ref       = predicted + r/16
+      period    = period + r/256
+
+    A clock that's way off (< 1/2 or > 3/2 of the period) doesn't move the period. A few in a row means the tempo
+    really changed, so we start over from the new interval.
+
+    The pll_tick() interrupt runs at a fixed rate while we're started and emits whatever edges are due, so each edge
+    goes out within one tick of when the loop says it's due. Rules:
+
+      - never run ahead into the next MIDI clock's edges before that clock arrives (4k+3 is the last edge for clock k)
+      - never skip an edge, if we're behind catch up one edge at a time, at least PLL_MIN_EDGE_US apart
+
+    The loop math works on a pll_state_t and timestamps passed in, so the debug command 'j' can run it against a
+    fake jittery clock and report what comes out.
+*/
+
+#define PLL_TICK_US               25            // edge timing resolution
+#define PLL_MIN_EDGE_US           1000          // closest two edges can be when catching up
+#define PLL_DEFAULT_PERIOD_US     20833         // 120 bpm, used until we've seen two clocks
+#define PLL_LOST_US               100000        // no MIDI clock for this long -> start over on the next one
+#define PLL_RELOCK_OUTLIERS       3             // this many outliers in a row means the tempo changed
+
+pll_state_t pll;                                // the real one, shared with pll_tick()
+
+IntervalTimer tempoTimer;                       // interrupt-driven timer to generate tempo clock pulses
+
+bool started = false;
+
+bool first_tempo_clock = false;
+
+elapsedMicros sinceMIDIStart;                   // used to detect if quick or slower MIDI Clock after MIDI Start
+
+volatile int tempo_burst_edges = 0;             // used at Stop, see myStop()
+uint32_t tempo_burst_gap;
+
+#define US_TO_CYCLES(u)           ((uint32_t)(u) * (F_CPU_ACTUAL / 1000000))
+
+
+// Feed one MIDI clock timestamp into the loop. Returns true if it was taken as an outlier.
+
+bool pll_clock( pll_state_t *p, uint32_t ts ) {
+  uint32_t dt = ts - p->last_ts;
+  uint32_t predicted;
+  int32_t  r;
+  bool     outlier = false;
+
+  if( !p->have_ref || (dt > US_TO_CYCLES( PLL_LOST_US )) ) {
+    if( p->period == 0 )
+      p->period = US_TO_CYCLES( PLL_DEFAULT_PERIOD_US );
+
+    p->ref = ts;                                // nothing to track yet, take it as is
+    p->have_ref = true;
+    p->have_period = false;
+    p->outliers = 0;
+  }
+  else if( !p->have_period ) {
+    p->period = dt;                             // second clock, first real period measurement
+    p->ref = ts;
+    p->have_period = true;
+  }
+  else {
+    if( (dt < p->period / 2) || (dt > p->period * 3 / 2) ) {
+      outlier = true;
+
+      if( ++p->outliers >= PLL_RELOCK_OUTLIERS ) {
+        p->period = dt;                         // tempo change, not noise
+        p->ref = ts;
+        p->outliers = 0;
+      }
+      else
+        p->ref += (uint32_t)p->period;          // assume it's noise, free-run through it
+    }
+    else {
+      p->outliers = 0;
+
+      predicted = p->ref + (uint32_t)p->period;
+      r = (int32_t)(ts - predicted);
+
+      p->ref = predicted + r / 16;
+      p->period += (float)r / 256;
+    }
+  }
+
+  p->last_ts = ts;
+
+  return outlier;
+}
+
+
+// Highest edge # that should have happened by now
+
+uint32_t pll_target_edge( pll_state_t *p, uint32_t now ) {
+  int32_t since = (int32_t)(now - p->ref);
+  uint32_t q;
+
+  if( since < 0 )                               // filtered time of this clock hasn't come yet, finish the last one
+    return p->clock_edge - 1;
+
+  q = (uint32_t)( (float)since * 4 / p->period ) + p->first_shift;
+
+  if( q > 3 )
+    q = 3;                                      // don't run into the next clock's edges
+
+  return p->clock_edge + q;
+}
+
+
+// If an edge is due, account for it and return true. Level for edge n is (n & 1) == 0 -> drive tempo clock LOW.
+
+bool pll_edge_due( pll_state_t *p, uint32_t now ) {
+  if( (int32_t)(pll_target_edge( p, now ) - p->edges_out) < 0 )
+    return false;
+
+  if( (p->edges_out != 0) && ((now - p->last_edge) < US_TO_CYCLES( PLL_MIN_EDGE_US )) )
+    return false;
+
+  p->last_edge = now;
+  p->edges_out++;
+
+  return true;
+}
+
+
+void pll_tick() {                                         // INTERRUPT CONTEXT, be careful, don't do too much
+  uint32_t now = ARM_DWT_CYCCNT;
+
+  if( tempo_burst_edges ) {                               // fixed rate burst, ignores MIDI clock
+    if( (now - pll.last_edge) >= tempo_burst_gap ) {
+      set_tape_sync_clk_gpo( !get_tape_sync_clk_gpo() );
+      pll.last_edge = now;
+      tempo_burst_edges--;
+    }
+    return;
+  }
+
+  if( started && pll.have_ref && pll_edge_due( &pll, now ) )
+    set_tape_sync_clk_gpo( ((pll.edges_out - 1) & 1) == 0 );    // inverted, true drives tempo clock LOW
+}
+
+
+void pll_timer_start() {
+  tempoTimer.begin( pll_tick, PLL_TICK_US );
+  tempoTimer.priority( 0 );                               // highest priority
+}
+
+
+// -- Called when we get a MIDI Clock
+
+/*
+  NOTE! MIDI Start means start the sequencer at the NEXT MIDI CLOCK.
+        Since we double the MIDI Clock to 48ppqn, we need to make sure we only start it (push the footpedal)
+         on a MIDI Clock boundary (not an interpolated 48ppqn clock pulse).
+
+
+  Hold tempo clock HIGH
+  Get MIDI Start
+    Drop tempo clock
+  Get MIDI Clock
+    Raise tempo clock
+    Drive tempo clock with interpolated MIDI clock timing
+*/
+
+void midi_clock_in( uint32_t ts ) {
+  noInterrupts();                                         // pll_tick() reads this
+
+  pll_clock( &pll, ts );
+
+  rec_clock( REC_CLK_MIDI, ts );
+
+  play_clock();                                           // SMF player, if it's following us
+
+  if( first_tempo_clock ) {
+    pll.clock_edge = 0;                                   // edge 0 was Start dropping the tempo clock
+
+    if( sinceMIDIStart > (pll.period / US_TO_CYCLES( 1 ) / 4 + 1000) )    // more than 1/4 period (+1ms fudge) since Start?
+      pll.first_shift = 1;                                // then raise it right away, on this clock
+    else
+      pll.first_shift = 0;
+
+    first_tempo_clock = false;                            // first one is special
+  }
+  else {
+    pll.clock_edge += 4;
+    pll.first_shift = 0;
+  }
+
+  interrupts();
+}
+
+
+void myClock() {  
+  midi_clock_in( ARM_DWT_CYCCNT );                        // earliest we see it, loop below smooths out how late that was
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    PLL simulation, for checking the tracking loop without a DAW
+
+    Runs the same pll_state_t code against a made-up clock: steady tempo, plus random jitter on every clock, plus
+    every so often a late one (like our loop being busy). Reports how far the output edges land from where
+    a perfect 48 ppqn clock would put them.
+*/
+
+void run_pll_sim( int bpm, int jitter_us, int late_us ) {
+  pll_state_t sim;
+  uint32_t ideal_period = US_TO_CYCLES( 60000000 / bpm / 24 );
+  uint32_t t0 = 100000;
+  uint32_t next_clock = 0;
+  uint32_t clk_ts;
+  uint32_t now;
+  int clocks = 0;
+  int outliers = 0;
+  int edges = 0;
+  int32_t err_us;
+  int32_t min_err = INT32_MAX;
+  int32_t max_err = INT32_MIN;
+  int64_t sum_err = 0;
+
+  #define PLL_SIM_CLOCKS          480           // 20 beats
+  #define PLL_SIM_SETTLE          48            // don't count the first 2 beats
+
+  memset( &sim, 0, sizeof(sim) );
+  sim.edges_out = 1;                            // like Start: edge 0 already happened
+
+  for( now = 0; clocks < PLL_SIM_CLOCKS; now += US_TO_CYCLES( PLL_TICK_US ) ) {
+
+    if( (int32_t)(now - next_clock) >= 0 ) {    // time for a MIDI clock
+      clk_ts = now + US_TO_CYCLES( random( jitter_us + 1 ) );
+
+      if( (clocks % 37) == 36 )
+        clk_ts += US_TO_CYCLES( late_us );      // the occasional really late one
+
+      if( pll_clock( &sim, clk_ts ) )
+        outliers++;
+
+      if( clocks == 0 ) {
+        sim.clock_edge = 0;
+        t0 = next_clock;
+      }
+      else
+        sim.clock_edge += 4;
+
+      clocks++;
+      next_clock += ideal_period;
+    }
+
+    if( sim.have_ref && pll_edge_due( &sim, now ) ) {
+      if( clocks > PLL_SIM_SETTLE ) {
+        err_us = (int32_t)(now - (t0 + (uint64_t)(sim.edges_out - 1) * ideal_period / 4)) / (int32_t)US_TO_CYCLES( 1 );
+
+        sum_err += err_us;
+        min_err = min( min_err, err_us );
+        max_err = max( max_err, err_us );
+
+        edges++;
+      }
+    }
+  }
+
+  if( !edges )
+    return;
+
+  Serial.printf("PLL sim: %d bpm, input clock jitter %d us p-p, every 37th clock +%d us late\n", bpm, jitter_us, late_us);
+  Serial.printf("   %d clocks, %d outliers, %d edges\n", clocks, outliers, edges);
+  Serial.printf("   output edges: %d us late on average, jitter %d us p-p (%d to %d)\n",
+                (int)(sum_err / edges), max_err - min_err, min_err, max_err);
+  Serial.printf("   period locked at %d us (ideal %d)\n", (int)(sim.period / US_TO_CYCLES( 1 )), ideal_period / US_TO_CYCLES( 1 ));
+}
+
+
+
+bool honorMIDIStartStopState() {
+  return honor_start_stop;
+}
+
+bool honorMIDIStartStop( bool honor ) {
+  bool prev = honor_start_stop;
+
+  honor_start_stop = honor;
+
+  Serial.printf("%s honor MIDI Start/Stop messages\n", honor?"Will":"Will NOT");
+
+  return prev;
+}
+
+
+
+// -- Called when we get a MIDI Start
+
+/*
+    When we get a MIDI Start, the NEXT MIDI CLOCK marks the initial downbeat.
+
+    BUT! We are generating 2 LM-1 clocks for each MIDI Clock.
+
+    We need to wait for the next MIDI Clock to actually start the LM-1 sequencer.
+
+    MIDI Clock  1000 1000 1000
+    LM-1 Clock  1010 1010 1010
+*/
+
+void myStart() {
+  Serial.println("received MIDI Start");
+
+  play_midi_start();                                        // SMF player, if it's following MIDI clock
+
+  if( !started ) {                                          // if we hadn't started yet
+    if( honorMIDIStartStopState() ) {
+      Serial.printf("Honoring MIDI Start, pressing foot pedal\n");
+      z80_seq_ctl( Z80_SEQ_START );                           // simulate foot pedal press
+    }
+
+    noInterrupts();
+
+    tempo_burst_edges = 0;
+    set_tape_sync_clk_gpo( true );                          // inverted, drive tempo clock LOW when we get MIDI Start
+
+    pll.edges_out = 1;                                      // that was edge 0
+    pll.last_edge = ARM_DWT_CYCCNT;
+    pll.clock_edge = 0;
+    pll.first_shift = 0;
+
+    started = true;                                         // now we've started
+    sinceMIDIStart = 0;                                     // used to figure out how much time has passed by first MIDI Clock
+
+    first_tempo_clock = true;                               // first tempo clock is funny, just 3 edges
+
+    interrupts();
+
+    pll_timer_start();
+  }
+  else {
+    Serial.println("DUPLICATE MIDI Start, ignoring");
+  }
+}
+
+
+// -- Called when we get a MIDI Continue
+
+void myContinue() {
+  play_midi_continue();                                 // SMF player, if it's following MIDI clock
+
+/*
+  Serial.println("received MIDI Continue");
+
+  if( honor_start_stop ) {
+
+    got_midi_start = true;                              // we don't really honor Continue, we treat it like Start
+
+    z80_seq_ctl( Z80_SEQ_START );                       // simulate foot pedal press
+  }
+  else {
+    Serial.printf("MIDI Start (Continue) honor disabled\n");
+  }
+*/
+}
+
+
+// -- Called when we get a MIDI Stop
+
+void myStop() {
+  Serial.println("received MIDI Stop");
+
+  play_midi_stop();                                     // SMF player, if it's following MIDI clock
+
+  if( started ) {
+    first_tempo_clock = false;                          // shouldn't need to do this, but it doesn't hurt (in case we got no MIDI clocks)
+
+    if( honorMIDIStartStopState() ) {
+      Serial.printf("Honoring MIDI Stop, pressing foot pedal\n");
+      z80_seq_ctl( Z80_SEQ_STOP );                      // simulate foot pedal press
+
+      noInterrupts();                                   // a couple of fixed pulses so the Z-80 sees the Stop
+      set_tape_sync_clk_gpo( true );                    // inverted, LOW, then 3 more edges 4.5ms apart
+      tempo_burst_gap = US_TO_CYCLES( 18000/4 );
+      pll.last_edge = ARM_DWT_CYCCNT;
+      tempo_burst_edges = 3;
+      interrupts();
+
+      delay( 100 );
+    }
+    
+    started = false;                                    // now we've stopped
+
+    tempoTimer.end();                                   // make sure this isn't running
+    tempo_burst_edges = 0;
+    set_tape_sync_clk_gpo( false );                     // inverted, hold tempo clock HIGH until the next Start
+  }
+  else {
+    Serial.println("DUPLICATE MIDI Stop, ignoring");
+  }
+}
+
+
+
+
+
+/* ---------------------------------------------------------------------------------------
+    Realtime output (Clock / Start / Stop)
+
+    MIDI Clock out has to follow the LM-1's FSK clock closely, so it's sent right from the FSK edge interrupt instead of
+    waiting for loop() to get around to it (OLED blit, SD card, local UI...).
+
+    DIN-5:  Bytes queued in the Serial1 library buffer go out in order, so a clock behind a SysEx dump could wait a long
+            time. Instead we write the byte straight into the LPUART's hardware TX FIFO, ahead of whatever is still in
+            the library buffer. Realtime bytes are allowed anywhere in the stream, even in the middle of another message.
+            If the FIFO is full, the byte waits in a small slot and goes out as soon as there's room.
+
+    USB:    usbMIDI isn't reentrant, so loop code brackets its usbMIDI sends with usb_tx_begin() / usb_tx_end(). If the
+            edge lands inside one of those, the byte waits in a slot and usb_tx_end() sends it before returning.
+            usbMIDI can block if the host stops reading, so if a send from the interrupt ever takes longer than
+            USB_RT_SLOW_US, USB realtime goes back to being sent from loop() until the next Stop.
+
+    Latency is measured from the FSK edge to the byte being handed to the hardware. For DIN-5 we add the time to shift
+    out whatever was already in the FIFO ahead of it. "t" debug command prints it.
+*/
+
+#define DIN_BYTE_CYCLES           (320 * (F_CPU_ACTUAL / 1000000))      // 10 bits at 31250 baud
+#define USB_RT_SLOW_US            100
+
+rt_slot_t din_rt_slot;
+rt_slot_t usb_rt_slot;
+
+rt_stats_t din_rt_stats;
+rt_stats_t usb_rt_stats;
+
+volatile bool usb_tx_busy = false;                  // loop code is inside usbMIDI
+volatile bool usb_rt_slow = false;                  // send USB realtime from loop() instead of the interrupt
+
+volatile bool midi_start_sent = false;              // so loop() can log it, can't print from the interrupt
+
+
+// rt_slot_xxx and rt_stats_xxx must be called with interrupts off
+
+bool rt_slot_push( rt_slot_t *s, uint8_t b, uint32_t edge ) {
+  if( s->n == RT_SLOT_SIZE )
+    return false;
+
+  s->b[s->n] = b;
+  s->edge[s->n] = edge;
+  s->n++;
+  return true;
+}
+
+bool rt_slot_pop( rt_slot_t *s, uint8_t *b, uint32_t *edge ) {
+  if( s->n == 0 )
+    return false;
+
+  *b = s->b[0];
+  *edge = s->edge[0];
+
+  s->n--;
+  for( int xxx = 0; xxx != s->n; xxx++ ) {
+    s->b[xxx] = s->b[xxx+1];
+    s->edge[xxx] = s->edge[xxx+1];
+  }
+  return true;
+}
+
+void rt_stats_add( rt_stats_t *st, uint8_t b, uint32_t cycles ) {
+  if( b != MIDI_RT_CLOCK )                          // Start goes out right in front of a Clock, just look at Clocks
+    return;
+
+  if( (st->clocks == 0) || (cycles < st->min_cycles) )
+    st->min_cycles = cycles;
+
+  if( cycles > st->max_cycles )
+    st->max_cycles = cycles;
+
+  st->sum_cycles += cycles;
+  st->clocks++;
+}
+
+
+// --- DIN-5
+
+bool din_rt_write( uint8_t b, uint32_t edge ) {
+  uint32_t queued = LPUART_WATER_TXCOUNT( *(volatile uint32_t *)(IMXRT_LPUART6_ADDRESS + IMXRT_LPUART_WATER) );
+
+  if( queued >= LPUART_TX_FIFO_DEPTH )
+    return false;
+
+  *(volatile uint32_t *)(IMXRT_LPUART6_ADDRESS + IMXRT_LPUART_DATA) = b;
+
+  rt_stats_add( &din_rt_stats, b, (ARM_DWT_CYCCNT - edge) + (queued * DIN_BYTE_CYCLES) );
+  return true;
+}
+
+void din_rt_drain() {                               // interrupts off
+  uint8_t b;
+  uint32_t edge;
+
+  while( din_rt_slot.n && din_rt_write( din_rt_slot.b[0], din_rt_slot.edge[0] ) )
+    rt_slot_pop( &din_rt_slot, &b, &edge );
+}
+
+
+// --- USB
+
+bool usb_tx_begin() {
+  bool got = false;
+
+  noInterrupts();
+  if( !usb_tx_busy ) {
+    usb_tx_busy = true;
+    got = true;
+  }
+  interrupts();
+
+  return got;
+}
+
+void usb_tx_end() {
+  uint8_t b;
+  uint32_t edge;
+  bool sent = false;
+
+  while( true ) {
+    noInterrupts();
+    if( !rt_slot_pop( &usb_rt_slot, &b, &edge ) ) {
+      usb_tx_busy = false;                          // nothing waiting, let go while interrupts are still off
+      interrupts();
+      break;
+    }
+    interrupts();
+
+    usbMIDI.sendRealTime( b );                      // realtime bytes that showed up while we were busy go right after
+    sent = true;
+
+    noInterrupts();
+    rt_stats_add( &usb_rt_stats, b, ARM_DWT_CYCCNT - edge );
+    interrupts();
+  }
+
+  if( sent )
+    usbMIDI.send_now();
+}
+
+
+// --- Called from the FSK edge interrupt, or from loop()
+
+// Straight into the FIFO, or the slot if it's full. Also used for realtime thru.
+
+void din_rt_send( uint8_t b, uint32_t edge ) {
+  noInterrupts();
+  din_rt_drain();                                   // anything already waiting goes first
+
+  if( din_rt_slot.n || !din_rt_write( b, edge ) ) {
+    din_rt_stats.deferred++;
+    if( !rt_slot_push( &din_rt_slot, b, edge ) )
+      din_rt_stats.dropped++;
+  }
+  interrupts();
+
+  midi_din_out_event();
+}
+
+
+void send_midi_rt( uint8_t b, uint32_t edge ) {
+  uint8_t route = get_midi_clock_out_route();
+  uint32_t start;
+
+  if( route & ROUTE_DIN5 )
+    din_rt_send( b, edge );
+
+  if( route & ROUTE_USB ) {
+    if( !usb_rt_slow && usb_tx_begin() ) {
+      start = ARM_DWT_CYCCNT;
+
+      usbMIDI.sendRealTime( b );
+      usbMIDI.send_now();
+
+      noInterrupts();
+      rt_stats_add( &usb_rt_stats, b, ARM_DWT_CYCCNT - edge );
+      interrupts();
+
+      if( (ARM_DWT_CYCCNT - start) > (USB_RT_SLOW_US * (F_CPU_ACTUAL / 1000000)) )
+        usb_rt_slow = true;                         // host isn't keeping up, don't risk blocking in the interrupt again
+
+      usb_tx_end();
+    }
+    else {
+      noInterrupts();
+      usb_rt_stats.deferred++;
+      if( !rt_slot_push( &usb_rt_slot, b, edge ) )
+        usb_rt_stats.dropped++;
+      interrupts();
+    }
+
+    midi_usb_out_event();
+  }
+}
+
+
+// --- loop() side: anything that couldn't go out from the interrupt
+
+void midi_rt_drain() {
+  noInterrupts();
+  din_rt_drain();
+  interrupts();
+
+  if( usb_rt_slot.n && usb_tx_begin() )
+    usb_tx_end();                                   // sends whatever is waiting
+
+  if( midi_start_sent ) {
+    midi_start_sent = false;
+    Serial.println("sent MIDI Start");
+  }
+}
+
+
+void send_midi_stop() {
+  send_midi_rt( MIDI_RT_STOP, ARM_DWT_CYCCNT );
+  midi_rt_drain();
+
+  usb_rt_slow = false;                              // give USB another chance from the interrupt next time
+}
+
+
+void print_rt_stats( const char *port, rt_stats_t *st ) {
+  rt_stats_t s;
+
+  noInterrupts();
+  s = *st;
+  memset( st, 0, sizeof(rt_stats_t) );
+  interrupts();
+
+  if( s.clocks == 0 ) {
+    Serial.printf("Clock out %s: none sent\n", port);
+    return;
+  }
+
+  Serial.printf("Clock out %s: %d clocks, edge to byte min %d us, avg %d us, max %d us, jitter %d us p-p, %d deferred, %d dropped\n",
+                port, s.clocks,
+                (int)(s.min_cycles / (F_CPU_ACTUAL / 1000000)),
+                (int)((s.sum_cycles / s.clocks) / (F_CPU_ACTUAL / 1000000)),
+                (int)(s.max_cycles / (F_CPU_ACTUAL / 1000000)),
+                (int)((s.max_cycles - s.min_cycles) / (F_CPU_ACTUAL / 1000000)),
+                s.deferred, s.dropped);
+}
+
+void print_midi_clock_out_timing() {
+  print_rt_stats( "DIN-5", &din_rt_stats );
+  print_rt_stats( "USB  ", &usb_rt_stats );
+
+  if( usb_rt_slow )
+    Serial.printf("Clock out USB: host was slow, sending from loop until next Stop\n");
+}
+
+
+
+/* ---------------------------------------------------------------------------------------
+    MIDI Clock Interrupt Handling
+*/
+
+bool midi_start_stop_clk_enable = false;
+
+bool enable_midi_start_stop_clock( bool en ) {        // enable/disable interrupt used to detect FSK TTL clock
+  bool prev_en = midi_start_stop_clk_enable;          // remember what it was
+
+  midi_start_stop_clk_enable = en;
+  
+  if( en ) {
+    Serial.println("enable clk detect");
+    attachInterrupt( digitalPinToInterrupt(TAPE_FSK_TTL),  internal_tempo_clock, FALLING );
+  }
+  else {
+    Serial.println("DISABLE clk detect");
+    detachInterrupt( digitalPinToInterrupt(TAPE_FSK_TTL) );
+  }
+
+  return prev_en;                                     // so we can put it back like it was
+}
+
+
+int int_tempo_clk_counts = 0;
+
+void internal_tempo_clock( void ) {
+  uint32_t edge = ARM_DWT_CYCCNT;                     // everything is measured from here
+
+  if( !digitalRead( LM1_LED_A ) ) {
+    int_tempo_clk_counts++;
+    if( int_tempo_clk_counts >= 2 ) {                 // MIDI clock is 24 PPQN, FSK clock is 48 PPQN, so send a MIDI clock every other FSK clock
+      int_tempo_clk_counts = 0;
+
+      if( !song_is_started ) {                        // first clock, Start goes out right in front of it
+        song_is_started = true;
+        send_midi_rt( MIDI_RT_START, edge );
+        midi_start_sent = true;
+      }
+
+      send_midi_rt( MIDI_RT_CLOCK, edge );
+      rec_clock( REC_CLK_FSK, edge );
+
+      no_tempo_clk_detect = 0;                        // reset "no clk" detector
+    }
+  
+    sinceLastFSKClk = 0;                              // keep pulling this back to 0, it's how we detect that the FSK clock has stopped
+  }
+}
+
+
+// This gets used for cases where we have not been able to keep an eye on the FSK clock
+
+void reset_FSK_clock_check() {
+  sinceLastFSKClk = 0;
+  int_tempo_clk_counts = 0;
+}
+
+
+
+
+
+/* ---------------------------------------------------------------------------------------
+     _______     _______ ________   __
+    / ____\ \   / / ____|  ____\ \ / /
+   | (___  \ \_/ / (___ | |__   \ V / 
+    \___ \  \   / \___ \|  __|   > <  
+    ____) |  | |  ____) | |____ / . \ 
+   |_____/   |_| |_____/|______/_/ \_\
+                                                          
+    Sysex for:
+      - Sample Download / Upload
+      - Pattern Data Download / Upload
+      - Utility Commands (setting serial number, bank name, etc.)
+
+    FORMAT:
+            0xF0 0x69 ...bytes of packed data... 0xF7
+*/
+
+#define OUR_MIDI_MFR_ID         0x69                                    // 0x60 - 0x7f [Reserved for Other Uses]
+
+// ENCODING
+
+// messages are packed into the shared buffer (LM_Buffers) and held there until the upload is out, see send_packed_sysex()
+
+int pack_sysex_data( int len, unsigned char *in, unsigned char *out );  // encode input buffer for sysex transmission (no high bits set)
+
+
+// DECODING
+
+/*
+    Received messages are not collected whole. The 32 byte header is decoded into sx_rx_buf, and that picks a sink:
+
+      SX_SINK_BUF         small messages (param, name, note map, requests) stay in sx_rx_buf, handled at F7
+      SX_SINK_STAGE       sample for a voice board, or RAM image for the active bank -- collected in the stage slot of the
+                          shared buffer (LM_Buffers), loaded at the F7
+      SX_SINK_SD_FILE     sample or RAM image for an SD card bank, written to a temp file as it arrives, renamed at the F7
+
+    Payload bytes are decoded into sx_rx_block and handed to the sink a block at a time, so we never hold the packed
+    message.
+
+    Nothing in use is touched until the whole message is in and checks out: the length is what the header said (8KB
+    for a RAM image), and a compressed payload ended on a token boundary. Only then is the bus taken, for as long as
+    the load takes. A message that fails, or is cut off, leaves the voice boards, Z-80 RAM, STAGING and the SD banks
+    the way they were. If the sender goes quiet for SX_RX_TIMEOUT_MS mid-message, the message is dropped as if it had
+    been cut off. Program Changes that come in while a big message is on its way are held until it's done.
+*/
+
+#define SX_RX_TIMEOUT_MS        2000                                    // DIN-5 chunks come every ~40 ms, USB faster
+
+uint8_t sx_rx_buf[SX_RX_BUF_SIZE];                                      // header, or all of a small message
+uint8_t sx_rx_block[SX_RX_BLOCK_SIZE];                                  // payload on its way to the sink
+int sysex_decode_idx = 0;                                               // # of bytes decoded so far, header included
+int sx_rx_block_len = 0;                                                // # of bytes waiting in sx_rx_block
+int sx_sink_done = 0;                                                   // # of payload bytes handed to the sink
+
+#define SX_SINK_NONE            0                                       // haven't seen the whole header yet
+#define SX_SINK_BUF             1
+#define SX_SINK_STAGE           2
+#define SX_SINK_SD_FILE         3
+
+uint8_t sx_sink = SX_SINK_NONE;
+int sx_sink_max;                                                        // most payload bytes the sink will take
+
+uint8_t *sx_rx_stage = NULL;                                            // SX_SINK_STAGE, the shared buffer's stage slot
+
+elapsedMillis sx_rx_since;                                              // since the last chunk of the message came in
+int sx_rx_deferred_pgm = -1;                                            // Program Change that came in during the message
+
+char sx_rx_name[24];                                                    // sample or RAM bank name from the header, cleaned up
+uint16_t sx_rx_cs;                                                      // running checksum of a RAM image, for its default name
+FsFile sx_rx_file;                                                      // SX_SINK_SD_FILE
+char sx_rx_path[MAX_LEN_PATH_NAME];
+
+bool sx_rx_z;                                                           // version 1, payload is compressed
+sxz_decoder_t sx_rx_zdec;
 
-uint8_t sysex_decode_buf[DECODE_BUF_SIZE];                              // working buf for sysex in operations, scratchpad for encode operations
-int sysex_decode_idx = 0;
 
 void init_sysex_decoder();
 bool process_sysex_byte( uint8_t b );                                   // returns true when end of stream (0xf7) found
@@ -1422,7 +2756,9 @@ void sysex_store_epilogue();
 
 // utilities
 
-void send_sysex( int len, uint8_t *b );
+void send_sysex( int len, uint8_t *b );                                 // starts it, sysex_tx_service() sends it
+void send_packed_sysex( int len, uint8_t *raw );                        // pack and send, using the shared buffer
+bool send_packed_sysex_parts( uint8_t *hdr, int hdr_len, uint8_t *data, int data_len );     // same, header and data don't have to be together. false if busy or no buffer
 
 
 // sysex data structures
@@ -1434,6 +2770,7 @@ void send_sysex( int len, uint8_t *b );
     \__/ |\_/_____ 3-bit command
       |  +-------- 1-bit "Request" flag (1 -> Luma-1 should send some data back)
       +----------- 4-bit version, 0000 for v1.0 
+                                    0001 for compressed payload, BANK SAMPLE and BANK RAM only (0x11 / 0x19, 0x12 / 0x1a)
 
 
     8 possible commands
@@ -1441,7 +2778,7 @@ void send_sysex( int len, uint8_t *b );
     0     sample data receive / send (LEGACY)
     1     bank sample data receive / send
     2     bank ram data receive / send
-    3     - unused -
+    3     note map profile receive / send
     4     parameter set / get
     5     utility
     6     - unused -
@@ -1464,12 +2801,16 @@ void send_sysex( int len, uint8_t *b );
     00 / 08   *** LEGACY, DEPRECATED *** SAMPLE Down / Upload (to/from active bank), 24-char sample name, 7-byte pad (to 32 bytes), followed by uLaw sample data
     01 / 09   BANK SAMPLE Down / Upload (to/from SD bank/drum), 1 byte bank#, 1 byte drum sel, 24 byte name, pad 5, uLaw sample data
     02 / 0a   BANK RAM Down / Upload (to/from SD bank), 1 byte bank#, 24 byte name, 6 byte pad, followed by 8KB RAM data
-    03 / 0b   
+    03 / 0b   NOTE MAP Down / Upload (to/from note map profile), 1 byte profile #, 30 byte pad, followed by 256 byte note map table
     04 / 0c   8-bit PARAMETER (see param table below), 8-bit param, 8-bit val
     05 / 0d   NAME UTILITY, used to set/get Voice and RAM bank names, see description below
     06        ERROR REPLY
-    07 / 0f   ESCAPE, next byte is an extended cmd, currently unused
+    07 / 0f   ESCAPE, next byte is an extended cmd: 01 BULK backup request, 02 BULK ITEM, 03 BULK END (see below)
  
+    Version 1 (compressed) messages have the same header, and the payload after it is compressed with LM_SysExZ (delta
+    + run length, see LM_SysExZ.h). sample_len is still the uncompressed length. A version 1 request gets a version 1
+    reply. Version 0 messages work exactly as before.
+
     In an error situation, Luma-1 will reply with a cmd = 06 message with one of the following strings in the name field:
 
     SD ERROR        SD Card error
@@ -1479,12 +2820,18 @@ void send_sysex( int len, uint8_t *b );
 #define CMD_SAMPLE          0x00        // LEGACY, avoid using, doesn't allow specifying specific drum
 #define CMD_SAMPLE_BANK     0x01
 #define CMD_RAM_BANK        0x02
+#define CMD_NOTE_MAP        0x03
 
 #define CMD_PARAM           0x04
 #define CMD_NAME_UTIL       0x05
 
 #define CMD_REQUEST         0x08        // OR into CMD to turn it into a REQUEST
 
+#define SX_VERSION_MASK     0xf0
+#define SX_VERSION_Z        0x10        // payload compressed with LM_SysExZ
+
+bool sx_tx_z = false;                   // replying to a version 1 request, compress what we send
+
 
 // === SAMPLES
 
@@ -1523,6 +2870,18 @@ typedef struct {
 } __attribute__((packed)) sx_ram_bank_hdr_t;
                                         // struct is followed by RAM data, 8KB
 
+// === NOTE MAPS
+
+//  cmd = 0x03 / 0x0b is note map profile store / request. Table format is in LM_NoteMap.h: for each of the 128 MIDI notes,
+//  1 byte drum # (0xff = none) and 1 byte velocity (0 = use the note's velocity). Only user profiles (2-9) can be stored.
+
+typedef struct {
+  uint8_t cmd;                          // 0x03 or 0x0b
+  uint8_t profile;                      // 0 - 9, 0xff = active profile (request only)
+  uint8_t pad[30];                      // unused, pad
+} __attribute__((packed)) sx_note_map_hdr_t;
+                                        // struct is followed by note_map_t, 256 bytes
+
 // === PARAMETER UTILITIES
 
 //  cmd = 0x04 / 0x0c is set / get parameter
@@ -1541,6 +2900,7 @@ typedef struct {
 #define SX_PARAM_MIDI_SOFT_THRU   0x07      // MIDI Soft Thru: On / Off
 #define SX_PARAM_MIDI_START_EN    0x08      // MIDI Start Enable: Enabled / Disabled
 #define SX_PARAM_MIDI_SEND_VEL    0x09      // MIDI Send Velocity: Enabled / Disabled
+#define SX_PARAM_NOTE_MAP         0x0a      // MIDI Note Map profile: 0 (Luma-1), 1 (General MIDI), 2-9 (user, from SD)
 
 #define SX_PARAM_REBOOT           0xf0      // Reboot: Just Reboot / Reset to Factory Default Settings    WRITE-ONLY
 #define SX_PARAM_KEYPRESS         0xfe      // jam in a key                                               WRITE-ONLY
@@ -1562,20 +2922,87 @@ typedef struct {
 //  cmd = 0x05 / 0x0d, name type = 0x01, RAM Pattern Bank Name write / read
 //  cmd = 0x05 / 0x0d, name type = 0x02, Teensy code version read-only
 
-// Name Types:
-#define SX_VOICE_BANK_NAME    0x00
-#define SX_RAM_BANK_NAME      0x01
-#define SX_TEENSY_VERSION     0x02      // this one can only be read
-#define SX_SERIAL_NUMBER      0x03      // 8 char ASCII string, null terminated
+// Name Types:
+#define SX_VOICE_BANK_NAME    0x00
+#define SX_RAM_BANK_NAME      0x01
+#define SX_TEENSY_VERSION     0x02      // this one can only be read
+#define SX_SERIAL_NUMBER      0x03      // 8 char ASCII string, null terminated
+
+typedef struct {
+  uint8_t cmd;                          // 0x05 or 0x0d
+  char name[24];                        // bank name, C string, 24 chars max
+  uint8_t bank;                         // bank number, 00 - 99, 0xff = currently active
+  uint8_t name_type;                    // name type
+  uint8_t pad[5];                       // unused, pad
+} __attribute__((packed)) sx_name_util_hdr_t;
+                                        // nothing after, all data in struct
+
+// === BULK BACKUP
+
+//  cmd = 0x0f (0x1f for compressed items), ext cmd 0x01, is a bulk backup request. Luma-1 replies with one BULK ITEM
+//  message per item, then a BULK END. Items are numbered the same way every time, so a host that lost the connection
+//  can ask again starting at the first item it didn't get (or whose hash didn't match).
+//
+//    SX_BULK_VOICE_BANK    11 items: bank name, then drum_sel 0-9
+//    SX_BULK_RAM_BANK      1 item
+//    SX_BULK_CARD          voice banks 00-99 (11 items each, item # = bank * 11 + n), then RAM banks 00-99 (item # 1100 + bank)
+
+#define CMD_ESCAPE            0x07
+
+#define SX_EXT_BULK           0x01      // request
+#define SX_EXT_BULK_ITEM      0x02
+#define SX_EXT_BULK_END       0x03
+
+#define SX_BULK_VOICE_BANK    0x00
+#define SX_BULK_RAM_BANK      0x01
+#define SX_BULK_CARD          0x02
+
+typedef struct {
+  uint8_t cmd;                          // 0x0f or 0x1f
+  uint8_t ext_cmd;                      // SX_EXT_BULK
+  uint8_t scope;                        // SX_BULK_xxx
+  uint8_t bank;                         // 00 - 99, ignored for SX_BULK_CARD
+  uint16_t first_item;                  // 0, or where to pick up a broken transfer
+  uint8_t pad[26];                      // unused, pad
+} __attribute__((packed)) sx_bulk_req_hdr_t;
+
+#define SX_ITEM_BANK_NAME     0x00
+#define SX_ITEM_VOICE         0x01
+#define SX_ITEM_RAM           0x02
+
+#define SX_ITEM_EMPTY         0x01      // flags: nothing there (no file, or no bank name), len is 0
+#define SX_ITEM_ERROR         0x02      // flags: file is there (name is filled in) but too big for an item, or the read came up short. len is 0
+
+typedef struct {
+  uint8_t cmd;                          // 0x07 or 0x17 (data is compressed, like BANK SAMPLE / BANK RAM)
+  uint8_t ext_cmd;                      // SX_EXT_BULK_ITEM
+  uint16_t item;                        // this item #
+  uint16_t total;                       // # of items in the whole transfer
+  uint8_t kind;                         // SX_ITEM_xxx
+  uint8_t bank;                         // 00 - 99
+  uint8_t drum_sel;                     // SX_ITEM_VOICE only
+  uint8_t flags;
+  uint16_t len;                         // data length, uncompressed
+  uint32_t hash;                        // hash32() of the 24 byte name followed by the data
+  uint8_t pad[16];                      // unused, pad
+  char name[24];                        // voice, RAM bank, or bank name, C string
+} __attribute__((packed)) sx_bulk_item_hdr_t;
+
+#define SX_BULK_ITEM_RAW_MAX  (sizeof(sx_bulk_item_hdr_t) + SXZ_MAX_LEN(32768))          // full size voice, compressed worst case
+
+static_assert( ((((SX_BULK_ITEM_RAW_MAX + 6) / 7) * 8 + 1) + SX_BULK_ITEM_RAW_MAX) <= BUF_MAIN_SIZE,
+               "shared buffer can't hold a bulk item with a full size voice, see send_packed_sysex_parts()" );
+                                        // followed by len bytes of data
 
 typedef struct {
-  uint8_t cmd;                          // 0x05 or 0x0d
-  char name[24];                        // bank name, C string, 24 chars max
-  uint8_t bank;                         // bank number, 00 - 99, 0xff = currently active
-  uint8_t name_type;                    // name type
-  uint8_t pad[5];                       // unused, pad
-} __attribute__((packed)) sx_name_util_hdr_t;
-                                        // nothing after, all data in struct
+  uint8_t cmd;                          // 0x07
+  uint8_t ext_cmd;                      // SX_EXT_BULK_END
+  uint16_t total;
+  uint16_t first_item;                  // where this transfer started
+  uint16_t sent;                        // # of items sent
+  uint8_t ok;                           // 1 if we got through all of them, 0 if we had to stop
+  uint8_t pad[23];                      // unused, pad
+} __attribute__((packed)) sx_bulk_end_hdr_t;
 
 
 
@@ -1586,9 +3013,9 @@ typedef struct {
 */
 
 void send_pattern_RAM_sysex( uint8_t banknum ) {
-  int encoded_size = 0;
   uint8_t *ram;
-  sx_ram_bank_hdr_t *hdr = (sx_ram_bank_hdr_t*)sysex_decode_buf;
+  sx_ram_bank_hdr_t hdr_buf;
+  sx_ram_bank_hdr_t *hdr = &hdr_buf;
 
   Serial.printf("SysEx send Pattern RAM\n");
   
@@ -1598,43 +3025,20 @@ void send_pattern_RAM_sysex( uint8_t banknum ) {
 
   if( ram ) {                                                       // valid?
   
-    // -- zero working buf
+    // -- zero header
   
-    memset( sysex_decode_buf, 0, sizeof(sysex_decode_buf) );
+    memset( hdr, 0, sizeof(sx_ram_bank_hdr_t) );
     
-    // --- build the unencoded message
+    // --- build the header, RAM data follows it
   
-    hdr->cmd = CMD_RAM_BANK;
+    hdr->cmd = sx_tx_z ? (SX_VERSION_Z | CMD_RAM_BANK) : CMD_RAM_BANK;
     hdr->bank = banknum;                                            // 0xff for current working pattern RAM
   
     sprintf( hdr->name, get_ram_bank_name( banknum ) );
   
-    memcpy( &sysex_decode_buf[sizeof(sx_ram_bank_hdr_t)], ram, 8192 );
-  
-    //Serial.printf("===> WILL ENCODE: \n");
-    //dumpit( sysex_decode_buf, 256 );
-  
-    // --- encode
-  
-    /*
-        The MIDI library wraps our data with the needed F0 start and F7 end markers.
-        We jam our mfr ID at the start, unencoded and always with the hi bit clear.
-  
-        F0
-        mfr ID
-        ...encoded data, all hi bits clear...
-        F7
-    */
-      
-    sysex_encode_buf[0] = OUR_MIDI_MFR_ID;
-    
-    encoded_size = pack_sysex_data( 8192 + sizeof(sx_ram_bank_hdr_t), sysex_decode_buf, &sysex_encode_buf[1] );
-  
-    encoded_size += 1;                                // for the unencoded mfr ID in location 0
-  
-    // --- transmit
-  
-    send_sysex( encoded_size, sysex_encode_buf );
+    // --- encode and transmit
+
+    send_packed_sysex_parts( (uint8_t*)hdr, sizeof(sx_ram_bank_hdr_t), ram, 8192 );
   }
   else {
     Serial.printf("### Error loading bank %02x\n", banknum);
@@ -1645,44 +3049,84 @@ void send_pattern_RAM_sysex( uint8_t banknum ) {
 
 
 
-void sysex_ram_store( uint8_t *se, int len ) {
-  char vname[24];
+/*
+    Pattern RAM store (see SysEx DECODER).
+
+    Bank 255 is collected in the stage slot. At the F7, if all 8KB are there, the Z-80 is held off the bus while it's
+    loaded, then rebooted.
+    Banks 00-99 are written to a temp file in the bank dir. At the F7 it's renamed -- the default name has the
+    checksum of the data in it, so we don't know the name until then -- and any old file there is removed.
+*/
+
+#define SX_RAM_TMP_FN           "SYSEX.TMP"
+
+void sysex_ram_sink_open( uint8_t *se ) {
   sx_ram_bank_hdr_t *hdr = (sx_ram_bank_hdr_t*)se;
 
   Serial.printf("\n-- Sysex Pattern RAM Store\n");
-  
-  // --- sanity check the name
-  
-  if( strlen( hdr->name ) == 0 )                                                                        // no name?
-    snprintf( vname, 24, "RAM_BANK_%04X.BIN", checksum((uint8_t*)&se[SYSEX_HEADER_SIZE],8192) );        // default name w/checksum
-  else
-    snprintf( vname, 24, "%s", hdr->name );
+  Serial.printf("   Pattern RAM name: %.23s\n", hdr->name );
 
-  Serial.printf("   Pattern RAM len: %d\n", len - SYSEX_HEADER_SIZE );
-  Serial.printf("   Pattern RAM name: %s\n", hdr->name );
-  if( hdr->bank == 255 )
+  snprintf( sx_rx_name, 24, "%.23s", hdr->name );                 // if empty, default name gets filled in at the end
+
+  sx_sink_max = 8192;
+
+  if( hdr->bank == 255 ) {
     Serial.printf("   Pattern RAM bank: ACTIVE Z-80 RAM\n" );
-  else
+
+    sysex_stage_sink_open();                                    // Z-80 RAM isn't touched until it's all here
+  }
+  else {
     Serial.printf("   Pattern RAM bank: %02d\n", hdr->bank );
 
-  // --- if bank 00-99, write to SD card. if bank == 255, write to active ram, save filename, and reboot
+    snprintf( sx_rx_path, sizeof(sx_rx_path), "/RAMBANKS/%02d/%s", hdr->bank, SX_RAM_TMP_FN );
+    sysex_file_sink_open();
+  }
+}
+
 
-  if( hdr->bank == 255 ) {
-    sysex_store_prologue();                                     // take the bus, pause hihat
+void sysex_ram_sink_close( bool ok ) {
+  sx_ram_bank_hdr_t *hdr = (sx_ram_bank_hdr_t*)sx_rx_buf;
+  char dir[MAX_LEN_PATH_NAME];
+  char path[MAX_LEN_PATH_NAME];
 
-    // Z-80 is paused
+  if( ok && (sx_sink_done != 8192) ) {
+    Serial.printf("### Pattern RAM: got %d bytes, expected 8192\n", sx_sink_done );
+    ok = false;
+  }
 
-    load_z80_ram( (uint8_t*)&se[SYSEX_HEADER_SIZE] );           // copy the payload into the z-80 RAM
-                                                                
-    set_active_ram_bank_name( vname );                          // save the filename
+  if( strlen( sx_rx_name ) == 0 )                                                   // no name?
+    snprintf( sx_rx_name, 24, "RAM_BANK_%04X.BIN", sx_rx_cs );                     // default name w/checksum
 
-    reboot_after_sysex = true;                                  // this will reboot the z-80 on the way out
+  if( sx_sink == SX_SINK_STAGE ) {
+    if( ok ) {
+      sysex_store_prologue();                                   // take the bus, pause hihat
+      load_z80_ram( sx_rx_stage );
+      set_active_ram_bank_name( sx_rx_name );                   // save the filename
 
-    sysex_store_epilogue();                                     // release the bus, reboot z-80
+      reboot_after_sysex = true;                                // new RAM under the Z-80, start it fresh
+      sysex_store_epilogue();                                   // release the bus, reboot z-80
+    }
+    return;
   }
-  else {
-    store_ram_bank( (uint8_t*)&se[SYSEX_HEADER_SIZE], hdr->bank, hdr->name );
+
+  sx_rx_file.close();
+
+  if( !ok ) {
+    SD.remove( sx_rx_path );                                    // don't leave a partial file behind
+    return;
   }
+
+  snprintf( dir, sizeof(dir), "/RAMBANKS/%02d/", hdr->bank );
+  snprintf( path, sizeof(path), "%s%s", dir, sx_rx_name );
+
+  SD.remove( path );                                            // rename won't replace an existing file
+
+  if( !SD.rename( sx_rx_path, path ) )
+    Serial.printf("### Pattern RAM: could not rename %s to %s\n", sx_rx_path, path );
+  else
+    delete_all_in_dir_except( dir, sx_rx_name );
+
+  catalog_invalidate_ram_bank( hdr->bank );
 }
 
 
@@ -1739,9 +3183,9 @@ char *drum_sel_2_name( uint8_t drum_sel ) {
 void send_sample_sysex( uint8_t banknum, uint8_t drum_sel ) {
   char vname[24];
   int vlen;
-  int encoded_size = 0;
   uint8_t *sample;
-  sx_sample_bank_hdr_t *hdr = (sx_sample_bank_hdr_t*)sysex_decode_buf;
+  sx_sample_bank_hdr_t hdr_buf;
+  sx_sample_bank_hdr_t *hdr = &hdr_buf;
 
   Serial.printf("--- SysEx send Sample request\n");
   
@@ -1751,13 +3195,13 @@ void send_sample_sysex( uint8_t banknum, uint8_t drum_sel ) {
 
   if( sample ) {                                                                // valid?
   
-    // -- zero working buf
+    // -- zero header
   
-    memset( sysex_decode_buf, 0, sizeof(sysex_decode_buf) );
+    memset( hdr, 0, sizeof(sx_sample_bank_hdr_t) );
     
-    // --- build the unencoded message
+    // --- build the header, sample data follows it
   
-    hdr->cmd = CMD_SAMPLE_BANK;
+    hdr->cmd = sx_tx_z ? (SX_VERSION_Z | CMD_SAMPLE_BANK) : CMD_SAMPLE_BANK;
     hdr->bank = banknum;                                                        // 0xff for current working pattern RAM
     hdr->drum_sel = drum_sel;
   
@@ -1765,95 +3209,557 @@ void send_sample_sysex( uint8_t banknum, uint8_t drum_sel ) {
 
     hdr->sample_len = vlen;                                                     // put the # of bytes in the sample in the header
   
-    /*
-    Serial.printf("send_sample_sysex: sysex_decode_buf @ %08x, header size = %d (%02x), sample start @ %08x\n",
-                                    sysex_decode_buf, sizeof(sx_sample_bank_hdr_t), sizeof(sx_sample_bank_hdr_t), &sysex_decode_buf[sizeof(sx_sample_bank_hdr_t)]);
-    */
+    // --- encode and transmit
 
-    memcpy( &sysex_decode_buf[sizeof(sx_sample_bank_hdr_t)], sample, vlen );    // copy the sample data into the sysex message buffer
-  
-    // --- encode
-  
-    /*
-        The MIDI library wraps our data with the needed F0 start and F7 end markers.
-        We jam our mfr ID at the start, unencoded and always with the hi bit clear.
-  
-        F0
-        mfr ID
-        ...encoded data, all hi bits clear...
-        F7
-    */
-      
-    sysex_encode_buf[0] = OUR_MIDI_MFR_ID;
-    
-    // encode (no hi bits set) the header and sample data, right after the MIDI Manufacturer ID, which is not encoded (hi bit always 0)
-    
-    encoded_size = pack_sysex_data( vlen + sizeof(sx_sample_bank_hdr_t), sysex_decode_buf, &sysex_encode_buf[1] );
-  
-    encoded_size += 1;                                // for the unencoded mfr ID in location 0
+    send_packed_sysex_parts( (uint8_t*)hdr, sizeof(sx_sample_bank_hdr_t), sample, vlen );
+  }
+  else {
+    Serial.printf("### Error loading bank %02x\n", banknum);
+    beep_failure();
+  }
+}
+
+
+/*
+    Sample store (see SysEx DECODER).
+
+    Samples for a voice board (legacy cmd 0, or cmd 1 to STAGING) are collected in the stage slot. At the F7, if we got
+    sample_len bytes, the bus is taken and set_voice_sample() loads the voice board and writes its STAGING copy.
+    Legacy cmd 0 has no sample_len (and some senders leave it 0), then whatever came in is the sample.
+
+    Samples for an SD card bank are written to a temp file in the bank dir as they arrive. At the F7 it's moved into
+    the voice dir and whatever was there is removed. On an error the temp file is removed and the old voice stays.
+    Either way the bank's packed copy and catalog entries are invalidated, so they are rebuilt from what's really on
+    the card -- that also covers a rename that failed halfway.
+*/
+
+#define SX_SD_SAMPLE_MAX        65536                           // same limit the old whole-message decode buffer had
+#define SX_SAMPLE_TMP_FN        "SYSEX.TMP"
+
+uint16_t sx_rx_voice;                                           // voice the sample is for
+int sx_rx_sample_len;                                           // from the header, 0 = take whatever comes
+
+
+// stage slot sinks, the sample or RAM image waits there until the F7
+
+void sysex_stage_sink_open() {
+  sx_rx_stage = buf_claim( BUF_OWNER_SYSEX_RX, BUF_STAGE_SIZE );
+
+  if( sx_rx_stage ) {
+    sx_sink = SX_SINK_STAGE;
+  }
+  else {
+    Serial.printf("### sysex: no room to collect it (bulk backup running?)\n" );
+    sx_sink = SX_SINK_NONE;
+    sysex_err_abort = true;
+  }
+}
+
+
+void sysex_sample_sink_open( uint8_t *se ) {
+  sx_sample_bank_hdr_t *hdr = (sx_sample_bank_hdr_t*)se;
+  char dir[MAX_LEN_PATH_NAME];
+
+  Serial.printf("-- Sysex Sample Store\n");
+  Serial.printf("   Sample name: %.23s\n", hdr->name );
   
-    // --- transmit
+  // sanity check the name
   
-    send_sysex( encoded_size, sysex_encode_buf );
+  if( hdr->name[0] == 0 )                                                           // any string there?
+    snprintf( sx_rx_name, 24, "NONAME.BIN" );
+  else
+    snprintf( sx_rx_name, 24, "%.23s", hdr->name );
+
+  sx_rx_voice = (hdr->cmd == CMD_SAMPLE) ? last_drum                               // legacy cmd 0 loads into last active drum
+                                         : drum_sel_2_voice( hdr->drum_sel );
+
+  sx_rx_sample_len = (hdr->cmd == CMD_SAMPLE_BANK) ? hdr->sample_len : 0;
+
+  if( sx_rx_voice == 0 ) {
+    Serial.printf("### Sysex Sample Store: bad drum select %02x\n", hdr->drum_sel );
+    sx_sink = SX_SINK_NONE;
+    sysex_err_abort = true;
+    return;
+  }
+
+  if( (hdr->cmd == CMD_SAMPLE) || (hdr->bank == BANK_STAGING) ) {                   // into a voice board
+
+    if( sx_rx_sample_len > BUF_STAGE_SIZE ) {
+      Serial.printf("### Sysex Sample Store: sample_len %d, max is %d\n", sx_rx_sample_len, BUF_STAGE_SIZE );
+      sx_sink = SX_SINK_NONE;
+      sysex_err_abort = true;
+      return;
+    }
+
+    Serial.printf("   Sample len: %d, collecting it first\n", sx_rx_sample_len );
+
+    sx_sink_max = sx_rx_sample_len ? sx_rx_sample_len : BUF_STAGE_SIZE;
+    sysex_stage_sink_open();
+  }
+  else {                                                                            // copy into selected SD card bank and voice directory
+    if( hdr->bank > 99 ) {
+      Serial.printf("### Sysex Sample Store: bad bank %02x\n", hdr->bank );
+      sx_sink = SX_SINK_NONE;
+      sysex_err_abort = true;
+      return;
+    }
+
+    build_voice_filename( sx_rx_voice, hdr->bank, dir );
+    make_dir( dir );                                                                // rename at the F7 won't create it
+
+    snprintf( sx_rx_path, sizeof(sx_rx_path), "/DRMBANKS/%02d/%s", hdr->bank, SX_SAMPLE_TMP_FN );
+
+    sx_sink_max = SX_SD_SAMPLE_MAX;
+    sysex_file_sink_open();
+  }
+}
+
+
+void sysex_sample_sink_close( bool ok ) {
+  sx_sample_bank_hdr_t *hdr = (sx_sample_bank_hdr_t*)sx_rx_buf;
+  voice_sample_t vs;
+  char dir[MAX_LEN_PATH_NAME];
+  char path[MAX_LEN_PATH_NAME];
+
+  if( ok && sx_rx_sample_len && (sx_sink_done != sx_rx_sample_len) ) {
+    Serial.printf("### Sample: got %d bytes, header says %d\n", sx_sink_done, sx_rx_sample_len );
+    ok = false;
+  }
+
+  switch( sx_sink ) {
+    case SX_SINK_STAGE:     if( ok ) {
+                              vs = voice_sample( sx_rx_stage, sx_sink_done );
+
+                              sysex_store_prologue();                               // take the bus, pause hihat
+                              set_voice_sample( sx_rx_voice, &vs, sx_rx_name );     // also puts it in STAGING
+                              sysex_store_epilogue();                               // release the bus
+                            }
+                            break;
+
+    case SX_SINK_SD_FILE:   sx_rx_file.close();
+
+                            if( ok ) {
+                              build_voice_filename( sx_rx_voice, hdr->bank, dir );
+                              snprintf( path, sizeof(path), "%s/%s", dir, sx_rx_name );
+
+                              SD.remove( path );                                    // rename won't replace an existing file
+
+                              if( SD.rename( sx_rx_path, path ) )
+                                delete_all_in_dir_except( dir, sx_rx_name );
+                              else {
+                                Serial.printf("### Sample: could not rename %s to %s\n", sx_rx_path, path );
+                                ok = false;
+                              }
+                            }
+
+                            if( !ok )
+                              SD.remove( sx_rx_path );                              // don't leave a partial file behind
+
+                            sd_bank_voice_written( hdr->bank, hdr->drum_sel );      // packed bank and catalog, either way
+                            break;
+  }
+
+  Serial.printf("-- Sysex Sample Store %s, %d bytes\n\n", ok ? "complete" : "FAILED", sx_sink_done );
+}
+
+
+void sysex_sample_request( uint8_t *se, int len ) {
+  sx_sample_bank_hdr_t *hdr = (sx_sample_bank_hdr_t*)se;
+
+  Serial.printf("-- Sysex Sample Request\n");
+
+  Serial.printf("   Bank %02d, Drum %02d (%s)\n", hdr->bank, hdr->drum_sel, drum_sel_2_name(hdr->drum_sel));
+
+  send_sample_sysex( hdr->bank, hdr->drum_sel );
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    SysEx Bulk Backup
+
+    One request streams a voice bank, a RAM bank, or the whole card. handle_sysex_bulk() runs from loop(). While one
+    item is going out in the background (sysex_tx_service()), the next one is read from the SD card into the stage slot
+    of the shared buffer (LM_Buffers), so the card and the MIDI port are both kept busy. When the port is free, the
+    prefetched item is packed and sent.
+
+    Items are read BULK_READ_BYTES per call, like the catalog scan, and not at all while MIDI input is waiting, so a
+    full size voice never holds up loop(). The hash is taken as the data comes in, over the name and then the data.
+    A file too big for an item, or one that reads short, goes out with SX_ITEM_ERROR and no data -- the host finds
+    out it didn't get that file, instead of getting part of it with a good hash.
+
+    The stage slot is ours from the request to the BULK END, so the data can't change between the hash and the send.
+*/
+
+#define BULK_VOICE_ITEMS        11                              // bank name + 10 voices
+#define BULK_CARD_RAM_BASE      (100 * BULK_VOICE_ITEMS)
+#define BULK_READ_BYTES         512                             // one SD sector per handle_sysex_bulk() call
+
+bool bulk_active = false;
+bool bulk_ready = false;                                        // next item is in bulk_data / bulk_item
+bool bulk_reading = false;                                      // ... or on its way in, from bulk_file
+uint8_t bulk_scope;
+uint8_t bulk_bank;
+bool bulk_z;
+uint16_t bulk_next;                                             // next item to read
+uint16_t bulk_first;
+uint16_t bulk_total;
+uint16_t bulk_sent;
+elapsedMillis bulk_millis;
+
+sx_bulk_item_hdr_t bulk_item;
+
+uint8_t *bulk_data = NULL;                                      // prefetched item data, the shared buffer's stage slot
+File bulk_file;                                                 // file being read, stays open between calls
+int bulk_got;                                                   // bytes of it read so far
+
+sx_bulk_end_hdr_t bulk_end;                                     // BULK END, waiting for the port if bulk_end_pending
+bool bulk_end_pending = false;
+
+
+uint16_t bulk_item_count( uint8_t scope ) {
+  switch( scope ) {
+    case SX_BULK_VOICE_BANK:    return BULK_VOICE_ITEMS;
+    case SX_BULK_RAM_BANK:      return 1;
+    case SX_BULK_CARD:          return BULK_CARD_RAM_BASE + 100;
+    default:                    return 0;
+  }
+}
+
+
+// item # -> what it is
+
+void bulk_item_id( uint16_t item, uint8_t *kind, uint8_t *bank, uint8_t *drum_sel ) {
+  uint16_t n = item;
+
+  *drum_sel = 0;
+
+  if( bulk_scope == SX_BULK_RAM_BANK ) {
+    *kind = SX_ITEM_RAM;
+    *bank = bulk_bank;
+    return;
+  }
+
+  if( bulk_scope == SX_BULK_CARD ) {
+    if( item >= BULK_CARD_RAM_BASE ) {
+      *kind = SX_ITEM_RAM;
+      *bank = item - BULK_CARD_RAM_BASE;
+      return;
+    }
+
+    *bank = item / BULK_VOICE_ITEMS;
+    n = item % BULK_VOICE_ITEMS;
+  }
+  else
+    *bank = bulk_bank;
+
+  if( n == 0 )
+    *kind = SX_ITEM_BANK_NAME;
+  else {
+    *kind = SX_ITEM_VOICE;
+    *drum_sel = n - 1;
+  }
+}
+
+
+// the item can't be sent as it is. keep the name so the host knows which one, drop the data.
+
+void bulk_item_error() {
+  sx_bulk_item_hdr_t *hdr = &bulk_item;
+
+  hdr->flags |= SX_ITEM_ERROR;
+  hdr->len = 0;
+  hdr->hash = hash32( (uint8_t*)hdr->name, sizeof(hdr->name) );
+
+  if( bulk_file )
+    bulk_file.close();
+}
+
+
+// start on the next item, fill in bulk_item. true if it's done already (bank name, no file, or a file we can't send),
+//  otherwise bulk_file is open and bulk_item_step() reads the data.
+
+bool bulk_item_start() {
+  sx_bulk_item_hdr_t *hdr = &bulk_item;
+  char dir[MAX_LEN_PATH_NAME];
+  char *bank_name;
+  uint32_t max_len;
+
+  memset( hdr, 0, sizeof(sx_bulk_item_hdr_t) );
+
+  hdr->cmd = bulk_z ? (SX_VERSION_Z | CMD_ESCAPE) : CMD_ESCAPE;
+  hdr->ext_cmd = SX_EXT_BULK_ITEM;
+  hdr->item = bulk_next;
+  hdr->total = bulk_total;
+
+  bulk_item_id( bulk_next, &hdr->kind, &hdr->bank, &hdr->drum_sel );
+
+  if( hdr->kind == SX_ITEM_BANK_NAME ) {
+    bank_name = get_voice_bank_name( hdr->bank );
+
+    if( bank_name && bank_name[0] )
+      snprintf( hdr->name, sizeof(hdr->name), "%s", bank_name );
+    else
+      hdr->flags |= SX_ITEM_EMPTY;
+
+    hdr->hash = hash32( (uint8_t*)hdr->name, sizeof(hdr->name) );
+    return true;
+  }
+
+  if( hdr->kind == SX_ITEM_VOICE ) {
+    build_voice_filename( drum_sel_2_voice( hdr->drum_sel ), hdr->bank, dir );
+    max_len = BUF_STAGE_SIZE;
+  }
+  else {
+    snprintf( dir, sizeof(dir), "/RAMBANKS/%02d/", hdr->bank );
+    max_len = 8192;
+  }
+
+  bulk_file = cat_first_file( dir );
+
+  if( !bulk_file ) {
+    hdr->flags |= SX_ITEM_EMPTY;
+    hdr->hash = hash32( (uint8_t*)hdr->name, sizeof(hdr->name) );
+    return true;
+  }
+
+  snprintf( hdr->name, sizeof(hdr->name), "%s", bulk_file.name() );
+
+  if( bulk_file.size() > max_len ) {
+    Serial.printf("### Bulk backup: %s %s is %d bytes, max is %d\n", dir, hdr->name, (int)bulk_file.size(), max_len );
+    bulk_item_error();
+    return true;
+  }
+
+  hdr->len = bulk_file.size();
+  hdr->hash = hash32( (uint8_t*)hdr->name, sizeof(hdr->name) );
+  bulk_got = 0;
+
+  if( hdr->len == 0 ) {
+    bulk_file.close();
+    return true;
+  }
+
+  return false;
+}
+
+
+// one read's worth of the open item, true when it's all in (or the read came up short)
+
+bool bulk_item_step() {
+  sx_bulk_item_hdr_t *hdr = &bulk_item;
+  int left = hdr->len - bulk_got;
+  int n;
+
+  n = bulk_file.read( bulk_data + bulk_got, (left > BULK_READ_BYTES) ? BULK_READ_BYTES : left );
+
+  if( n <= 0 ) {
+    Serial.printf("### Bulk backup: short read of %s, got %d of %d bytes\n", hdr->name, bulk_got, hdr->len );
+    bulk_item_error();
+    return true;
+  }
+
+  hdr->hash = hash32_update( hdr->hash, bulk_data + bulk_got, n );
+  bulk_got += n;
+
+  if( bulk_got == hdr->len ) {
+    bulk_file.close();
+    return true;
+  }
+
+  return false;
+}
+
+
+void bulk_item_done() {
+  bulk_reading = false;
+  bulk_next++;
+  bulk_ready = true;
+}
+
+
+// BULK END goes out when the port is free, the last item (or something else) may still be going out
+
+void bulk_end_flush() {
+  if( bulk_end_pending && !sysex_tx_busy() ) {
+    bulk_end_pending = false;
+    send_packed_sysex( sizeof(bulk_end), (uint8_t*)&bulk_end );
+  }
+}
+
+
+void bulk_send_end( bool ok ) {
+
+  memset( &bulk_end, 0, sizeof(bulk_end) );
+
+  bulk_end.cmd = CMD_ESCAPE;
+  bulk_end.ext_cmd = SX_EXT_BULK_END;
+  bulk_end.total = bulk_total;
+  bulk_end.first_item = bulk_first;
+  bulk_end.sent = bulk_sent;
+  bulk_end.ok = ok ? 1 : 0;
+
+  bulk_end_pending = true;
+  bulk_end_flush();
+
+  Serial.printf("-- Bulk backup %s: %d of %d items from %d, %d s\n", ok ? "done" : "STOPPED", bulk_sent, bulk_total, bulk_first, (int)bulk_millis / 1000 );
+
+  if( bulk_file )
+    bulk_file.close();
+
+  buf_release( BUF_OWNER_BULK );
+  bulk_data = NULL;
+
+  bulk_active = false;
+  bulk_ready = false;
+  bulk_reading = false;
+}
+
+
+void sysex_bulk_request( uint8_t *se, int len ) {
+  sx_bulk_req_hdr_t *hdr = (sx_bulk_req_hdr_t*)se;
+
+  bulk_end_flush();                                             // requests wait for a free port, so the last END goes now
+
+  if( bulk_active ) {
+    Serial.printf("### Bulk backup already running, stopping it\n");
+    bulk_send_end( false );
+  }
+
+  bulk_scope = hdr->scope;
+  bulk_bank = hdr->bank;
+  bulk_z = sx_tx_z;
+  bulk_total = bulk_item_count( hdr->scope );
+  bulk_first = hdr->first_item;
+  bulk_next = hdr->first_item;
+  bulk_sent = 0;
+  bulk_millis = 0;
+
+  Serial.printf("\n-- Sysex Bulk Backup Request\n");
+  Serial.printf("   scope %d, bank %02d, items %d-%d%s\n", bulk_scope, bulk_bank, bulk_first, bulk_total - 1, bulk_z ? ", compressed" : "" );
+
+  if( (bulk_total == 0) || ((bulk_scope != SX_BULK_CARD) && (bulk_bank > 99)) || (bulk_first >= bulk_total) ) {
+    Serial.printf("### Bulk backup: bad request\n");
+    bulk_send_end( false );
+    return;
+  }
+
+  bulk_data = buf_claim( BUF_OWNER_BULK, BUF_STAGE_SIZE );
+
+  if( !bulk_data ) {
+    bulk_send_end( false );
+    return;
+  }
+
+  bulk_active = true;
+  bulk_ready = false;
+  bulk_reading = false;
+}
+
+
+void sysex_escape_request( uint8_t *se, int len ) {
+  switch( se[1] ) {
+    case SX_EXT_BULK:       sysex_bulk_request( se, len );                          break;
+    default:                Serial.printf("### Sysex: unknown extended cmd %02x\n", se[1] );
+  }
+}
+
+
+// from loop(), not loop_time_critical() -- this reads the SD card, one sector per call
+
+void handle_sysex_bulk() {
+
+  bulk_end_flush();
+
+  if( !bulk_active )
+    return;
+
+  if( in_local_ui() ) {                                         // local UI can change banks under us
+    bulk_send_end( false );
+    return;
+  }
+
+  if( !bulk_ready ) {
+    if( bulk_next == bulk_total ) {
+      if( !sysex_tx_busy() )
+        bulk_send_end( true );                                  // all out
+      return;
+    }
+
+    if( midi_in_pending() )                                     // MIDI in first, the card can wait a turn
+      return;
+
+    if( bulk_reading ? bulk_item_step() : bulk_item_start() )   // overlaps with the last item going out
+      bulk_item_done();
+    else
+      bulk_reading = true;
+    return;
   }
-  else {
-    Serial.printf("### Error loading bank %02x\n", banknum);
-    beep_failure();
+
+  if( sysex_tx_busy() )                                         // next one's ready, wait for the port
+    return;
+
+  if( !send_packed_sysex_parts( (uint8_t*)&bulk_item, sizeof(sx_bulk_item_hdr_t), bulk_data, bulk_item.len ) ) {
+    bulk_send_end( false );                                     // someone else has the shared buffer
+    return;
   }
+
+  bulk_sent++;
+  bulk_ready = false;
 }
 
 
-void sysex_sample_store( uint8_t *se, int len ) {
-  char vname[24];
-  sx_sample_bank_hdr_t *hdr = (sx_sample_bank_hdr_t*)se;
+bool sysex_bulk_busy()                    {     return bulk_active;                 }
 
-  Serial.printf("-- Sysex Sample Store\n");
 
-  Serial.printf("   Sample len: %d\n", len - sizeof(sx_sample_bank_hdr_t) );
-  Serial.printf("   Sample name: %s\n", hdr->name );
-  
-  // sanity check the name
-  
-  if( strlen( hdr->name ) == 0 )                                                // any string there?
-    snprintf( vname, 24, "NONAME.BIN" );
-  else
-    snprintf( vname, 24, "%s", hdr->name );
+/* ---------------------------------------------------------------------------------------
+    SysEx Note Map Store / Request
+*/
 
-  // now store it into the hardware and/or SD card
+void sysex_note_map_store( uint8_t *se, int len ) {
+  sx_note_map_hdr_t *hdr = (sx_note_map_hdr_t*)se;
 
-  sysex_store_prologue();                                                        // take the bus, pause hihat
+  Serial.printf("--- Note Map store, profile %d\n", hdr->profile );
 
-  if( hdr->cmd == CMD_SAMPLE ) {                                                    // legacy cmd 0 sample?                            
-    set_voice( last_drum, &sysex_decode_buf[sizeof(sx_sample_bank_hdr_t)], 
-                  (len - sizeof(sx_sample_bank_hdr_t)), vname );                    // load into last active drum
-  }
-  else {                                                                            // must be cmd 1, with bank and drum selects
-    if( hdr->bank == BANK_STAGING ) {
-      set_voice( drum_sel_2_voice(hdr->drum_sel), 
-                  &sysex_decode_buf[sizeof(sx_sample_bank_hdr_t)], 
-                  (len - sizeof(sx_sample_bank_hdr_t)), vname );                    // load into selected drum card, will also put in STAGING
-    }
-    else {
-      write_sd_bank_voice( hdr->bank, hdr->drum_sel, hdr->name,                     // copy into selected SD card bank and voice directory (and delete any old one there)
-                  &sysex_decode_buf[sizeof(sx_sample_bank_hdr_t)], 
-                  (len - sizeof(sx_sample_bank_hdr_t)) );                           // sample data is right after sx_sample_bank_hdr_t struct
-    }
+  if( len != (int)(sizeof(sx_note_map_hdr_t) + sizeof(note_map_t)) ) {
+    Serial.printf("### Note Map: expected %d bytes, got %d\n", sizeof(sx_note_map_hdr_t) + sizeof(note_map_t), len );
+    beep_failure();
+    return;
   }
 
-  sysex_store_epilogue();                                                        // release the bus
-
-  Serial.printf("-- Sysex Sample Store complete\n\n");
+  if( store_note_map( hdr->profile, (note_map_t*)(se + sizeof(sx_note_map_hdr_t)) ) )
+    beep_success();
+  else
+    beep_failure();
 }
 
 
-void sysex_sample_request( uint8_t *se, int len ) {
-  sx_sample_bank_hdr_t *hdr = (sx_sample_bank_hdr_t*)se;
+static_assert( SX_RX_BUF_SIZE >= (sizeof(sx_note_map_hdr_t) + sizeof(note_map_t)), "sx_rx_buf too small to build a note map response in place" );
 
-  Serial.printf("-- Sysex Sample Request\n");
+void sysex_note_map_request( uint8_t *se, int len ) {
+  sx_note_map_hdr_t *hdr = (sx_note_map_hdr_t*)se;
+  uint8_t profile = hdr->profile;
 
-  Serial.printf("   Bank %02d, Drum %02d (%s)\n", hdr->bank, hdr->drum_sel, drum_sel_2_name(hdr->drum_sel));
+  if( profile == 0xff )
+    profile = get_note_map();
 
-  send_sample_sysex( hdr->bank, hdr->drum_sel );
+  Serial.printf("--- Note Map request, profile %d\n", profile );
+
+  // --- build the response in place, header followed by the table
+
+  memset( se, 0, sizeof(sx_note_map_hdr_t) );
+
+  hdr->cmd = CMD_NOTE_MAP;                        // respond with REQUEST bit cleared
+  hdr->profile = profile;
+
+  if( !get_note_map_data( profile, (note_map_t*)(se + sizeof(sx_note_map_hdr_t)) ) ) {
+    Serial.printf("### Note Map: can't load profile %d\n", profile );
+    beep_failure();
+    return;
+  }
+
+  // --- encode and transmit
+
+  send_packed_sysex( sizeof(sx_note_map_hdr_t) + sizeof(note_map_t), se );
 }
 
 
@@ -1921,6 +3827,11 @@ void sysex_param( uint8_t *se, int len ) {
                                   eeprom_save_midi_send_velocity( v ? true:false );    
                                   break;
 
+    case SX_PARAM_NOTE_MAP:       Serial.printf("   MIDI Note Map: %02d\n", v );
+                                  if( select_note_map( v ) )
+                                    eeprom_save_midi_note_map( v );
+                                  break;
+
     case SX_PARAM_REBOOT:         Serial.printf("   Reboot: %02d\n", v );     reboot( v ? true:false );           break;
 
     case SX_PARAM_KEYPRESS:       Serial.printf("   Keypress: %02d\n", v );
@@ -1934,7 +3845,6 @@ void sysex_param( uint8_t *se, int len ) {
 
 
 void sysex_param_request( uint8_t *se, int len ) {
-  int encoded_size = 0;
   uint8_t v;
   sx_parm_hdr_t *hdr = (sx_parm_hdr_t*)se;
 
@@ -1963,6 +3873,8 @@ void sysex_param_request( uint8_t *se, int len ) {
 
     case SX_PARAM_MIDI_SEND_VEL:  v = get_midi_send_vel()?1:0;        Serial.printf("   MIDI Start Enable: %02d\n", v );  break;
 
+    case SX_PARAM_NOTE_MAP:       v = get_note_map();                 Serial.printf("   MIDI Note Map: %02d\n", v );      break;
+
     default:                      Serial.printf("   *** Unexpected param: %02x, ignoring\n\n",hdr->param);                break;
   }
 
@@ -1972,27 +3884,10 @@ void sysex_param_request( uint8_t *se, int len ) {
 
   hdr->cmd = CMD_PARAM;                           // respond with REQUEST bit cleared
                                                   // param is still valid, val has been filled in
-  // --- encode
-
-  /*
-      The MIDI library wraps our data with the needed F0 start and F7 end markers.
-      We jam our mfr ID at the start, unencoded and always with the hi bit clear.
-
-      F0
-      mfr ID
-      ...encoded data, all hi bits clear...
-      F7
-  */
-    
-  sysex_encode_buf[0] = OUR_MIDI_MFR_ID;
-  
-  encoded_size = pack_sysex_data( sizeof(sx_parm_hdr_t), (unsigned char*)hdr, &sysex_encode_buf[1] );      // len, in*, out*
-
-  encoded_size += 1;                                // for the unencoded mfr ID in location 0
 
-  // --- transmit
+  // --- encode and transmit
 
-  send_sysex( encoded_size, sysex_encode_buf );
+  send_packed_sysex( sizeof(sx_parm_hdr_t), (uint8_t*)hdr );
 }
 
 
@@ -2038,7 +3933,6 @@ void sysex_name_util( uint8_t *se, int len ) {
 
 
 void sysex_name_util_request( uint8_t *se, int len ) {
-  int encoded_size = 0;
   sx_name_util_hdr_t *hdr = (sx_name_util_hdr_t*)se;
 
   Serial.printf("-- Get Name Utility: \n");
@@ -2062,158 +3956,554 @@ void sysex_name_util_request( uint8_t *se, int len ) {
                               Serial.printf("   Serial Number: %s\n", hdr->name );
                               break;
 
-    default:                  snprintf( hdr->name, 24, "ERROR INVALID REQUEST" );
-                              Serial.printf("   *** Unexpected name_type: %02x, returning ERROR\n\n",hdr->name_type);
-                              break;
+    default:                  snprintf( hdr->name, 24, "ERROR INVALID REQUEST" );
+                              Serial.printf("   *** Unexpected name_type: %02x, returning ERROR\n\n",hdr->name_type);
+                              break;
+  }
+  
+  // --- build & send the response
+
+  hdr->cmd = CMD_NAME_UTIL;                       // respond with REQUEST bit cleared
+                                                  // bank is still valid, name_type is still valid, name has been filled in
+  
+  // --- encode and transmit
+
+  send_packed_sysex( sizeof(sx_name_util_hdr_t), (uint8_t*)hdr );
+}
+
+
+
+/* ---------------------------------------------------------------------------------------
+    SysEx utilities
+*/
+
+/*
+    Some USB MIDI receivers (cough, Windows, cough) have trouble reliably consuming a large sysex message.
+
+    So we chunk the sysex message up into bite-sized SYSEX_CHUNK_BYTES-byte pieces, and send them in the background
+    from handle_midi_out() so MIDI in, clock and drum triggers keep going while a sample uploads.
+
+    USB pacing starts fast and backs off. If handing a chunk to usbMIDI takes longer than SX_TX_STALL_US, its transmit
+    buffers were full (or the host stopped reading), so the gap between chunks doubles. After SX_TX_SPEEDUP_CHUNKS quick
+    chunks in a row the gap shrinks by a quarter. The gap we end up at is remembered and the next upload starts there.
+    sysex_chunk_delay (MENU 89) is the most we'll ever wait between chunks.
+
+    DIN-5 is paced by the UART, we just top up the Serial1 buffer each pass.
+
+    While an upload is going out on USB, other channel messages for that port are held off -- a status byte in the
+    middle would end the SysEx early. On DIN-5 they wait in the voice queue and go out before the next F0 (see
+    "DIN-5 output"), SysEx thru is turned off. Realtime bytes are fine anywhere.
+
+    One upload at a time, and nothing waits for one to finish. Requests from the host that come in meanwhile are
+    queued and answered after it (see sysex_dispatch()), an upload started from the front panel is refused.
+*/
+
+#define SYSEX_CHUNK_BYTES        256                             // sysex chunk payload size
+
+#define SX_TX_STALL_US            2000                            // a chunk normally takes well under this to hand off
+#define SX_TX_GAP_STEP_US         1000                            // first back-off step
+#define SX_TX_SPEEDUP_CHUNKS      8
+
+uint8_t se_chunk[SYSEX_CHUNK_BYTES+2];                            // room for the start (0xf0) & end (0xf7) sysex bytes
+
+uint8_t *sx_tx_data;                                              // packed message, in the shared buffer
+int sx_tx_len;
+uint8_t sx_tx_routes_active = 0;                                  // ROUTE_USB / ROUTE_DIN5 still sending
+
+int sx_tx_usb_pos;
+int sx_tx_din_pos;                                                // counts the F0 and F7 too
+
+uint32_t sx_tx_usb_gap_us;
+uint32_t sx_tx_usb_best_gap_us = 0;                               // where the last upload settled, start there next time
+int sx_tx_usb_fast_run;
+int sx_tx_usb_stalls;
+
+elapsedMicros sx_tx_usb_since;                                    // since the last chunk went out
+elapsedMillis sx_tx_millis;                                       // since the upload started
+
+/*
+    Pack len bytes of raw (header + payload) and send it.
+
+    The MIDI library wraps our data with the needed F0 start and F7 end markers.
+    We jam our mfr ID at the start, unencoded and always with the hi bit clear.
+
+      F0
+      mfr ID
+      ...encoded data, all hi bits clear...
+      F7
+
+    The packed message is built in the shared buffer, which we hold until the last byte has gone out.
+*/
+
+void send_packed_sysex( int len, uint8_t *raw ) {
+  send_packed_sysex_parts( raw, len, NULL, 0 );
+}
+
+
+// header and data can live in different places (e.g., a header on the stack and a sample in filebuf). They are put
+// back to back in the shared buffer, after the room needed for the packed message, and packed from there.
+// If the header cmd is version 1, the data is compressed on the way in.
+
+bool send_packed_sysex_parts( uint8_t *hdr, int hdr_len, uint8_t *data, int data_len ) {
+  uint8_t *enc;
+  uint8_t *raw;
+  bool z = ((hdr[0] & SX_VERSION_MASK) == SX_VERSION_Z);
+  int len = hdr_len + (z ? SXZ_MAX_LEN(data_len) : data_len);              // worst case until we've compressed it
+  int packed_len = ((len + 6) / 7) * 8 + 1;
+  int encoded_size;
+
+  if( sysex_tx_busy() ) {                           // one upload at a time. remote requests wait for us, see sysex_dispatch()
+    Serial.printf("### send_packed_sysex: still sending the last one, not sending\n");
+    beep_failure();
+    return false;
+  }
+
+  enc = buf_claim( BUF_OWNER_SYSEX_TX, packed_len + len );
+
+  if( !enc ) {
+    Serial.printf("### send_packed_sysex: no buffer, not sending\n");
+    beep_failure();
+    return false;
+  }
+
+  raw = enc + packed_len;
+
+  memcpy( raw, hdr, hdr_len );
+
+  if( z ) {
+    len = hdr_len + sxz_compress( data, data_len, raw + hdr_len );
+    Serial.printf("== compressed %d bytes to %d\n", data_len, len - hdr_len );
+  }
+  else if( data_len )
+    memcpy( raw + hdr_len, data, data_len );
+
+  enc[0] = OUR_MIDI_MFR_ID;
+
+  encoded_size = pack_sysex_data( len, raw, &enc[1] );
+
+  Serial.printf("== pack_sysex_data: len = %d / out = %d\n", len, encoded_size );
+
+  encoded_size += 1;                                // for the unencoded mfr ID in location 0
+
+  send_sysex( encoded_size, enc );                  // sysex_tx_service() releases the buffer when it's all gone out
+  return true;
+}
+
+
+// Start sending len bytes of b (no F0/F7). b must stay put until sysex_tx_busy() is false, and the last one must be done.
+
+void send_sysex( int len, uint8_t *b ) {
+
+  sx_tx_data = b;
+  sx_tx_len = len;
+  sx_tx_usb_pos = 0;
+  sx_tx_din_pos = 0;
+  sx_tx_routes_active = get_midi_sysex_route() & (ROUTE_USB | ROUTE_DIN5);
+
+  sx_tx_usb_gap_us = min( sx_tx_usb_best_gap_us, (uint32_t)sysex_chunk_delay * 1000 );
+  sx_tx_usb_fast_run = 0;
+  sx_tx_usb_stalls = 0;
+  sx_tx_usb_since = sx_tx_usb_gap_us;               // first chunk can go right away
+  sx_tx_millis = 0;
+
+  Serial.printf("Sending %d bytes of SysEx%s%s, starting gap %d us\n", len,
+                (sx_tx_routes_active & ROUTE_USB) ? " via USB" : "",
+                (sx_tx_routes_active & ROUTE_DIN5) ? " via DIN-5" : "", sx_tx_usb_gap_us );
+
+  sysex_tx_service();                               // get the first chunk going, the rest goes from handle_midi_out()
+}
+
+
+void sysex_tx_usb_chunk() {
+  int n = min( SYSEX_CHUNK_BYTES, sx_tx_len - sx_tx_usb_pos );
+  int k = 0;
+  uint32_t start;
+  uint32_t took;
+  uint32_t max_gap = (uint32_t)sysex_chunk_delay * 1000;
+
+  if( sx_tx_usb_pos == 0 ) {
+    usb_tx_flush();                                               // anything queued goes before the F0, not in the middle
+    se_chunk[k++] = 0xf0;                                         // sysex START
+  }
+
+  memcpy( &se_chunk[k], &sx_tx_data[sx_tx_usb_pos], n );
+  k += n;
+  sx_tx_usb_pos += n;
+
+  if( sx_tx_usb_pos == sx_tx_len )
+    se_chunk[k++] = 0xf7;                                         // sysex END
+
+  start = ARM_DWT_CYCCNT;
+
+  usb_tx_begin();                                                 // bracket each chunk, not the gaps, so clocks can get in
+  usbMIDI.sendSysEx( k, se_chunk, true );                         // true -> tell midi lib to NOT add F0/F7
+  usb_tx_end();
+
+  took = (ARM_DWT_CYCCNT - start) / (F_CPU_ACTUAL / 1000000);
+
+  midi_usb_out_event();
+
+  // --- pacing
+
+  if( took > SX_TX_STALL_US ) {                                   // usbMIDI had to wait for the host, back off
+    sx_tx_usb_stalls++;
+    sx_tx_usb_fast_run = 0;
+    sx_tx_usb_gap_us = max( sx_tx_usb_gap_us * 2, (uint32_t)SX_TX_GAP_STEP_US );
+  }
+  else if( ++sx_tx_usb_fast_run == SX_TX_SPEEDUP_CHUNKS ) {       // keeping up, try a little faster
+    sx_tx_usb_fast_run = 0;
+    sx_tx_usb_gap_us -= sx_tx_usb_gap_us / 4;
+    if( sx_tx_usb_gap_us < (SX_TX_GAP_STEP_US / 4) )
+      sx_tx_usb_gap_us = 0;
+  }
+
+  if( sx_tx_usb_gap_us > max_gap )
+    sx_tx_usb_gap_us = max_gap;
+
+  sx_tx_usb_since = 0;
+}
+
+
+void sysex_tx_din_fill() {
+  uint8_t b;
+
+  if( sx_tx_din_pos == 0 ) {                                      // notes go before the F0, not after
+    din_tx_flush();
+    if( din_tx_q_n || din_tx_in_sysex )
+      return;
+  }
+
+  while( (sx_tx_din_pos != (sx_tx_len + 2)) && (HW_MIDI.availableForWrite() > 0) ) {
+    if( sx_tx_din_pos == 0 )
+      b = 0xf0;                                                   // sysex START
+    else if( sx_tx_din_pos == (sx_tx_len + 1) )
+      b = 0xf7;                                                   // sysex END
+    else
+      b = sx_tx_data[sx_tx_din_pos - 1];
+
+    din_tx_raw( &b, 1 );
+    sx_tx_din_pos++;
+  }
+
+  midi_din_out_event();
+}
+
+
+// Called from handle_midi_out(), sends whatever is due and never waits
+
+void sysex_tx_service() {
+
+  if( !sx_tx_routes_active )
+    return;
+
+  if( (sx_tx_routes_active & ROUTE_USB) && (sx_tx_usb_since >= sx_tx_usb_gap_us) ) {
+    sysex_tx_usb_chunk();
+
+    if( sx_tx_usb_pos == sx_tx_len ) {
+      sx_tx_routes_active &= ~ROUTE_USB;
+      sx_tx_usb_best_gap_us = sx_tx_usb_gap_us;
+
+      Serial.printf("SysEx via USB done, %d ms, ended at gap %d us, %d stalls\n", (int)sx_tx_millis, sx_tx_usb_gap_us, sx_tx_usb_stalls );
+    }
+  }
+
+  if( sx_tx_routes_active & ROUTE_DIN5 ) {
+    sysex_tx_din_fill();
+
+    if( sx_tx_din_pos == (sx_tx_len + 2) ) {
+      sx_tx_routes_active &= ~ROUTE_DIN5;
+
+      Serial.printf("SysEx via DIN-5 done, %d ms\n", (int)sx_tx_millis );
+    }
+  }
+
+  if( !sx_tx_routes_active )
+    buf_release( BUF_OWNER_SYSEX_TX );                            // no-op if the data wasn't in the shared buffer
+}
+
+
+bool sysex_tx_busy()                      {     return sx_tx_routes_active != 0;    }
+uint8_t sysex_tx_routes()                 {     return sx_tx_routes_active;         }
+bool sysex_tx_din_sending()               {     return (sx_tx_routes_active & ROUTE_DIN5) && (sx_tx_din_pos > 0);     }
+bool sysex_tx_usb_sending()               {     return (sx_tx_routes_active & ROUTE_USB) && (sx_tx_usb_pos > 0);      }
+
+
+/* ---------------------------------------------------------------------------------------
+    SysEx DECODER
+*/
+
+void init_sysex_decoder() {
+  process_sysex_state = SYSEX_FIND_F0;                // set up to hunt for F0 (start of sysex)
+}
+
+/*
+    We are receiving a SysEx message containing sample data.
+    Get ready to write it to a voice board.
+*/
+
+void sysex_store_prologue() {
+  
+  teensy_drives_z80_bus( true );                      // grab the bus
+
+  set_rst_hihat( 1 );                                 // XXX FIXME should not need to do this, getting stomped
+
+  z80_bus_write( PATT_DISPLAY, voice_num_map[(last_drum & 0xf) - 4]);     // PATT didsplay shows voice we are loading into
+}
+
+
+void sysex_store_epilogue() {
+
+  set_rst_hihat( 0 );                                 // XXX FIXME should not need to do this, getting stomped
+
+  if( reboot_after_sysex ) {
+    z80_reset( true );
+    teensy_drives_z80_bus( false );                   // we're done, let the z-80 go again
+    z80_reset( false );
+
+    delay( 250 );
+    
+    reboot_after_sysex = false;  
+  }
+  else {
+    delay(100);
+    teensy_drives_z80_bus( false );                   // just release the bus
+    delay(100);
+  }
+}
+
+
+
+// --- Sinks
+
+void sysex_rx_begin() {                               // new message for us, mfr ID matched
+  sysex_decode_idx = 0;
+  sx_rx_block_len = 0;
+  sx_sink_done = 0;
+  sx_rx_cs = 0;
+  sx_rx_z = false;
+  sx_sink = SX_SINK_NONE;
+
+  memset( sx_rx_buf, 0, sizeof(sx_rx_buf) );
+}
+
+
+void sysex_file_sink_open() {
+  if( sx_rx_file.open( sx_rx_path, (O_RDWR | O_CREAT | O_TRUNC) ) ) {
+    sx_sink = SX_SINK_SD_FILE;
+  }
+  else {
+    Serial.printf("### sysex: could not open %s for writing\n", sx_rx_path );
+    sx_sink = SX_SINK_NONE;
+    sysex_err_abort = true;
+  }
+}
+
+
+// header is all here, pick where the rest of the message goes
+
+bool sysex_is_z( uint8_t cmd ) {                      // version 1 sample or RAM store, not a request
+  return (cmd == (SX_VERSION_Z | CMD_SAMPLE_BANK)) || (cmd == (SX_VERSION_Z | CMD_RAM_BANK));
+}
+
+
+void sysex_sink_open() {
+
+  sx_sink = SX_SINK_BUF;                              // unless it's one of the big ones, keep it all in sx_rx_buf
+  sx_sink_max = SX_RX_BUF_SIZE - SYSEX_HEADER_SIZE;
+
+  sx_rx_z = sysex_is_z( sx_rx_buf[0] );
+
+  if( sx_rx_z ) {
+    Serial.printf("   compressed payload\n");
+    sx_rx_buf[0] &= ~SX_VERSION_MASK;                 // from here on it's handled like the v1.0 cmd
+    sxz_decode_init( &sx_rx_zdec );
+  }
+
+  switch( sx_rx_buf[0] ) {
+    case CMD_SAMPLE:
+    case CMD_SAMPLE_BANK:   sysex_sample_sink_open( sx_rx_buf );     break;
+
+    case CMD_RAM_BANK:      sysex_ram_sink_open( sx_rx_buf );       break;
+  }
+}
+
+
+void sysex_sink_write( uint8_t *d, int n ) {
+
+  switch( sx_sink ) {
+    case SX_SINK_STAGE:     memcpy( &sx_rx_stage[sx_sink_done], d, n );                   break;
+
+    case SX_SINK_SD_FILE:   if( sx_rx_file.write( d, n ) != (size_t)n ) {
+                              Serial.printf("### sysex: short write to %s, card full?\n", sx_rx_path );
+                              sysex_err_abort = true;
+                            }
+                            break;
+  }
+
+  if( sx_rx_buf[0] == CMD_RAM_BANK )
+    sx_rx_cs += checksum( d, n );
+
+  sx_sink_done += n;
+}
+
+
+// F7, or something went wrong. push out the last partial block, finish up with the sink, handle small messages.
+
+void sysex_rx_end() {
+  bool ok = !sysex_err_abort;
+
+  if( sx_sink == SX_SINK_NONE )                       // shorter than a header, treat it like a small message
+    sx_sink = ok ? SX_SINK_BUF : SX_SINK_NONE;
+
+  if( ok && sx_rx_z && !sxz_decode_done( &sx_rx_zdec ) ) {
+    Serial.printf("### sysex: compressed payload cut off mid-token\n");
+    ok = false;
   }
-  
-  // --- build & send the response
 
-  hdr->cmd = CMD_NAME_UTIL;                       // respond with REQUEST bit cleared
-                                                  // bank is still valid, name_type is still valid, name has been filled in
-  
-  // --- encode
+  if( ok && sx_rx_block_len ) {
+    sysex_sink_write( sx_rx_block, sx_rx_block_len );
+    sx_rx_block_len = 0;
+    ok = !sysex_err_abort;
+  }
 
-  /*
-      The MIDI library wraps our data with the needed F0 start and F7 end markers.
-      We jam our mfr ID at the start, unencoded and always with the hi bit clear.
+  if( ok )
+    Serial.printf("   Found Sysex end after %d bytes\n", sysex_decode_idx );
 
-      F0
-      mfr ID
-      ...encoded data, all hi bits clear...
-      F7
-  */
-    
-  sysex_encode_buf[0] = OUR_MIDI_MFR_ID;
-  
-  encoded_size = pack_sysex_data( sizeof(sx_name_util_hdr_t), (unsigned char*)hdr, &sysex_encode_buf[1] );      // len, in*, out*
+  switch( sx_sink ) {
+    case SX_SINK_BUF:       if( ok )
+                              sysex_dispatch( sx_rx_buf, sysex_decode_idx );
+                            break;
 
-  encoded_size += 1;                                // for the unencoded mfr ID in location 0
+    case SX_SINK_STAGE:
+    case SX_SINK_SD_FILE:   if( sx_rx_buf[0] == CMD_RAM_BANK )
+                              sysex_ram_sink_close( ok );
+                            else
+                              sysex_sample_sink_close( ok );
+                            break;
+  }
+
+  buf_release( BUF_OWNER_SYSEX_RX );                  // no-op unless it was SX_SINK_STAGE
+  sx_rx_stage = NULL;
+
+  if( !ok ) {
+    Serial.printf("### ERROR receiving sysex\n");                                 // notify the user, clean up, and give up :-)
+    beep_failure();
+  }
 
-  // --- transmit
+  sx_sink = SX_SINK_NONE;
+  sysex_err_abort = false;
 
-  send_sysex( encoded_size, sysex_encode_buf );
+  if( sx_rx_deferred_pgm >= 0 ) {                     // bank change that had to wait for us
+    byte pgm = sx_rx_deferred_pgm;
+
+    sx_rx_deferred_pgm = -1;
+    myProgramChange( 0, pgm );
+  }
 }
 
 
+bool sysex_rx_busy() {
+  return (sx_sink != SX_SINK_NONE) && (sx_sink != SX_SINK_BUF);
+}
 
-/* ---------------------------------------------------------------------------------------
-    SysEx utilities
-*/
 
-/*
-    Some USB MIDI receivers (cough, Windows, cough) have trouble reliably consuming a large sysex message.
+// true if pgm has to wait for the message being received, sysex_rx_end() does it then. Only the last one counts.
 
-    So we chunk the sysex message up into bite-sized SYSEX_CHUNK_BYTES-byte pieces.
+bool sysex_rx_defer_pgm( uint8_t pgm ) {
+  if( !sysex_rx_busy() )
+    return false;
 
-    We delay sysex_chunk_delay ms between each chunk.
-    MENU 89 can be used to adjust the delay.
-*/
+  Serial.printf("Program Change val = %d, after the SysEx\n", pgm);
+  sx_rx_deferred_pgm = pgm;
+  return true;
+}
 
-#define SYSEX_CHUNK_BYTES         256                             // sysex chunk payload size
 
-uint8_t se_chunk[SYSEX_CHUNK_BYTES+1];                            // make this one byte bigger for the start (0xf0) & end (0xf7) sysex bytes
+// The sender stopped in the middle of a message (cable pulled, app quit). Neither the DIN-5 framer nor usbMIDI
+//  will ever end it for us.
 
-void send_sysex( int len, uint8_t *b ) {
-  int se_chunks;
-  int se_remainder;
-  uint8_t *in_buf;
+void sysex_rx_check_timeout() {
+  if( (process_sysex_state < SYSEX_GET_B7S) || (sx_rx_since < SX_RX_TIMEOUT_MS) )
+    return;
 
-  Serial.printf("Sending %d bytes of SysEx ", len );
+  Serial.printf("### sysex: nothing for %d ms after %d bytes, giving up\n", (int)sx_rx_since, sysex_decode_idx );
 
-  if( get_midi_sysex_route() & ROUTE_USB ) {
-    Serial.printf("via USB...");
+  sysex_err_abort = true;
+  sysex_rx_end();                                     // drops what we collected, beeps
 
-    if( len <= SYSEX_CHUNK_BYTES ) {
-      usbMIDI.sendSysEx( len, b );                                // small messages we just send the easy way
-    }
-    else {
-      in_buf = b;
-        
-      se_chunks = len / SYSEX_CHUNK_BYTES;
-    
-      se_remainder = len - (se_chunks * SYSEX_CHUNK_BYTES);
-    
-      Serial.printf("Chunks: %d, Remainder: %d\n", se_chunks, se_remainder);
-  
-      // --- FIRST CHUNK, includes 0xf0 start byte
-      se_chunk[0] = 0xf0;                                           // sysex START
-      memcpy( &se_chunk[1], in_buf, SYSEX_CHUNK_BYTES );
-      usbMIDI.sendSysEx( SYSEX_CHUNK_BYTES+1, se_chunk, true );     // true -> tell midi lib to NOT add F0/F7
-      delay( sysex_chunk_delay );
-      Serial.printf("Sent chunk 1/%d\n", se_chunks);
-      in_buf += SYSEX_CHUNK_BYTES;
-  
-      // --- CHUNK LOOP
-      for( int xxx = 0; xxx != (se_chunks-1); xxx++ ) {             // already sent the first one
-        usbMIDI.sendSysEx( SYSEX_CHUNK_BYTES, in_buf, true );       // true -> tell midi lib to NOT add F0/F7
-        delay( sysex_chunk_delay );
-        Serial.printf("Sent chunk %d/%d\n", xxx+1, se_chunks);
-        in_buf += SYSEX_CHUNK_BYTES;
-      }
-  
-      // --- LAST CHUNK, ends with 0xf7 end byte, could be remainder bytes long, could be just the 0xf7 if no remainder
-      if( se_remainder )
-        memcpy( &se_chunk, in_buf, se_remainder );
-      se_chunk[se_remainder] = 0xf7;                                // sysex END
-      usbMIDI.sendSysEx( se_remainder+1, se_chunk, true );          // true -> tell midi lib to NOT add F0/F7
-      Serial.printf("Sent remainder chunk\n");
-    }
-  }
-  
-  if( get_midi_sysex_route() & ROUTE_DIN5 ) {
-    Serial.printf("via DIN-5...\n");
-    midiDIN.sendSysEx( len, b );
-  }
-  
-  Serial.printf("...done!\n\n");
+  process_sysex_state = SYSEX_INITIALIZE;             // the rest of it (if it ever shows up) is ignored until an F0
 }
 
 
-/* ---------------------------------------------------------------------------------------
-    SysEx DECODER
-*/
+// one decoded byte
 
-void init_sysex_decoder() {
-  process_sysex_state = SYSEX_FIND_F0;                // set up to hunt for F0 (start of sysex)
-}
+void sysex_store_byte( uint8_t b ) {
+  uint8_t zout[SXZ_MAX_RUN];
+  int n;
 
-/*
-    We are receiving a SysEx message containing sample data.
-    Get ready to write it to a voice board.
-*/
+  if( sysex_decode_idx < SYSEX_HEADER_SIZE ) {
+    sx_rx_buf[sysex_decode_idx++] = b;
 
-void sysex_store_prologue() {
-  
-  teensy_drives_z80_bus( true );                      // grab the bus
+    if( sysex_decode_idx == SYSEX_HEADER_SIZE )
+      sysex_sink_open();
+    return;
+  }
 
-  set_rst_hihat( 1 );                                 // XXX FIXME should not need to do this, getting stomped
+  if( !sx_rx_z ) {
+    sysex_store_payload( b );
+    return;
+  }
 
-  z80_bus_write( PATT_DISPLAY, voice_num_map[(last_drum & 0xf) - 4]);     // PATT didsplay shows voice we are loading into
+  n = sxz_decode_byte( &sx_rx_zdec, b, zout );        // compressed, 0 or more payload bytes come out
+
+  for( int xxx = 0; (xxx != n) && !sysex_err_abort; xxx++ )
+    sysex_store_payload( zout[xxx] );
 }
 
 
-void sysex_store_epilogue() {
+// one payload byte, header is done
 
-  set_rst_hihat( 0 );                                 // XXX FIXME should not need to do this, getting stomped
+void sysex_store_payload( uint8_t b ) {
 
-  if( reboot_after_sysex ) {
-    z80_reset( true );
-    teensy_drives_z80_bus( false );                   // we're done, let the z-80 go again
-    z80_reset( false );
+  if( (sysex_decode_idx - SYSEX_HEADER_SIZE) >= sx_sink_max ) {         // don't blow past what the sink can take
+    Serial.printf("### sysex: more than %d bytes for cmd %02x, forcing stop\n", sx_sink_max, sx_rx_buf[0] );
+    sysex_err_abort = true;
+    return;
+  }
 
-    delay( 250 );
-    
-    reboot_after_sysex = false;  
+  if( sx_sink == SX_SINK_BUF ) {
+    sx_rx_buf[sysex_decode_idx] = b;
   }
   else {
-    delay(100);
-    teensy_drives_z80_bus( false );                   // just release the bus
-    delay(100);
+    sx_rx_block[sx_rx_block_len++] = b;
+
+    if( sx_rx_block_len == SX_RX_BLOCK_SIZE ) {
+      sysex_sink_write( sx_rx_block, sx_rx_block_len );
+      sx_rx_block_len = 0;
+    }
   }
+
+  sysex_decode_idx++;
 }
 
 
+// one whole group from the word-at-a-time unpacker. straight into the block if it fits, otherwise a byte at a time.
+
+void sysex_store_group( uint8_t *g ) {
+
+  if( (sx_sink != SX_SINK_NONE) && (sx_sink != SX_SINK_BUF) && !sx_rx_z &&
+      ((sx_rx_block_len + 7) <= SX_RX_BLOCK_SIZE) &&
+      ((sysex_decode_idx - SYSEX_HEADER_SIZE + 7) <= sx_sink_max) ) {
+    memcpy( &sx_rx_block[sx_rx_block_len], g, 7 );
+    sx_rx_block_len += 7;
+    sysex_decode_idx += 7;
+    return;
+  }
+
+  for( int xxx = 0; (xxx != 7) && !sysex_err_abort; xxx++ )
+    sysex_store_byte( g[xxx] );
+}
+
 
 bool check_store_byte( uint8_t b ) {
   if( b == 0xf7 ) {
@@ -2221,18 +4511,10 @@ bool check_store_byte( uint8_t b ) {
   }
   else {
     b7s <<= 1;
-    sysex_decode_buf[sysex_decode_idx++] = (b | (b7s & 0x80));
+    sysex_store_byte( b | (b7s & 0x80) );
 
-    if( sysex_decode_idx >= DECODE_BUF_SIZE ) {         // don't blow past end of buf
-      Serial.print("### sysex_buf_size limit, forcing stop "); Serial.println( sysex_decode_idx );
-      
-      sysex_err_abort = true;                         // checked below, will bail on sysex operation
-      
-      return true;
-    }
+    return sysex_err_abort;                           // sink had a problem, stop here
   }
-
-  return false;
 }
 
 
@@ -2249,19 +4531,24 @@ bool process_sysex_byte( uint8_t b ) {
   bool r = false;
     
   switch( process_sysex_state ) {
-    case SYSEX_INITIALIZE:  sysex_decode_idx = 0;                               // ensure buffer index is reset
-                            sysex_err_abort = false;                            // not in error state
+    case SYSEX_INITIALIZE:  sysex_err_abort = false;                            // not in error state
                                                                                 // fall thru to the F0 hunter
     case SYSEX_FIND_F0:     if( b == 0xf0 )
                               process_sysex_state = SYSEX_FIND_MFR_ID;    break;
     
     case SYSEX_FIND_MFR_ID: if( b == OUR_MIDI_MFR_ID ) {
+                              sysex_rx_begin();                           // ours, get ready to decode
                               process_sysex_state = SYSEX_GET_B7S;
                             }    
                             else
                               process_sysex_state = SYSEX_FIND_F0;        break;
     
-    case SYSEX_GET_B7S:     b7s = b;                    
+    case SYSEX_GET_B7S:     if( b == 0xf7 ) {                             // payload was a multiple of 7, F7 lands here
+                              r = true;
+                              init_sysex_decoder();                       break;
+                            }
+
+                            b7s = b;                    
                             process_sysex_state = SYSEX_GET_BYTE_1;       break;
 
     case SYSEX_GET_BYTE_1:
@@ -2294,63 +4581,143 @@ bool process_sysex_byte( uint8_t b ) {
 // mySystemExclusiveChunk() called for variable-sized sysex chunks as received. We use a state machine to decode a stream of these
 //  variable-sized sysex chunks. "last" will be set to true for the final chunk.
 //
-//  ---> EXCEPT, "last" does not seem to be valid for DIN-5 sysex transfers, only USB.
+//  DIN-5 chunks come from din_rx_frame(), USB chunks from the usbMIDI library. Either way the F7 is what ends a message,
+//  "last" without an F7 means it got cut off.
 
 void mySystemExclusiveChunk(const byte *d, uint16_t len, bool last) {
+  int n = len;
+  uint8_t group[7];
 
   Serial.printf("-- Got Sysex chunk: %d bytes, last: %d, err: %d\n", len, last, sysex_err_abort );
 
+  sx_rx_since = 0;
+
   // --- PROCESS EACH BLOCK
+  //  whole 8 byte groups are unpacked in one go, the state machine handles F0, mfr ID, F7, and groups split across chunks
   
-  for( int xxx = 0; xxx != len; xxx++ ) {                                                         // walk thru all bytes received in this block
-    if( !sysex_err_abort                                                                          // if no errors detected
-        && process_sysex_byte( *d++ )                                                             // and we processed thru the last byte
-        && last ) {                                                                               // and teensy agrees that this is the last block
-          
-      sysex_decode_idx++;                                                                         // add 1 to make index = len
-    
-      Serial.printf("   Found Sysex end after %d bytes\n", sysex_decode_idx );
+  while( n ) {                                                                    // walk thru all bytes received in this block
+    if( (process_sysex_state == SYSEX_GET_B7S) && (n >= 8) && sysex_unpack_group( d, group ) ) {
+      sysex_store_group( group );
+      d += 8;
+      n -= 8;
+
+      if( sysex_err_abort ) {                                                     // sink gave up
+        init_sysex_decoder();
+        sysex_rx_end();
+      }
+      continue;
+    }
 
-      switch( sysex_decode_buf[0] ) {
+    if( process_sysex_byte( *d++ ) )                                              // F7, or the sink gave up
+      sysex_rx_end();                                                             // finish up, handle it, or play the error beep
+    n--;
+  }
 
-        // --- sysex DOWNLOAD types
-        
-        case CMD_SAMPLE:
-        case CMD_SAMPLE_BANK:                   sysex_sample_store( sysex_decode_buf, sysex_decode_idx );         break;
+  // --- LAST BLOCK BUT NO F7? IT GOT CUT OFF
 
-        case CMD_RAM_BANK:                      sysex_ram_store( sysex_decode_buf, sysex_decode_idx );            break;
+  if( last && (process_sysex_state >= SYSEX_GET_B7S) ) {
+    Serial.printf("### sysex: last chunk, but no F7\n");
+    sysex_err_abort = true;
+    sysex_rx_end();
+  }
 
-        case CMD_PARAM:                         sysex_param( sysex_decode_buf, sysex_decode_idx );                break;
+  // --- RESET STATE AFTER LAST BLOCK FOR NEXT TIME
+  
+  if( last ) {
+    process_sysex_state = SYSEX_INITIALIZE;                                       // done, either success or failure, but get ready for the next one
+    sysex_err_abort = false;
+  }
+}
 
-        case CMD_NAME_UTIL:                     sysex_name_util( sysex_decode_buf, sysex_decode_idx );            break;
 
-        // --- sysex UPLOAD REQUEST types
+/*
+    Requests that come in while an upload is going out can't be answered yet, and we don't wait for the port -- that
+    would hold up loop() for as long as the upload takes (~12 s for a sample over DIN-5). The request header is queued
+    and handle_sysex_requests() (from loop()) runs it once the port is free. Requests are all header, so that's all
+    we keep. If the queue is full the request is dropped, the host times out and asks again.
+*/
 
-        case (CMD_SAMPLE + CMD_REQUEST):        
-        case (CMD_SAMPLE_BANK + CMD_REQUEST):   sysex_sample_request( sysex_decode_buf, sysex_decode_idx );       break;
+#define SX_REQ_Q_LEN            4
 
-        case (CMD_RAM_BANK + CMD_REQUEST):      sysex_ram_request( sysex_decode_buf, sysex_decode_idx );          break;
+uint8_t sx_req_q[SX_REQ_Q_LEN][SYSEX_HEADER_SIZE];
+int sx_req_head = 0;
+int sx_req_count = 0;
 
-        case (CMD_PARAM + CMD_REQUEST):         sysex_param_request( sysex_decode_buf, sysex_decode_idx );        break;
 
-        case (CMD_NAME_UTIL + CMD_REQUEST):     sysex_name_util_request( sysex_decode_buf, sysex_decode_idx );    break;
-      }
-    }
+void sysex_request_defer( uint8_t *se ) {
+  if( sx_req_count == SX_REQ_Q_LEN ) {
+    Serial.printf("### SysEx: %d requests waiting already, dropping %02x\n", SX_REQ_Q_LEN, se[0] );
+    return;
   }
 
-  // --- IF LAST BLOCK AND THERE WAS AN ERROR AT SOME POINT, PLAY ERROR BEEP
+  memcpy( sx_req_q[(sx_req_head + sx_req_count) % SX_REQ_Q_LEN], se, SYSEX_HEADER_SIZE );
+  sx_req_count++;
 
-  if( sysex_err_abort && last ) {                                                 // sysex_err_abort will have stopped the processing
-    Serial.printf("### ERROR receiving sysex\n");                                 // notify the user, clean up, and give up :-)
-    beep_failure();
+  Serial.printf("SysEx request %02x, will answer when the upload is done\n", se[0] );
+}
+
+
+// one per call, its reply keeps the port busy until the next one can go
+
+void handle_sysex_requests() {
+  uint8_t se[SX_RX_BUF_SIZE];                         // some replies are built in place, bigger than the request
+
+  if( !sx_req_count || sysex_tx_busy() )
+    return;
+
+  memset( se, 0, sizeof(se) );
+  memcpy( se, sx_req_q[sx_req_head], SYSEX_HEADER_SIZE );
+
+  sx_req_head = (sx_req_head + 1) % SX_REQ_Q_LEN;
+  sx_req_count--;
+
+  sysex_dispatch( se, SYSEX_HEADER_SIZE );
+}
+
+
+// small messages, whole thing is in se
+
+void sysex_dispatch( uint8_t *se, int len ) {
+
+  if( (se[0] & CMD_REQUEST) && sysex_tx_busy() ) {            // reply would have to wait for the port
+    sysex_request_defer( se );
+    return;
   }
 
-  // --- RESET STATE AFTER LAST BLOCK FOR NEXT TIME
-  
-  if( last ) {
-    process_sysex_state = SYSEX_INITIALIZE;                                       // done, either success or failure, but get ready for the next one
-    sysex_err_abort = false;
+  if( (se[0] == (SX_VERSION_Z | CMD_SAMPLE_BANK | CMD_REQUEST)) ||             // version 1 request, reply compressed
+      (se[0] == (SX_VERSION_Z | CMD_RAM_BANK | CMD_REQUEST)) ||
+      (se[0] == (SX_VERSION_Z | CMD_ESCAPE | CMD_REQUEST)) ) {
+    se[0] &= ~SX_VERSION_MASK;
+    sx_tx_z = true;
+  }
+
+  switch( se[0] ) {
+
+    // --- sysex DOWNLOAD types (samples and RAM go to a sink, see sysex_sink_open())
+    
+    case CMD_NOTE_MAP:                      sysex_note_map_store( se, len );          break;
+
+    case CMD_PARAM:                         sysex_param( se, len );                   break;
+
+    case CMD_NAME_UTIL:                     sysex_name_util( se, len );               break;
+
+    // --- sysex UPLOAD REQUEST types
+
+    case (CMD_SAMPLE + CMD_REQUEST):        
+    case (CMD_SAMPLE_BANK + CMD_REQUEST):   sysex_sample_request( se, len );          break;
+
+    case (CMD_RAM_BANK + CMD_REQUEST):      sysex_ram_request( se, len );             break;
+
+    case (CMD_NOTE_MAP + CMD_REQUEST):      sysex_note_map_request( se, len );        break;
+
+    case (CMD_PARAM + CMD_REQUEST):         sysex_param_request( se, len );           break;
+
+    case (CMD_NAME_UTIL + CMD_REQUEST):     sysex_name_util_request( se, len );       break;
+
+    case (CMD_ESCAPE + CMD_REQUEST):        sysex_escape_request( se, len );          break;
   }
+
+  sx_tx_z = false;
 }
 
 
@@ -2358,45 +4725,240 @@ void mySystemExclusiveChunk(const byte *d, uint16_t len, bool last) {
     SysEx ENCODER (for uploads)
 */
 
+/*
+    Each group of 7 bytes goes out as a byte holding their hi bits (1st byte's in bit 6 ... 7th byte's in bit 0),
+    then the 7 bytes with their hi bits cleared.
+
+    Whole groups are done a word at a time. The 7 bytes are loaded into a uint64_t and one multiply by SYSEX_B7_GATHER
+    collects their hi bits into the top byte, in the right order. Every partial product lands on its own bit, so
+    nothing carries into the bits we keep. Unpacking multiplies the hi bits byte by the same constant to spread the
+    bits back out to bit 7 of each byte.
+
+    A short last group keeps the wire format we've always had: its hi bits are right-aligned (1st byte in bit k-1 for a
+    k byte group), and the decoder reads them from bit 6 down like any other group. Don't "fix" one without the other.
+
+    'e' debug command checks both against the original byte-at-a-time code and times them.
+*/
+
+#define SYSEX_B7_GATHER         0x0080402010080402ULL                   // bit 9i+1 for i = 0..6
+#define SYSEX_HI_BITS_7         0x0080808080808080ULL                   // bit 7 of bytes 0..6
+#define SYSEX_LO_BITS_7         0x007f7f7f7f7f7f7fULL
+#define SYSEX_HI_BITS_8         0x8080808080808080ULL
+
+
+void sysex_pack_group( const uint8_t *in, uint8_t *out ) {              // 7 bytes in, 8 out
+  uint64_t v = 0;
+  uint64_t w;
+
+  memcpy( &v, in, 7 );
+
+  w  = ((v & SYSEX_HI_BITS_7) * SYSEX_B7_GATHER) >> 56;                 // hi bits byte
+  w |= (v & SYSEX_LO_BITS_7) << 8;                                      // then the data
+
+  memcpy( out, &w, 8 );
+}
+
+
+bool sysex_unpack_group( const uint8_t *in, uint8_t *out ) {            // 8 bytes in, 7 out
+  uint64_t v;
+  uint64_t w;
+
+  memcpy( &v, in, 8 );
+
+  if( v & SYSEX_HI_BITS_8 )                                             // F7 or some other status byte in here, not a whole group
+    return false;
+
+  w = (v >> 8) | (((v & 0xff) * SYSEX_B7_GATHER) & SYSEX_HI_BITS_7);
+
+  memcpy( out, &w, 7 );
+  return true;
+}
+
+
 int pack_sysex_data( int len, uint8_t *in, uint8_t *out ) {
+  int in_idx = 0;
+  int out_idx = 0;
+  uint8_t b7s = 0;
+  int k;
+
+  for( ; (len - in_idx) >= 7; in_idx += 7, out_idx += 8 )               // whole groups
+    sysex_pack_group( &in[in_idx], &out[out_idx] );
+
+  k = len - in_idx;
+
+  if( k ) {                                                             // short last group, hi bits right-aligned
+    for( int yyy = 0; yyy != k; yyy++ ) {
+      b7s = (b7s << 1) | (in[in_idx + yyy] >> 7);
+      out[out_idx + 1 + yyy] = in[in_idx + yyy] & 0x7f;
+    }
+
+    out[out_idx] = b7s;
+    out_idx += k + 1;
+  }
+
+  return out_idx;
+}
+
+
+/*
+    Pack / unpack self test
+
+    The original byte-at-a-time packer, and a byte-at-a-time unpacker that does what process_sysex_byte() does.
+    Random data, every length up to SX_PACK_TEST_MAX, must come out byte-for-byte the same both ways. Then time both.
+*/
+
+#define SX_PACK_TEST_MAX        512
+#define SX_PACK_TEST_REPS       64
+
+int pack_sysex_data_ref( int len, uint8_t *in, uint8_t *out ) {
   int in_idx = 0;
   int out_idx = 0;
   uint8_t b7s;
   uint8_t w;
   int yyy;
-  
+
   do {
       b7s = 0;
-      
-      for( yyy = 1; yyy != 8; yyy++ ) {             // process 7 bytes of input at a time,
-                                                    //  generate 8 bytes of output
-        b7s <<= 1;                                  // 0 in low bit
-        
+
+      for( yyy = 1; yyy != 8; yyy++ ) {
+        b7s <<= 1;
+
         w = in[in_idx++];
-        
-        // printf("i %d %02x\n", yyy, w );
-        
-        if( w & 0x80 ) b7s |= 1;                    // if 1 in b7, set corresponding bit in b7s
-        
-        w &= 0x7f;
-        
-        // printf("o %d    %02x\n", yyy, w );
-        
-        out[out_idx+yyy] = w;
-        
+
+        if( w & 0x80 ) b7s |= 1;
+
+        out[out_idx+yyy] = w & 0x7f;
+
         if( in_idx >= len )
                 break;
       }
-      
-      // printf("-         %02x\n", b7s );
-      
+
       out[out_idx] = b7s;
-      
+
       out_idx += yyy;
 
   } while( in_idx < len );
-  
-  Serial.printf("== pack_sysex_data: len = %d in = %d / out = %d\n", len, in_idx, out_idx);
-  
+
   return out_idx+1;
 }
+
+
+int unpack_sysex_data_ref( int len, uint8_t *in, uint8_t *out ) {
+  int out_idx = 0;
+  uint8_t hi = 0;
+
+  for( int xxx = 0; xxx != len; xxx++ ) {
+    if( (xxx % 8) == 0 ) {
+      hi = in[xxx];
+    }
+    else {
+      hi <<= 1;
+      out[out_idx++] = in[xxx] | (hi & 0x80);
+    }
+  }
+
+  return out_idx;
+}
+
+
+int unpack_sysex_data( int len, uint8_t *in, uint8_t *out ) {
+  int in_idx = 0;
+  int out_idx = 0;
+
+  for( ; ((len - in_idx) >= 8) && sysex_unpack_group( &in[in_idx], &out[out_idx] ); in_idx += 8, out_idx += 7 )
+    ;
+
+  return out_idx + unpack_sysex_data_ref( len - in_idx, &in[in_idx], &out[out_idx] );      // short last group
+}
+
+
+void run_sysex_pack_test() {
+  uint8_t raw[SX_PACK_TEST_MAX];
+  uint8_t enc_ref[((SX_PACK_TEST_MAX + 6) / 7) * 8];
+  uint8_t enc[((SX_PACK_TEST_MAX + 6) / 7) * 8];
+  uint8_t dec_ref[SX_PACK_TEST_MAX];
+  uint8_t dec[SX_PACK_TEST_MAX];
+  int n_ref, n;
+  int fails = 0;
+  uint32_t start;
+  uint32_t cyc_pack_ref = 0, cyc_pack = 0, cyc_unpack_ref = 0, cyc_unpack = 0;
+  sxz_decoder_t z;
+  uint8_t zout[SXZ_MAX_RUN];
+  int zlen = 0;
+  int zfails = 0;
+  int k;
+
+  Serial.printf("\n--- SysEx pack/unpack round trip, lengths 1-%d\n", SX_PACK_TEST_MAX );
+
+  for( int len = 1; len <= SX_PACK_TEST_MAX; len++ ) {
+    for( int xxx = 0; xxx != len; xxx++ )
+      raw[xxx] = random( 256 );
+
+    n_ref = pack_sysex_data_ref( len, raw, enc_ref );
+    n     = pack_sysex_data( len, raw, enc );
+
+    if( (n != n_ref) || memcmp( enc, enc_ref, n ) ) {
+      if( fails++ < 8 )
+        Serial.printf("### pack mismatch, len %d: %d bytes vs %d\n", len, n, n_ref );
+      continue;
+    }
+
+    n_ref = unpack_sysex_data_ref( n, enc, dec_ref );
+    n     = unpack_sysex_data( n, enc, dec );
+
+    if( (n != n_ref) || memcmp( dec, dec_ref, n ) ) {
+      if( fails++ < 8 )
+        Serial.printf("### unpack mismatch, len %d: %d bytes vs %d\n", len, n, n_ref );
+      continue;
+    }
+
+    if( ((len % 7) == 0) && ((n != len) || memcmp( dec, raw, len )) ) {          // whole groups survive the trip exactly
+      if( fails++ < 8 )
+        Serial.printf("### round trip mismatch, len %d\n", len );
+    }
+  }
+
+  Serial.printf("    %s, %d failures\n", fails ? "FAILED" : "OK", fails );
+
+  // --- compression round trip, factory pattern RAM in SX_PACK_TEST_MAX byte pieces
+
+  for( int off = 0; off != sizeof(factory_ram); off += SX_PACK_TEST_MAX ) {
+    memcpy( raw, &factory_ram[off], SX_PACK_TEST_MAX );
+
+    n = sxz_compress( raw, SX_PACK_TEST_MAX, enc );
+    zlen += n;
+
+    sxz_decode_init( &z );
+    n_ref = 0;
+
+    for( int xxx = 0; xxx != n; xxx++ ) {
+      k = sxz_decode_byte( &z, enc[xxx], zout );
+
+      if( (n_ref + k > SX_PACK_TEST_MAX) || memcmp( zout, &raw[n_ref], k ) )
+        break;
+      n_ref += k;
+    }
+
+    if( (n_ref != SX_PACK_TEST_MAX) || !sxz_decode_done( &z ) )
+      zfails++;
+  }
+
+  Serial.printf("    compressed factory RAM: %d -> %d bytes, %s\n", sizeof(factory_ram), zlen, zfails ? "FAILED" : "OK" );
+
+  // --- timing, full size buffer
+
+  for( int xxx = 0; xxx != SX_PACK_TEST_REPS; xxx++ ) {
+    start = ARM_DWT_CYCCNT;   n = pack_sysex_data_ref( SX_PACK_TEST_MAX, raw, enc_ref );    cyc_pack_ref += ARM_DWT_CYCCNT - start;
+    start = ARM_DWT_CYCCNT;   n = pack_sysex_data( SX_PACK_TEST_MAX, raw, enc );            cyc_pack += ARM_DWT_CYCCNT - start;
+    start = ARM_DWT_CYCCNT;   unpack_sysex_data_ref( n, enc, dec_ref );                     cyc_unpack_ref += ARM_DWT_CYCCNT - start;
+    start = ARM_DWT_CYCCNT;   unpack_sysex_data( n, enc, dec );                             cyc_unpack += ARM_DWT_CYCCNT - start;
+  }
+
+  cyc_pack       = cyc_pack       * 100 / SX_PACK_TEST_REPS / SX_PACK_TEST_MAX;       // hundredths of a cycle per byte
+  cyc_pack_ref   = cyc_pack_ref   * 100 / SX_PACK_TEST_REPS / SX_PACK_TEST_MAX;
+  cyc_unpack     = cyc_unpack     * 100 / SX_PACK_TEST_REPS / SX_PACK_TEST_MAX;
+  cyc_unpack_ref = cyc_unpack_ref * 100 / SX_PACK_TEST_REPS / SX_PACK_TEST_MAX;
+
+  Serial.printf("    pack:   %d.%02d cycles/byte (was %d.%02d)\n",   cyc_pack / 100,   cyc_pack % 100,   cyc_pack_ref / 100,   cyc_pack_ref % 100 );
+  Serial.printf("    unpack: %d.%02d cycles/byte (was %d.%02d)\n\n", cyc_unpack / 100, cyc_unpack % 100, cyc_unpack_ref / 100, cyc_unpack_ref % 100 );
+}
@@ -0,0 +1,169 @@
+/* ---------------------------------------------------------------------------------------
+    MIDI NOTE MAP
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LM_NoteMap_H_
+#define LM_NoteMap_H_
+
+#include "LM_MIDI.h"                        // MIDI_NOTE_xx, MIDI_VEL_xx
+
+/*
+    MIDI note -> drum mapping
+
+    Incoming notes are looked up in a 128 entry table, one entry per MIDI note. Each entry says which drum (index into
+    the drums[] table in LM_MIDI) that note plays, and whether it plays with the note's velocity or a fixed one
+    (that's how the soft trigger range works).
+
+    Profiles 0 and 1 are built in, and built at compile time. Profiles 2-9 are user profiles, stored on the SD card as
+    the same 256 byte table, and can be sent over with SysEx (CMD_NOTE_MAP). The active profile is picked with the
+    SX_PARAM_NOTE_MAP parameter and saved in EEPROM.
+
+    Notes sent OUT (drum triggers from the Z-80 sequencer) use the lowest note in the active profile that plays each drum.
+*/
+
+// drum indices, these are the entries in drums[]
+
+#define drum_BASS           0
+#define drum_SNARE          1
+#define drum_HIHAT          2
+#define drum_HIHAT_OPEN     3
+#define drum_CLAPS          4
+#define drum_CABASA         5
+#define drum_TAMB           6
+#define drum_TOM_UP         7
+#define drum_TOM_DN         8
+#define drum_CONGA_UP       9
+#define drum_CONGA_DN       10
+#define drum_COWBELL        11
+#define drum_CLAVE          12
+
+#define NUM_DRUMS           13
+
+#define NOTE_MAP_NOTES              128
+#define NOTE_MAP_NONE               0xff            // this note doesn't play anything
+
+typedef struct {
+  uint8_t drum;                                     // drum_xx, or NOTE_MAP_NONE
+  uint8_t vel;                                      // 0 = use the note's velocity, otherwise always play with this one
+} note_map_entry_t;
+
+typedef struct {
+  note_map_entry_t e[NOTE_MAP_NOTES];
+} note_map_t;
+
+#define NOTE_MAP_FILE_SIZE          sizeof(note_map_t)    // 256 bytes, same layout on SD and over SysEx
+
+// profiles
+
+#define NOTE_MAP_KENTON             0               // original Luma-1 layout, C1 - C2, soft triggers an octave+ lower
+#define NOTE_MAP_GM                 1               // General MIDI drum map
+#define NOTE_MAP_FIRST_USER         2               // 2 - 9 are loaded from SD
+#define NOTE_MAP_LAST_USER          9
+
+#define NOTE_MAP_DIR                "/NOTEMAPS"     // user profiles are /NOTEMAPS/nn.MAP
+
+
+void init_note_map();                               // select the profile saved in EEPROM, falls back to NOTE_MAP_KENTON
+
+bool select_note_map( uint8_t profile );            // make profile active, false (and nothing changes) if it can't be loaded
+uint8_t get_note_map();                             // active profile #
+
+const note_map_entry_t *note_map_lookup( uint8_t note );    // entry for a MIDI note, in the active profile
+uint8_t note_map_out_note( uint8_t drum, bool soft );       // note to send for a drum, NOTE_MAP_NONE if the profile doesn't have one
+
+bool get_note_map_data( uint8_t profile, note_map_t *m );   // copy of a profile's table, false if it can't be loaded
+bool store_note_map( uint8_t profile, note_map_t *m );      // save a user profile to SD, reloads it if it is active
+
+
+// --- Built-in profiles, built by the compiler
+
+constexpr void nm_set( note_map_t &m, int note, uint8_t drum, uint8_t vel ) {
+  m.e[note].drum = drum;
+  m.e[note].vel  = vel;
+}
+
+constexpr note_map_t note_map_build_empty() {
+  note_map_t m = {};
+
+  for( int n = 0; n != NOTE_MAP_NOTES; n++ )
+    nm_set( m, n, NOTE_MAP_NONE, 0 );
+
+  return m;
+}
+
+constexpr note_map_t note_map_build_kenton() {
+  note_map_t m = note_map_build_empty();
+
+  nm_set( m, MIDI_NOTE_BASS,        drum_BASS,        0 );
+  nm_set( m, MIDI_NOTE_SNARE,       drum_SNARE,       0 );
+  nm_set( m, MIDI_NOTE_HIHAT,       drum_HIHAT,       0 );
+  nm_set( m, MIDI_NOTE_HIHAT_OPEN,  drum_HIHAT_OPEN,  0 );
+  nm_set( m, MIDI_NOTE_CLAPS,       drum_CLAPS,       0 );
+  nm_set( m, MIDI_NOTE_CABASA,      drum_CABASA,      0 );
+  nm_set( m, MIDI_NOTE_TAMB,        drum_TAMB,        0 );
+  nm_set( m, MIDI_NOTE_TOM_UP,      drum_TOM_UP,      0 );
+  nm_set( m, MIDI_NOTE_TOM_DN,      drum_TOM_DN,      0 );
+  nm_set( m, MIDI_NOTE_CONGA_UP,    drum_CONGA_UP,    0 );
+  nm_set( m, MIDI_NOTE_CONGA_DN,    drum_CONGA_DN,    0 );
+  nm_set( m, MIDI_NOTE_COWBELL,     drum_COWBELL,     0 );
+  nm_set( m, MIDI_NOTE_CLAVE,       drum_CLAVE,       0 );
+
+  for( int n = MIDI_NOTE_BASS; n <= MIDI_NOTE_CLAVE; n++ )                  // for controllers without velocity
+    nm_set( m, n - MIDI_NOTE_SOFT_TRIG_OFFSET, m.e[n].drum, MIDI_VEL_SOFT );
+
+  return m;
+}
+
+constexpr note_map_t note_map_build_gm() {
+  note_map_t m = note_map_build_empty();
+
+  nm_set( m, 35, drum_BASS,       0 );              // Acoustic Bass Drum
+  nm_set( m, 36, drum_BASS,       0 );              // Bass Drum 1
+  nm_set( m, 37, drum_CLAVE,      0 );              // Side Stick
+  nm_set( m, 38, drum_SNARE,      0 );              // Acoustic Snare
+  nm_set( m, 39, drum_CLAPS,      0 );              // Hand Clap
+  nm_set( m, 40, drum_SNARE,      0 );              // Electric Snare
+  nm_set( m, 41, drum_TOM_DN,     0 );              // Low Floor Tom
+  nm_set( m, 42, drum_HIHAT,      0 );              // Closed Hi-Hat
+  nm_set( m, 43, drum_TOM_DN,     0 );              // High Floor Tom
+  nm_set( m, 44, drum_HIHAT,      0 );              // Pedal Hi-Hat
+  nm_set( m, 45, drum_TOM_DN,     0 );              // Low Tom
+  nm_set( m, 46, drum_HIHAT_OPEN, 0 );              // Open Hi-Hat
+  nm_set( m, 47, drum_TOM_UP,     0 );              // Low-Mid Tom
+  nm_set( m, 48, drum_TOM_UP,     0 );              // Hi-Mid Tom
+  nm_set( m, 50, drum_TOM_UP,     0 );              // High Tom
+  nm_set( m, 54, drum_TAMB,       0 );              // Tambourine
+  nm_set( m, 56, drum_COWBELL,    0 );              // Cowbell
+  nm_set( m, 62, drum_CONGA_UP,   0 );              // Mute Hi Conga
+  nm_set( m, 63, drum_CONGA_UP,   0 );              // Open Hi Conga
+  nm_set( m, 64, drum_CONGA_DN,   0 );              // Low Conga
+  nm_set( m, 69, drum_CABASA,     0 );              // Cabasa
+  nm_set( m, 70, drum_CABASA,     0 );              // Maracas
+  nm_set( m, 75, drum_CLAVE,      0 );              // Claves
+
+  return m;
+}
+
+
+#endif
@@ -0,0 +1,191 @@
+/* ---------------------------------------------------------------------------------------
+    MIDI NOTE MAP
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LM_NoteMap.h"
+#include "LM_SDCard.h"
+#include "LM_EEPROM.h"
+
+const note_map_t note_map_kenton PROGMEM = note_map_build_kenton();
+const note_map_t note_map_gm     PROGMEM = note_map_build_gm();
+
+static_assert( note_map_build_kenton().e[MIDI_NOTE_CLAVE - MIDI_NOTE_SOFT_TRIG_OFFSET].drum == drum_CLAVE, "note map builders must run at compile time" );
+static_assert( NOTE_MAP_FILE_SIZE == 256, "note map file / SysEx table is 128 x 2 bytes" );
+
+note_map_t note_map;                                    // active profile, this is what note ons are looked up in
+uint8_t note_map_profile = NOTE_MAP_KENTON;
+
+uint8_t note_map_out[NUM_DRUMS];                        // note to send for each drum, from the active profile
+uint8_t note_map_out_soft[NUM_DRUMS];                   // same, fixed soft velocity entries, used when not sending velocity
+
+
+// a table from SD or SysEx could be anything, make sure it only points at real drums
+
+bool note_map_valid( note_map_t *m ) {
+  for( int n = 0; n != NOTE_MAP_NOTES; n++ ) {
+    if( (m->e[n].drum != NOTE_MAP_NONE) && (m->e[n].drum >= NUM_DRUMS) )
+      return false;
+
+    if( m->e[n].vel > 127 )
+      return false;
+  }
+
+  return true;
+}
+
+
+void note_map_path( uint8_t profile, char *path ) {
+  snprintf( path, MAX_LEN_PATH_NAME, "%s/%02d.MAP", NOTE_MAP_DIR, profile );
+}
+
+
+bool get_note_map_data( uint8_t profile, note_map_t *m ) {
+  char path[MAX_LEN_PATH_NAME];
+  File f;
+  int len;
+
+  switch( profile ) {
+    case NOTE_MAP_KENTON:   memcpy( m, &note_map_kenton, sizeof(note_map_t) );    return true;
+    case NOTE_MAP_GM:       memcpy( m, &note_map_gm,     sizeof(note_map_t) );    return true;
+  }
+
+  if( profile > NOTE_MAP_LAST_USER ) {
+    Serial.printf("### Note map %d: no such profile\n", profile);
+    return false;
+  }
+
+  note_map_path( profile, path );
+
+  f = SD.open( path );
+
+  if( !f ) {
+    Serial.printf("### Note map %d: can't open %s\n", profile, path);
+    return false;
+  }
+
+  len = f.read( (uint8_t*)m, sizeof(note_map_t) );
+  f.close();
+
+  if( (len != sizeof(note_map_t)) || !note_map_valid( m ) ) {
+    Serial.printf("### Note map %d: %s is bad (%d bytes)\n", profile, path, len);
+    return false;
+  }
+
+  return true;
+}
+
+
+// lowest note that plays each drum is the one we send
+
+void note_map_build_out() {
+  memset( note_map_out,      NOTE_MAP_NONE, sizeof(note_map_out) );
+  memset( note_map_out_soft, NOTE_MAP_NONE, sizeof(note_map_out_soft) );
+
+  for( int n = 0; n != NOTE_MAP_NOTES; n++ ) {
+    note_map_entry_t *e = &note_map.e[n];
+
+    if( e->drum == NOTE_MAP_NONE )
+      continue;
+
+    if( e->vel == 0 ) {
+      if( note_map_out[e->drum] == NOTE_MAP_NONE )
+        note_map_out[e->drum] = n;
+    }
+    else if( e->vel < MIDI_VEL_LOUD ) {
+      if( note_map_out_soft[e->drum] == NOTE_MAP_NONE )
+        note_map_out_soft[e->drum] = n;
+    }
+  }
+}
+
+
+bool select_note_map( uint8_t profile ) {
+  note_map_t m;
+
+  if( !get_note_map_data( profile, &m ) )
+    return false;
+
+  memcpy( &note_map, &m, sizeof(note_map_t) );
+  note_map_profile = profile;
+
+  note_map_build_out();
+
+  Serial.printf("Note map %d selected\n", profile);
+  return true;
+}
+
+
+uint8_t get_note_map() {
+  return note_map_profile;
+}
+
+
+const note_map_entry_t *note_map_lookup( uint8_t note ) {
+  return &note_map.e[note & 0x7f];
+}
+
+
+uint8_t note_map_out_note( uint8_t drum, bool soft ) {
+  if( drum >= NUM_DRUMS )
+    return NOTE_MAP_NONE;
+
+  return soft ? note_map_out_soft[drum] : note_map_out[drum];
+}
+
+
+bool store_note_map( uint8_t profile, note_map_t *m ) {
+  char path[MAX_LEN_PATH_NAME];
+
+  if( (profile < NOTE_MAP_FIRST_USER) || (profile > NOTE_MAP_LAST_USER) ) {
+    Serial.printf("### Note map %d: only profiles %d-%d can be stored\n", profile, NOTE_MAP_FIRST_USER, NOTE_MAP_LAST_USER);
+    return false;
+  }
+
+  if( !note_map_valid( m ) ) {
+    Serial.printf("### Note map %d: bad table, not stored\n", profile);
+    return false;
+  }
+
+  make_dir( (char*)NOTE_MAP_DIR );
+
+  note_map_path( profile, path );
+
+  if( !replace_file( path, (uint8_t*)m, sizeof(note_map_t) ) ) {
+    Serial.printf("### Note map %d: couldn't write %s\n", profile, path);
+    return false;
+  }
+
+  if( profile == note_map_profile )                     // changed the one we're using, pick up the changes
+    select_note_map( profile );
+
+  return true;
+}
+
+
+void init_note_map() {
+  uint8_t profile = eeprom_load_midi_note_map();
+
+  if( !select_note_map( profile ) )
+    select_note_map( NOTE_MAP_KENTON );                 // always works
+}
@@ -25,11 +25,14 @@
 #include "LM_OLED_Images.h"
 
 #include "LM_LUI.h"
+#include "LM_Timers.h"
 
 
 bool display_found = false;
 
-elapsedMillis show_bootscreen_time;
+void bootscreen_done( int arg );
+
+lm_timer_t bootscreen_timer = TIMER_INIT( bootscreen_done, 0 );     // takes the bootscreen down after BOOTSCREEN_DWELL_MS
 
 elapsedMillis oled_frame_time;              // just redraw every 16ms
 
@@ -105,44 +108,12 @@ void display_oled_bootscreen() {
 //  display.display();                          // --> don't use stock one
 
   bootscreen_showing = true;
-  show_bootscreen_time = 0;       // start bootscreen dwell timer
+  timer_start( &bootscreen_timer, BOOTSCREEN_DWELL_MS );    // start bootscreen dwell timer
 }
 
 
-// total hack to convert 8bpp PISKEL sprites into 1bpp bitmaps that the graphics library can use
-
-uint8_t ram_bm[16][2];
-
-uint8_t *cvt_bm( uint32_t *bm ) {
-  uint32_t h;
-  uint8_t o;
-  
-  for( int yyy = 0; yyy != 16; yyy++ ) {
-    
-    o = 0;
-    
-    for( int xxx = 0; xxx != 8; xxx++ ) {
-      h = *bm++;
-      if( h == 0xff000000 )
-        o |= 1;
-      if( xxx < 7 ) o <<= 1;
-    }
-
-    ram_bm[yyy][0] = o;
-
-    o = 0;
-    
-    for( int xxx = 0; xxx != 8; xxx++ ) {
-      h = *bm++;
-      if( h == 0xff000000 )
-        o |= 1;
-      if( xxx < 7 ) o <<= 1;
-    }
-
-    ram_bm[yyy][1] = o;
-  }
-
-  return (uint8_t *)ram_bm;
+void bootscreen_done( int arg ) {
+  bootscreen_showing = false;
 }
 
 
@@ -190,7 +161,7 @@ void draw_sys_display() {
   display.drawLine( 0, 10, 128, 10, SH110X_WHITE );
 
 
- // display.drawBitmap(64, 48, cvt_bm(&clock_icons[0][0]), 16, 16, SH110X_WHITE);
+ // display.drawBitmap(64, 48, clock_icons[0], 16, 16, SH110X_WHITE);
 
   // -- if not in local UI mode, draw other status
   
@@ -220,7 +191,7 @@ void draw_sys_display() {
 
 
 /*
-  If we are showing the bootscreen, leave it up until the dwell time has passed OR the user hit a key.
+  If we are showing the bootscreen, leave it up until the dwell time has passed (bootscreen_timer) OR the user hit a key.
 
   If we are running normally, repaint the OLED every 16ms (60Hz).
 */
@@ -228,11 +199,7 @@ void draw_sys_display() {
 void handle_oled_display() {
 
   if( display_found == true ) {
-    if( bootscreen_showing ) {
-      if( show_bootscreen_time >= BOOTSCREEN_DWELL_MS )
-        bootscreen_showing = false;
-    }
-    else {
+    if( !bootscreen_showing ) {
       if( oled_frame_time > MS_PER_OLED_FRAME ) {
         oled_frame_time = 0;
         oled_frame_cnt++;
@@ -259,7 +226,7 @@ void handle_oled_display() {
   Luma-1 has its own display routine which:
   
     - sends the offscreen framebuffer to the OLED more quickly
-    - calls loop_time_critical() 8 times while painting the display to ensure that time-critical operations like MIDI are not delayed
+    - calls time_critical_yield() while painting the display to ensure that time-critical operations like MIDI are not delayed
 
   NOTE:
         The Adafruit library is very general-purpose, supporting multiple display controllers and resolutions.
@@ -301,21 +268,21 @@ void luma_oled_display(void) {
         (uint8_t)( 0x00 + (SH1106G_COL_FUDGE & 0xF))    // set lo bybble of col
         };
 
-      loop_time_critical();                             // i2c writes can take a long time
+      time_critical_yield();                            // i2c writes can take a long time
 
     // Send the cmd to set the page
     
     Wire1.beginTransmission( DISP_I2C_ADDR );    
 
-      loop_time_critical();                             // i2c writes can take a long time
+      time_critical_yield();                            // i2c writes can take a long time
 
     Wire1.write( cmd, 4 );
 
-      loop_time_critical();                             // i2c writes can take a long time
+      time_critical_yield();                            // i2c writes can take a long time
 
     Wire1.endTransmission();
 
-      loop_time_critical();                             // i2c writes can take a long time
+      time_critical_yield();                            // i2c writes can take a long time
 
     // Send a page worth of data
 
@@ -329,49 +296,49 @@ void luma_oled_display(void) {
     for( int xxx = 0; xxx != (128/16); xxx++ ) {
       Wire1.beginTransmission( DISP_I2C_ADDR );    
 
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
 
       Wire1.write( 0x40 );                              // D/C = 1 -> sending DATA (not command)
 
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
 
       Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
       Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
       Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
        Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
       Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
       Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
       Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
        Wire1.write( ptr, 2 );
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
       ptr += 2;
 
       Wire1.endTransmission();
 
       //ptr += 16;
   
-        loop_time_critical();                           // i2c writes can take a long time
+        time_critical_yield();                          // i2c writes can take a long time
    }
     
   }
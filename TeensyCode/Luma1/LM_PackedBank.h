@@ -0,0 +1,78 @@
+/* ---------------------------------------------------------------------------------------
+    PACKED VOICE BANKS
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LM_PackedBank_H_
+#define LM_PackedBank_H_
+
+#include "LM_SDCard.h"                      // MAX_LEN_FILE_NAME
+#include "LM_Voices.h"                      // MAX_BANKNAME_CHARS
+
+/*
+    A packed bank is a single file holding all 10 voices of a bank, plus its name:
+
+      /DRMBANKS/bb/BANK.LMB
+
+    Sector 0 is a fixed header with a voice table. Sample data for each voice starts on a sector boundary,
+    so loading a voice is one seek and one big contiguous read. The directory layout is still the master
+    copy, anything that writes to it deletes the packed file.
+*/
+
+#define PBANK_MAGIC                 "LMBK"
+#define PBANK_VERSION               1
+#define PBANK_NUM_VOICES            10
+#define PBANK_SECTOR_SIZE           512
+#define PBANK_FN                    "BANK.LMB"
+
+typedef struct {
+  char      name[MAX_LEN_FILE_NAME];                    // original voice file name
+  uint32_t  offset;                                     // byte offset of sample data in file, sector aligned
+  uint32_t  len;                                        // # of sample bytes, 0 = no voice
+  uint8_t   hw_len;                                     // SAMPLE_LEN_xx
+  uint8_t   pad[3];
+  uint32_t  hash;                                       // hash32() of the sample data
+} pbank_voice_t;                                        // 40 bytes
+
+typedef struct {
+  char          magic[4];                               // PBANK_MAGIC, not terminated
+  uint8_t       version;
+  uint8_t       num_voices;
+  uint8_t       pad0[2];
+  char          bank_name[MAX_BANKNAME_CHARS];
+  pbank_voice_t voices[PBANK_NUM_VOICES];               // same order as the BANK_LOAD_xx bits
+  uint8_t       pad1[PBANK_SECTOR_SIZE - 32 - (PBANK_NUM_VOICES * sizeof(pbank_voice_t))];
+} pbank_hdr_t;                                          // exactly one sector
+
+static_assert( sizeof(pbank_hdr_t) == PBANK_SECTOR_SIZE, "packed bank header is one sector on the card" );
+
+bool pack_voice_bank( uint8_t bank_num );               // directory layout -> packed file
+bool unpack_voice_bank( uint8_t bank_num );             // packed file -> directory layout
+
+bool load_packed_voice_bank( uint16_t voice_selects, uint8_t bank_num );   // false if no valid packed file, caller should use directories
+char *get_packed_bank_name();                           // name from the last packed header read
+
+void invalidate_packed_bank( uint8_t bank_num );        // call when the directory copy of a bank changes
+
+
+#endif
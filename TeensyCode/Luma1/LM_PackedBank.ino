@@ -0,0 +1,275 @@
+/* ---------------------------------------------------------------------------------------
+    PACKED VOICE BANKS
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LM_SDCard.h"
+#include "LM_Voices.h"
+#include "LM_PackedBank.h"
+#include "LM_SDCatalog.h"
+
+extern uint8_t filebuf[32768];
+extern char fn_buf[256];
+
+pbank_hdr_t pbank_hdr;                                  // header of the packed bank we are working on
+
+char pbank_fn[64];
+
+uint8_t pbank_zeros[PBANK_SECTOR_SIZE];                 // for padding sample data out to a sector boundary
+
+
+void build_packed_bank_filename( uint8_t bank_num, char *fn ) {
+  sprintf( fn, "/DRMBANKS/%02d/%s", bank_num, PBANK_FN );
+}
+
+
+char *get_packed_bank_name() {
+  return pbank_hdr.bank_name;
+}
+
+
+// read and sanity check the header at the start of f
+
+bool read_packed_bank_hdr( File &f ) {
+
+  if( f.read( &pbank_hdr, sizeof(pbank_hdr) ) != sizeof(pbank_hdr) ) {
+    Serial.printf("### packed bank: short header\n");
+    return false;
+  }
+
+  if( (memcmp( pbank_hdr.magic, PBANK_MAGIC, 4 ) != 0) ||
+      (pbank_hdr.version != PBANK_VERSION) ||
+      (pbank_hdr.num_voices != PBANK_NUM_VOICES) ) {
+    Serial.printf("### packed bank: bad header\n");
+    return false;
+  }
+
+  pbank_hdr.bank_name[MAX_BANKNAME_CHARS-1] = 0;        // don't trust what came off the card
+
+  for( int vvv = 0; vvv != PBANK_NUM_VOICES; vvv++ )
+    pbank_hdr.voices[vvv].name[MAX_LEN_FILE_NAME-1] = 0;
+
+  return true;
+}
+
+
+// read voice vvv of the open packed bank into filebuf, and check it against the hash in the header
+
+bool read_packed_voice( File &f, int vvv ) {
+  pbank_voice_t *pv = &pbank_hdr.voices[vvv];
+
+  if( (pv->len == 0) || (pv->len > sizeof(filebuf)) )
+    return false;
+
+  if( !f.seek( pv->offset ) )
+    return false;
+
+  if( f.read( filebuf, pv->len ) != (int)pv->len )
+    return false;
+
+  if( hash32( filebuf, pv->len ) != pv->hash ) {
+    Serial.printf("### packed bank: hash mismatch on %s\n", pv->name);
+    return false;
+  }
+
+  return true;
+}
+
+
+/* ================================================================================================================
+    Load voices from a packed bank.
+    Voices that are missing or don't verify are loaded from the bank's directories the old way.
+    Returns false if there is no usable packed file at all.
+*/
+
+bool load_packed_voice_bank( uint16_t voice_selects, uint8_t bank_num ) {
+  File pf;
+  voice_sample_t vs;
+
+  build_packed_bank_filename( bank_num, pbank_fn );
+
+  pf = SD.open( pbank_fn );
+
+  if( !pf )
+    return false;                                       // normal, most banks aren't packed
+
+  if( !read_packed_bank_hdr( pf ) ) {
+    pf.close();
+    return false;
+  }
+
+  Serial.printf("Loading from packed bank %s\n", pbank_fn);
+
+  for( int vvv = 0; vvv != PBANK_NUM_VOICES; vvv++ ) {
+    if( voice_selects & (1 << vvv) ) {
+      if( read_packed_voice( pf, vvv ) ) {
+        vs = voice_sample( filebuf, pbank_hdr.voices[vvv].len );
+        set_voice_sample( bank_voice_2_stb( vvv ), &vs, pbank_hdr.voices[vvv].name );
+      }
+      else {
+        build_voice_filename( bank_voice_2_stb( vvv ), bank_num, fn_buf );
+        load_voice_file( bank_voice_2_stb( vvv ), fn_buf );
+      }
+    }
+  }
+
+  pf.close();
+
+  return true;
+}
+
+
+/* ================================================================================================================
+    Conversion between the directory layout and the packed file
+*/
+
+bool pack_voice_bank( uint8_t bank_num ) {
+  File pf;
+  int len;
+  int pad;
+  uint32_t offset = PBANK_SECTOR_SIZE;                  // sample data starts right after the header sector
+  pbank_voice_t *pv;
+  bool r = true;
+
+  Serial.printf("Packing voice bank %02d\n", bank_num);
+
+  memset( &pbank_hdr, 0, sizeof(pbank_hdr) );
+  memcpy( pbank_hdr.magic, PBANK_MAGIC, 4 );
+  pbank_hdr.version = PBANK_VERSION;
+  pbank_hdr.num_voices = PBANK_NUM_VOICES;
+  strncpy( pbank_hdr.bank_name, get_voice_bank_name( bank_num ), MAX_BANKNAME_CHARS-1 );
+
+  build_packed_bank_filename( bank_num, pbank_fn );
+  SD.remove( pbank_fn );
+
+  pf = SD.open( pbank_fn, FILE_WRITE );
+
+  if( !pf ) {
+    Serial.printf("### pack_voice_bank: could not open %s for writing\n", pbank_fn);
+    return false;
+  }
+
+  pf.write( (uint8_t*)&pbank_hdr, sizeof(pbank_hdr) );        // placeholder, real one written at the end
+
+  for( int vvv = 0; vvv != PBANK_NUM_VOICES; vvv++ ) {
+    pv = &pbank_hdr.voices[vvv];
+
+    build_voice_filename( bank_voice_2_stb( vvv ), bank_num, fn_buf );
+
+    if( get_first_file_in_dir( fn_buf, pv->name, filebuf, &len, sizeof(filebuf) ) ) {
+      pv->offset  = offset;
+      pv->len     = len;
+      pv->hw_len  = needed_hw_len( len );
+      pv->hash    = hash32( filebuf, len );
+
+      pad = (PBANK_SECTOR_SIZE - (len % PBANK_SECTOR_SIZE)) % PBANK_SECTOR_SIZE;
+
+      if( (pf.write( filebuf, len ) != (size_t)len) || (pf.write( pbank_zeros, pad ) != (size_t)pad) ) {
+        Serial.printf("### pack_voice_bank: write failed\n");
+        r = false;
+        break;
+      }
+
+      offset += len + pad;
+    }
+    else
+      Serial.printf("### pack_voice_bank: no voice in %s, leaving it out\n", fn_buf);
+  }
+
+  if( r ) {
+    pf.seek( 0 );
+    r = (pf.write( (uint8_t*)&pbank_hdr, sizeof(pbank_hdr) ) == sizeof(pbank_hdr));
+  }
+
+  pf.close();
+
+  if( !r ) 
+    SD.remove( pbank_fn );                              // don't leave a half-written bank around
+  else
+    Serial.printf("Packed bank %02d: %d bytes\n", bank_num, offset);
+
+  return r;
+}
+
+
+bool unpack_voice_bank( uint8_t bank_num ) {
+  File pf;
+  char vdir[64];
+  char name_fn[64];
+  pbank_voice_t *pv;
+
+  Serial.printf("Unpacking voice bank %02d\n", bank_num);
+
+  build_packed_bank_filename( bank_num, pbank_fn );
+
+  pf = SD.open( pbank_fn );
+
+  if( !pf ) {
+    Serial.printf("### unpack_voice_bank: no %s\n", pbank_fn);
+    return false;
+  }
+
+  if( !read_packed_bank_hdr( pf ) ) {
+    pf.close();
+    return false;
+  }
+
+  for( int vvv = 0; vvv != PBANK_NUM_VOICES; vvv++ ) {
+    pv = &pbank_hdr.voices[vvv];
+
+    if( read_packed_voice( pf, vvv ) ) {
+      build_voice_filename( bank_voice_2_stb( vvv ), bank_num, vdir );
+
+      delete_all_in_dir( vdir );                        // these skip invalidate_packed_bank(), the two copies will match
+      make_dir( vdir );
+
+      strcat( vdir, "/" );
+      strcat( vdir, pv->name );
+
+      create_file( vdir, filebuf, pv->len );
+    }
+  }
+
+  pf.close();
+
+  sprintf( name_fn, "/DRMBANKS/%02d/BANKNAME.TXT", bank_num );
+  replace_file( name_fn, (uint8_t*)pbank_hdr.bank_name, strlen( pbank_hdr.bank_name ) );
+
+  catalog_invalidate_voice_bank( bank_num, true, BANK_LOAD_ALL );
+
+  return true;
+}
+
+
+void invalidate_packed_bank( uint8_t bank_num ) {
+
+  if( bank_num == BANK_STAGING )                        // STAGING is never packed
+    return;
+
+  build_packed_bank_filename( bank_num, pbank_fn );
+
+  if( SD.exists( pbank_fn ) ) {
+    Serial.printf("Removing stale packed bank %s\n", pbank_fn);
+    SD.remove( pbank_fn );
+  }
+}
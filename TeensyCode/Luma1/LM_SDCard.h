@@ -24,6 +24,8 @@
 #ifndef LM_SDCard_
 #define LM_SDCard_
 
+#include <SD.h>                                     // File, used in prototypes of helpers that take an open file
+
 #define MAX_LEN_FILE_NAME           24              // filenames can be up to 24 chars         
 #define MAX_LEN_PATH_NAME           64              // path can be up to 40 chars
 
@@ -45,6 +47,38 @@ void delete_and_copy( char *dst, char * src, char *default_data, int default_len
                                                                                         // If src doesn't exist, copy default_len bytes from default_data[] to dst.
 
 void delete_all_in_dir( char *dirname );                // delete any/all files in dirname
+void delete_all_in_dir_except( char *dirname, char *keep_fn );    // same, but leave the file named keep_fn alone
+
+// -- Single pass directory operations
+
+#define DIR_OP_DELETE               0                   // remove every file, except one named arg (if arg != NULL)
+
+typedef struct {
+  int found;                                            // files seen in the directory
+  int done;                                             // files removed
+  int errors;                                           // remove failures, or the directory couldn't be opened
+} dir_op_result_t;
+
+bool dir_op( char *dirname, uint8_t op, char *arg, dir_op_result_t *res );   // walk dirname once, returns true if no errors
+
+// -- Streaming file copy
+
+#define SD_COPY_BUF_SIZE            (16*1024)           // multiple of the 512 byte sector size
+
+typedef struct {
+  uint32_t files;                                       // copied OK
+  uint32_t bytes;
+  uint32_t micros;                                      // time spent copying, for MB/s
+  uint32_t errors;
+} sd_copy_stats_t;
+
+void sd_copy_stats_clear( sd_copy_stats_t *st );
+void sd_copy_stats_print( const char *what, sd_copy_stats_t *st );     // files, bytes, ms, MB/s
+
+bool sd_copy_file( FsFile &src, char *dst_path, uint32_t *hash, sd_copy_stats_t *st );      // src must be open, dst is replaced
+
+// copy first file in src_dir to dst_dir (same name), then delete any other files in dst_dir. returns name, len, hash of the file.
+bool sd_copy_first_file_in_dir( char *src_dir, char *dst_dir, char *fn, uint32_t *len, uint32_t *hash, sd_copy_stats_t *st );
 
 bool create_file( char *path, uint8_t *d, int len );    // create a file at path, copy len bytes of data d into it
 
@@ -70,6 +104,11 @@ char *get_active_ram_bank_name();                       // if there is a name, r
 
 uint16_t checksum( uint8_t *d, int len );               // calculate a 16 bit checksum, used for naming RAM save files
 
+#define HASH32_INIT                 0x811c9dc5          // FNV-1a offset basis
+
+uint32_t hash32( uint8_t *d, int len );                 // 32 bit FNV-1a hash, used to verify sample data
+uint32_t hash32_update( uint32_t h, uint8_t *d, int len );    // same, but can be run over data in pieces, start with h = HASH32_INIT
+
 void sd_card_ls();                                      // dump the SD card directory
 
 bool format_card();                                     // initialize SD card, create expected dir structure
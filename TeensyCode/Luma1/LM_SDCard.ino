@@ -24,6 +24,7 @@
 #include <SD.h>
 #include "LM_SDCard.h"
 #include "LM_EEPROM.h"
+#include "LM_SDCatalog.h"
 
 /* ---------------------------------------------------------------------------------------
     Files, SD Card
@@ -201,38 +202,246 @@ void delete_and_copy( char *dst, char *src, char *default_data, int default_len
 }
 
 
+/* ----------------------------------------------------------------------------------------------------------------
+    Directory operations
+
+    dir_op() walks a directory once, using a single open handle, and deletes the files it finds as it goes (all of
+    them, or all but the one named arg). Removing an entry only marks its directory slot, so the walk can keep going
+    from where it is. That keeps clearing out a bank dir at one SD round trip per file, instead of reopening the dir
+    for every file.
+
+    Subdirectories are skipped. Counts of what was found, removed, and failed come back in res.
+*/
+
+void build_dir_path( char *path, char *dirname, const char *fn ) {
+  int l = strlen( dirname );
+
+  if( l && (dirname[l-1] == '/') )                                        // some callers pass "/STAGING/CONGA/", some don't
+    snprintf( path, MAX_LEN_PATH_NAME, "%s%s", dirname, fn );
+  else
+    snprintf( path, MAX_LEN_PATH_NAME, "%s/%s", dirname, fn );
+}
+
+
+bool dir_op( char *dirname, uint8_t op, char *arg, dir_op_result_t *res ) {
+  File dir;
+  File f;
+  char name[MAX_LEN_FILE_NAME+1];
+  char path[MAX_LEN_PATH_NAME];
+  bool is_dir;
+  bool r;
+
+  res->found  = 0;
+  res->done   = 0;
+  res->errors = 0;
+
+  dir = SD.open( dirname );
+
+  if( !dir || !dir.isDirectory() ) {
+    Serial.printf("### dir_op: could not open dir %s\n", dirname);
+    res->errors++;
+    return false;
+  }
+
+  while( (f = dir.openNextFile()) ) {
+    snprintf( name, sizeof(name), "%s", f.name() );
+    is_dir = f.isDirectory();
+    f.close();                                                            // don't hold the file open while we remove it
+
+    if( is_dir )
+      continue;
+
+    res->found++;
+
+    if( (op == DIR_OP_DELETE) && arg && (strcasecmp( name, arg ) == 0) )  // FAT names are not case sensitive
+      continue;                                                           // this is the one we want to keep
+
+    build_dir_path( path, dirname, name );
+
+    r = SD.remove( path );
+
+    if( r )
+      res->done++;
+    else {
+      Serial.printf("### dir_op: remove of %s failed\n", path);
+      res->errors++;
+    }
+  }
+
+  dir.close();
+
+  Serial.printf("dir_op: %s, %d files, %d removed, %d errors\n", dirname, res->found, res->done, res->errors);
+
+  return res->errors == 0;
+}
+
+
 // delete any/all files in dirname
 
 void delete_all_in_dir( char *dirname ) {
-  bool r;
-  Serial.printf("delete_all_in_dir: %s\n", dirname);
+  dir_op_result_t res;
 
-  if( root ) {
-    for( int xxx = 0; xxx != 20; xxx++ ) {                  // delete up to 20 existing files, more checks needed?
-      root = SD.open( dirname );
-      file = root.openNextFile();
+  dir_op( dirname, DIR_OP_DELETE, NULL, &res );
+}
 
-      if( file ) {
-        snprintf( fn_buf, sizeof(fn_buf)-1, dirname );
-        strcat( fn_buf, "/" );
-        strcat( fn_buf, file.name() );                      // remove() needs full path
-        Serial.printf("Found %s, deleting it\n", fn_buf);
-        file.close();
-        r = SD.remove( fn_buf );
-        if( !r )
-          Serial.printf("delete_all_in_dir: remove of %s failed\n", fn_buf);
-      }
-      else {
-        Serial.printf("delete_all_in_dir: no files to delete found\n");
-        break;
-      }
+
+// delete all files in dirname, except for the one named keep_fn
+
+void delete_all_in_dir_except( char *dirname, char *keep_fn ) {
+  dir_op_result_t res;
+
+  dir_op( dirname, DIR_OP_DELETE, keep_fn, &res );
+}
+
+
+/* ----------------------------------------------------------------------------------------------------------------
+    Streaming file copy
+
+    Copies go through copy_buf in big sector-multiple chunks, straight from the source file to the destination,
+    so there's no size limit and no bouncing through filebuf. The destination is preallocated as one contiguous run
+    of clusters before the first write, so SdFat doesn't have to hunt the FAT for free clusters as it goes.
+
+    A running hash32 is taken over the data as it streams. Every read and write is checked for a full count and the
+    final destination size has to match the source. The hash is handed back so callers can check it against what they
+    expected and record it -- store_voice_file() compares it with the STAGING catalog entry, then catalogs the copy.
+    Nothing is read back, that would double the SD traffic.
+*/
+
+DMAMEM uint8_t copy_buf[SD_COPY_BUF_SIZE] __attribute__((aligned(32)));     // 32 byte aligned for SDIO DMA, not cached in DTCM
+
+
+void sd_copy_stats_clear( sd_copy_stats_t *st ) {
+  memset( st, 0, sizeof(sd_copy_stats_t) );
+}
+
+
+void sd_copy_stats_print( const char *what, sd_copy_stats_t *st ) {
+  Serial.printf("%s: %d files, %d bytes in %d.%03d ms, %.2f MB/s, %d errors\n", 
+                what, st->files, st->bytes, st->micros / 1000, st->micros % 1000,
+                st->micros ? ((float)st->bytes / (float)st->micros) : 0.0,     // bytes per us == MB/s
+                st->errors );
+}
+
+
+// copy src (already open) to dst_path, replacing whatever is there
+
+bool sd_copy_file( FsFile &src, char *dst_path, uint32_t *hash, sd_copy_stats_t *st ) {
+  FsFile dst;
+  uint32_t len;
+  uint32_t remaining;
+  uint32_t chunk;
+  uint32_t h = HASH32_INIT;
+  bool r = true;
+  elapsedMicros copy_time;
+
+  len = src.fileSize();
+
+  if( !dst.open( dst_path, (O_RDWR | O_CREAT | O_TRUNC) ) ) {
+    Serial.printf("### sd_copy_file: could not open %s for writing\n", dst_path);
+    st->errors++;
+    return false;
+  }
+
+  if( len && !dst.preAllocate( len ) )                                    // not fatal, card may just be fragmented
+    Serial.printf("sd_copy_file: could not preallocate %d contiguous bytes for %s\n", len, dst_path);
+
+  remaining = len;
+
+  while( remaining ) {
+    chunk = (remaining > SD_COPY_BUF_SIZE) ? SD_COPY_BUF_SIZE : remaining;
+
+    if( src.read( copy_buf, chunk ) != (int)chunk ) {
+      Serial.printf("### sd_copy_file: short read, %d bytes left\n", remaining);
+      r = false;
+      break;
+    }
+
+    h = hash32_update( h, copy_buf, chunk );
+
+    if( dst.write( copy_buf, chunk ) != chunk ) {
+      Serial.printf("### sd_copy_file: short write to %s, card full?\n", dst_path);
+      r = false;
+      break;
     }
+
+    remaining -= chunk;
+  }
+
+  if( r && (dst.fileSize() != len) ) {
+    Serial.printf("### sd_copy_file: %s is %d bytes, expected %d\n", dst_path, (int)dst.fileSize(), len);
+    r = false;
+  }
+
+  dst.close();
+
+  if( r ) {
+    st->files++;
+    st->bytes += len;
+  }
+  else {
+    SD.remove( dst_path );                                                // don't leave a partial file behind
+    st->errors++;
   }
-  else
-    Serial.printf("delete_all_in_dir: could not open root, this seems bad\n");
 
-  Serial.printf("delete_all_in_dir: done\n");
+  st->micros += copy_time;
 
+  if( hash )
+    *hash = h;
+
+  return r;
+}
+
+
+/*
+    Copy the first (non-dot) file in src_dir into dst_dir, keeping its name, then clear out anything else in dst_dir.
+    This is how voices move between STAGING and the banks, each voice dir holds a single file.
+    Returns the file name (up to MAX_LEN_FILE_NAME), length and hash of what was copied.
+*/
+
+bool sd_copy_first_file_in_dir( char *src_dir, char *dst_dir, char *fn, uint32_t *len, uint32_t *hash, sd_copy_stats_t *st ) {
+  FsFile dir;
+  FsFile src;
+  char name[MAX_LEN_FILE_NAME];
+  char dst_path[MAX_LEN_PATH_NAME];
+  bool r = false;
+
+  if( !dir.open( src_dir, O_RDONLY ) ) {
+    Serial.printf("### sd_copy_first_file_in_dir: could not open %s\n", src_dir);
+    st->errors++;
+    return false;
+  }
+
+  while( src.openNext( &dir, O_RDONLY ) ) {
+    src.getName( name, sizeof(name) );
+
+    if( !src.isDir() && (name[0] != '.') )                                // skip the OSX ._ and .DS_Store files
+      break;
+
+    src.close();
+  }
+
+  if( src.isOpen() ) {
+    build_dir_path( dst_path, dst_dir, name );
+    Serial.printf("Copying %s%s -> %s, %d bytes\n", src_dir, name, dst_path, (int)src.fileSize());
+
+    *len = src.fileSize();
+
+    r = sd_copy_file( src, dst_path, hash, st );
+    src.close();
+
+    if( r ) {
+      snprintf( fn, MAX_LEN_FILE_NAME, "%s", name );
+      delete_all_in_dir_except( dst_dir, name );
+    }
+  }
+  else {
+    Serial.printf("### sd_copy_first_file_in_dir: no file found in %s\n", src_dir);
+    st->errors++;
+  }
+
+  dir.close();
+
+  return r;
 }
 
 
@@ -303,56 +512,29 @@ void build_rambank_filename( uint8_t bank_num, uint16_t cs, char *fn ) {
 }
 
 
-// look for a file, return status.
-// if del == true, delete the file that was found.
-
-bool ram_bank_file_exists( uint8_t banknum, bool del ) {
-  bool r = false;
-
-  Serial.printf("Checking for ram bank file in bank %02d\n", banknum);
-
-  sprintf( sd_scratch, "/RAMBANKS/%02d/", banknum );
-
-  root = SD.open( sd_scratch );
-  
-  file = root.openNextFile();
-
-  if ( file ) {
-    Serial.printf("### found a ram bank file!\n");
-    r = true;
-
-    if( del ) {
-      Serial.printf("### DELETING that file\n");
-      sprintf( sd_scratch, "/RAMBANKS/%02d/%s", banknum, file.name() );
-      Serial.printf("File to delete name = %s\n", sd_scratch);
-      SD.remove( sd_scratch );
-    }
-  }
-  else {
-    Serial.printf("No ram bank file found for bank %02d\n", banknum);
-  }
-
-  return r;
-}
-
-
 /*
   if banknum == 255, snapshot Z-80 RAM and save to /RAMBANKS/banknum/RAM_IMAGE_<checksum>.bin
   if banknum == 00-99, save to /RAMBANKS/banknum/ram_fn (unless NULL, then use RAM_IMAGE_<seqnum>.bin)
 */
 
 void store_ram_bank( uint8_t *ram_image, uint8_t banknum, char *ram_fn ) {
+  char *fn;
 
   Serial.printf("store_ram_bank: %s\n", ram_fn );
 
-  // -- clean up any old files in this directory, bound it to 1000 files, should be more than enough
+  sprintf( sd_scratch, "/RAMBANKS/%02d/", banknum );
 
-  for( int xxx = 0; xxx != 1000; xxx++ ) {
-    if ( ram_bank_file_exists( banknum, true ) == false )       // the "true" means to delete if a file is found, returns false when no file found
-      break;
+  fn = strrchr( ram_fn, '/' );                                  // callers pass either a full path or just a file name
+  
+  if( fn )
+    fn++;
+  else {
+    fn = ram_fn;
+    snprintf( fn_buf, sizeof(fn_buf), "%s%s", sd_scratch, ram_fn );
+    ram_fn = fn_buf;
   }
 
-  // -- now write the new file
+  // -- write the new file first, then clean up any old files in this directory in one pass
 
   if ( file = SD.open( ram_fn, (O_RDWR | O_CREAT | O_TRUNC) ) ) {
     Serial.println("### open OK");
@@ -360,10 +542,14 @@ void store_ram_bank( uint8_t *ram_image, uint8_t banknum, char *ram_fn ) {
     file.write( ram_image, 8192 );
 
     file.close();       // this will flush anything pending to the card
+
+    delete_all_in_dir_except( sd_scratch, fn );
   }
   else {
     Serial.printf("### %s: open failed\n", ram_fn);      
   }
+
+  catalog_invalidate_ram_bank( banknum );
 }
 
 
@@ -467,25 +653,14 @@ void load_ram_bank( uint8_t banknum ) {
 
 char *get_ram_bank_name( uint8_t bank_num ) {             // 0xff for current active Z-80 RAM
 
-  if( bank_num == 0xff ) {                                                    // special case, currently active RAM
-    copy_z80_ram( rambuf );
-    if( !get_active_ram_bank_name() )                                         // big hack, if there is a filename, this copies it to filebuf, then we exit and return that
-      sprintf( (char*)filebuf, "RAM_BANK_%04x", checksum(rambuf,8192));       // otherwise, put the default filename into filebuf
-  }
-  else {
-    sprintf( (char*)filebuf, "/RAMBANKS/%02d/", bank_num );
-  
-    root = SD.open( (char*)filebuf );
-    file = root.openNextFile();
-  
-    if( file ) {
-      snprintf( (char*)filebuf, MAX_DISPLAYED_FN_LEN, "%s", file.name() );
-      file.close();
-    }
-    else {
-      sprintf( (char*)filebuf, "No RAM Bank %02d found", bank_num );
-    }
-  }
+  if( bank_num != 0xff )
+    return catalog_ram_bank_name( bank_num );             // banks 00-99 come from the SD catalog
+
+  // special case, currently active RAM
+
+  copy_z80_ram( rambuf );
+  if( !get_active_ram_bank_name() )                                           // big hack, if there is a filename, this copies it to filebuf, then we exit and return that
+    sprintf( (char*)filebuf, "RAM_BANK_%04x", checksum(rambuf,8192));         // otherwise, put the default filename into filebuf
 
   Serial.printf("get_ram_bank_name: returning %s\n", filebuf);
   
@@ -548,6 +723,22 @@ uint16_t checksum( uint8_t *d, int len ) {
   return cs;
 }
 
+
+uint32_t hash32_update( uint32_t h, uint8_t *d, int len ) {
+
+  for( int xxx = 0; xxx != len; xxx++ ) {
+    h ^= d[xxx];
+    h *= 0x01000193;                                    // FNV-1a prime
+  }
+
+  return h;
+}
+
+
+uint32_t hash32( uint8_t *d, int len ) {
+  return hash32_update( HASH32_INIT, d, len );
+}
+
 // dump the SD card directory
 void sd_card_ls() {
   SD.sdfs.ls( LS_R );
@@ -631,11 +822,18 @@ bool format_card() {
       Serial.println("creating Z80_CODE directory");
       SD.sdfs.mkdir( "/Z80_CODE", true );
 
+      // --- build NOTEMAPS directory, user MIDI note map profiles go here
+      
+      Serial.println("creating NOTEMAPS directory");
+      SD.sdfs.mkdir( NOTE_MAP_DIR, true );
+
       // -- RAM bank 0 is special, it's the default to load, and contains the factory patterns
 
       Serial.println("initializing RAM bank 0, default factory settings");
-      //load_z80_ram( factory_ram );
+      //load_z80_ram( (uint8_t*)factory_ram );
       //save_ram_bank( 0 );
+
+      catalog_invalidate_all();                         // everything we knew about the card is gone
       
       Serial.println("DONE!");
     }
@@ -0,0 +1,83 @@
+/* ---------------------------------------------------------------------------------------
+    SD CARD CATALOG
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LM_SDCatalog_H_
+#define LM_SDCatalog_H_
+
+#include "LM_SDCard.h"                      // MAX_LEN_FILE_NAME
+#include "LM_Voices.h"                      // MAX_BANKNAME_CHARS
+
+/*
+    RAM copy of what is in the 100 voice banks and 100 RAM banks on the SD card, so that scrolling
+    through banks in the local UI (and answering SysEx name requests) doesn't touch the card.
+
+    Bank names are read at boot. Per-voice file names, sizes and hashes are filled in a little at a time
+    from loop() while the machine is idle, one 512 byte read per call. Anything that writes a bank invalidates its entries, they get
+    re-read on the next lookup (names) or the next idle pass (voices).
+
+    STAGING voices have entries too, but they are never scanned. set_voice_sample() fills one in when it writes the
+    STAGING copy, so a bank store can check what it copied against what was staged.
+*/
+
+#define CAT_NUM_BANKS               100
+#define CAT_NUM_VOICES              10                  // same order as the BANK_LOAD_xx bits
+
+typedef struct {
+  char      name[MAX_LEN_FILE_NAME];
+  uint32_t  len;                                        // 0 = no file
+  uint32_t  hash;                                       // hash32() of the file data
+  uint32_t  hashed;                                     // bytes of it hashed so far, the scan does 512 at a time
+} cat_file_t;
+
+typedef struct {
+  bool        name_valid;
+  uint16_t    voices_valid;                             // bitmap, BANK_LOAD_xx
+  char        name[MAX_BANKNAME_CHARS+1];
+  cat_file_t  voices[CAT_NUM_VOICES];
+} cat_voice_bank_t;
+
+typedef struct {
+  bool        valid;                                    // name and len
+  bool        hash_valid;
+  cat_file_t  image;
+} cat_ram_bank_t;
+
+void init_catalog();                                    // call once SD card is up, reads all bank names
+
+void handle_catalog();                                  // call from loop when idle, fills in voice info in the background
+
+char *catalog_voice_bank_name( uint8_t bank_num );      // 00-99
+char *catalog_ram_bank_name( uint8_t bank_num );        // 00-99
+
+cat_file_t *catalog_voice( uint8_t bank_num, int vvv ); // vvv is the BANK_LOAD_xx bit #, NULL if not cataloged yet. bank can be BANK_STAGING
+cat_file_t *catalog_ram_bank( uint8_t bank_num );      // NULL if not cataloged yet
+
+void catalog_invalidate_voice_bank( uint8_t bank_num, bool name, uint16_t voices );     // voices is a BANK_LOAD_xx bitmap
+void catalog_invalidate_ram_bank( uint8_t bank_num );
+void catalog_set_voice( uint8_t bank_num, int vvv, char *fn, uint32_t len, uint32_t hash );     // after writing a voice file
+void catalog_invalidate_all();
+
+
+#endif
@@ -0,0 +1,385 @@
+/* ---------------------------------------------------------------------------------------
+    SD CARD CATALOG
+
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LM_SDCard.h"
+#include "LM_Voices.h"
+#include "LM_SDCatalog.h"
+
+// ~38KB, so keep it out of DTCM. DMAMEM is not zeroed at startup, catalog_clear() takes care of that.
+
+DMAMEM cat_voice_bank_t cat_voice_banks[CAT_NUM_BANKS];
+DMAMEM cat_ram_bank_t   cat_ram_banks[CAT_NUM_BANKS];
+DMAMEM cat_voice_bank_t cat_staging;                   // only what set_voice_sample() put there, see catalog_set_voice()
+
+bool catalog_cleared = false;
+
+uint8_t cat_buf[512];                                   // small read buffer for hashing, so we don't stomp on filebuf
+
+char cat_scratch[MAX_LEN_PATH_NAME];
+
+// background scan position: bank #, then voice 0-9, 10 = the RAM bank
+
+#define CAT_SCAN_RAM                CAT_NUM_VOICES
+#define CAT_SCAN_INTERVAL_MS        2                   // at most one read per this many ms, keeps loop() responsive
+
+int cat_scan_bank = 0;
+int cat_scan_item = 0;
+elapsedMillis cat_scan_timer;
+
+File cat_scan_f;                                        // file being hashed, stays open between calls
+cat_file_t *cat_scan_cf = NULL;                         // ... and its entry, NULL = none
+
+
+// Stop hashing, something changed on the card (or is about to change the entry). It starts over next time.
+
+void cat_scan_abort() {
+  if( cat_scan_cf ) {
+    cat_scan_f.close();
+    cat_scan_cf = NULL;
+  }
+}
+
+
+void catalog_clear() {
+  cat_scan_abort();
+  memset( cat_voice_banks, 0, sizeof(cat_voice_banks) );
+  memset( cat_ram_banks,   0, sizeof(cat_ram_banks) );
+  memset( &cat_staging,    0, sizeof(cat_staging) );
+  catalog_cleared = true;
+}
+
+
+// find the first real file in dirname, skipping the OSX dot files. returned File is not open if there isn't one.
+
+File cat_first_file( char *dirname ) {
+  File d;
+  File f;
+
+  d = SD.open( dirname );
+
+  if( d ) {
+    f = d.openNextFile();
+
+    for( int xxx = 0; f && (f.name()[0] == '.') && (xxx != 10); xxx++ ) {
+      f.close();
+      f = d.openNextFile();
+    }
+
+    d.close();
+
+    if( f && (f.name()[0] == '.') )                     // nothing but dot files
+      f.close();
+  }
+
+  return f;
+}
+
+
+// fill in name and len. only the first 32KB counts, that's all that ever gets loaded. Leaves the file open (if
+//  there is one) for cat_hash_start().
+
+File cat_read_file_info( char *dirname, cat_file_t *cf ) {
+  File f;
+
+  if( cf == cat_scan_cf )
+    cat_scan_abort();
+
+  memset( cf, 0, sizeof(cat_file_t) );
+
+  f = cat_first_file( dirname );
+
+  if( f ) {
+    snprintf( cf->name, MAX_LEN_FILE_NAME, "%s", f.name() );
+
+    cf->len = (f.size() > sizeof(filebuf)) ? sizeof(filebuf) : f.size();
+  }
+
+  return f;
+}
+
+
+// Starts hashing the file in dirname, true if there's nothing to hash (no file, or empty) and cf is done already
+
+bool cat_hash_start( char *dirname, cat_file_t *cf ) {
+  File f = cat_read_file_info( dirname, cf );
+
+  cf->hash = HASH32_INIT;
+
+  if( !f )
+    return true;
+
+  if( cf->len == 0 ) {
+    f.close();
+    return true;
+  }
+
+  cat_scan_f = f;
+  cat_scan_cf = cf;
+  return false;
+}
+
+
+// One read's worth, true when the file is done (or couldn't be read, it's left with what we got)
+
+bool cat_hash_step() {
+  cat_file_t *cf = cat_scan_cf;
+  int left = cf->len - cf->hashed;
+  int n;
+
+  n = cat_scan_f.read( cat_buf, (left > (int)sizeof(cat_buf)) ? sizeof(cat_buf) : left );
+
+  if( n > 0 ) {
+    cf->hash = hash32_update( cf->hash, cat_buf, n );
+    cf->hashed += n;
+  }
+
+  if( (n <= 0) || (cf->hashed == cf->len) ) {
+    cat_scan_f.close();
+    cat_scan_cf = NULL;
+    return true;
+  }
+
+  return false;
+}
+
+
+void cat_scan_voice_bank_name( uint8_t bank_num ) {
+  snprintf( cat_voice_banks[bank_num].name, MAX_BANKNAME_CHARS+1, "%s", sd_voice_bank_name( bank_num ) );
+  cat_voice_banks[bank_num].name_valid = true;
+}
+
+
+// name and len only, the hash gets filled in later by handle_catalog()
+
+void cat_scan_ram_bank_name( uint8_t bank_num ) {
+  File f;
+
+  sprintf( cat_scratch, "/RAMBANKS/%02d/", bank_num );
+
+  f = cat_read_file_info( cat_scratch, &cat_ram_banks[bank_num].image );
+  if( f )
+    f.close();
+
+  cat_ram_banks[bank_num].valid = true;
+  cat_ram_banks[bank_num].hash_valid = false;
+}
+
+
+// the item at cat_scan_bank / cat_scan_item has its hash
+
+void cat_scan_item_done() {
+  if( cat_scan_item == CAT_SCAN_RAM ) {
+    cat_ram_banks[cat_scan_bank].valid = true;
+    cat_ram_banks[cat_scan_bank].hash_valid = true;
+  }
+  else
+    cat_voice_banks[cat_scan_bank].voices_valid |= (1 << cat_scan_item);
+}
+
+
+/* ================================================================================================================
+    Build / maintain
+*/
+
+void init_catalog() {
+  elapsedMillis t;
+
+  catalog_clear();
+
+  for( int bbb = 0; bbb != CAT_NUM_BANKS; bbb++ ) {
+    cat_scan_voice_bank_name( bbb );
+    cat_scan_ram_bank_name( bbb );
+  }
+
+  Serial.printf("SD catalog: %d voice bank and %d RAM bank names read in %d ms\n", CAT_NUM_BANKS, CAT_NUM_BANKS, (int)t);
+}
+
+
+// Does one SD read per call: open the next file that needs it, or hash another 512 bytes of the one that's open.
+// Stays off the card while MIDI is coming in or a song is playing, a read can hold up loop() for a while.
+
+void handle_catalog() {
+  int checked = 0;
+
+  if( !catalog_cleared || (cat_scan_timer < CAT_SCAN_INTERVAL_MS) )
+    return;
+
+  if( midi_in_pending() || song_is_started || play_running() )
+    return;
+
+  cat_scan_timer = 0;
+
+  if( cat_scan_cf ) {
+    if( cat_hash_step() )
+      cat_scan_item_done();
+    return;
+  }
+
+  while( checked++ != (CAT_NUM_BANKS * (CAT_NUM_VOICES+1)) ) {
+
+    if( cat_scan_item == CAT_SCAN_RAM ) {
+      if( !cat_ram_banks[cat_scan_bank].valid || !cat_ram_banks[cat_scan_bank].hash_valid ) {
+        sprintf( cat_scratch, "/RAMBANKS/%02d/", cat_scan_bank );
+        if( cat_hash_start( cat_scratch, &cat_ram_banks[cat_scan_bank].image ) )
+          cat_scan_item_done();
+        return;
+      }
+    }
+    else
+    if( !(cat_voice_banks[cat_scan_bank].voices_valid & (1 << cat_scan_item)) ) {
+      build_voice_filename( bank_voice_2_stb( cat_scan_item ), cat_scan_bank, cat_scratch );
+      if( cat_hash_start( cat_scratch, &cat_voice_banks[cat_scan_bank].voices[cat_scan_item] ) )
+        cat_scan_item_done();
+      return;
+    }
+
+    if( ++cat_scan_item > CAT_SCAN_RAM ) {                // next item, then next bank
+      cat_scan_item = 0;
+      if( ++cat_scan_bank == CAT_NUM_BANKS )
+        cat_scan_bank = 0;
+    }
+  }
+}
+
+
+// 00-99, or STAGING. NULL if neither.
+
+cat_voice_bank_t *cat_voice_bank( uint8_t bank_num ) {
+  if( bank_num == BANK_STAGING )
+    return &cat_staging;
+
+  return (bank_num < CAT_NUM_BANKS) ? &cat_voice_banks[bank_num] : NULL;
+}
+
+
+void catalog_invalidate_voice_bank( uint8_t bank_num, bool name, uint16_t voices ) {
+  cat_voice_bank_t *vb = cat_voice_bank( bank_num );
+
+  if( !catalog_cleared || !vb )
+    return;
+
+  cat_scan_abort();
+
+  if( name )
+    vb->name_valid = false;
+
+  vb->voices_valid &= ~voices;
+}
+
+
+// we just wrote this voice file and know what's in it, no need to go back to the card
+
+void catalog_set_voice( uint8_t bank_num, int vvv, char *fn, uint32_t len, uint32_t hash ) {
+  cat_voice_bank_t *vb = cat_voice_bank( bank_num );
+  cat_file_t *cf;
+
+  if( !catalog_cleared || !vb || (vvv < 0) || (vvv >= CAT_NUM_VOICES) )
+    return;
+
+  cf = &vb->voices[vvv];
+
+  if( cf == cat_scan_cf )
+    cat_scan_abort();
+
+  snprintf( cf->name, sizeof(cf->name), "%s", fn );
+  cf->len  = len;
+  cf->hash = hash;
+  cf->hashed = len;
+
+  vb->voices_valid |= (1 << vvv);
+}
+
+
+void catalog_invalidate_ram_bank( uint8_t bank_num ) {
+  if( !catalog_cleared || (bank_num >= CAT_NUM_BANKS) )
+    return;
+
+  cat_scan_abort();
+
+  cat_ram_banks[bank_num].valid = false;
+  cat_ram_banks[bank_num].hash_valid = false;
+}
+
+
+void catalog_invalidate_all() {
+  catalog_clear();
+}
+
+
+/* ================================================================================================================
+    Lookups. These only go to the card if the entry was invalidated (or we haven't been initialized).
+*/
+
+char *catalog_voice_bank_name( uint8_t bank_num ) {
+  if( !catalog_cleared )
+    catalog_clear();
+
+  if( bank_num >= CAT_NUM_BANKS )
+    return sd_voice_bank_name( bank_num );
+
+  if( !cat_voice_banks[bank_num].name_valid )
+    cat_scan_voice_bank_name( bank_num );
+
+  return cat_voice_banks[bank_num].name;
+}
+
+
+char *catalog_ram_bank_name( uint8_t bank_num ) {
+  static char not_found[32];
+
+  if( !catalog_cleared )
+    catalog_clear();
+
+  if( (bank_num < CAT_NUM_BANKS) && !cat_ram_banks[bank_num].valid )
+    cat_scan_ram_bank_name( bank_num );
+
+  if( (bank_num >= CAT_NUM_BANKS) || (cat_ram_banks[bank_num].image.name[0] == 0) ) {
+    sprintf( not_found, "No RAM Bank %02d found", bank_num );
+    return not_found;
+  }
+
+  return cat_ram_banks[bank_num].image.name;
+}
+
+
+cat_file_t *catalog_voice( uint8_t bank_num, int vvv ) {
+  cat_voice_bank_t *vb = cat_voice_bank( bank_num );
+
+  if( !catalog_cleared || !vb || (vvv < 0) || (vvv >= CAT_NUM_VOICES) )
+    return NULL;
+
+  if( !(vb->voices_valid & (1 << vvv)) )
+    return NULL;
+
+  return &vb->voices[vvv];
+}
+
+
+cat_file_t *catalog_ram_bank( uint8_t bank_num ) {
+  if( !catalog_cleared || (bank_num >= CAT_NUM_BANKS) || !cat_ram_banks[bank_num].hash_valid )
+    return NULL;
+
+  return &cat_ram_banks[bank_num].image;
+}
@@ -0,0 +1,128 @@
+/*
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LM_SMF_
+#define LM_SMF_
+
+/*
+    Standard MIDI Files
+
+    The recorder captures everything Luma plays (its own sequencer's drum triggers) and receives (notes, Start /
+    Stop / Continue from every port) into a Type-0 SMF in /RECORD/. The tempo map comes from the clock we're
+    following: the FSK clock from the Z-80 sequencer, or MIDI clock in when that's all there is.
+
+    The player streams a Type-0 or Type-1 SMF off the card and triggers the voices straight from a timer interrupt,
+    at the file's tempo (or one we're told), or following MIDI clock in.
+*/
+
+#define SMF_DIVISION                480             // ticks per quarter note
+#define SMF_DEFAULT_TEMPO_US        500000          // 120 bpm until a clock tells us otherwise
+#define SMF_HDR_LEN                 22              // MThd chunk + MTrk chunk header
+#define SMF_TRK_LEN_OFFSET          18              // where the MTrk length goes, patched when we stop
+
+#define SMF_META                    0xff
+#define SMF_META_TRACK_NAME         0x03
+#define SMF_META_END_OF_TRACK       0x2f
+#define SMF_META_TEMPO              0x51
+#define SMF_META_TIME_SIG           0x58
+#define SMF_ESCAPE                  0xf7            // F7 <len> <bytes>: raw bytes, used for Start / Stop / Continue
+
+
+// --- Recorder
+
+#define REC_DIR                     "/RECORD"
+
+#define REC_CLK_FSK                 0               // clock sources for the tempo map
+#define REC_CLK_MIDI                1
+
+// Events are logged here by whoever sees them first (interrupts included), with the cycle counter.
+// rec_service() turns them into SMF bytes.
+
+#define REC_EV_MSG                  0
+#define REC_EV_CLOCK                1
+
+typedef struct {
+  uint32_t  cycles;                                 // ARM_DWT_CYCCNT when it happened
+  uint8_t   kind;                                   // REC_EV_xx
+  uint8_t   b[3];                                   // message (status first), or clock source in b[0]
+} rec_event_t;                                      // 8 bytes
+
+#define REC_EV_RING_SIZE            256             // power of 2
+#define REC_BUF_SIZE                4096            // each half of the SMF output buffer, a multiple of the 512 byte sector
+#define REC_PREALLOC                (4UL*1024*1024) // contiguous space grabbed up front, trimmed when we stop
+
+bool rec_start();                                   // new file in REC_DIR, false if the card isn't cooperating
+void rec_stop();
+bool rec_running();
+
+void rec_msg( uint8_t status, uint8_t d1, uint8_t d2, uint32_t cycles );       // note on/off etc., or FA/FB/FC
+void rec_clock( uint8_t src, uint32_t cycles );                                // every 24 ppqn clock, from REC_CLK_xx
+
+void rec_service();                                 // call frequently, log -> SMF bytes, cheap
+void handle_recorder();                             // call from loop(), writes full buffers to SD when things are quiet
+
+
+// --- Player
+
+#define PLAY_MAX_TRACKS             16              // Type-1 files, each track has its own read position
+#define PLAY_TRK_BUF_SIZE           512             // read buffer per track
+#define PLAY_EV_RING_SIZE           512             // parsed events waiting for the interrupt, power of 2
+#define PLAY_TICK_US                100             // player interrupt rate, that's the timing resolution
+
+#define PLAY_EV_TRIG                0
+#define PLAY_EV_TEMPO               1
+#define PLAY_EV_END                 2
+
+typedef struct {
+  uint32_t  tick;                                   // absolute, in the file's ticks
+  uint32_t  val;                                    // TRIG: status | note << 8 | vel << 16, TEMPO: us per quarter note
+  uint16_t  strobe;                                 // TRIG: voice and flags from the note map
+  uint8_t   flags;
+  uint8_t   kind;                                   // PLAY_EV_xx
+} play_event_t;                                     // 12 bytes
+
+typedef struct {
+  uint32_t  start;                                  // file offset of the first event
+  uint32_t  next;                                   // file offset of the next byte to read into the buffer
+  uint32_t  end;                                    // file offset of the end of the MTrk chunk
+  uint16_t  len;                                    // bytes in the buffer
+  uint16_t  idx;                                    // next byte in the buffer
+  uint32_t  tick;                                   // time of the event we're sitting on (its delta has been read)
+  uint8_t   running;                                // running status
+  bool      done;
+  uint8_t   *buf;
+} play_track_t;
+
+bool play_start( const char *path, bool follow, int bpm );     // follow MIDI clock in, or bpm (0 = the file's tempo)
+void play_stop();
+bool play_running();
+
+void play_clock();                                  // from midi_clock_in(), interrupts off
+void play_midi_start();                             // MIDI Start / Stop / Continue, when following
+void play_midi_stop();
+void play_midi_continue();
+
+void handle_player();                               // call from loop(), reads and parses ahead of the playhead
+
+
+#endif
@@ -0,0 +1,772 @@
+/*
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <SD.h>
+#include "LM_SMF.h"
+#include "LM_SDCard.h"
+#include "LM_DrumTriggers.h"
+#include "LM_Z80Bus.h"
+#include "LM_Voices.h"
+
+/* ---------------------------------------------------------------------------------------
+    SMF Player
+
+    Songs too long for the 8 KB pattern RAM play straight off the card. Two halves:
+
+      1. handle_player() (from loop()) reads each track through a small buffer of its own, merges the tracks by time,
+         maps notes to voices with the note map, and drops the results into play_ev_ring. It stays up to
+         PLAY_EV_RING_SIZE events ahead of the playhead, and only touches the card when no MIDI input or drum
+         triggers are waiting, one read per call. RAM use doesn't depend on the size of the file.
+
+      2. play_tick(), a PLAY_TICK_US timer interrupt, works out where the playhead is and strobes every voice that's
+         due, all of a chord in one trig_voices(). Nothing in loop() can make a hit late, except holding the Z-80 bus:
+         then it tries again next tick, and if the bus is held for PLAY_STALE_US, the hits that came due are dropped
+         instead of all going off late in a pile.
+
+    The playhead runs from the file's tempo map (or a fixed bpm), or follows MIDI clock in: MIDI Start plays from the
+    top on the next clock, each clock is 1/24 quarter note, and between clocks the position is interpolated with the
+    filtered clock period from the tempo clock tracking loop (pll). It never runs past the next clock before that
+    clock shows up. Stop / Continue pause and resume.
+
+    The expander sees our strobes like the Z-80's. self_trig_mark() tells the trigger interrupt to drop them, so they
+    don't come back out as MIDI. What's played goes to the recorder, if it's running.
+*/
+
+#define PLAY_EV_RING_MASK           (PLAY_EV_RING_SIZE - 1)
+
+#define PLAY_CYC_PER_US             (F_CPU_ACTUAL / 1000000)
+#define PLAY_STALE_US               20000           // bus held this long, drop the hits that came due
+
+#define PLAY_IDLE                   0
+#define PLAY_CUEING                 1               // loop() is refilling from the top, interrupt keeps its hands off
+#define PLAY_WAIT                   2               // following MIDI clock, waiting for Start
+#define PLAY_RUNNING                3
+#define PLAY_PAUSED                 4               // following MIDI clock, got Stop
+#define PLAY_DONE                   5               // interrupt played the end, loop() cleans up
+
+static_assert( (PLAY_EV_RING_SIZE & PLAY_EV_RING_MASK) == 0, "PLAY_EV_RING_SIZE must be a power of 2" );
+
+DMAMEM play_event_t play_ev_ring[PLAY_EV_RING_SIZE];     // DTCM is spoken for, the cache makes OCRAM about as quick
+uint32_t play_ev_head = 0;                          // only handle_player() writes this
+uint32_t play_ev_tail = 0;                          // only play_tick() writes this, except when cueing
+
+DMAMEM uint8_t play_trk_buf[PLAY_MAX_TRACKS][PLAY_TRK_BUF_SIZE] __attribute__((aligned(32)));
+
+play_track_t play_trk[PLAY_MAX_TRACKS];
+int      play_num_trks;
+
+FsFile   play_file;
+char     play_path[MAX_LEN_PATH_NAME];
+uint16_t play_division;                             // the file's ticks per quarter note
+bool     play_follow;                               // MIDI clock in is the playhead
+uint32_t play_fixed_tempo_us;                       // 0 = tempo from the file
+
+volatile bool play_end_queued;                      // everything's parsed, PLAY_EV_END is in the ring
+uint32_t play_end_tick;
+bool     play_read_error;
+
+volatile uint8_t play_state = PLAY_IDLE;
+
+IntervalTimer playTimer;
+
+// --- time, interrupt side
+
+uint64_t play_t64;                                  // cycles since the playhead was at 0 (internal tempo)
+uint32_t play_last_cyc;
+
+uint64_t play_seg_t0;                               // time and tick of the last tempo change
+uint32_t play_seg_tick0;
+uint32_t play_tempo_us;
+
+uint32_t play_clocks;                               // MIDI clocks since Start, following
+bool     play_clk_wait;                             // got Start, next clock is clock 0
+bool     play_clk_started;                          // clock 0 has come in
+bool     play_clk_resume;                           // got Continue, next clock moves us on
+
+bool     play_deferring;                            // hits are due but the bus is busy
+uint32_t play_defer_start;
+
+// --- stats
+
+uint32_t play_hits;
+uint32_t play_chords;
+uint32_t play_tempo_changes;
+uint32_t play_bus_waits;                            // had to wait for loop() to let go of the bus
+uint32_t play_dropped;                              // waited too long
+uint32_t play_starved;                              // ticks with nothing parsed yet, loop() fell behind
+uint32_t play_max_late_us;                          // internal tempo only
+uint32_t play_reads;
+
+
+bool play_running() {
+  return play_state != PLAY_IDLE;
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    Playhead, interrupt side
+*/
+
+uint64_t play_tick_t64( uint32_t tick ) {
+  return play_seg_t0 + (uint64_t)(tick - play_seg_tick0) * play_tempo_us * PLAY_CYC_PER_US / play_division;
+}
+
+
+void play_set_tempo( uint32_t tick, uint32_t tempo_us ) {
+  play_seg_t0 = play_tick_t64( tick );              // new tempo starts exactly on its tick
+  play_seg_tick0 = tick;
+  play_tempo_us = tempo_us;
+  play_tempo_changes++;
+}
+
+
+uint32_t play_now_tick( uint32_t now ) {
+  int32_t since;
+  uint32_t frac = 0;
+
+  if( play_follow ) {
+    since = (int32_t)(now - pll.ref);               // filtered time of the latest clock
+
+    if( (since > 0) && (pll.period >= 1) ) {
+      frac = (uint32_t)( (float)since * 256 / pll.period );
+      if( frac > 255 )
+        frac = 255;                                 // don't run into the next clock, wait for it
+    }
+
+    return ((uint64_t)play_clocks * 256 + frac) * play_division / (24 * 256);
+  }
+
+  return play_seg_tick0 + (uint32_t)( (play_t64 - play_seg_t0) * play_division / ((uint64_t)play_tempo_us * PLAY_CYC_PER_US) );
+}
+
+
+void play_tick() {                                  // INTERRUPT CONTEXT
+  uint32_t now = ARM_DWT_CYCCNT;
+  uint32_t head, tail;
+  uint32_t now_tick;
+  uint32_t late_us;
+  uint64_t due = 0;
+  play_event_t *e;
+  uint16_t strobes[TRIG_VOICES_MAX];
+  uint8_t flags[TRIG_VOICES_MAX];
+  uint32_t msgs[TRIG_VOICES_MAX];
+  bool fire;
+  int n = 0;
+  int i;
+
+  play_t64 += (uint32_t)(now - play_last_cyc);
+  play_last_cyc = now;
+
+  if( play_state != PLAY_RUNNING )
+    return;
+
+  head = __atomic_load_n( &play_ev_head, __ATOMIC_ACQUIRE );
+  tail = play_ev_tail;
+
+  if( tail == head ) {
+    if( !play_end_queued )
+      play_starved++;
+    return;
+  }
+
+  now_tick = play_now_tick( now );
+  e = &play_ev_ring[tail & PLAY_EV_RING_MASK];
+
+  if( (int32_t)(now_tick - e->tick) < 0 )           // nothing due yet
+    return;
+
+  fire = !z80_bus_in_use();
+
+  if( !fire ) {
+    if( !play_deferring ) {
+      play_deferring = true;
+      play_defer_start = now;
+      play_bus_waits++;
+    }
+
+    if( (now - play_defer_start) < (PLAY_STALE_US * PLAY_CYC_PER_US) )
+      return;                                       // try again next tick
+  }
+
+  if( !play_follow )
+    due = play_tick_t64( e->tick );
+
+  while( (tail != head) && ((int32_t)(now_tick - e->tick) >= 0) ) {
+    switch( e->kind ) {
+      case PLAY_EV_TEMPO:
+        if( !play_follow ) {                        // following, the clock is the tempo
+          play_set_tempo( e->tick, e->val );
+          now_tick = play_now_tick( now );
+        }
+        break;
+
+      case PLAY_EV_END:
+        play_state = PLAY_DONE;
+        break;
+
+      case PLAY_EV_TRIG:
+        for( i = 0; i != n; i++ )                   // same voice twice at once, last one wins
+          if( strobes[i] == e->strobe )
+            break;
+
+        if( i != TRIG_VOICES_MAX ) {
+          strobes[i] = e->strobe;
+          flags[i] = e->flags;
+          msgs[i] = e->val;
+
+          if( i == n )
+            n++;
+        }
+        break;
+    }
+
+    tail++;
+    e = &play_ev_ring[tail & PLAY_EV_RING_MASK];
+  }
+
+  __atomic_store_n( &play_ev_tail, tail, __ATOMIC_RELEASE );           // slots are free for handle_player() again
+
+  if( !n )
+    return;
+
+  if( !fire ) {
+    play_dropped += n;
+    return;
+  }
+
+  self_trig_mark();                                 // the trigger interrupt will see these, they're not the Z-80's
+
+  teensy_drives_z80_bus( true );                    // nobody in loop() has it, checked above
+  trig_voices( strobes, flags, n );
+  teensy_drives_z80_bus( false );
+
+  play_deferring = false;
+
+  for( i = 0; i != n; i++ )
+    rec_msg( msgs[i], msgs[i] >> 8, msgs[i] >> 16, now );
+
+  play_hits += n;
+  play_chords++;
+
+  if( !play_follow && (play_t64 > due) ) {
+    late_us = (uint32_t)((play_t64 - due) / PLAY_CYC_PER_US);
+    if( late_us > play_max_late_us )
+      play_max_late_us = late_us;
+  }
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    Following MIDI clock, loop() side, interrupts off in play_clock()
+*/
+
+void play_clock() {
+  if( !play_follow )
+    return;
+
+  if( play_clk_wait ) {
+    play_clocks = 0;                                // first clock after Start is the downbeat
+    play_clk_wait = false;
+    play_clk_started = true;
+
+    if( play_state == PLAY_WAIT )
+      play_state = PLAY_RUNNING;                    // (still cueing, handle_player() starts us when it's done)
+  }
+  else if( (play_state == PLAY_RUNNING) || ((play_state == PLAY_CUEING) && play_clk_started) ) {
+    play_clocks++;
+  }
+  else if( (play_state == PLAY_PAUSED) && play_clk_resume ) {
+    play_clocks++;
+    play_clk_resume = false;
+    play_state = PLAY_RUNNING;
+  }
+}
+
+
+void play_midi_start() {
+  if( !play_follow || (play_state == PLAY_IDLE) )
+    return;
+
+  noInterrupts();
+  play_clk_wait = true;
+  play_clk_started = false;
+  play_clk_resume = false;
+  play_state = PLAY_CUEING;                         // back to the top, handle_player() refills
+  interrupts();
+}
+
+
+void play_midi_stop() {
+  if( !play_follow )
+    return;
+
+  noInterrupts();
+  play_clk_wait = false;
+
+  if( play_state == PLAY_RUNNING )
+    play_state = PLAY_PAUSED;
+  else if( play_state == PLAY_CUEING )
+    play_clk_started = false;                       // stopped before we got going, wait for the next Start
+  interrupts();
+}
+
+
+void play_midi_continue() {
+  if( play_follow && (play_state == PLAY_PAUSED) )
+    play_clk_resume = true;
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    Reading and parsing, loop() side
+*/
+
+int play_trk_byte( play_track_t *t ) {
+  uint32_t n;
+
+  if( t->idx == t->len ) {
+    if( t->next >= t->end )
+      return -1;
+
+    n = t->end - t->next;
+    if( n > PLAY_TRK_BUF_SIZE )
+      n = PLAY_TRK_BUF_SIZE;
+
+    if( !play_file.seekSet( t->next ) || (play_file.read( t->buf, n ) != (int)n) ) {
+      play_read_error = true;
+      return -1;
+    }
+
+    t->next += n;
+    t->len = n;
+    t->idx = 0;
+    play_reads++;
+  }
+
+  return t->buf[t->idx++];
+}
+
+
+bool play_trk_skip( play_track_t *t, uint32_t n ) {
+  uint32_t in_buf = t->len - t->idx;
+
+  if( n <= in_buf ) {
+    t->idx += n;
+    return true;
+  }
+
+  n -= in_buf;                                      // skip the rest of the buffer, and then some of the file
+  t->idx = t->len;
+
+  if( n > (t->end - t->next) )
+    return false;
+
+  t->next += n;
+  return true;
+}
+
+
+bool play_trk_vlq( play_track_t *t, uint32_t *v ) {
+  int b;
+
+  *v = 0;
+
+  for( int i = 0; i != 4; i++ ) {
+    if( (b = play_trk_byte( t )) < 0 )
+      return false;
+
+    *v = (*v << 7) | (b & 0x7f);
+
+    if( !(b & 0x80) )
+      return true;
+  }
+
+  return false;                                     // more than 4 bytes, not a legal VLQ
+}
+
+
+void play_trk_delta( play_track_t *t ) {
+  uint32_t delta;
+
+  if( play_trk_vlq( t, &delta ) )
+    t->tick += delta;
+  else
+    t->done = true;                                 // ran off the end without an End of Track
+}
+
+
+void play_push( uint8_t kind, uint32_t tick, uint32_t val, uint16_t strobe, uint8_t flags ) {
+  play_event_t *e = &play_ev_ring[play_ev_head & PLAY_EV_RING_MASK];
+
+  e->tick = tick;
+  e->val = val;
+  e->strobe = strobe;
+  e->flags = flags;
+  e->kind = kind;
+
+  __atomic_store_n( &play_ev_head, play_ev_head + 1, __ATOMIC_RELEASE );   // publish
+}
+
+
+// Parse the event the track is sitting on, queue it if it's something we play, then read the next delta.
+
+void play_trk_event( play_track_t *t ) {
+  int c, type, d1, d2 = 0;
+  uint8_t status;
+  uint32_t len;
+  uint32_t tempo_us = 0;
+  uint16_t strobe;
+  uint8_t flags;
+
+  if( (c = play_trk_byte( t )) < 0 ) {
+    t->done = true;
+    return;
+  }
+
+  if( c == SMF_META ) {
+    t->running = 0;                                 // meta events and SysEx cancel running status
+
+    if( ((type = play_trk_byte( t )) < 0) || !play_trk_vlq( t, &len ) ) {
+      t->done = true;
+      return;
+    }
+
+    if( type == SMF_META_END_OF_TRACK ) {
+      t->done = true;
+      return;
+    }
+
+    if( (type == SMF_META_TEMPO) && (len == 3) ) {
+      for( int i = 0; i != 3; i++ ) {
+        if( (c = play_trk_byte( t )) < 0 ) {
+          t->done = true;
+          return;
+        }
+        tempo_us = (tempo_us << 8) | c;
+      }
+
+      if( !play_fixed_tempo_us && tempo_us )
+        play_push( PLAY_EV_TEMPO, t->tick, tempo_us, 0, 0 );
+    }
+    else if( !play_trk_skip( t, len ) ) {
+      t->done = true;
+      return;
+    }
+  }
+  else if( (c == 0xf0) || (c == SMF_ESCAPE) ) {
+    t->running = 0;
+
+    if( !play_trk_vlq( t, &len ) || !play_trk_skip( t, len ) ) {
+      t->done = true;
+      return;
+    }
+  }
+  else {
+    if( c & 0x80 ) {
+      status = c;
+      t->running = c;
+      d1 = play_trk_byte( t );
+    }
+    else {
+      status = t->running;                          // running status, that was the first data byte
+      d1 = c;
+    }
+
+    if( !status || (status >= 0xf0) || (d1 < 0) ) {          // not a channel message, the file is broken
+      t->done = true;
+      return;
+    }
+
+    if( ((status & 0xf0) != 0xc0) && ((status & 0xf0) != 0xd0) && ((d2 = play_trk_byte( t )) < 0) ) {
+      t->done = true;
+      return;
+    }
+
+    // Note Ons on any channel, through the note map. Note Off doesn't do anything to a Luma voice.
+
+    if( ((status & 0xf0) == 0x90) && (d2 != 0) && map_midi_2_strobe( d1, d2, &strobe, &flags ) )
+      play_push( PLAY_EV_TRIG, t->tick, status | (d1 << 8) | (d2 << 16), strobe, flags );
+  }
+
+  play_trk_delta( t );
+}
+
+
+// Parse ahead until the ring is full. all = false stops after one card read, so MIDI gets a turn.
+
+void play_fill( bool all ) {
+  uint32_t reads = play_reads;
+  play_track_t *t;
+
+  while( (play_ev_head - __atomic_load_n( &play_ev_tail, __ATOMIC_ACQUIRE )) < PLAY_EV_RING_SIZE ) {
+
+    t = NULL;                                       // the track with the earliest next event
+    for( int i = 0; i != play_num_trks; i++ )
+      if( !play_trk[i].done && (!t || (play_trk[i].tick < t->tick)) )
+        t = &play_trk[i];
+
+    if( !t ) {
+      if( !play_end_queued ) {
+        play_push( PLAY_EV_END, play_end_tick, 0, 0, 0 );
+        play_end_queued = true;
+      }
+      return;
+    }
+
+    play_trk_event( t );                            // queues at most one event
+
+    if( t->done && (t->tick > play_end_tick) )
+      play_end_tick = t->tick;                      // song ends with the longest track
+
+    if( !all && (play_reads != reads) )
+      return;
+  }
+}
+
+
+// Back to the top of every track and fill the ring. The interrupt has to be leaving the ring alone.
+
+void play_cue() {
+  play_track_t *t;
+
+  play_ev_head = play_ev_tail = 0;
+  play_end_queued = false;
+  play_end_tick = 0;
+
+  for( int i = 0; i != play_num_trks; i++ ) {
+    t = &play_trk[i];
+    t->next = t->start;
+    t->len = t->idx = 0;
+    t->tick = 0;
+    t->running = 0;
+    t->done = false;
+
+    play_trk_delta( t );
+  }
+
+  play_fill( true );
+}
+
+
+void play_rewind_time() {                           // interrupts off
+  play_last_cyc = ARM_DWT_CYCCNT;
+  play_t64 = 0;
+  play_seg_t0 = 0;
+  play_seg_tick0 = 0;
+  play_tempo_us = play_fixed_tempo_us ? play_fixed_tempo_us : SMF_DEFAULT_TEMPO_US;
+  play_deferring = false;
+}
+
+
+uint32_t play_be( uint8_t *b, int n ) {
+  uint32_t v = 0;
+
+  while( n-- )
+    v = (v << 8) | *b++;
+
+  return v;
+}
+
+
+bool play_open( const char *path ) {
+  uint8_t hdr[14];
+  uint32_t pos, size, len;
+  uint16_t format, ntrks;
+  play_track_t *t;
+
+  if( !play_file.open( path, O_RDONLY ) ) {
+    Serial.printf("### player: could not open %s\n", path);
+    return false;
+  }
+
+  size = play_file.fileSize();
+
+  if( (play_file.read( hdr, sizeof(hdr) ) != sizeof(hdr)) || memcmp( hdr, "MThd", 4 ) || (play_be( &hdr[4], 4 ) < 6) ) {
+    Serial.printf("### player: %s is not a MIDI file\n", path);
+    play_file.close();
+    return false;
+  }
+
+  format = play_be( &hdr[8], 2 );
+  ntrks = play_be( &hdr[10], 2 );
+  play_division = play_be( &hdr[12], 2 );
+
+  if( (format > 1) || (play_division & 0x8000) || !play_division ) {
+    Serial.printf("### player: %s is format %d, division %04X. Need format 0 or 1, ticks per quarter note\n", path, format, play_division);
+    play_file.close();
+    return false;
+  }
+
+  // find the MTrk chunks, skip anything else
+
+  play_num_trks = 0;
+
+  for( pos = 8 + play_be( &hdr[4], 4 ); (play_num_trks != ntrks) && ((pos + 8) <= size); pos += 8 + len ) {
+    if( !play_file.seekSet( pos ) || (play_file.read( hdr, 8 ) != 8) )
+      break;
+
+    len = play_be( &hdr[4], 4 );
+
+    if( memcmp( hdr, "MTrk", 4 ) )
+      continue;
+
+    if( play_num_trks == PLAY_MAX_TRACKS ) {
+      Serial.printf("### player: %s has more than %d tracks\n", path, PLAY_MAX_TRACKS);
+      play_file.close();
+      return false;
+    }
+
+    t = &play_trk[play_num_trks];
+    t->start = pos + 8;
+    t->end = ((pos + 8 + len) > size) ? size : (pos + 8 + len);         // truncated file, play what's there
+    t->buf = play_trk_buf[play_num_trks];
+    play_num_trks++;
+  }
+
+  if( !play_num_trks ) {
+    Serial.printf("### player: no tracks in %s\n", path);
+    play_file.close();
+    return false;
+  }
+
+  Serial.printf("Player: %s, format %d, %d tracks, %d ppqn\n", path, format, play_num_trks, play_division);
+
+  return true;
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    Start / stop, loop() side
+*/
+
+bool play_start( const char *path, bool follow, int bpm ) {
+
+  if( play_state != PLAY_IDLE )
+    play_stop();
+
+  if( !play_open( path ) )
+    return false;
+
+  snprintf( play_path, sizeof(play_path), "%s", path );
+
+  play_follow = follow;
+  play_fixed_tempo_us = (bpm > 0) ? (60000000 / bpm) : 0;
+
+  play_hits = play_chords = play_tempo_changes = play_bus_waits = play_dropped = play_starved = play_max_late_us = play_reads = 0;
+
+  play_state = PLAY_CUEING;
+  play_read_error = false;
+  play_cue();
+
+  if( play_read_error ) {
+    Serial.printf("### player: could not read %s\n", play_path);
+    play_file.close();
+    play_state = PLAY_IDLE;
+    return false;
+  }
+
+  noInterrupts();
+  play_rewind_time();
+  play_clocks = 0;
+  play_clk_wait = false;
+  play_clk_started = false;
+  play_clk_resume = false;
+  play_state = follow ? PLAY_WAIT : PLAY_RUNNING;
+  interrupts();
+
+  playTimer.begin( play_tick, PLAY_TICK_US );
+  playTimer.priority( 16 );                         // under the tempo clock, over the trigger expander and MIDI
+
+  if( follow )
+    Serial.printf("Player: waiting for MIDI Start\n");
+  else if( bpm > 0 )
+    Serial.printf("Player: playing at %d bpm\n", bpm);
+  else
+    Serial.printf("Player: playing\n");
+
+  return true;
+}
+
+
+void play_print_stats() {
+  Serial.printf("Played %s: %d hits in %d chords, %d tempo changes, %d card reads\n",
+                play_path, play_hits, play_chords, play_tempo_changes, play_reads);
+  Serial.printf("  %d waits for the Z-80 bus, %d hits dropped, %d ticks with nothing parsed yet, %d of our strobes ignored by the trigger interrupt\n",
+                play_bus_waits, play_dropped, play_starved, self_trigs_ignored());
+
+  if( !play_follow )
+    Serial.printf("  worst hit %d us late (timer tick is %d us)\n", play_max_late_us, PLAY_TICK_US);
+}
+
+
+void play_stop() {
+  if( play_state == PLAY_IDLE )
+    return;
+
+  playTimer.end();
+  play_state = PLAY_IDLE;
+  play_file.close();
+
+  play_print_stats();
+}
+
+
+void handle_player() {
+  drum_trig_event dte;
+
+  switch( play_state ) {
+    case PLAY_IDLE:
+      return;
+
+    case PLAY_DONE:
+      if( !play_follow ) {
+        play_stop();
+        return;
+      }
+
+      play_print_stats();                           // following, be ready for the next Start
+      play_state = PLAY_CUEING;
+      play_clk_started = false;
+      // fall through
+
+    case PLAY_CUEING:                               // from the top, after MIDI Start or the end of the song
+      play_cue();
+
+      noInterrupts();
+      play_rewind_time();
+      play_state = play_clk_started ? PLAY_RUNNING : PLAY_WAIT;    // clock 0 may have come in while we were reading
+      interrupts();
+      break;
+  }
+
+  if( play_read_error ) {
+    Serial.printf("### player: read error on %s, stopping\n", play_path);
+    play_stop();
+    return;
+  }
+
+  if( midi_in_pending() || peek_trig_event( &dte ) )          // busy, we're far enough ahead to wait
+    return;
+
+  play_fill( false );
+}
@@ -0,0 +1,505 @@
+/*
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <SD.h>
+#include "LM_SMF.h"
+#include "LM_SDCard.h"
+#include "LM_DrumTriggers.h"
+
+/* ---------------------------------------------------------------------------------------
+    SMF Recorder
+
+    Nothing on the MIDI path waits for the SD card:
+
+      1. Whoever sees an event first logs it with the cycle counter -- the trigger interrupt's timestamp for drum
+         hits, the input pump for received messages, the FSK edge interrupt / MIDI clock in for clocks. That's just
+         a copy into rec_ev_ring.
+
+      2. rec_service() (from loop_time_critical(), it's cheap) turns logged events into SMF track bytes, in one half
+         of rec_buf. When a half fills up, filling moves on to the other half.
+
+      3. handle_recorder() (from loop()) writes a full half to the card in one REC_BUF_SIZE write, when no MIDI input
+         or drum triggers are waiting. The SMF header is the first thing in the first half, so every write starts on
+         a REC_BUF_SIZE boundary in the file, and the file is preallocated so the card isn't hunting for clusters.
+
+    Times are kept in cycles (extended to 64 bits here, the counter wraps every ~7s) and converted to ticks using the
+    current tempo, so what's in the file plays back at the real time it happened. Tempo changes come from measuring
+    24 clocks (one quarter note) of the FSK clock (our own sequencer), or MIDI clock in if there's no FSK clock.
+*/
+
+#define REC_EV_RING_MASK            (REC_EV_RING_SIZE - 1)
+
+#define REC_CYC_PER_US              (F_CPU_ACTUAL / 1000000)
+#define REC_CLK_LOST_US             250000          // no clock for this long -> it stopped, measure from scratch
+#define REC_TEMPO_HYSTERESIS        200             // tempo has to move by more than 1/200 to get a new tempo event
+#define REC_EV_MAX_BYTES            12              // biggest thing one event turns into (delta + meta tempo)
+
+rec_event_t rec_ev_ring[REC_EV_RING_SIZE];
+volatile uint32_t rec_ev_head = 0;
+volatile uint32_t rec_ev_tail = 0;
+
+DMAMEM uint8_t rec_buf[2][REC_BUF_SIZE] __attribute__((aligned(32)));     // 32 byte aligned for SDIO DMA
+
+int      rec_fill = 0;                              // half being filled
+int      rec_fill_len = 0;
+bool     rec_half_full[2];                          // waiting to be written to the card
+
+FsFile   rec_file;
+char     rec_path[MAX_LEN_PATH_NAME];
+uint32_t rec_file_len;                              // bytes written so far
+
+volatile bool rec_on = false;
+
+// --- time
+
+uint64_t rec_now64;                                 // cycles since we started
+uint32_t rec_now_cyc;                               // ARM_DWT_CYCCNT that goes with rec_now64
+
+uint64_t rec_last_t;                                // time of the last event written
+uint32_t rec_last_tick;
+
+uint64_t rec_tempo_t0;                              // time and tick of the last tempo change
+uint32_t rec_tempo_tick0;
+uint32_t rec_tempo_us;                              // current tempo, us per quarter note
+
+// --- clock measurement, per REC_CLK_xx
+
+bool     rec_clk_seen[2];
+uint64_t rec_clk_last[2];
+uint64_t rec_clk_q_start[2];                        // first clock of the quarter note being measured
+int      rec_clk_n[2];
+
+// --- stats
+
+uint32_t rec_events;
+uint32_t rec_ev_dropped;                            // log was full
+uint32_t rec_buf_overruns;                          // both halves full, card too slow
+uint32_t rec_tempo_changes;
+uint32_t rec_max_write_us;
+
+
+bool rec_running() {
+  return rec_on;
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    1. Logging, may be called from interrupts
+*/
+
+void rec_log( uint8_t kind, uint8_t b0, uint8_t b1, uint8_t b2, uint32_t cycles ) {
+  rec_event_t *e;
+
+  if( !rec_on )
+    return;
+
+  noInterrupts();
+  if( (rec_ev_head - rec_ev_tail) == REC_EV_RING_SIZE ) {
+    rec_ev_dropped++;
+  }
+  else {
+    e = &rec_ev_ring[rec_ev_head & REC_EV_RING_MASK];
+    e->cycles = cycles;
+    e->kind = kind;
+    e->b[0] = b0;
+    e->b[1] = b1;
+    e->b[2] = b2;
+    rec_ev_head++;
+  }
+  interrupts();
+}
+
+
+void rec_msg( uint8_t status, uint8_t d1, uint8_t d2, uint32_t cycles ) {
+  if( status == 0xf8 )                              // clocks come in thru rec_clock(), from the source we follow
+    return;
+
+  rec_log( REC_EV_MSG, status, d1, d2, cycles );
+}
+
+
+void rec_clock( uint8_t src, uint32_t cycles ) {
+  rec_log( REC_EV_CLOCK, src, 0, 0, cycles );
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    2. Log -> SMF bytes
+*/
+
+// room for n more bytes without running into a half that hasn't been written yet
+
+bool rec_room( int n ) {
+  int space = REC_BUF_SIZE - rec_fill_len;
+
+  if( rec_half_full[rec_fill] )                     // the last put filled a half and moved us into one not yet written
+    return false;
+
+  if( !rec_half_full[rec_fill ^ 1] )
+    space += REC_BUF_SIZE;
+
+  return n <= space;
+}
+
+
+void rec_put( uint8_t b ) {
+  rec_buf[rec_fill][rec_fill_len++] = b;
+
+  if( rec_fill_len == REC_BUF_SIZE ) {
+    rec_half_full[rec_fill] = true;
+    rec_fill ^= 1;
+    rec_fill_len = 0;
+  }
+}
+
+
+void rec_put32( uint32_t v ) {
+  rec_put( v >> 24 );
+  rec_put( v >> 16 );
+  rec_put( v >> 8 );
+  rec_put( v );
+}
+
+
+void rec_put_vlq( uint32_t v ) {
+  uint8_t tmp[5];
+  int n = 0;
+
+  tmp[n++] = v & 0x7f;
+  while( v >>= 7 )
+    tmp[n++] = 0x80 | (v & 0x7f);
+
+  while( n )
+    rec_put( tmp[--n] );
+}
+
+
+uint32_t rec_ticks_at( uint64_t t ) {
+  return rec_tempo_tick0 + (uint32_t)( (t - rec_tempo_t0) * SMF_DIVISION / ((uint64_t)rec_tempo_us * REC_CYC_PER_US) );
+}
+
+
+void rec_put_delta( uint64_t t ) {
+  uint32_t tick;
+
+  if( t < rec_last_t )                              // logged a little out of order (trigger vs input), keep deltas >= 0
+    t = rec_last_t;
+  rec_last_t = t;
+
+  tick = rec_ticks_at( t );
+  rec_put_vlq( tick - rec_last_tick );
+  rec_last_tick = tick;
+}
+
+
+void rec_put_tempo() {
+  rec_put( SMF_META );
+  rec_put( SMF_META_TEMPO );
+  rec_put( 3 );
+  rec_put( rec_tempo_us >> 16 );
+  rec_put( rec_tempo_us >> 8 );
+  rec_put( rec_tempo_us );
+}
+
+
+void rec_set_tempo( uint64_t t, uint32_t tempo_us ) {
+  rec_put_delta( t );
+
+  // new tempo starts on the tick we just wrote, so ticks stay continuous
+  rec_tempo_t0 += (uint64_t)(rec_last_tick - rec_tempo_tick0) * rec_tempo_us * REC_CYC_PER_US / SMF_DIVISION;
+  rec_tempo_tick0 = rec_last_tick;
+  rec_tempo_us = tempo_us;
+
+  rec_put_tempo();
+  rec_tempo_changes++;
+}
+
+
+void rec_clock_event( uint8_t src, uint64_t t ) {
+  uint32_t lost = REC_CLK_LOST_US * REC_CYC_PER_US;
+  uint32_t tempo_us;
+  uint32_t diff;
+
+  if( src > REC_CLK_MIDI )
+    return;
+
+  if( !rec_clk_seen[src] || ((t - rec_clk_last[src]) > lost) ) {
+    rec_clk_n[src] = 0;                             // (re)started, this is the first clock of a quarter note
+    rec_clk_q_start[src] = t;
+  }
+  else if( ++rec_clk_n[src] == 24 ) {
+    tempo_us = (uint32_t)((t - rec_clk_q_start[src]) / REC_CYC_PER_US);
+    rec_clk_n[src] = 0;
+    rec_clk_q_start[src] = t;
+
+    // the FSK clock is our own sequencer, MIDI clock in only counts when that's quiet
+
+    if( (src == REC_CLK_FSK) || !rec_clk_seen[REC_CLK_FSK] || ((t - rec_clk_last[REC_CLK_FSK]) > lost) ) {
+      diff = (tempo_us > rec_tempo_us) ? (tempo_us - rec_tempo_us) : (rec_tempo_us - tempo_us);
+
+      if( diff > (rec_tempo_us / REC_TEMPO_HYSTERESIS) )
+        rec_set_tempo( t, tempo_us );
+    }
+  }
+
+  rec_clk_seen[src] = true;
+  rec_clk_last[src] = t;
+}
+
+
+void rec_msg_event( uint8_t *b, uint64_t t ) {
+
+  if( b[0] >= 0xf0 ) {                              // system messages, just Start / Continue / Stop are kept
+    if( (b[0] != 0xfa) && (b[0] != 0xfb) && (b[0] != 0xfc) )
+      return;
+
+    rec_put_delta( t );
+    rec_put( SMF_ESCAPE );
+    rec_put( 1 );
+    rec_put( b[0] );
+  }
+  else {
+    rec_put_delta( t );
+    for( int i = 0, n = thru_msg_len( b[0] ); i < n; i++ )
+      rec_put( b[i] );
+  }
+
+  rec_events++;
+}
+
+
+void rec_service() {
+  uint32_t head;
+  uint32_t now;
+  uint32_t age;
+  uint64_t t;
+  rec_event_t e;
+
+  if( !rec_on )
+    return;
+
+  head = rec_ev_head;                               // everything up to here was logged before now
+  now = ARM_DWT_CYCCNT;
+
+  rec_now64 += (uint32_t)(now - rec_now_cyc);
+  rec_now_cyc = now;
+
+  while( rec_ev_tail != head ) {
+    e = rec_ev_ring[rec_ev_tail & REC_EV_RING_MASK];
+    rec_ev_tail++;
+
+    if( !rec_room( REC_EV_MAX_BYTES ) ) {
+      rec_buf_overruns++;
+      continue;
+    }
+
+    age = now - e.cycles;
+    t = (age > rec_now64) ? 0 : (rec_now64 - age);              // logged just before we started
+
+    if( e.kind == REC_EV_CLOCK )
+      rec_clock_event( e.b[0], t );
+    else
+      rec_msg_event( e.b, t );
+  }
+}
+
+
+/* ---------------------------------------------------------------------------------------
+    3. SMF bytes -> card
+*/
+
+bool rec_write( uint8_t *d, uint32_t len ) {
+  elapsedMicros write_time;
+
+  if( rec_file.write( d, len ) != len ) {
+    Serial.printf("### recorder: short write to %s, card full?\n", rec_path);
+    return false;
+  }
+
+  rec_file_len += len;
+
+  if( write_time > rec_max_write_us )
+    rec_max_write_us = write_time;
+
+  return true;
+}
+
+
+void rec_abort() {
+  rec_on = false;
+  rec_file.close();
+  Serial.printf("### recorder: stopped, %s is incomplete\n", rec_path);
+}
+
+
+void handle_recorder() {
+  drum_trig_event dte;
+
+  if( !rec_on )
+    return;
+
+  if( midi_in_pending() || peek_trig_event( &dte ) )          // busy, the buffer can wait a bit
+    return;
+
+  for( int i = 0; i < 2; i++ ) {
+    if( rec_half_full[i] && (i != rec_fill) ) {
+      if( !rec_write( rec_buf[i], REC_BUF_SIZE ) ) {
+        rec_abort();
+        return;
+      }
+      rec_half_full[i] = false;
+      return;                                                 // one write per call, let MIDI have a turn
+    }
+  }
+}
+
+
+bool rec_start() {
+  int n;
+
+  if( rec_on )
+    return true;
+
+  if( !SD.exists( REC_DIR ) && !SD.mkdir( REC_DIR ) ) {
+    Serial.printf("### recorder: could not make %s\n", REC_DIR);
+    return false;
+  }
+
+  for( n = 1; n < 10000; n++ ) {
+    sprintf( rec_path, "%s/LUMA%04d.MID", REC_DIR, n );
+    if( !SD.exists( rec_path ) )
+      break;
+  }
+
+  if( n == 10000 ) {
+    Serial.printf("### recorder: %s is full\n", REC_DIR);
+    return false;
+  }
+
+  if( !rec_file.open( rec_path, (O_RDWR | O_CREAT | O_TRUNC) ) ) {
+    Serial.printf("### recorder: could not open %s for writing\n", rec_path);
+    return false;
+  }
+
+  if( !rec_file.preAllocate( REC_PREALLOC ) )                 // not fatal, card may just be fragmented
+    Serial.printf("recorder: could not preallocate %d contiguous bytes for %s\n", REC_PREALLOC, rec_path);
+
+  rec_fill = 0;
+  rec_fill_len = 0;
+  rec_half_full[0] = rec_half_full[1] = false;
+  rec_file_len = 0;
+
+  rec_now_cyc = ARM_DWT_CYCCNT;
+  rec_now64 = 0;
+  rec_last_t = 0;
+  rec_last_tick = 0;
+  rec_tempo_t0 = 0;
+  rec_tempo_tick0 = 0;
+  rec_tempo_us = SMF_DEFAULT_TEMPO_US;
+
+  rec_clk_seen[REC_CLK_FSK] = rec_clk_seen[REC_CLK_MIDI] = false;
+
+  rec_events = rec_ev_dropped = rec_buf_overruns = rec_tempo_changes = rec_max_write_us = 0;
+
+  // --- MThd, then the MTrk header (length filled in by rec_stop())
+
+  rec_put( 'M' ); rec_put( 'T' ); rec_put( 'h' ); rec_put( 'd' );
+  rec_put32( 6 );
+  rec_put( 0 ); rec_put( 0 );                                 // format 0
+  rec_put( 0 ); rec_put( 1 );                                 // 1 track
+  rec_put( SMF_DIVISION >> 8 ); rec_put( SMF_DIVISION & 0xff );
+
+  rec_put( 'M' ); rec_put( 'T' ); rec_put( 'r' ); rec_put( 'k' );
+  rec_put32( 0 );
+
+  // --- name, 4/4, starting tempo
+
+  rec_put( 0 ); rec_put( SMF_META ); rec_put( SMF_META_TRACK_NAME ); rec_put( 6 );
+  rec_put( 'L' ); rec_put( 'u' ); rec_put( 'm' ); rec_put( 'a' ); rec_put( '-' ); rec_put( '1' );
+
+  rec_put( 0 ); rec_put( SMF_META ); rec_put( SMF_META_TIME_SIG ); rec_put( 4 );
+  rec_put( 4 ); rec_put( 2 ); rec_put( 24 ); rec_put( 8 );
+
+  rec_put( 0 ); rec_put_tempo();
+
+  rec_ev_tail = rec_ev_head;                                  // empty log
+  rec_on = true;
+
+  Serial.printf("Recording to %s\n", rec_path);
+
+  return true;
+}
+
+
+void rec_stop() {
+  uint8_t len[4];
+  uint32_t trk_len;
+
+  if( !rec_on )
+    return;
+
+  rec_service();                                              // whatever is still in the log
+  rec_on = false;
+
+  for( int i = 0; i < 2; i++ ) {                              // a full half is always older than the one being filled
+    if( rec_half_full[i] && (i != rec_fill) ) {
+      if( !rec_write( rec_buf[i], REC_BUF_SIZE ) ) {
+        rec_abort();
+        return;
+      }
+      rec_half_full[i] = false;
+    }
+  }
+
+  rec_put_delta( rec_now64 );                                 // end of track goes at "now"
+  rec_put( SMF_META ); rec_put( SMF_META_END_OF_TRACK ); rec_put( 0 );
+
+  for( int i = 0; i < 2; i++ ) {                              // end of track might have just filled a half
+    if( rec_half_full[i] && !rec_write( rec_buf[i], REC_BUF_SIZE ) ) {
+      rec_abort();
+      return;
+    }
+  }
+
+  if( rec_fill_len && !rec_write( rec_buf[rec_fill], rec_fill_len ) ) {
+    rec_abort();
+    return;
+  }
+
+  trk_len = rec_file_len - SMF_HDR_LEN;
+  len[0] = trk_len >> 24;
+  len[1] = trk_len >> 16;
+  len[2] = trk_len >> 8;
+  len[3] = trk_len;
+
+  if( !rec_file.truncate( rec_file_len ) ||                   // give back the preallocated space we didn't use
+      !rec_file.seekSet( SMF_TRK_LEN_OFFSET ) ||
+      (rec_file.write( len, 4 ) != 4) ) {
+    Serial.printf("### recorder: could not finish %s\n", rec_path);
+  }
+
+  rec_file.close();
+
+  Serial.printf("Recorded %s: %d events, %d bytes, %d tempo changes\n", rec_path, rec_events, rec_file_len, rec_tempo_changes);
+  Serial.printf("  %d dropped (log full), %d dropped (card too slow), worst write %d us\n", rec_ev_dropped, rec_buf_overruns, rec_max_write_us);
+}
@@ -0,0 +1,135 @@
+/*
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LM_SysExZ.h"
+
+/*
+    SysEx payload compression. Plain C, shared with host tools -- see LM_SysExZ.h for the format.
+*/
+
+#define SXZ_MIN_RUN                 3                               // shorter runs are cheaper as literals
+
+#define SXZ_CTRL                    0
+#define SXZ_LITERAL                 1
+#define SXZ_RUN                     2
+
+
+// --- Encoder
+
+static uint8_t sxz_delta( const uint8_t *in, int idx ) {
+  return in[idx] - (idx ? in[idx-1] : 0);
+}
+
+
+// length of the run of equal deltas starting at idx, up to SXZ_MAX_RUN
+
+static int sxz_run_len( const uint8_t *in, int len, int idx ) {
+  uint8_t d = sxz_delta( in, idx );
+  int n = 1;
+
+  while( ((idx + n) < len) && (n < SXZ_MAX_RUN) && (sxz_delta( in, idx + n ) == d) )
+    n++;
+
+  return n;
+}
+
+
+int sxz_compress( const uint8_t *in, int len, uint8_t *out ) {
+  int in_idx = 0;
+  int out_idx = 0;
+  int lit_start;
+  int run;
+
+  while( in_idx < len ) {
+    run = sxz_run_len( in, len, in_idx );
+
+    if( run >= SXZ_MIN_RUN ) {                                      // run token
+      out[out_idx++] = 257 - run;
+      out[out_idx++] = sxz_delta( in, in_idx );
+      in_idx += run;
+      continue;
+    }
+
+    // literals, up to the next run worth coding (or SXZ_MAX_RUN of them)
+
+    lit_start = in_idx;
+
+    while( (in_idx < len) && ((in_idx - lit_start) < SXZ_MAX_RUN) && (sxz_run_len( in, len, in_idx ) < SXZ_MIN_RUN) )
+      in_idx++;
+
+    out[out_idx++] = (in_idx - lit_start) - 1;
+
+    for( int xxx = lit_start; xxx != in_idx; xxx++ )
+      out[out_idx++] = sxz_delta( in, xxx );
+  }
+
+  return out_idx;
+}
+
+
+// --- Decoder
+
+void sxz_decode_init( sxz_decoder_t *z ) {
+  z->state = SXZ_CTRL;
+  z->count = 0;
+  z->prev = 0;
+}
+
+
+int sxz_decode_byte( sxz_decoder_t *z, uint8_t b, uint8_t *out ) {
+  int n = 0;
+
+  switch( z->state ) {
+    case SXZ_CTRL:      if( b < 0x80 ) {
+                          z->count = b + 1;
+                          z->state = SXZ_LITERAL;
+                        }
+                        else if( b > 0x80 ) {
+                          z->count = 257 - b;
+                          z->state = SXZ_RUN;
+                        }
+                        break;
+
+    case SXZ_LITERAL:   z->prev += b;
+                        out[n++] = z->prev;
+
+                        if( --z->count == 0 )
+                          z->state = SXZ_CTRL;
+                        break;
+
+    case SXZ_RUN:       while( n != z->count ) {
+                          z->prev += b;
+                          out[n++] = z->prev;
+                        }
+
+                        z->state = SXZ_CTRL;
+                        break;
+  }
+
+  return n;
+}
+
+
+bool sxz_decode_done( sxz_decoder_t *z ) {
+  return z->state == SXZ_CTRL;
+}
@@ -0,0 +1,74 @@
+/*
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LM_SysExZ_H_
+#define LM_SysExZ_H_
+
+/*
+    SysEx payload compression, for version 1 (0x1n) sample and RAM bank messages. See LM_MIDI.ino.
+
+    Plain C with no Arduino dependencies, so host tools can build these two files as-is and produce exactly what
+    the Luma-1 expects.
+
+    Delta, then PackBits-style run length:
+
+      Each payload byte is replaced by its difference from the byte before it (the first one from 0). Fill runs in
+      pattern RAM and silence in a sample become runs of 0, a steady ramp becomes a run of its step.
+
+      The deltas are then coded as a series of tokens, each a control byte c followed by:
+
+        c = 0x00 - 0x7f     c+1 literal deltas
+        c = 0x81 - 0xff     1 delta, repeated 257-c times (2 - 128)
+        c = 0x80            nothing, skip (never generated)
+
+    Worst case (nothing repeats) grows the payload by 1 byte in 128. The decoder keeps 3 bytes of state and is fed one
+    byte at a time, so it can sit right behind the 7-bit unpacker.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SXZ_MAX_RUN                 128                             // most bytes one token decodes to
+#define SXZ_MAX_LEN(n)              ((n) + (((n) + 127) / 128))     // biggest compressed size for n bytes in
+
+int sxz_compress( const uint8_t *in, int len, uint8_t *out );       // out must hold SXZ_MAX_LEN(len), returns compressed length
+
+typedef struct {
+  uint8_t state;
+  uint8_t count;                                                    // literals left in this token, or run length
+  uint8_t prev;                                                     // last decoded byte, for the delta
+} sxz_decoder_t;
+
+void sxz_decode_init( sxz_decoder_t *z );
+int sxz_decode_byte( sxz_decoder_t *z, uint8_t b, uint8_t *out );   // feed one compressed byte, returns # of bytes put in out (up to SXZ_MAX_RUN)
+bool sxz_decode_done( sxz_decoder_t *z );                           // true if the stream ended between tokens
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,60 @@
+/*
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LM_Timers_
+#define LM_Timers_
+
+/*
+    Timer wheel for deferred work (Note Offs, footswitch release, MIDI traffic indicators, etc.)
+
+    One tick per millisecond. Starting, stopping and expiring a timer are O(1), and nothing is
+    called unless it's actually due. Callbacks run from handle_timers(), never from an interrupt.
+    timer_start() / timer_stop() are safe to call from interrupts.
+*/
+
+typedef void (*lm_timer_fn)( int arg );
+
+typedef struct lm_timer {
+  struct lm_timer   *next;
+  struct lm_timer   **pprev;            // whatever points at us, NULL when not armed
+  uint32_t          expires;            // tick it's due
+  uint32_t          period;             // ms, 0 = one shot
+  lm_timer_fn       fn;
+  int               arg;                // handed to fn, e.g. which drum
+} lm_timer_t;
+
+#define TIMER_INIT( fn, arg )           { NULL, NULL, 0, 0, (fn), (arg) }
+
+void timer_setup( lm_timer_t *t, lm_timer_fn fn, int arg );
+
+void timer_start( lm_timer_t *t, uint32_t ms );             // one shot, ms from now. Restarts it if already armed
+void timer_start_periodic( lm_timer_t *t, uint32_t ms );    // every ms, first one ms from now
+void timer_stop( lm_timer_t *t );
+bool timer_armed( lm_timer_t *t );
+
+void handle_timers();                                       // call frequently, runs whatever is due
+
+void print_timer_stats();
+
+
+#endif
@@ -0,0 +1,218 @@
+/*
+    The Luma-1 Drum Machine Project
+    Copyright 2021-2024, Joe Britt
+    
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided 
+    that the following conditions are met:
+    
+    1. Redistributions of source code must retain the above copyright notice, this list of conditions and the 
+       following disclaimer.
+    
+    2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and 
+       the following disclaimer in the documentation and/or other materials provided with the distribution.
+    
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND ANY EXPRESS OR IMPLIED 
+    WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A 
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+    TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) 
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+    NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LM_Timers.h"
+
+/*
+    Hierarchical timer wheel
+
+    Level 0 has a slot for each of the next 256 ticks. Level 1 slots each cover 256 ticks (64 of them, ~16s),
+    level 2 slots cover 16384 ticks (64 of them, ~17 min). A timer goes straight into the slot for the tick it's due
+    when that's within 256 ticks, otherwise into a coarser slot. Every time level 0 wraps around, the next level 1 slot
+    is emptied back into the wheel (and level 2 the same way when level 1 wraps), so each timer is only touched a
+    couple of times no matter how far out it is.
+
+    Slots are lists linked thru the timers themselves, so there's nothing to allocate.
+*/
+
+#define TW_L0_BITS          8
+#define TW_LN_BITS          6
+#define TW_L0_SIZE          (1 << TW_L0_BITS)
+#define TW_LN_SIZE          (1 << TW_LN_BITS)
+#define TW_L0_MASK          (TW_L0_SIZE - 1)
+#define TW_LN_MASK          (TW_LN_SIZE - 1)
+
+#define TW_L1_SPAN          (1UL << (TW_L0_BITS + TW_LN_BITS))            // ticks covered by levels 0 and 1
+#define TW_L2_SPAN          (1UL << (TW_L0_BITS + 2 * TW_LN_BITS))        // longest timer
+
+lm_timer_t *tw_l0[TW_L0_SIZE];
+lm_timer_t *tw_ln[2][TW_LN_SIZE];
+
+uint32_t tw_base = 0;                               // next tick to process
+uint32_t tw_armed = 0;                              // # of timers in the wheel
+
+uint32_t tw_fired = 0;
+uint32_t tw_max_behind = 0;                         // most ticks caught up in one handle_timers() call
+
+
+// --- list ops, interrupts must be off
+
+void tw_link( lm_timer_t *t, lm_timer_t **head ) {
+  t->next = *head;
+  if( t->next )
+    t->next->pprev = &t->next;
+  *head = t;
+  t->pprev = head;
+}
+
+void tw_unlink( lm_timer_t *t ) {
+  *t->pprev = t->next;
+  if( t->next )
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+
+void tw_add( lm_timer_t *t ) {
+  uint32_t delta = t->expires - tw_base;
+
+  if( (int32_t)delta < 0 )                                              // already late, next tick
+    tw_link( t, &tw_l0[tw_base & TW_L0_MASK] );
+  else if( delta < TW_L0_SIZE )
+    tw_link( t, &tw_l0[t->expires & TW_L0_MASK] );
+  else if( delta < TW_L1_SPAN )
+    tw_link( t, &tw_ln[0][(t->expires >> TW_L0_BITS) & TW_LN_MASK] );
+  else {
+    if( delta >= TW_L2_SPAN )
+      t->expires = tw_base + TW_L2_SPAN - 1;                             // as far as we can go
+    tw_link( t, &tw_ln[1][(t->expires >> (TW_L0_BITS + TW_LN_BITS)) & TW_LN_MASK] );
+  }
+}
+
+
+// put everything in a coarse slot back into the wheel, returns the slot index (0 -> the next level needs it too)
+
+int tw_cascade( int level, int idx ) {
+  lm_timer_t *t;
+
+  noInterrupts();
+  while( (t = tw_ln[level][idx]) != NULL ) {
+    tw_unlink( t );
+    tw_add( t );
+  }
+  interrupts();
+
+  return idx;
+}
+
+
+void timer_setup( lm_timer_t *t, lm_timer_fn fn, int arg ) {
+  t->next = NULL;
+  t->pprev = NULL;
+  t->period = 0;
+  t->fn = fn;
+  t->arg = arg;
+}
+
+
+void timer_arm( lm_timer_t *t, uint32_t ms, uint32_t period ) {
+  uint32_t now = millis();
+
+  noInterrupts();
+  if( t->pprev )
+    tw_unlink( t );
+  else
+    tw_armed++;
+
+  if( tw_armed == 1 )                               // wheel was empty, nothing to catch up on
+    tw_base = now;
+
+  t->expires = now + (ms ? ms : 1);
+  t->period = period;
+  tw_add( t );
+  interrupts();
+}
+
+void timer_start( lm_timer_t *t, uint32_t ms )            {     timer_arm( t, ms, 0 );          }
+void timer_start_periodic( lm_timer_t *t, uint32_t ms )   {     timer_arm( t, ms, ms );         }
+
+
+void timer_stop( lm_timer_t *t ) {
+  noInterrupts();
+  if( t->pprev ) {
+    tw_unlink( t );
+    tw_armed--;
+  }
+  interrupts();
+}
+
+
+bool timer_armed( lm_timer_t *t ) {
+  return t->pprev != NULL;
+}
+
+
+void handle_timers() {
+  uint32_t now = millis();
+  uint32_t behind = 0;
+  lm_timer_t *due;
+  lm_timer_t *t;
+  int idx;
+
+  while( (int32_t)(now - tw_base) >= 0 ) {
+    if( tw_armed == 0 ) {                           // nothing waiting, just keep up
+      tw_base = now + 1;
+      break;
+    }
+
+    idx = tw_base & TW_L0_MASK;
+
+    if( !idx && !tw_cascade( 0, (tw_base >> TW_L0_BITS) & TW_LN_MASK ) )
+      tw_cascade( 1, (tw_base >> (TW_L0_BITS + TW_LN_BITS)) & TW_LN_MASK );
+
+    noInterrupts();
+    due = tw_l0[idx];                               // take the whole slot, anything armed from here on goes elsewhere
+    tw_l0[idx] = NULL;
+    if( due )
+      due->pprev = &due;
+    tw_base++;
+    interrupts();
+
+    while( true ) {
+      noInterrupts();
+      t = due;
+      if( t == NULL ) {
+        interrupts();
+        break;
+      }
+
+      tw_unlink( t );
+
+      if( t->period ) {                             // periodic, back in for the next one
+        t->expires += t->period;
+        tw_add( t );
+      }
+      else
+        tw_armed--;
+      interrupts();
+
+      tw_fired++;
+      if( t->fn )
+        t->fn( t->arg );
+    }
+
+    behind++;
+  }
+
+  if( behind > tw_max_behind )
+    tw_max_behind = behind;
+}
+
+
+void print_timer_stats() {
+  Serial.printf("Timers:  %d armed, %d fired, caught up at most %d ticks in one pass\n", tw_armed, tw_fired, tw_max_behind);
+
+  tw_fired = 0;
+  tw_max_behind = 0;
+}
@@ -27,10 +27,35 @@
 #ifndef LM_Voices_H_
 #define LM_Voices_H_
 
+#include <SD.h>                                         // File, used in stage_voice_open()
+
+#define SAMPLE_LEN_2K           0x00
+#define SAMPLE_LEN_4K           0x01
+#define SAMPLE_LEN_8K           0x02
+#define SAMPLE_LEN_32K          0x03
+
+/*
+    A voice_sample_t is a view onto sample data that lives somewhere else (filebuf, the SysEx decode buffer,
+    the EPROM dump buffer, ...). Only the first len bytes are real. Padding up to the hardware length is
+    implicit: the loader streams 0s to the voice board, so nobody needs to zero the tail of a 32KB buffer.
+*/
+
+typedef struct {
+  uint8_t *data;                                        // first sample byte, NOT copied
+  int      len;                                         // # of valid bytes at data
+  uint8_t  hw_len;                                      // SAMPLE_LEN_xx needed for len
+} voice_sample_t;
+
+voice_sample_t voice_sample( uint8_t *s, int len );     // build a view, fills in hw_len
+
 void set_voice( uint16_t voice, uint8_t *s, int len, char *vname );     // use this to load voices (also handles size constraints and staging)
+void set_voice_sample( uint16_t voice, voice_sample_t *vs, char *vname );
 
 void trig_voice( uint16_t voice, uint8_t val );                         // select voice with Z-80 address
 
+#define TRIG_VOICES_MAX         16
+uint32_t trig_voices( uint16_t *voices, uint8_t *vals, int n );         // stop all n, then start all n, back to back. returns cycles from first to last start
+
 void set_load_data( uint8_t d );                                        // puts d on LOAD bus
 
 #define kLOAD                   0
@@ -45,29 +70,30 @@ void set_rst_hihat( bool s );                           // pulse high to reset h
 void set_hat_loading_led( bool s );                     // s = 1 -> nHAT_LOADING = input, s = 1 -> nHAT_LOADING = output, drive to 0
 
 
-#define SAMPLE_LEN_2K           0x00
-#define SAMPLE_LEN_4K           0x01
-#define SAMPLE_LEN_8K           0x02
-#define SAMPLE_LEN_32K          0x03
-
 // voice selectors are STB_ addresses, e.g., STB_SNARE
 
 void set_sample_length( uint16_t v, uint8_t len );      // set desired sample length for voice
 
-void load_sample( uint16_t v, uint8_t *s, int len );    // copy sample s into voice v SRAM
-                                                        // XXX - add hook for status
+void load_sample( uint16_t v, voice_sample_t *vs, int len );    // copy len bytes of sample vs into voice v SRAM, 0s past vs->len
+                                                                // XXX - add hook for status
+
+void load_sample_begin( uint16_t v, int len );          // load_sample() in pieces: begin, then len load_sample_byte()s, then end
+void load_sample_byte( uint8_t b );
+void load_sample_end();
 
 void load_voice_prologue( uint16_t v );
 void load_voice_epilogue( uint16_t v );
 
-void stage_voice( char *dirname, char *fn, uint8_t *s, int len );
+bool stage_voice( char *dirname, char *fn, uint8_t *s, int len );     // false if it didn't all get written
+File stage_voice_open( char *dirname, char *fn );      // replace whatever is in dirname with a new empty file fn, caller closes it
 
 void stage_bank_name( uint8_t cur_bank_num );
 
 void stage_bank_num( uint8_t cur_bank_num );
 uint8_t get_orig_bank_num();
 
-void load_voice( uint16_t voice, uint8_t *s, int len );
+void load_voice( uint16_t voice, voice_sample_t *vs, int len );
+void load_voice_begin( uint16_t voice, int len );      // set the length and get ready, then load_sample_byte() / load_sample_end()
 
 void load_voice_file( uint16_t voice, char *filename );
 
@@ -91,6 +117,9 @@ uint8_t *get_voice( uint8_t bank_num, uint16_t voice, char *voice_name, int *voi
 
 void build_voice_filename( uint16_t voice, uint8_t bank_num, char *fn );
 
+uint16_t bank_voice_2_stb( int vvv );                   // voice # 0-9 in a bank (BANK_LOAD_xx bit #) -> STB_xx
+int stb_2_bank_voice( uint16_t voice );                 // STB_xx -> voice # 0-9, -1 if not a voice
+
 extern uint16_t voice_load_bm;
 
 void load_voice_bank( uint16_t voice_selects, uint8_t bank_num );
@@ -102,11 +131,15 @@ void store_voice_bank( uint16_t voice_selects, uint8_t bank_num );      // copie
 char *get_cur_bank_name();                                              // gets STAGING voice bank name
 
 char *get_voice_bank_name( uint8_t bank_num );                          // bank num 00-99, or 255 for STAGING
+char *sd_voice_bank_name( uint8_t bank_num );                           // same, but always reads the card (used to build the SD catalog)
 void set_voice_bank_name( uint8_t bank_num, char *name );
 
 // use this to write a voice to a specific bank and drum on the SD card
 
 void write_sd_bank_voice( uint8_t bank, uint8_t drum, char *drum_name, uint8_t *sample_data, int len );
 
+char *sd_bank_voice_path( uint8_t bank, uint8_t drum, char *drum_name );   // clear out the drum dir, return the path to write the new file to
+void sd_bank_voice_written( uint8_t bank, uint8_t drum );                 // new file is in place, update packed bank and catalog
+
 
 #endif
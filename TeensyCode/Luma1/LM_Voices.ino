@@ -25,6 +25,8 @@
 
 #include "LM_SDCard.h"
 #include "LM_Voices.h"
+#include "LM_PackedBank.h"
+#include "LM_SDCatalog.h"
 
 uint16_t voice_load_bm = BANK_LOAD_ALL;             // bitmap selects which voices will be loaded/stored
 
@@ -45,77 +47,56 @@ uint8_t *get_voice_file( char *dirname, char *voice_name, int *voice_len );
 
 
 
-void copy_voice_SD( char *dirname_src, char *dirname_dst ) {
-  Serial.printf("Copying %s -> %s\n", dirname_src, dirname_dst );
+// A copy's running hash has to match what set_voice_sample() staged. If STAGING has no catalog entry for vvv (or
+//  it's for some other file), there's nothing to check against and the copy stands on its read/write counts.
 
-  root = SD.open( dirname_src );
-  file = root.openNextFile();
-
-  if( file ) {
-
-    // --- read it into memory
-    
-    filesize = file.size();
-    snprintf( src_fn, 63, file.name() );                                      // remember this, will copy to this filename in other dir
-    Serial.printf("name: %s\n", src_fn );
-    Serial.printf("size: %d\n", filesize );
-    if( filesize > sizeof(filebuf) ) {
-      Serial.printf("File too big, truncating to %d bytes\n", sizeof(filebuf));
-      filesize = sizeof(filebuf);
-    }
-    file.read( filebuf, filesize );                                           // read it into 32KB working buffer
-    file.close();
-    Serial.println("Source file read");
+bool stage_copy_check( int vvv, char *fn, uint32_t len, uint32_t hash ) {
+  cat_file_t *cf = catalog_voice( BANK_STAGING, vvv );
 
-    // --- if there is a file at the dest already, delete it
-    
-    for( int xxx = 0; xxx != 1000; xxx++ ) {                                  // bound it to 1000 files, should be more than enough
-      root = SD.open( dirname_dst );
-      file = root.openNextFile();
-
-      if( file ) {
-        snprintf( stage_fn, 255, "%s/%s", dirname_dst, file.name() );
-        Serial.printf("Found file %s, deleting %s\n", file.name(), stage_fn );
-        SD.remove( stage_fn );
-        Serial.println("Removed, now saving new one");
-      }
-      else
-        break;
-    }
+  if( !cf || (cf->len != len) || strcasecmp( cf->name, fn ) )
+    return true;
 
-    // --- now copy the read in file to the dst directory
-    
-    snprintf( stage_fn, 255, "%s/%s", dirname_dst, src_fn );
-    Serial.print("Saving to: "); Serial.println( stage_fn );
-    
-    file = SD.open( stage_fn, FILE_WRITE );
-  
-    if( file ) {
-      file.write( filebuf, filesize );
-      file.close(); 
-    }
-    else {
-      Serial.print("### Error, could not open file "); Serial.print( stage_fn ); Serial.println(" for writing.");
-    }
-  
-  }
-  else {
-    Serial.printf("*** ERROR: %s SOURCE file not found\n", dirname_src );
+  if( cf->hash != hash ) {
+    Serial.printf("### %s: copied with hash %08x, staged with %08x\n", fn, hash, cf->hash);
+    return false;
   }
 
-  Serial.printf("\n");
+  return true;
 }
 
 
+// copy one voice from STAGING to bank_num, streaming, and record what we wrote in the catalog
 
-void store_voice_file( char *voice_name, uint8_t bank_num ) {
+bool store_voice_file( char *voice_name, uint8_t bank_num, uint16_t stb, sd_copy_stats_t *st ) {
   char srcname[48];
   char dstname[48];
+  char fn[MAX_LEN_FILE_NAME];
+  char path[MAX_LEN_PATH_NAME];
+  uint32_t len;
+  uint32_t hash;
+  int vvv = stb_2_bank_voice( stb );
+  bool r;
 
   snprintf( srcname, 48, "/STAGING/%s/",                voice_name );
   snprintf( dstname, 48, "/DRMBANKS/%02d/%s", bank_num, voice_name );
   
-  copy_voice_SD( srcname, dstname );
+  r = sd_copy_first_file_in_dir( srcname, dstname, fn, &len, &hash, st );
+
+  if( r && !stage_copy_check( vvv, fn, len, hash ) ) {
+    build_dir_path( path, dstname, fn );
+    SD.remove( path );                                  // don't leave a bad copy in the bank
+    st->files--;                                        // sd_copy_file() counted it as good
+    st->bytes -= len;
+    st->errors++;
+    r = false;
+  }
+
+  if( r && (len <= sizeof(filebuf)) )                   // catalog only hashes up to 32KB, anything bigger gets re-read
+    catalog_set_voice( bank_num, vvv, fn, len, hash );
+  else
+    catalog_invalidate_voice_bank( bank_num, false, (vvv >= 0) ? (1 << vvv) : 0 );
+
+  return r;
 }
 
 
@@ -134,11 +115,15 @@ void store_voice_file( char *voice_name, uint8_t bank_num ) {
     We always push a full 16KB of bytes into each. If the sample uses less than the full 16KB, the empty space is filled with 0.
     We set the Conga/Tom playblack length to the longer length of the two.
 
-    NOTE: Assumes that the sample buffer s is full 32KB, so we can zero bytes from len -> 32K
+    The sample is passed around as a voice_sample_t view, the padding 0s are generated by load_sample() on the fly.
+    So s only needs to hold len bytes, and it is never written to.
     
 */
 
-void stage_voice( char *dirname, char *fn, uint8_t *s, int len ) {
+// remove whatever is in the STAGING dir, and open a new file there. caller writes to it and closes it.
+
+File stage_voice_open( char *dirname, char *fn ) {
+  File f;
   
   Serial.print("Staging "); Serial.println( fn );
   
@@ -154,17 +139,28 @@ void stage_voice( char *dirname, char *fn, uint8_t *s, int len ) {
   }
 
   sprintf( stage_fn, "%s%s", dirname, fn );
-  Serial.printf("Saving to stage: %s, len = %d\n", stage_fn, len );
+  Serial.printf("Saving to stage: %s\n", stage_fn );
   
-  file = SD.open( stage_fn, FILE_WRITE );
+  f = SD.open( stage_fn, FILE_WRITE );
 
-  if( file ) {
-    file.write( s, len );
-    file.close(); 
-  }
-  else {
+  if( !f ) {
     Serial.print("### Error, could not open file "); Serial.print( stage_fn ); Serial.println(" for writing.");
   }
+
+  return f;
+}
+
+
+bool stage_voice( char *dirname, char *fn, uint8_t *s, int len ) {
+  File f = stage_voice_open( dirname, fn );
+  bool r = false;
+
+  if( f ) {
+    r = (f.write( s, len ) == (size_t)len);
+    f.close(); 
+  }
+
+  return r;
 }
 
 
@@ -249,26 +245,36 @@ int len_round_up( uint16_t voice, int len ) {
   return rounded;
 }
 
-// this should be the only thing that calls load_voice
+voice_sample_t voice_sample( uint8_t *s, int len ) {
+  voice_sample_t vs;
+
+  vs.data   = s;
+  vs.len    = len;
+  vs.hw_len = needed_hw_len( len );
+
+  return vs;
+}
+
+
+// byte idx of the sample as the voice board sees it, silence past the end of the real data
+
+uint8_t voice_sample_byte( voice_sample_t *vs, int idx ) {
+  return (idx < vs->len) ? vs->data[idx] : 0;
+}
+
 
 void set_voice( uint16_t voice, uint8_t *s, int len, char *vname ) {
-  char sdir[64];
+  voice_sample_t vs = voice_sample( s, len );
+
+  set_voice_sample( voice, &vs, vname );
+}
 
-  Serial.printf("set_voice(): %04X, %d bytes, %s\n", voice, len, vname);
-  //Serial.printf("cga: %d, tom: %d\n", loaded_congas_len, loaded_toms_len );
-  
-  uint8_t hw_len = SAMPLE_LEN_32K;
-  
-  // --- zero sample buffer from s[len] to s[32767], in case we need to load a padded sample
-  
-  for( int xxx = len; xxx != 32768; xxx++ )
-    s[xxx] = 0;
 
-  // --- figure out needed hardware sample len value
+// this should be the only thing that calls load_voice
 
-  hw_len = needed_hw_len( len );
+// set our new length and prepare our STAGING path
 
-  // -- set our new length and prepare our STAGING path
+void voice_staging_dir( uint16_t voice, uint8_t hw_len, char *sdir ) {
 
   switch( voice ) {
     case STB_BASS:      snprintf( sdir, 32, "/STAGING/BASS/"    );                                    break;
@@ -283,23 +289,33 @@ void set_voice( uint16_t voice, uint8_t *s, int len, char *vname ) {
     case STB_TOMS:      snprintf( sdir, 32, "/STAGING/TOM/"     );  loaded_toms_len     = hw_len;     break;
     case STB_CONGAS:    snprintf( sdir, 32, "/STAGING/CONGA/"   );  loaded_congas_len   = hw_len;     break;
   }
+}
+
+
+void set_voice_sample( uint16_t voice, voice_sample_t *vs, char *vname ) {
+  char sdir[64];
+  int vvv = stb_2_bank_voice( voice );
+
+  Serial.printf("set_voice(): %04X, %d bytes, %s\n", voice, vs->len, vname);
+  //Serial.printf("cga: %d, tom: %d\n", loaded_congas_len, loaded_toms_len );
+  
+  voice_staging_dir( voice, vs->hw_len, sdir );
 
   //if( cur_bank_num != BANK_STAGING ) {                              // are we loading from STAGING?
-    stage_voice( sdir, vname, s, len );                             // store SD card shadow copy
+  if( stage_voice( sdir, vname, vs->data, vs->len ) )               // store SD card shadow copy, unpadded
+    catalog_set_voice( BANK_STAGING, vvv, vname, vs->len, hash32( vs->data, vs->len ) );     // store_voice_file() checks against this
+  else
+    catalog_invalidate_voice_bank( BANK_STAGING, false, (vvv >= 0) ? (1 << vvv) : 0 );
   //}
 
   // --- Store it in STAGING, and copy it to the voice sample RAM
 
-  if( (voice == STB_TOMS) || (voice == STB_CONGAS) ) {              // always send full 16384 to both CONGA and TOM
-    len = 16384;
-  }
-
   Serial.printf("Copying staging file to voice hardware\n");
 
   disable_drum_trig_interrupt();                                    // don't detect drum writes as triggers
   load_voice_prologue( voice );
   
-  load_voice( voice, s, len_round_up(voice, len) );                 // send to the voice board
+  load_voice( voice, vs, len_round_up(voice, vs->len) );            // send to the voice board, CONGA and TOM always get full 16384
 
   if( (voice == STB_TOMS) || (voice == STB_CONGAS) ) {                                                          // always send full 16384 to both CONGA and TOM
     set_sample_length( voice, (loaded_toms_len > loaded_congas_len) ? loaded_toms_len : loaded_congas_len );    // and set length to longer one
@@ -312,7 +328,6 @@ void set_voice( uint16_t voice, uint8_t *s, int len, char *vname ) {
 }
 
 
-
 // if the requested voice is CONGA, we need to use the TOM strobe and set D[2]
 // in the original LM-1, D[2] selected which EPROM set to use.
 // in Luma-1, D[2] selects the hi address bit of the SRAM. 
@@ -337,6 +352,50 @@ void trig_voice( uint16_t voice, uint8_t val ) {
 }
 
 
+// Several voices at once (a chord from MIDI). Same as calling trig_voice() for stop, then start, on each one,
+// but the DO enable stays on for the whole thing and the starts are written back to back.
+// ASSUMES TRIGGER INTERRUPTS DISABLED, Teensy owns the bus
+
+uint32_t trig_voices( uint16_t *voices, uint8_t *vals, int n ) {
+  uint16_t v[TRIG_VOICES_MAX];
+  uint8_t d[TRIG_VOICES_MAX];
+  uint32_t first, last;
+
+  if( n > TRIG_VOICES_MAX )
+    n = TRIG_VOICES_MAX;
+
+  for( int i = 0; i != n; i++ ) {
+    v[i] = voices[i];
+    d[i] = vals[i];
+
+    if( v[i] == STB_CONGAS ) {                // same as trig_voice()
+      v[i] = STB_TOMS;
+      d[i] |= 0x04;
+    }
+  }
+
+  save_LED_SET_2();
+
+    clr_LED_SET_2( DRUM_DO_ENABLE );
+
+    for( int i = 0; i != n; i++ )
+      z80_bus_write( v[i], 0x00 );            // stop everybody first...
+
+    first = last = ARM_DWT_CYCCNT;
+
+    for( int i = 0; i != n; i++ ) {
+      last = ARM_DWT_CYCCNT;                  // when the last start went out, vs. the first
+      z80_bus_write( v[i], d[i] );            // ...then start them as close together as we can
+    }
+
+    set_LED_SET_2( DRUM_DO_ENABLE );
+
+  restore_LED_SET_2();
+
+  return last - first;
+}
+
+
 
 // ASSUMES TRIGGER INTERRUPTS DISABLED
 
@@ -472,66 +531,84 @@ void set_sample_length( uint16_t voice, uint8_t len ) {
   5. strobe /VOICE_WR to latch the data byte into voice SRAM at the addr selected by the addr counters
   6. write next data byte to DRUM_CONGAS, will latch data into U3 and pulse addr clk, advancing SRAM addr from addr counters
   goto 5 until all data written
+
+  len is the number of bytes to push, which can be more than vs->len. The extra bytes are sent as 0.
   
 */
 
-void load_sample( uint16_t voice, uint8_t *s, int len ) {
-  int progress_tick = 0;
+// load_sample() in pieces, so the data can be pushed as it arrives. begin, then one load_sample_byte() per byte, then end.
+
+uint16_t  ls_voice;
+int       ls_idx;
+int       ls_progress_tick;
+
+void load_sample_begin( uint16_t voice, int len ) {
   
   Serial.print("Loading sample data to voice "); print_voice_name( voice );
 
   Serial.print(", sample len = "); Serial.println( len );
 
+  ls_voice = voice;
+  ls_idx = 0;
+  ls_progress_tick = 0;
+
   set_LED_SET_2( LED_LOAD );                  // LOAD LED on, it will flash during loading
+}
 
-  set_play_load( kPLAY );                     // 1. PLAY/LOAD = PLAY
 
-  set_load_data_and_clock( *s++ );            // 2. write first data byte, will also pulse the addr clk
-  len--;
+void load_sample_byte( uint8_t b ) {
 
-  set_play_load( kLOAD );                     // 3. PLAY/LOAD = LOAD, now set_load_data_and_clock() will advance addr counters
+  if( ls_idx++ == 0 ) {
+    set_play_load( kPLAY );                   // 1. PLAY/LOAD = PLAY
 
-  // ZERO THE ADDR COUNTERS ON THE SELECTED VOICE BOARD
-  
-  // if we're loading the HIHAT, pulse the GPIO that resets the address counters
+    set_load_data_and_clock( b );             // 2. write first data byte, will also pulse the addr clk
 
-  if( voice == STB_HIHAT ) {
-    set_rst_hihat( 0 );
-    set_rst_hihat( 1 );
-    set_rst_hihat( 0 );
+    set_play_load( kLOAD );                   // 3. PLAY/LOAD = LOAD, now set_load_data_and_clock() will advance addr counters
 
-    set_hat_loading_led( true );              // and turn on the "loading" LED
-  }
+    // ZERO THE ADDR COUNTERS ON THE SELECTED VOICE BOARD
+    
+    // if we're loading the HIHAT, pulse the GPIO that resets the address counters
 
-  // write a '0' then a '1' to the run flip-flop. The clock for that flop is the decoded addr strobe, and D = Z-80 D[0]
+    if( ls_voice == STB_HIHAT ) {
+      set_rst_hihat( 0 );
+      set_rst_hihat( 1 );
+      set_rst_hihat( 0 );
 
-  trig_voice( voice, 0x00 );                  // stop
-  trig_voice( voice, 0x01 );                  // start
+      set_hat_loading_led( true );            // and turn on the "loading" LED
+    }
 
+    // write a '0' then a '1' to the run flip-flop. The clock for that flop is the decoded addr strobe, and D = Z-80 D[0]
 
-  // --- SAMPLE LOAD LOOP
+    trig_voice( ls_voice, 0x00 );             // stop
+    trig_voice( ls_voice, 0x01 );             // start
 
-  while( len >= 0 ) {    
-    set_voice_wr( 0 );                        // 5. strobe /VOICE_WR to latch the last U3 data byte into voice SRAM 
-    delayNanoseconds( 250 );
-    set_voice_wr( 1 );                        //                              at the addr selected by the addr counters
+    return;
+  }
 
-    set_load_data_and_clock( *s++ );          // 6. write next data byte, will also pulse the addr clk
+  set_voice_wr( 0 );                          // 5. strobe /VOICE_WR to latch the last U3 data byte into voice SRAM 
+  delayNanoseconds( 250 );
+  set_voice_wr( 1 );                          //                              at the addr selected by the addr counters
 
-    len--;                                    // one less byte to send
+  set_load_data_and_clock( b );               // 6. write next data byte, will also pulse the addr clk
 
-    if( progress_tick++ > 4095 ) {
-      clr_LED_SET_2( LED_LOAD );
-    }
+  if( ls_progress_tick++ > 4095 ) {
+    clr_LED_SET_2( LED_LOAD );
+  }
 
-    if( progress_tick++ > 8191 ) {
-      set_LED_SET_2( LED_LOAD );
-      progress_tick = 0;
-    }
+  if( ls_progress_tick++ > 8191 ) {
+    set_LED_SET_2( LED_LOAD );
+    ls_progress_tick = 0;
   }
-  
-  // --- END SAMPLE LOAD LOOP
-  
+}
+
+
+void load_sample_end() {
+
+  set_voice_wr( 0 );                          // latch the last byte
+  delayNanoseconds( 250 );
+  set_voice_wr( 1 );
+
+  set_load_data_and_clock( 0 );
 
   // CLEAN UP, we're done
   
@@ -540,7 +617,7 @@ void load_sample( uint16_t voice, uint8_t *s, int len ) {
 
   // if we just loaded the HIHAT, turn off its LED
 
-  if( voice == STB_HIHAT ) {
+  if( ls_voice == STB_HIHAT ) {
     set_rst_hihat( 1 );                       // leave with it disabled, so other loads don't stomp on it
 
     set_hat_loading_led( false );             // turn off the HiHat LED
@@ -548,7 +625,7 @@ void load_sample( uint16_t voice, uint8_t *s, int len ) {
 
   // write a '0' to the run flip-flop. The clock for that flop is the decoded addr strobe, and D = Z-80 D[0]
   
-  trig_voice( voice, 0x00 );
+  trig_voice( ls_voice, 0x00 );
 
   set_play_load( kPLAY );                     // let the 556 timer drive the addr clock again
 
@@ -559,6 +636,17 @@ void load_sample( uint16_t voice, uint8_t *s, int len ) {
 }
 
 
+void load_sample( uint16_t voice, voice_sample_t *vs, int len ) {
+
+  load_sample_begin( voice, len );
+
+  for( int idx = 0; idx != len; idx++ )
+    load_sample_byte( voice_sample_byte( vs, idx ) );
+
+  load_sample_end();
+}
+
+
 void load_voice_prologue( uint16_t v ) {
   //if( v == STB_HIHAT )
     set_rst_hihat( 1 );                       // stop it
@@ -577,7 +665,20 @@ void load_voice_epilogue( uint16_t v ) {
  */
 
 
-void load_voice( uint16_t voice, uint8_t *s, int len ) {
+void load_voice( uint16_t voice, voice_sample_t *vs, int len ) {
+
+  load_voice_begin( voice, len );
+
+  for( int idx = 0; idx != len; idx++ )
+    load_sample_byte( voice_sample_byte( vs, idx ) );
+
+  load_sample_end();
+}
+
+
+// everything load_voice() does before the sample data goes in
+
+void load_voice_begin( uint16_t voice, int len ) {
   uint8_t voice_len = SAMPLE_LEN_32K;     // assume max
 
   // progress display
@@ -624,7 +725,7 @@ void load_voice( uint16_t voice, uint8_t *s, int len ) {
   // loading the HIHAT requires strobing the RST_HIHAT signal.
   // load_sample() detects HIHAT loads and does the right thing.
     
-  load_sample( voice, s, len );
+  load_sample_begin( voice, len );
 }
 
 
@@ -658,11 +759,50 @@ void build_voice_filename( uint16_t voice, uint8_t bank_num, char *fn ) {
 }
 
 
+// voice # in a bank (the BANK_LOAD_xx bit #) <-> voice strobe
+
+uint16_t bank_voice_2_stb( int vvv ) {
+  switch( vvv ) {
+    case 0:   return STB_CONGAS;
+    case 1:   return STB_TOMS;
+    case 2:   return STB_SNARE;
+    case 3:   return STB_BASS;
+    case 4:   return STB_HIHAT;
+    case 5:   return STB_COWBELL;
+    case 6:   return STB_CLAPS;
+    case 7:   return STB_CLAVE;
+    case 8:   return STB_TAMB;
+    case 9:   return STB_CABASA;
+    default:  return 0;
+  }
+}
+
+
+int stb_2_bank_voice( uint16_t voice ) {
+  for( int vvv = 0; vvv != 10; vvv++ )
+    if( bank_voice_2_stb( vvv ) == voice )
+      return vvv;
+
+  return -1;
+}
+
+
 /*
     for Voice Banks: /DRMBANKS/bb/BANKNAME.TXT
+
+    Banks 00-99 come from the SD catalog, STAGING always comes from the card.
 */
- 
+
 char *get_voice_bank_name( uint8_t bank_num ) {
+
+  if( bank_num != BANK_STAGING )
+    return catalog_voice_bank_name( bank_num );
+
+  return sd_voice_bank_name( bank_num );
+}
+
+
+char *sd_voice_bank_name( uint8_t bank_num ) {
   
   if( bank_num == BANK_STAGING )
     sprintf( src_fn, STAGING_BANKNAME_FN );
@@ -695,12 +835,24 @@ void set_voice_bank_name( uint8_t bank_num, char *name ) {
     sprintf( src_fn, "/DRMBANKS/%02d/BANKNAME.TXT", bank_num );
 
   delete_and_copy( src_fn, 0, name, strlen(name) );
+
+  invalidate_packed_bank( bank_num );
+  catalog_invalidate_voice_bank( bank_num, true, 0 );
 }
 
 
 void write_sd_bank_voice( uint8_t bank, uint8_t drum, char *drum_name, uint8_t *sample_data, int len ) {
+
   Serial.printf("Writing voice data for %s to bank %02d, drum number %02d, len = %d bytes\n", drum_name, bank, drum, len);
 
+  create_file( sd_bank_voice_path( bank, drum, drum_name ), sample_data, len );     // actually put the file data there
+
+  sd_bank_voice_written( bank, drum );
+}
+
+
+char *sd_bank_voice_path( uint8_t bank, uint8_t drum, char *drum_name ) {
+
   build_voice_filename( drum_sel_2_voice( drum ), bank, src_fn );
 
   delete_all_in_dir( src_fn );                      // get rid of any other files in the target dir
@@ -710,7 +862,16 @@ void write_sd_bank_voice( uint8_t bank, uint8_t drum, char *drum_name, uint8_t *
   strcat( src_fn, "/" );
   strcat( src_fn, drum_name );
 
-  create_file( src_fn, sample_data, len );          // actually put the file data there
+  return src_fn;
+}
+
+
+void sd_bank_voice_written( uint8_t bank, uint8_t drum ) {
+  int vvv;
+
+  invalidate_packed_bank( bank );                   // packed copy of this bank is now out of date
+  vvv = stb_2_bank_voice( drum_sel_2_voice( drum ) );
+  catalog_invalidate_voice_bank( bank, false, (vvv < 0) ? BANK_LOAD_ALL : (1 << vvv) );
 }
 
 
@@ -741,6 +902,7 @@ char *get_cur_bank_name() {
 
 void load_voice_bank( uint16_t voice_selects, uint8_t bank_num ) {
   bool prev = prev_drum_trig_int_enable;
+  bool packed = false;
   
   Serial.printf("\n--- Loading voice bank # %02d %s\n\n", bank_num, (bank_num==255)?"(STAGING)":" ");
 
@@ -748,22 +910,31 @@ void load_voice_bank( uint16_t voice_selects, uint8_t bank_num ) {
     
   disable_drum_trig_interrupt();            // XXX should not need to do this, fix properly
   prev_drum_trig_int_enable = false;
-  
-  if( voice_selects & BANK_LOAD_CONGAS )    { build_voice_filename( STB_CONGAS,   bank_num, fn_buf );   load_voice_file( STB_CONGAS,    fn_buf ); }
-  if( voice_selects & BANK_LOAD_TOMS )      { build_voice_filename( STB_TOMS,     bank_num, fn_buf );   load_voice_file( STB_TOMS,      fn_buf ); }
-  if( voice_selects & BANK_LOAD_SNARE )     { build_voice_filename( STB_SNARE,    bank_num, fn_buf );   load_voice_file( STB_SNARE,     fn_buf ); }
-  if( voice_selects & BANK_LOAD_BASS )      { build_voice_filename( STB_BASS,     bank_num, fn_buf );   load_voice_file( STB_BASS,      fn_buf ); }
-  if( voice_selects & BANK_LOAD_HIHAT )     { build_voice_filename( STB_HIHAT,    bank_num, fn_buf );   load_voice_file( STB_HIHAT,     fn_buf ); }
-  if( voice_selects & BANK_LOAD_COWBELL )   { build_voice_filename( STB_COWBELL,  bank_num, fn_buf );   load_voice_file( STB_COWBELL,   fn_buf ); }
-  if( voice_selects & BANK_LOAD_CLAPS )     { build_voice_filename( STB_CLAPS,    bank_num, fn_buf );   load_voice_file( STB_CLAPS,     fn_buf ); }
-  if( voice_selects & BANK_LOAD_CLAVE )     { build_voice_filename( STB_CLAVE,    bank_num, fn_buf );   load_voice_file( STB_CLAVE,     fn_buf ); }     // also RIMSHOT
-  if( voice_selects & BANK_LOAD_TAMB )      { build_voice_filename( STB_TAMB,     bank_num, fn_buf );   load_voice_file( STB_TAMB,      fn_buf ); }
-  if( voice_selects & BANK_LOAD_CABASA )    { build_voice_filename( STB_CABASA,   bank_num, fn_buf );   load_voice_file( STB_CABASA,    fn_buf ); }
+
+  if( bank_num != BANK_STAGING )
+    packed = load_packed_voice_bank( voice_selects, bank_num );     // one file, a few big reads
+  
+  if( !packed ) {
+    if( voice_selects & BANK_LOAD_CONGAS )    { build_voice_filename( STB_CONGAS,   bank_num, fn_buf );   load_voice_file( STB_CONGAS,    fn_buf ); }
+    if( voice_selects & BANK_LOAD_TOMS )      { build_voice_filename( STB_TOMS,     bank_num, fn_buf );   load_voice_file( STB_TOMS,      fn_buf ); }
+    if( voice_selects & BANK_LOAD_SNARE )     { build_voice_filename( STB_SNARE,    bank_num, fn_buf );   load_voice_file( STB_SNARE,     fn_buf ); }
+    if( voice_selects & BANK_LOAD_BASS )      { build_voice_filename( STB_BASS,     bank_num, fn_buf );   load_voice_file( STB_BASS,      fn_buf ); }
+    if( voice_selects & BANK_LOAD_HIHAT )     { build_voice_filename( STB_HIHAT,    bank_num, fn_buf );   load_voice_file( STB_HIHAT,     fn_buf ); }
+    if( voice_selects & BANK_LOAD_COWBELL )   { build_voice_filename( STB_COWBELL,  bank_num, fn_buf );   load_voice_file( STB_COWBELL,   fn_buf ); }
+    if( voice_selects & BANK_LOAD_CLAPS )     { build_voice_filename( STB_CLAPS,    bank_num, fn_buf );   load_voice_file( STB_CLAPS,     fn_buf ); }
+    if( voice_selects & BANK_LOAD_CLAVE )     { build_voice_filename( STB_CLAVE,    bank_num, fn_buf );   load_voice_file( STB_CLAVE,     fn_buf ); }     // also RIMSHOT
+    if( voice_selects & BANK_LOAD_TAMB )      { build_voice_filename( STB_TAMB,     bank_num, fn_buf );   load_voice_file( STB_TAMB,      fn_buf ); }
+    if( voice_selects & BANK_LOAD_CABASA )    { build_voice_filename( STB_CABASA,   bank_num, fn_buf );   load_voice_file( STB_CABASA,    fn_buf ); }
+  }
 
   if( prev )
     enable_drum_trig_interrupt();
 
-  stage_bank_name( bank_num );              // if there is a BANKNAME.TXT, copy it to STAGING
+  if( packed )
+    replace_file( (char*)STAGING_BANKNAME_FN, (uint8_t*)get_packed_bank_name(), strlen( get_packed_bank_name() ) );
+  else
+    stage_bank_name( bank_num );            // if there is a BANKNAME.TXT, copy it to STAGING
+
   stage_bank_num( bank_num );               // and remember the original bank we loaded into STAGING
 
   if( bank_num < 100 )                      // 255 = STAGING
@@ -774,31 +945,41 @@ void load_voice_bank( uint16_t voice_selects, uint8_t bank_num ) {
 // copies STAGING to bank_num on SD
 
 void store_voice_bank( uint16_t voice_selects, uint8_t bank_num ) {
+  sd_copy_stats_t st;
+
   Serial.print("--- Storing voice bank # "); Serial.println( bank_num );
 
-  if( voice_selects & BANK_LOAD_CONGAS )    { build_voice_filename( STB_CONGAS,   bank_num, fn_buf );   store_voice_file( (char*)"CONGA",    bank_num ); }
-  if( voice_selects & BANK_LOAD_TOMS )      { build_voice_filename( STB_TOMS,     bank_num, fn_buf );   store_voice_file( (char*)"TOM",      bank_num ); }
-  if( voice_selects & BANK_LOAD_SNARE )     { build_voice_filename( STB_SNARE,    bank_num, fn_buf );   store_voice_file( (char*)"SNARE",    bank_num ); }
-  if( voice_selects & BANK_LOAD_BASS )      { build_voice_filename( STB_BASS,     bank_num, fn_buf );   store_voice_file( (char*)"BASS",     bank_num ); }
-  if( voice_selects & BANK_LOAD_HIHAT )     { build_voice_filename( STB_HIHAT,    bank_num, fn_buf );   store_voice_file( (char*)"HIHAT",    bank_num ); }
-  if( voice_selects & BANK_LOAD_COWBELL )   { build_voice_filename( STB_COWBELL,  bank_num, fn_buf );   store_voice_file( (char*)"COWBELL",  bank_num ); }
-  if( voice_selects & BANK_LOAD_CLAPS )     { build_voice_filename( STB_CLAPS,    bank_num, fn_buf );   store_voice_file( (char*)"CLAPS",    bank_num ); }
-  if( voice_selects & BANK_LOAD_CLAVE )     { build_voice_filename( STB_CLAVE,    bank_num, fn_buf );   store_voice_file( (char*)"CLAVE",    bank_num ); }     // also RIMSHOT
-  if( voice_selects & BANK_LOAD_TAMB )      { build_voice_filename( STB_TAMB,     bank_num, fn_buf );   store_voice_file( (char*)"TAMB",     bank_num ); }
-  if( voice_selects & BANK_LOAD_CABASA )    { build_voice_filename( STB_CABASA,   bank_num, fn_buf );   store_voice_file( (char*)"CABASA",   bank_num ); }
+  invalidate_packed_bank( bank_num );
+
+  sd_copy_stats_clear( &st );
+
+  if( voice_selects & BANK_LOAD_CONGAS )    store_voice_file( (char*)"CONGA",    bank_num, STB_CONGAS,   &st );
+  if( voice_selects & BANK_LOAD_TOMS )      store_voice_file( (char*)"TOM",      bank_num, STB_TOMS,     &st );
+  if( voice_selects & BANK_LOAD_SNARE )     store_voice_file( (char*)"SNARE",    bank_num, STB_SNARE,    &st );
+  if( voice_selects & BANK_LOAD_BASS )      store_voice_file( (char*)"BASS",     bank_num, STB_BASS,     &st );
+  if( voice_selects & BANK_LOAD_HIHAT )     store_voice_file( (char*)"HIHAT",    bank_num, STB_HIHAT,    &st );
+  if( voice_selects & BANK_LOAD_COWBELL )   store_voice_file( (char*)"COWBELL",  bank_num, STB_COWBELL,  &st );
+  if( voice_selects & BANK_LOAD_CLAPS )     store_voice_file( (char*)"CLAPS",    bank_num, STB_CLAPS,    &st );
+  if( voice_selects & BANK_LOAD_CLAVE )     store_voice_file( (char*)"CLAVE",    bank_num, STB_CLAVE,    &st );     // also RIMSHOT
+  if( voice_selects & BANK_LOAD_TAMB )      store_voice_file( (char*)"TAMB",     bank_num, STB_TAMB,     &st );
+  if( voice_selects & BANK_LOAD_CABASA )    store_voice_file( (char*)"CABASA",   bank_num, STB_CABASA,   &st );
+
+  sd_copy_stats_print( "store_voice_bank", &st );
 
   // -- if there is a /STAGING/BANKNAME.TXT, copy it to the dest bank
 
   sprintf( src_fn, "/DRMBANKS/%02d/BANKNAME.TXT", bank_num );
   delete_and_copy( src_fn, STAGING_BANKNAME_FN, STAGING_DEFAULT_BANKNAME, strlen(STAGING_DEFAULT_BANKNAME) );
+
+  catalog_invalidate_voice_bank( bank_num, true, 0 );     // voices were filled in by store_voice_file()
 }
 
 
 
+// only the first *voice_len bytes of the returned buffer are valid, padding is done by load_sample()
+
 uint8_t *get_voice_file( char *dirname, char *voice_name, int *voice_len ) {
 
-  memset( filebuf, 0, 32768 );                                                    // zero buffer, so smaller sounds are padded with silence
-  
   Serial.printf("get_voice_file: Opening %s\n", dirname );
   
   if( !get_first_file_in_dir( dirname, voice_name, filebuf, voice_len, 32768 ) )  // will return data in filebuf, name in voice_name, len in voice_len
@@ -824,7 +1005,7 @@ void load_voice_file( uint16_t voice, char *fn ) {
   
   vbuf = get_voice_file( fn, vname, &vlen );
 
-  set_voice( voice, vbuf, vlen, vname );                                      // put it in staging, pad it if needed, put it in voice board      
+  set_voice( voice, vbuf, vlen, vname );                                      // put it in staging, put it in voice board (padded if needed)
 }
 
 
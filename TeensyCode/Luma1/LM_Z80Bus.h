@@ -99,6 +99,7 @@ void z80_reset( bool inreset );
 bool z80_in_reset = true;
 
 void teensy_drives_z80_bus( bool drive );         // acquire or release the Z-80 bus, set up pin modes appropriately
+bool z80_bus_in_use();                            // true while loop() code has the bus
 
 bool teensy_driving_bus = false;                  // use this to detect if bus is already owned by teensy
 
@@ -117,6 +118,7 @@ void load_z80_rom( uint8_t *rom_image );          // copy 6KB from rom_image to
 
 void copy_z80_ram( uint8_t *img );                // copy 8KB Z-80 RAM to img
 void load_z80_ram( uint8_t *img );                // copy 8KB img to z-80 RAM
+void load_z80_ram_block( int offset, uint8_t *d, int len );     // copy len bytes of d to z-80 RAM, starting offset bytes in
 
 void dump_z80_mem( uint16_t startAddr, uint16_t len );
 
@@ -95,6 +95,13 @@ void teensy_drives_z80_bus( bool drive ) {
   }
 }
 
+// Somebody in loop() has the bus. Interrupt code that wants it (SMF player) has to wait for this to be false.
+
+bool z80_bus_in_use() {
+  return bus_drive_counting_semaphore != 0;
+}
+
+
 void teensy_drives_z80_bus_hw( bool drive ) {
   int mode = (drive ? OUTPUT : INPUT);
   
@@ -357,17 +364,23 @@ void copy_z80_ram( uint8_t *img ) {
 
 
 void load_z80_ram( uint8_t *img ) {
-  uint16_t addr = 0xa000;
   
   Serial.print("Loading Z-80 RAM image...");
 
-  for( int xxx = 0; xxx != (8*1024); xxx++ )
-    z80_bus_write( addr++, img[xxx] );
+  load_z80_ram_block( 0, img, 8*1024 );
 
   Serial.println("done!");
 }
 
 
+void load_z80_ram_block( int offset, uint8_t *d, int len ) {
+  uint16_t addr = 0xa000 + offset;
+
+  for( int xxx = 0; xxx != len; xxx++ )
+    z80_bus_write( addr++, d[xxx] );
+}
+
+
 
 void load_z80_rom( uint8_t *rom_image ) {
     
@@ -27,8 +27,6 @@
 
 void apply_z80_patches();                       // fixed patches, called at boot (e.g., remove STORE / MENU delay)
 
-void handle_z80_patches();                      // call frequently, handles timers that change patch states
-
 
 // --- Z80 Sequencer Status & Control
 
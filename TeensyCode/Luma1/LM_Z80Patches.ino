@@ -32,6 +32,7 @@
 */
 
 #include "LM_Z80Patches.h"
+#include "LM_Timers.h"
 
 
 // --- called at boot
@@ -71,8 +72,9 @@ bool z80_sequencer_running() {                      // *** CALL ONLY WHEN TEENSY
 
 #define FOOT_DOWN_TIME_MS                           250
 
-elapsedMillis footswitch_time;
-int footswitch_up_time = 0;                         // time in the future to lift footswitch
+void footswitch_up( int arg );
+
+lm_timer_t footswitch_timer = TIMER_INIT( footswitch_up, 0 );       // armed while the footswitch is "down"
 
 
 
@@ -85,14 +87,13 @@ void z80_patch_footswitch( bool down ) {            // *** CALL ONLY WHEN TEENSY
   if( down ) {                                      // override check
     z80_bus_write( 0x8725, 0x18 );                  // 18 = jr            in scan_keys()
 
-    footswitch_time = 0;                            // reset clock...
-    footswitch_up_time = FOOT_DOWN_TIME_MS;         // ...will raise it at this time in the future
+    timer_start( &footswitch_timer, FOOT_DOWN_TIME_MS );      // will raise it this long from now
   }
   else 
   {
     z80_bus_write( 0x8725, 0x20 );                  // 20 = jr nz         in scan_keys()
 
-    footswitch_up_time = 0;                         // 0 -> it's already up
+    timer_stop( &footswitch_timer );                // it's already up
   }
 }
 
@@ -100,8 +101,8 @@ void z80_patch_footswitch( bool down ) {            // *** CALL ONLY WHEN TEENSY
 
 void z80_seq_ctl( bool state ) {
 
-  if( footswitch_up_time != 0 ) {                   // should not happen
-    //Serial.printf("*** footswitch_up_time != 0 !!!\n");
+  if( timer_armed( &footswitch_timer ) ) {          // should not happen
+    //Serial.printf("*** footswitch still down !!!\n");
     return;
   }
 
@@ -125,21 +126,13 @@ void z80_seq_ctl( bool state ) {
 }
 
 
-// --- call frequently, handles timers that change patch states
-
-void handle_z80_patches() {
-
-  // --- if FOOT_DOWN_TIME_MS has elapsed since "pressing" the foot switch, let it up
-
-  if( (footswitch_up_time > 0) && (footswitch_time >= footswitch_up_time) ) {
-      //Serial.printf("foot up\n");
-    teensy_drives_z80_bus( true );                    // *** Teensy owns Z-80 bus
-    z80_patch_footswitch( false );
-    teensy_drives_z80_bus( false );                   // *** Teensy releases Z-80 bus
-
-    footswitch_up_time = 0;                           // 0 -> it's already up
-  }
+// --- footswitch_timer: FOOT_DOWN_TIME_MS has elapsed since "pressing" the foot switch, let it up
 
+void footswitch_up( int arg ) {
+    //Serial.printf("foot up\n");
+  teensy_drives_z80_bus( true );                      // *** Teensy owns Z-80 bus
+  z80_patch_footswitch( false );
+  teensy_drives_z80_bus( false );                     // *** Teensy releases Z-80 bus
 }               
 
 
@@ -37,11 +37,18 @@
 #include "LM_Z80Patches.h"          // Surgical changes to the Z-80 code
 #include "LM_LUI.h"                 // Teensy UI that uses Z-80 keyboard, displays, and drum I/O, and uses i2c OLED display for detailed UI
 #include "LM_Voices.h"              // Sample loading routines
+#include "LM_PackedBank.h"          // Single-file voice banks
 #include "LM_MIDI.h"                // USB & DIN-5 MIDI support, note on/off, start/stop, MIDI clock, Sysex sample download
+#include "LM_SysExZ.h"              // Sysex payload compression, shared with host tools
+#include "LM_NoteMap.h"             // MIDI note -> drum mapping profiles
 #include "LM_OLED.h"                // OLED display support
 #include "LM_SDCard.h"              // SD card load / save / format
+#include "LM_SDCatalog.h"           // RAM copy of bank names, voice names/sizes
 #include "LM_Fan.h"                 // read temperature, control fan
 #include "LM_Utilities.h"           // misc - reboot, BCD/Decimal, etc.
+#include "LM_Buffers.h"             // shared working buffer, static RAM footprint
+#include "LM_Timers.h"              // timer wheel for deferred events (Note Offs, footswitch, indicators, ...)
+#include "LM_SMF.h"                 // Standard MIDI File recorder
 
 #include "LM1_RAM.h"                // 8KB default snapshot of Z-80 RAM with patterns loaded
 
@@ -141,7 +148,7 @@ void setup() {
     // ===============================
     // use this to load patterns from RAM image
     
-    //load_z80_ram( factory_ram );                            
+    //load_z80_ram( (uint8_t*)factory_ram );                            
 
     // ===============================
     // patch Z-80 ROM STORE
@@ -159,6 +166,11 @@ void setup() {
     // --- Load initial sounds
   
     load_voice_bank( voice_load_bm, BANK_STAGING );   // Load last loaded bank
+
+    // ===============================
+    // --- Read all the bank names, so the local UI doesn't have to go to the SD card
+
+    init_catalog();
       
     teensy_drives_z80_bus( false );                   // *** Teensy releases Z-80 bus
 
@@ -210,19 +222,34 @@ void setup() {
 // These are tasks that have tight timing requirements. 
 // This may be called from other places that take a long time (like the OLED display update routine).
 
+#define TIME_CRITICAL_YIELD_US        250
+
+elapsedMicros time_critical_since;
+
 void loop_time_critical() {
   
   // -- MIDI
   
   handle_midi_in();
 
+    handle_timers();                                // Note Offs, footswitch release, etc. that are due
+
     handle_midi_out();
 
+    rec_service();                                  // anything the recorder logged -> SMF bytes
+
   handle_midi_in();
 
-    handle_z80_patches();                           // handles timers that change patch states
+  time_critical_since = 0;
+}
 
-  handle_midi_in();
+
+// Long-running code (OLED blit, etc.) calls this at points where it's safe to handle MIDI.
+// It's cheap to call often -- only does the work if it's been a while, or DIN bytes are waiting.
+
+void time_critical_yield() {
+  if( (time_critical_since >= TIME_CRITICAL_YIELD_US) || midi_in_pending() )
+    loop_time_critical();
 }
 
 
@@ -252,6 +279,25 @@ void loop() {                                       // much effort is put into m
 
   loop_time_critical();
 
+  // --- SysEx replies that had to wait for an upload, and bulk backup (reads the SD card), live out here
+
+  handle_sysex_requests();
+  handle_sysex_bulk();
+
+  loop_time_critical();
+
+  // --- Recorder writes to the SD card when MIDI is quiet
+
+  handle_recorder();
+
+  loop_time_critical();
+
+  // --- SMF player reads ahead from the SD card, the voices are triggered from its timer interrupt
+
+  handle_player();
+
+  loop_time_critical();
+
   // --- Things we do only if the z-80 sequencer is not running
 
   if( !luma_is_playing() ) {
@@ -267,6 +313,8 @@ void loop() {                                       // much effort is put into m
 
     if( !in_local_ui() ) {      
       handle_fan();
+
+      handle_catalog();                             // fill in the SD catalog a bit at a time
     }  
   }
 